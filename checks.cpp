@@ -0,0 +1,25 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#define BOOST_TEST_MODULE sophos
+#include <boost/test/unit_test.hpp>
+
+// The checks are in tests/, one file per component.
@@ -34,8 +34,11 @@ int main(int argc, char** argv) {
     bool print_stats = false;
     uint32_t bench_count = 0;
     uint32_t rnd_entries_count = 0;
+    uint32_t checkpoint_count = 0;
+    bool client_assisted = false;
+    uint32_t newest_count = 0;
     
-    while ((c = getopt (argc, argv, "l:b:o:i:t:dpr:")) != -1)
+    while ((c = getopt (argc, argv, "l:b:o:i:t:dpr:k:cn:")) != -1)
         switch (c)
     {
         case 'l':
@@ -64,8 +67,17 @@ int main(int argc, char** argv) {
             rnd_entries_count = (uint32_t)std::stod(std::string(optarg),nullptr);
             //atol(optarg);
             break;
+        case 'k':
+            checkpoint_count = atoi(optarg);
+            break;
+        case 'c': // walk the chains on the client
+            client_assisted = true;
+            break;
+        case 'n': // only search the newest entries
+            newest_count = atoi(optarg);
+            break;
         case '?':
-            if (optopt == 'l' || optopt == 'b' || optopt == 'o' || optopt == 'i' || optopt == 't' || optopt == 'r')
+            if (optopt == 'l' || optopt == 'b' || optopt == 'o' || optopt == 'i' || optopt == 't' || optopt == 'r' || optopt == 'k' || optopt == 'n')
                 fprintf (stderr, "Option -%c requires an argument.\n", optopt);
             else if (isprint (optopt))
                 fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -108,6 +120,10 @@ int main(int argc, char** argv) {
         
         client_runner.reset( new sse::sophos::SophosClientRunner("localhost:4242", client_db, setup_size, n_keywords) );
     }
+    
+    if (checkpoint_count > 0) {
+        client_runner->set_search_checkpoint_count(checkpoint_count);
+    }
 
     for (std::string &path : input_files) {
         sse::logger::log(sse::logger::INFO) << "Load file " << path << std::endl;
@@ -142,7 +158,13 @@ int main(int argc, char** argv) {
         
         log_stream << "Search results: \n{";
 
-        auto res = client_runner->search(kw, print_callback);
+        if (newest_count > 0) {
+            client_runner->search_newest(kw, newest_count, print_callback);
+        }else if (client_assisted) {
+            client_runner->token_search(kw, true, std::thread::hardware_concurrency(), print_callback);
+        }else{
+            client_runner->search(kw, print_callback);
+        }
         
         log_stream << "}" << std::endl;
     }
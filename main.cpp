@@ -9,10 +9,25 @@
 #include <iostream>
 #include <fstream>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <future>
+#include <random>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "sophos_core.hpp"
 #include "large_storage_sophos_client.hpp"
 #include "utils.hpp"
+#include "thread_pool.hpp"
+#include "work_stealing_thread_pool.hpp"
+#include "search_executor.hpp"
+#include "numa_topology.hpp"
+#include "edb_file.hpp"
 
 using namespace sse::sophos;
 using namespace std;
@@ -33,7 +48,7 @@ void test_client_server()
     
     SearchRequest s_req;
     UpdateRequest u_req;
-    std::list<index_type> res;
+    search_results_type res;
     string key;
 
     if((client_sk_in.good() != client_master_key_in.good()) || (client_sk_in.good() != server_pk_in.good()))
@@ -60,7 +75,7 @@ void test_client_server()
         server.reset(new SophosServer("server.dat", server_pk_buf.str()));
         
         SearchRequest s_req;
-        std::list<index_type> res;
+        search_results_type res;
         string key;
 
     }else{
@@ -169,9 +184,279 @@ void test_kw_indexer()
     
 }
 
+// Tiny tasks submitted by a few producers running in the pool, as in the
+// search pipelines (the RSA walkers feed the access stage).
+template <class Pool>
+double benchmark_pool(size_t thread_count, size_t producer_count, size_t task_count)
+{
+    std::atomic<uint64_t> sink(0);
+    
+    auto begin = std::chrono::high_resolution_clock::now();
+    {
+        Pool pool(thread_count);
+        
+        auto task = [&sink](uint64_t x)
+        {
+            // a few hundred nanoseconds of work
+            for (int i = 0; i < 64; i++) {
+                x = x*6364136223846793005ULL + 1442695040888963407ULL;
+            }
+            sink += x & 1;
+        };
+        
+        auto producer = [&pool, &task, task_count, producer_count](size_t p)
+        {
+            for (size_t i = p; i < task_count; i += producer_count) {
+                pool.enqueue(task, i);
+            }
+        };
+        
+        std::vector<std::future<void>> producers;
+        for (size_t p = 0; p < producer_count; p++) {
+            producers.push_back(pool.enqueue(producer, p));
+        }
+        
+        // the pools refuse new tasks once joined
+        for (auto& f : producers) {
+            f.wait();
+        }
+        pool.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    
+    return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+void benchmark_thread_pools()
+{
+    const size_t task_count = 1000000;
+    unsigned max_threads = std::max(std::thread::hardware_concurrency(), 1U);
+    
+    cout << "threads \t ThreadPool (ms) \t WorkStealingThreadPool (ms)" << endl;
+    
+    for (unsigned t = 1; t <= max_threads; t *= 2) {
+        size_t producers = std::max(t/2, 1U);
+        
+        double t_mutex = benchmark_pool<ThreadPool>(t, producers, task_count);
+        double t_ws = benchmark_pool<WorkStealingThreadPool>(t, producers, task_count);
+        
+        cout << t << " \t\t " << t_mutex << " \t\t " << t_ws << endl;
+    }
+}
+
+// Concurrent searches, from client_count threads, each one made of
+// worker_count tasks that fill a block (as the lookups fill their token and
+// result blocks) and read it back a few times. Returns the number of
+// searches per second.
+double benchmark_executor(SearchExecutor& executor, size_t client_count, size_t worker_count, size_t search_count)
+{
+    constexpr size_t kBlockSize = 1 << 18; // 2 MB of 64 bits values
+    constexpr size_t kPasses = 4;
+    
+    std::atomic<uint64_t> sink(0);
+    
+    auto search = [&executor, &sink, worker_count]()
+    {
+        SearchExecutor::Placement placement(executor, worker_count);
+        SearchExecutor::TaskGroup group(executor);
+        
+        for (size_t w = 0; w < worker_count; w++) {
+            group.run([&sink, w]()
+                      {
+                          std::vector<uint64_t> block(kBlockSize);
+                          for (size_t i = 0; i < kBlockSize; i++) {
+                              block[i] = i*6364136223846793005ULL + w;
+                          }
+                          uint64_t x = 0;
+                          for (size_t p = 0; p < kPasses; p++) {
+                              for (size_t i = 0; i < kBlockSize; i += 8) {
+                                  x += block[(i*p + w) % kBlockSize];
+                              }
+                          }
+                          sink += x & 1;
+                      });
+        }
+        group.wait();
+    };
+    
+    auto begin = std::chrono::high_resolution_clock::now();
+    
+    std::vector<std::thread> clients;
+    for (size_t c = 0; c < client_count; c++) {
+        clients.push_back(std::thread([&search, c, client_count, search_count]()
+                                      {
+                                          for (size_t s = c; s < search_count; s += client_count) {
+                                              search();
+                                          }
+                                      }));
+    }
+    for (auto& t : clients) {
+        t.join();
+    }
+    
+    auto end = std::chrono::high_resolution_clock::now();
+    
+    return search_count/std::chrono::duration<double>(end - begin).count();
+}
+
+void benchmark_numa_placement()
+{
+    const size_t search_count = 512;
+    unsigned thread_count = std::max(std::thread::hardware_concurrency(), 1U);
+    NumaTopology topology = NumaTopology::detect();
+    
+    cout << topology.node_count() << " NUMA nodes, " << topology.cpu_count() << " CPUs" << endl;
+    
+    SearchExecutor unpinned(thread_count);
+    SearchExecutor pinned(thread_count, topology);
+    
+    size_t worker_count = std::max<size_t>(pinned.node_thread_count(0)/2, 1);
+    
+    cout << "clients \t unpinned (searches/s) \t pinned (searches/s)" << endl;
+    
+    for (size_t clients = 1; clients <= 2*thread_count; clients *= 2) {
+        double t_unpinned = benchmark_executor(unpinned, clients, worker_count, search_count);
+        double t_pinned = benchmark_executor(pinned, clients, worker_count, search_count);
+        
+        cout << clients << " \t\t " << t_unpinned << " \t\t " << t_pinned << endl;
+    }
+}
+
+// evicts a file from the page cache, so that the reads hit the disk
+static void drop_file_cache(const std::string& path)
+{
+#ifdef POSIX_FADV_DONTNEED
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+    }
+#endif
+}
+
+// Random lookups in an EDB file of entry_count entries, as a search with
+// lookup_count matches would do: with page faults through mmap (as RocksDB
+// reads the tables with allow_mmap_reads), then in blocks of keys through
+// EdbFile, with increasing queue depths.
+// Use a file on the SSD to benchmark (not on tmpfs).
+void benchmark_edb_file(const std::string& path, size_t entry_count, size_t lookup_count)
+{
+    constexpr size_t kBlockSize = 4096;
+    
+    if (entry_count == 0) {
+        return;
+    }
+    
+    std::mt19937_64 rng(0);
+    
+    std::vector<EdbFile::entry_type> entries(entry_count);
+    for (auto& e : entries) {
+        for (auto& b : e.first) {
+            b = (uint8_t)rng();
+        }
+        e.second = rng();
+    }
+    
+    if (!EdbFile::build(path, entries)) {
+        return;
+    }
+    
+    std::vector<update_token_type> keys(lookup_count);
+    for (auto& k : keys) {
+        k = entries[rng() % entry_count].first;
+    }
+    entries.clear();
+    
+    auto report = [lookup_count](const std::string& name, std::chrono::high_resolution_clock::time_point begin, size_t found_count)
+    {
+        double t = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - begin).count();
+        
+        cout << name << " \t " << lookup_count/t << " \t " << 1e6*t/lookup_count;
+        if (found_count != lookup_count) {
+            cout << " \t (" << lookup_count - found_count << " keys not found)";
+        }
+        cout << endl;
+    };
+    
+    cout << "read path \t lookups/s \t us/lookup" << endl;
+    
+    {
+        EdbFile file(path, false);
+        if (!file.is_open()) {
+            return;
+        }
+        
+        int fd = ::open(path.c_str(), O_RDONLY);
+        size_t length = (file.bucket_count() + 1)*EdbFile::kBucketSize;
+        void* map = ::mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        
+        if (map == MAP_FAILED) {
+            cout << "mmap failed" << endl;
+            return;
+        }
+        ::madvise(map, length, MADV_RANDOM);
+        drop_file_cache(path);
+        
+        auto begin = std::chrono::high_resolution_clock::now();
+        size_t found_count = 0;
+        
+        for (const auto& k : keys) {
+            uint64_t b = file.bucket_of(k);
+            index_type v;
+            bool overflow = true;
+            
+            for (uint64_t probe = 0; overflow && probe < file.bucket_count(); probe++, b = (b + 1) % file.bucket_count()) {
+                if (EdbFile::find_in_bucket(static_cast<const uint8_t*>(map) + EdbFile::bucket_offset(b), k, v, overflow)) {
+                    found_count++;
+                    break;
+                }
+            }
+        }
+        report("mmap", begin, found_count);
+        
+        ::munmap(map, length);
+    }
+    
+    for (unsigned depth : {1U, 16U, 64U, 256U}) {
+        EdbFile file(path, true, depth);
+        drop_file_cache(path);
+        
+        std::vector<update_token_type> block;
+        std::vector<index_type> values;
+        std::vector<bool> found;
+        size_t found_count = 0;
+        
+        auto begin = std::chrono::high_resolution_clock::now();
+        
+        for (size_t i = 0; i < keys.size(); i += kBlockSize) {
+            block.assign(keys.begin() + i, keys.begin() + std::min(i + kBlockSize, keys.size()));
+            found_count += file.multi_get(block, values, found);
+        }
+        
+        std::string name = std::string(file.uring() ? "io_uring" : "pread") + (file.direct_io() ? " direct" : "") + ", QD " + std::to_string(depth);
+        report(name, begin, found_count);
+    }
+    
+    ::unlink(path.c_str());
+}
+
 int main(int argc, const char * argv[]) {
 
-    test_client_server();
+    if (argc > 1 && std::string(argv[1]) == "bench_pools") {
+        benchmark_thread_pools();
+    }else if (argc > 1 && std::string(argv[1]) == "bench_numa") {
+        benchmark_numa_placement();
+    }else if (argc > 1 && std::string(argv[1]) == "bench_edb_file") {
+        // bench_edb_file [path [entry_count [lookup_count]]]
+        std::string path = (argc > 2) ? argv[2] : "edb_bench.dat";
+        size_t entry_count = (argc > 3) ? std::stoul(argv[3]) : (1 << 22);
+        size_t lookup_count = (argc > 4) ? std::stoul(argv[4]) : 100000;
+        
+        benchmark_edb_file(path, entry_count, lookup_count);
+    }else{
+        test_client_server();
+    }
     
     return 0;
 }
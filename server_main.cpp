@@ -42,9 +42,13 @@ int main(int argc, char** argv) {
     int c;
 
     bool async_search = true;
+    bool autotune = false;
+    size_t cq_count = std::thread::hardware_concurrency();
+    bool numa_placement = false;
+    bool consolidate_searches = false;
     
     std::string server_db;
-    while ((c = getopt (argc, argv, "b:s")) != -1)
+    while ((c = getopt (argc, argv, "b:stq:nc")) != -1)
         switch (c)
     {
         case 'b':
@@ -53,9 +57,24 @@ int main(int argc, char** argv) {
         case 's':
             async_search = false;
             break;
+        case 't':
+            autotune = true;
+            break;
+        case 'q':
+            // number of completion queues (0 for the synchronous gRPC API)
+            cq_count = std::stoul(std::string(optarg));
+            break;
+        case 'n':
+            // pin the search workers to the NUMA nodes
+            numa_placement = true;
+            break;
+        case 'c':
+            // rewrite the searched chains as posting lists (destructive)
+            consolidate_searches = true;
+            break;
 
         case '?':
-            if (optopt == 'i')
+            if (optopt == 'i' || optopt == 'q')
                 fprintf (stderr, "Option -%c requires an argument.\n", optopt);
             else if (isprint (optopt))
                 fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -82,7 +101,14 @@ int main(int argc, char** argv) {
         sse::logger::log(sse::logger::INFO) << "Running client with database " << server_db << std::endl;
     }
 
-    sse::sophos::run_sophos_server("0.0.0.0:4242", server_db, &server_ptr__, async_search);
+    if (autotune) {
+        // tune the search planner offline and exit
+        if (!sse::sophos::tune_sophos_server(server_db)) {
+            sse::logger::log(sse::logger::ERROR) << "Unable to tune the search planner" << std::endl;
+        }
+    }else{
+        sse::sophos::run_sophos_server("0.0.0.0:4242", server_db, &server_ptr__, async_search, cq_count, numa_placement, consolidate_searches);
+    }
 //    sse::sophos::run_sophos_server("0.0.0.0:4242", "/Users/raphaelbost/Code/sse/sophos/test.ssdb", &server_ptr__);
     
     sse::crypto::cleanup_crypto_lib();
@@ -0,0 +1,396 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#include "edb_file.hpp"
+
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace sse {
+namespace sophos {
+
+constexpr size_t EdbFile::kBucketSize;
+constexpr size_t EdbFile::kBucketEntryCount;
+constexpr double EdbFile::kDefaultLoadFactor;
+
+static const char kEdbFileMagic[8] = {'S', 'O', 'P', 'H', 'E', 'D', 'B', '1'};
+
+// first page of the file
+struct EdbFileHeader
+{
+    char magic[8];
+    uint64_t bucket_count;
+    uint64_t entry_count;
+};
+
+// a bucket starts with the number of its entries, and its flags
+constexpr size_t kBucketHeaderSize = 8;
+constexpr size_t kEntrySize = kUpdateTokenSize + sizeof(index_type);
+constexpr uint32_t kBucketOverflow = 1;
+
+// buffers of direct reads must be aligned on the logical block size
+struct AlignedDeleter
+{
+    void operator()(uint8_t* p) const
+    {
+        ::free(p);
+    }
+};
+typedef std::unique_ptr<uint8_t, AlignedDeleter> aligned_buffer;
+
+static aligned_buffer allocate_buckets(size_t count)
+{
+    void* p = NULL;
+    if (::posix_memalign(&p, EdbFile::kBucketSize, std::max<size_t>(count, 1)*EdbFile::kBucketSize) != 0) {
+        throw std::bad_alloc();
+    }
+    return aligned_buffer(static_cast<uint8_t*>(p));
+}
+
+static bool write_all(int fd, const uint8_t* data, size_t length)
+{
+    while (length > 0) {
+        ssize_t n = ::write(fd, data, length);
+        
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+uint64_t EdbFile::bucket_offset(uint64_t bucket)
+{
+    // skip the header page
+    return (bucket + 1)*kBucketSize;
+}
+
+static uint64_t home_bucket(const update_token_type& key, uint64_t bucket_count)
+{
+    // the tokens are PRF outputs: their first bytes are uniformly distributed
+    uint64_t h;
+    ::memcpy(&h, key.data(), sizeof(h));
+    return h % bucket_count;
+}
+
+uint64_t EdbFile::bucket_of(const update_token_type& key) const
+{
+    return home_bucket(key, bucket_count_);
+}
+
+bool EdbFile::find_in_bucket(const uint8_t* bucket, const update_token_type& key, index_type& value, bool& overflow)
+{
+    uint32_t count, flags;
+    ::memcpy(&count, bucket, sizeof(count));
+    ::memcpy(&flags, bucket + sizeof(count), sizeof(flags));
+    
+    count = std::min<uint32_t>(count, kBucketEntryCount);
+    
+    const uint8_t* entry = bucket + kBucketHeaderSize;
+    for (uint32_t i = 0; i < count; i++, entry += kEntrySize) {
+        if (::memcmp(entry, key.data(), kUpdateTokenSize) == 0) {
+            ::memcpy(&value, entry + kUpdateTokenSize, sizeof(index_type));
+            overflow = false;
+            return true;
+        }
+    }
+    
+    overflow = (flags & kBucketOverflow) != 0;
+    return false;
+}
+
+bool EdbFile::build(const std::string& path, const std::vector<entry_type>& entries, double load_factor)
+{
+    load_factor = std::min(std::max(load_factor, 0.1), 1.);
+    
+    const uint64_t bucket_count = std::max<uint64_t>((uint64_t)std::ceil(entries.size()/(kBucketEntryCount*load_factor)), 1);
+    
+    aligned_buffer buckets = allocate_buckets(bucket_count);
+    ::memset(buckets.get(), 0, bucket_count*kBucketSize);
+    
+    for (const entry_type& e : entries) {
+        uint64_t b = home_bucket(e.first, bucket_count);
+        
+        // linear probing: the full buckets on the way are flagged
+        for (uint64_t probe = 0; ; probe++) {
+            if (probe == bucket_count) {
+                logger::log(logger::ERROR) << "EDB file overflow: " << path << std::endl;
+                return false;
+            }
+            
+            uint8_t* bucket = buckets.get() + b*kBucketSize;
+            uint32_t count, flags;
+            ::memcpy(&count, bucket, sizeof(count));
+            
+            if (count < kBucketEntryCount) {
+                uint8_t* entry = bucket + kBucketHeaderSize + count*kEntrySize;
+                ::memcpy(entry, e.first.data(), kUpdateTokenSize);
+                ::memcpy(entry + kUpdateTokenSize, &e.second, sizeof(index_type));
+                count++;
+                ::memcpy(bucket, &count, sizeof(count));
+                break;
+            }
+            
+            ::memcpy(&flags, bucket + sizeof(count), sizeof(flags));
+            flags |= kBucketOverflow;
+            ::memcpy(bucket + sizeof(count), &flags, sizeof(flags));
+            
+            b = (b + 1) % bucket_count;
+        }
+    }
+    
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        logger::log(logger::ERROR) << "Unable to create the EDB file " << path << ": " << ::strerror(errno) << std::endl;
+        return false;
+    }
+    
+    aligned_buffer header_page = allocate_buckets(1);
+    ::memset(header_page.get(), 0, kBucketSize);
+    
+    EdbFileHeader header;
+    ::memcpy(header.magic, kEdbFileMagic, sizeof(header.magic));
+    header.bucket_count = bucket_count;
+    header.entry_count = entries.size();
+    ::memcpy(header_page.get(), &header, sizeof(header));
+    
+    bool ok = write_all(fd, header_page.get(), kBucketSize) && write_all(fd, buckets.get(), bucket_count*kBucketSize);
+    ok = (::fsync(fd) == 0) && ok;
+    ::close(fd);
+    
+    if (!ok) {
+        logger::log(logger::ERROR) << "Unable to write the EDB file " << path << std::endl;
+    }
+    return ok;
+}
+
+EdbFile::EdbFile(const std::string& path, bool direct_io, unsigned queue_depth) :
+fd_(-1), direct_io_(false), queue_depth_(queue_depth), bucket_count_(0), entry_count_(0),
+lookup_count_(0), bucket_read_count_(0)
+{
+#ifdef O_DIRECT
+    if (direct_io) {
+        fd_ = ::open(path.c_str(), O_RDONLY | O_DIRECT);
+        
+        if (fd_ >= 0) {
+            direct_io_ = true;
+        }else if (errno == EINVAL) {
+            // e.g. tmpfs
+            logger::log(logger::WARNING) << "Direct I/O is not supported for " << path << ": the reads go through the page cache" << std::endl;
+        }
+    }
+#endif
+    if (fd_ < 0) {
+        fd_ = ::open(path.c_str(), O_RDONLY);
+    }
+    if (fd_ < 0) {
+        logger::log(logger::ERROR) << "Unable to open the EDB file " << path << ": " << ::strerror(errno) << std::endl;
+        return;
+    }
+    
+#ifdef POSIX_FADV_RANDOM
+    ::posix_fadvise(fd_, 0, 0, POSIX_FADV_RANDOM);
+#endif
+    
+    aligned_buffer header_page = allocate_buckets(1);
+    EdbFileHeader header;
+    
+    if (::pread(fd_, header_page.get(), kBucketSize, 0) != (ssize_t)kBucketSize) {
+        logger::log(logger::ERROR) << "Unable to read the header of the EDB file " << path << std::endl;
+        ::close(fd_);
+        fd_ = -1;
+        return;
+    }
+    ::memcpy(&header, header_page.get(), sizeof(header));
+    
+    if (::memcmp(header.magic, kEdbFileMagic, sizeof(header.magic)) != 0 || header.bucket_count == 0) {
+        logger::log(logger::ERROR) << "Invalid EDB file: " << path << std::endl;
+        ::close(fd_);
+        fd_ = -1;
+        return;
+    }
+    bucket_count_ = header.bucket_count;
+    entry_count_ = header.entry_count;
+    
+    readers_.push_back(std::unique_ptr<UringReader>(new UringReader(fd_, queue_depth_)));
+}
+
+EdbFile::~EdbFile()
+{
+    readers_.clear();
+    
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+bool EdbFile::is_open() const
+{
+    return fd_ >= 0;
+}
+
+bool EdbFile::direct_io() const
+{
+    return direct_io_;
+}
+
+bool EdbFile::uring() const
+{
+    std::lock_guard<std::mutex> lock(readers_mtx_);
+    return !readers_.empty() && readers_.front()->uring();
+}
+
+uint64_t EdbFile::bucket_count() const
+{
+    return bucket_count_;
+}
+
+uint64_t EdbFile::entry_count() const
+{
+    return entry_count_;
+}
+
+std::unique_ptr<UringReader> EdbFile::acquire_reader() const
+{
+    {
+        std::lock_guard<std::mutex> lock(readers_mtx_);
+        
+        if (!readers_.empty()) {
+            std::unique_ptr<UringReader> reader = std::move(readers_.back());
+            readers_.pop_back();
+            return reader;
+        }
+    }
+    return std::unique_ptr<UringReader>(new UringReader(fd_, queue_depth_));
+}
+
+void EdbFile::release_reader(std::unique_ptr<UringReader> reader) const
+{
+    std::lock_guard<std::mutex> lock(readers_mtx_);
+    readers_.push_back(std::move(reader));
+}
+
+size_t EdbFile::multi_get(const std::vector<update_token_type>& keys, std::vector<index_type>& values, std::vector<bool>& found) const
+{
+    values.resize(keys.size());
+    found.assign(keys.size(), false);
+    
+    if (!is_open() || keys.empty()) {
+        return 0;
+    }
+    
+    lookup_count_ += keys.size();
+    
+    std::unique_ptr<UringReader> reader = acquire_reader();
+    
+    // keys still looked up, and their current bucket
+    std::vector<size_t> pending(keys.size());
+    std::vector<uint64_t> buckets(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        pending[i] = i;
+        buckets[i] = bucket_of(keys[i]);
+    }
+    
+    size_t found_count = 0;
+    
+    // a round reads the current bucket of every pending key: the keys that
+    // are not there and whose bucket overflowed go on with the next one
+    for (uint64_t round = 0; !pending.empty() && round < bucket_count_; round++) {
+        std::vector<uint64_t> round_buckets;
+        round_buckets.reserve(pending.size());
+        for (size_t i : pending) {
+            round_buckets.push_back(buckets[i]);
+        }
+        std::sort(round_buckets.begin(), round_buckets.end());
+        round_buckets.erase(std::unique(round_buckets.begin(), round_buckets.end()), round_buckets.end());
+        
+        aligned_buffer data = allocate_buckets(round_buckets.size());
+        std::vector<UringReader::Read> reads(round_buckets.size());
+        for (size_t j = 0; j < round_buckets.size(); j++) {
+            reads[j].offset = bucket_offset(round_buckets[j]);
+            reads[j].length = kBucketSize;
+            reads[j].buffer = data.get() + j*kBucketSize;
+            reads[j].ok = false;
+        }
+        
+        try {
+            reader->read(reads);
+        } catch (std::exception& e) {
+            logger::log(logger::ERROR) << "EDB file read failed: " << e.what() << std::endl;
+            // the ring is in an unknown state: do not reuse it
+            return found_count;
+        }
+        bucket_read_count_ += reads.size();
+        
+        std::vector<size_t> next_pending;
+        for (size_t i : pending) {
+            size_t j = std::lower_bound(round_buckets.begin(), round_buckets.end(), buckets[i]) - round_buckets.begin();
+            
+            if (!reads[j].ok) {
+                logger::log(logger::ERROR) << "Unable to read bucket " << buckets[i] << " of the EDB file" << std::endl;
+                continue;
+            }
+            
+            bool overflow;
+            index_type v;
+            if (find_in_bucket(data.get() + j*kBucketSize, keys[i], v, overflow)) {
+                values[i] = v;
+                found[i] = true;
+                found_count++;
+            }else if (overflow) {
+                buckets[i] = (buckets[i] + 1) % bucket_count_;
+                next_pending.push_back(i);
+            }
+        }
+        pending.swap(next_pending);
+    }
+    
+    release_reader(std::move(reader));
+    
+    return found_count;
+}
+
+std::ostream& EdbFile::print_stats(std::ostream& out) const
+{
+    out << "EDB file: " << entry_count_ << " entries in " << bucket_count_ << " buckets";
+    out << (direct_io_ ? ", direct I/O" : "") << (uring() ? ", io_uring" : ", synchronous reads");
+    out << " (queue depth " << queue_depth_ << "); Lookups: " << lookup_count_ << "; Bucket reads: " << bucket_read_count_ << std::endl;
+    
+    return out;
+}
+
+} // namespace sophos
+} // namespace sse
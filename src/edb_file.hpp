@@ -0,0 +1,102 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#pragma once
+
+#include "sophos_core.hpp"
+#include "uring_reader.hpp"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <ostream>
+
+namespace sse {
+namespace sophos {
+
+// Immutable on-disk hash table of EDB entries (update token -> encrypted
+// index), made for random reads from SSDs.
+// The entries are hashed into buckets of kBucketSize bytes, aligned on the
+// bucket size, so that a lookup is a single direct (O_DIRECT) read of its
+// bucket, without page faults nor read-ahead. A full bucket overflows into
+// the next ones.
+// The lookups of a block of keys are submitted together through io_uring
+// (see UringReader), keeping up to queue_depth reads in flight.
+class EdbFile {
+public:
+    typedef std::pair<update_token_type, index_type> entry_type;
+    
+    static constexpr size_t kBucketSize = 4096;
+    static constexpr size_t kBucketEntryCount = (kBucketSize - 8)/(kUpdateTokenSize + sizeof(index_type));
+    static constexpr double kDefaultLoadFactor = 0.8;
+    
+    // Writes a file with the given entries (whose tokens are distinct).
+    static bool build(const std::string& path, const std::vector<entry_type>& entries, double load_factor = kDefaultLoadFactor);
+    
+    // If direct_io is true and the file system supports it, the page cache is
+    // bypassed.
+    explicit EdbFile(const std::string& path, bool direct_io = true, unsigned queue_depth = UringReader::kDefaultQueueDepth);
+    ~EdbFile();
+    
+    EdbFile(const EdbFile&) = delete;
+    EdbFile& operator=(const EdbFile&) = delete;
+    
+    bool is_open() const;
+    bool direct_io() const;
+    bool uring() const;
+    uint64_t bucket_count() const;
+    uint64_t entry_count() const;
+    
+    // Same semantics as RockDBWrapper::multi_get. Can be called concurrently.
+    size_t multi_get(const std::vector<update_token_type>& keys, std::vector<index_type>& values, std::vector<bool>& found) const;
+    
+    // bucket in which the lookup of key starts, and its offset in the file
+    uint64_t bucket_of(const update_token_type& key) const;
+    static uint64_t bucket_offset(uint64_t bucket);
+    // Looks key up in a bucket. If it is not there, overflow is set to true
+    // if the lookup has to go on with the next bucket.
+    static bool find_in_bucket(const uint8_t* bucket, const update_token_type& key, index_type& value, bool& overflow);
+    
+    std::ostream& print_stats(std::ostream& out) const;
+    
+private:
+    std::unique_ptr<UringReader> acquire_reader() const;
+    void release_reader(std::unique_ptr<UringReader> reader) const;
+    
+    int fd_;
+    bool direct_io_;
+    unsigned queue_depth_;
+    uint64_t bucket_count_;
+    uint64_t entry_count_;
+    
+    // one reader per concurrent lookup
+    mutable std::vector<std::unique_ptr<UringReader>> readers_;
+    mutable std::mutex readers_mtx_;
+    
+    mutable std::atomic_size_t lookup_count_;
+    mutable std::atomic_size_t bucket_read_count_;
+};
+
+} // namespace sophos
+} // namespace sse
@@ -0,0 +1,77 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "edb_read_pool.hpp"
+
+namespace sse {
+namespace sophos {
+
+EdbReadPool::EdbReadPool(const RockDBWrapper& edb, size_t thread_count) :
+edb_(edb), thread_count_(std::max<size_t>(thread_count, 1)),
+in_flight_(0), max_in_flight_(0), read_count_(0),
+pool_(thread_count_)
+{
+}
+
+EdbReadPool::~EdbReadPool()
+{
+    pool_.join();
+}
+
+void EdbReadPool::read_started()
+{
+    size_t n = ++in_flight_;
+    size_t m = max_in_flight_;
+    while (n > m && !max_in_flight_.compare_exchange_weak(m, n)) {
+    }
+    read_count_++;
+}
+
+void EdbReadPool::read_done()
+{
+    in_flight_--;
+}
+
+size_t EdbReadPool::thread_count() const
+{
+    return thread_count_;
+}
+
+size_t EdbReadPool::in_flight() const
+{
+    return in_flight_;
+}
+
+size_t EdbReadPool::max_in_flight() const
+{
+    return max_in_flight_;
+}
+
+std::ostream& EdbReadPool::print_stats(std::ostream& out) const
+{
+    out << "EDB read pool: " << thread_count_ << " threads; Reads: " << read_count_;
+    out << "; Max reads in flight: " << max_in_flight_ << std::endl;
+    
+    return out;
+}
+
+} // namespace sophos
+} // namespace sse
@@ -0,0 +1,108 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include "rocksdb_wrapper.hpp"
+#include "thread_pool.hpp"
+#include "task.hpp"
+
+#include <vector>
+#include <atomic>
+#include <ostream>
+
+namespace sse {
+namespace sophos {
+
+// Block lookups in an EDB, run by a pool of threads.
+// Each read blocks its thread in the EDB's multi_get, as the RocksDB reads
+// are synchronous: the searches overlap their reads with their
+// cryptographic work by keeping a few of them in flight, and count these
+// threads against their workers (see SophosServer::search_read_pool). The
+// completion of a read is called by its thread, and should only hand the
+// results over (e.g. submit them to a stage).
+class EdbReadPool {
+public:
+    EdbReadPool(const RockDBWrapper& edb, size_t thread_count);
+    // waits for the reads in flight
+    ~EdbReadPool();
+    
+    EdbReadPool(const EdbReadPool&) = delete;
+    EdbReadPool& operator=(const EdbReadPool&) = delete;
+    
+    // Looks keys up (see RockDBWrapper::multi_get), and calls completion.
+    // keys, values and found must stay valid until then.
+    template <size_t N, typename V>
+    void multi_get(const std::vector<std::array<uint8_t, N>>& keys, std::vector<V>& values, std::vector<bool>& found, InlineTask completion);
+    
+    size_t thread_count() const;
+    size_t in_flight() const;
+    size_t max_in_flight() const;
+    
+    std::ostream& print_stats(std::ostream& out) const;
+    
+private:
+    template <size_t N, typename V> struct Read;
+    
+    void read_started();
+    void read_done();
+    
+    const RockDBWrapper& edb_;
+    const size_t thread_count_;
+    
+    std::atomic_size_t in_flight_;
+    std::atomic_size_t max_in_flight_;
+    std::atomic_size_t read_count_;
+    
+    ThreadPool pool_;
+};
+
+template <size_t N, typename V>
+struct EdbReadPool::Read
+{
+    EdbReadPool* pool;
+    const std::vector<std::array<uint8_t, N>>* keys;
+    std::vector<V>* values;
+    std::vector<bool>* found;
+    InlineTask completion;
+    
+    void operator()()
+    {
+        try {
+            pool->edb_.multi_get(*keys, *values, *found);
+        } catch (std::exception& e) {
+            logger::log(logger::ERROR) << "Exception in EDB read: " << e.what() << std::endl;
+            found->assign(keys->size(), false);
+        }
+        pool->read_done();
+        completion();
+    }
+};
+
+template <size_t N, typename V>
+void EdbReadPool::multi_get(const std::vector<std::array<uint8_t, N>>& keys, std::vector<V>& values, std::vector<bool>& found, InlineTask completion)
+{
+    read_started();
+    pool_.post(Read<N, V>{this, &keys, &values, &found, std::move(completion)});
+}
+
+} // namespace sophos
+} // namespace sse
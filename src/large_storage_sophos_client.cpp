@@ -294,10 +294,9 @@ namespace sse {
             
             auto derivation_prf = crypto::Prf<kUpdateTokenSize>(deriv_key);
             
-            std::string st_string(reinterpret_cast<char*>(st.data()), st.size());
-            
-            req.token = derivation_prf.prf(st_string + '0');
-            req.index = xor_mask(index, derivation_prf.prf(st_string + '1'));
+            index_type mask;
+            DerivationKernel(derivation_prf).derive(st, req.token, mask);
+            req.index = index ^ mask;
             
             logger::log(logger::DBG) << "Update token: (" << hex_string(req.token) << ", " << std::hex << req.index << ")" << std::endl;
             
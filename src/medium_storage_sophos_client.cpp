@@ -20,6 +20,7 @@
 
 
 #include "medium_storage_sophos_client.hpp"
+#include "result_encoding.hpp"
 #include "utils.hpp"
 #include "logger.hpp"
 
@@ -32,6 +33,11 @@
 #include <sse/dbparser/rapidjson/ostreamwrapper.h>
 #include <sse/dbparser/rapidjson/document.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <limits>
+#include <thread>
+
 
 #define DERIVATION_KEY "derivation"
 #define TDP_KEY "tdp_pk"
@@ -44,6 +50,8 @@ namespace sse {
     namespace sophos {
         
         
+        constexpr uint32_t MediumStorageSophosClient::kTokenSegmentSize;
+        
         size_t MediumStorageSophosClient::IndexHasher::operator()(const keyword_index_type& index) const
         {
             size_t h = 0;
@@ -59,6 +67,7 @@ namespace sse {
         
         const std::string MediumStorageSophosClient::rsa_prg_key_file__ = "rsa_prg.key";
         const std::string MediumStorageSophosClient::counter_map_file__ = "counters.dat";
+        const std::string MediumStorageSophosClient::result_cache_file__ = "results.dat";
 
         std::unique_ptr<SophosClient> MediumStorageSophosClient::construct_from_directory(const std::string& dir_path)
         {
@@ -98,7 +107,11 @@ namespace sse {
             master_key_buf << master_key_in.rdbuf();
             rsa_prg_key_buf << rsa_prg_key_in.rdbuf();
             
-            return std::unique_ptr<SophosClient>(new  MediumStorageSophosClient(counter_map_path, sk_buf.str(), master_key_buf.str(), rsa_prg_key_buf.str()));
+            std::unique_ptr<MediumStorageSophosClient> c_ptr(new  MediumStorageSophosClient(counter_map_path, sk_buf.str(), master_key_buf.str(), rsa_prg_key_buf.str()));
+            
+            c_ptr->open_result_cache(dir_path + "/" + result_cache_file__);
+            
+            return std::unique_ptr<SophosClient>(std::move(c_ptr));
         }
         
         
@@ -111,25 +124,26 @@ namespace sse {
             
             std::string counter_map_path = dir_path + "/" + counter_map_file__;
             
-            auto c_ptr =  std::unique_ptr<SophosClient>(new MediumStorageSophosClient(counter_map_path, n_keywords));
+            auto c_ptr =  std::unique_ptr<MediumStorageSophosClient>(new MediumStorageSophosClient(counter_map_path, n_keywords));
             
             c_ptr->write_keys(dir_path);
+            c_ptr->open_result_cache(dir_path + "/" + result_cache_file__);
 
-            return c_ptr;
+            return std::unique_ptr<SophosClient>(std::move(c_ptr));
         }
 
         MediumStorageSophosClient::MediumStorageSophosClient(const std::string& token_map_path, const size_t tm_setup_size) :
-        SophosClient(), rsa_prg_(), counter_map_(token_map_path, tm_setup_size)
+        SophosClient(), rsa_prg_(), counter_map_(token_map_path, tm_setup_size), checkpoint_count_(0)
         {
         }
         
         MediumStorageSophosClient::MediumStorageSophosClient(const std::string& token_map_path, const std::string& tdp_private_key, const std::string& derivation_master_key, const std::string& rsa_prg_key) :
-        SophosClient(tdp_private_key, derivation_master_key), rsa_prg_(rsa_prg_key), counter_map_(token_map_path)
+        SophosClient(tdp_private_key, derivation_master_key), rsa_prg_(rsa_prg_key), counter_map_(token_map_path), checkpoint_count_(0)
         {
         }
         
         MediumStorageSophosClient::MediumStorageSophosClient(const std::string& token_map_path, const std::string& tdp_private_key, const std::string& derivation_master_key, const std::string& rsa_prg_key, const size_t tm_setup_size) :
-        SophosClient(tdp_private_key, derivation_master_key), rsa_prg_(rsa_prg_key), counter_map_(token_map_path,tm_setup_size)
+        SophosClient(tdp_private_key, derivation_master_key), rsa_prg_(rsa_prg_key), counter_map_(token_map_path,tm_setup_size), checkpoint_count_(0)
         {
         }
         
@@ -170,8 +184,7 @@ namespace sse {
                 logger::log(logger::INFO) << "No matching counter found for keyword " << keyword << " (index " << hex_string(seed) << ")" << std::endl;
             }else{
                 // Now derive the original search token from the kw_index (as seed)
-                req.token = inverse_tdp().generate_array(rsa_prg_, seed);
-                req.token = inverse_tdp().invert_mult(req.token, kw_counter);
+                set_search_tokens(req, inverse_tdp().generate_array(rsa_prg_, seed), kw_counter);
                 
                 
                 req.derivation_key = derivation_prf().prf_string(seed);
@@ -197,8 +210,7 @@ namespace sse {
             kw_counter = rnd_elt.second;
             
              // Now derive the original search token from the kw_index (as seed)
-            req.token = inverse_tdp().generate_array(rsa_prg_, seed);
-            req.token = inverse_tdp().invert_mult(req.token, kw_counter);
+            set_search_tokens(req, inverse_tdp().generate_array(rsa_prg_, seed), kw_counter);
             
             
             req.derivation_key = derivation_prf().prf_string(seed);
@@ -208,6 +220,279 @@ namespace sse {
         }
         
         
+        SearchRequest   MediumStorageSophosClient::window_search_request(const std::string &keyword, uint32_t first, uint32_t last) const
+        {
+            uint32_t kw_counter;
+            SearchRequest req;
+            req.add_count = 0;
+            
+            keyword_index_type kw_index = get_keyword_index(keyword);
+            std::string seed(kw_index.begin(),kw_index.end());
+            
+            if(!counter_map_.get(kw_index, kw_counter))
+            {
+                logger::log(logger::INFO) << "No matching counter found for keyword " << keyword << " (index " << hex_string(seed) << ")" << std::endl;
+                return req;
+            }
+            
+            last = std::min(last, kw_counter);
+            if (first > last) {
+                // empty window
+                return req;
+            }
+            
+            // the walk starts at ST_last: no checkpoints, the walk is short
+            req.token = inverse_tdp().invert_mult(inverse_tdp().generate_array(rsa_prg_, seed), last);
+            req.derivation_key = derivation_prf().prf_string(seed);
+            req.add_count = last+1;
+            req.limit = last-first+1;
+            
+            return req;
+        }
+        
+        SearchRequest   MediumStorageSophosClient::newest_search_request(const std::string &keyword, uint32_t count) const
+        {
+            uint32_t kw_counter;
+            
+            if (count == 0 || !counter_map_.get(get_keyword_index(keyword), kw_counter)) {
+                SearchRequest req;
+                req.add_count = 0;
+                return req;
+            }
+            
+            uint32_t first = (count > kw_counter) ? 0 : kw_counter - count + 1;
+            return window_search_request(keyword, first, kw_counter);
+        }
+        
+        void MediumStorageSophosClient::set_search_tokens(SearchRequest& req, const search_token_type& st_0, uint32_t kw_counter) const
+        {
+            req.token = inverse_tdp().invert_mult(st_0, kw_counter);
+            
+            uint32_t count = std::min<uint32_t>(checkpoint_count_, kMaxCheckpointCount);
+            if (count == 0) {
+                return;
+            }
+            
+            // the chain has kw_counter+1 entries: split it in count+1 segments
+            // of at least kMinCheckpointStride entries
+            uint32_t stride = std::max<uint32_t>(kMinCheckpointStride, kw_counter/(count+1) + 1);
+            
+            // the entry at offset o in the walk is the one of counter kw_counter-o
+            for (uint32_t o = stride; o <= kw_counter && req.checkpoints.size() < count; o += stride) {
+                req.checkpoints.push_back(inverse_tdp().invert_mult(st_0, kw_counter - o));
+            }
+            
+            if (!req.checkpoints.empty()) {
+                req.checkpoint_stride = stride;
+            }
+        }
+        
+        void MediumStorageSophosClient::set_search_checkpoint_count(uint32_t count)
+        {
+            checkpoint_count_ = count;
+        }
+        
+        uint32_t MediumStorageSophosClient::search_checkpoint_count() const
+        {
+            return checkpoint_count_;
+        }
+
+        bool MediumStorageSophosClient::open_result_cache(const std::string& path)
+        {
+            // values of arbitrary length
+            std::unique_ptr<RockDBWrapper> cache(new RockDBWrapper(path, false));
+            
+            if (!cache->is_open()) {
+                logger::log(logger::ERROR) << "Unable to open the result cache at " << path << std::endl;
+                return false;
+            }
+            result_cache_ = std::move(cache);
+            return true;
+        }
+        
+        bool MediumStorageSophosClient::has_result_cache() const
+        {
+            return result_cache_ != nullptr;
+        }
+        
+        // A cached result list is stored as:
+        //  - the number of chain entries it covers (4 bytes);
+        //  - its encoding (1 byte, see result_encoding.hpp);
+        //  - the encoded results, or the raw ones if no encoding is smaller.
+        
+        bool MediumStorageSophosClient::get_cached_results(const keyword_index_type& kw_index, uint32_t& add_count, std::vector<index_type>& results) const
+        {
+            std::string data;
+            
+            if (!result_cache_ || !result_cache_->get(std::string(kw_index.begin(), kw_index.end()), data)) {
+                return false;
+            }
+            if (data.size() < sizeof(uint32_t) + 1) {
+                logger::log(logger::ERROR) << "Invalid cached search results" << std::endl;
+                return false;
+            }
+            
+            ::memcpy(&add_count, data.data(), sizeof(uint32_t));
+            ResultEncoding encoding = static_cast<ResultEncoding>(data[sizeof(uint32_t)]);
+            data.erase(0, sizeof(uint32_t) + 1);
+            
+            results.clear();
+            
+            if (encoding == RAW_RESULTS) {
+                if (data.size() % sizeof(index_type) != 0) {
+                    logger::log(logger::ERROR) << "Invalid cached search results" << std::endl;
+                    return false;
+                }
+                results.resize(data.size()/sizeof(index_type));
+                ::memcpy(results.data(), data.data(), data.size());
+                return true;
+            }
+            
+            if (!decode_results(encoding, data, [&results](uint64_t v){ results.push_back(v); })) {
+                logger::log(logger::ERROR) << "Invalid cached search results" << std::endl;
+                results.clear();
+                return false;
+            }
+            return true;
+        }
+        
+        SearchRequest   MediumStorageSophosClient::delta_search_request(const std::string &keyword, std::vector<index_type>& cached_results) const
+        {
+            uint32_t cached_count;
+            
+            cached_results.clear();
+            
+            if (!get_cached_results(get_keyword_index(keyword), cached_count, cached_results)) {
+                return search_request(keyword);
+            }
+            
+            // the entries from counter cached_count on were added after the
+            // cached search
+            return window_search_request(keyword, cached_count, std::numeric_limits<uint32_t>::max());
+        }
+        
+        bool MediumStorageSophosClient::cache_search_results(const std::string &keyword, uint32_t add_count, std::vector<index_type>& results)
+        {
+            if (!result_cache_) {
+                return false;
+            }
+            
+            std::string encoded;
+            ResultEncoding encoding = encode_results(results, encoding_flag(DELTA_VARINT) | encoding_flag(BITMAP), encoded);
+            
+            std::string data(reinterpret_cast<const char*>(&add_count), sizeof(uint32_t));
+            data.push_back(static_cast<char>(encoding));
+            
+            if (encoding == RAW_RESULTS) {
+                data.append(reinterpret_cast<const char*>(results.data()), results.size()*sizeof(index_type));
+            }else{
+                data.append(encoded);
+            }
+            
+            keyword_index_type kw_index = get_keyword_index(keyword);
+            return result_cache_->put(std::string(kw_index.begin(), kw_index.end()), data);
+        }
+        
+        std::string MediumStorageSophosClient::search_handle(const std::string& keyword) const
+        {
+            keyword_index_type kw_index = get_keyword_index(keyword);
+            std::string seed(kw_index.begin(),kw_index.end());
+            
+            return keyword_handle(derivation_prf().prf_string(seed));
+        }
+        
+        uint32_t MediumStorageSophosClient::search_tokens(const std::string& keyword, const token_segment_callback& post_segment, unsigned thread_count) const
+        {
+            uint32_t kw_counter;
+
+            keyword_index_type kw_index = get_keyword_index(keyword);
+            std::string seed(kw_index.begin(),kw_index.end());
+
+            if (!counter_map_.get(kw_index, kw_counter)) {
+                logger::log(logger::INFO) << "No matching counter found for keyword " << keyword << " (index " << hex_string(seed) << ")" << std::endl;
+                return 0;
+            }
+
+            const search_token_type st_0 = inverse_tdp().generate_array(rsa_prg_, seed);
+            std::string deriv_key = derivation_prf().prf_string(seed);
+            auto derivation_prf = crypto::Prf<kUpdateTokenSize>(deriv_key);
+            const DerivationKernel kernel(derivation_prf);
+
+            const uint32_t entry_count = kw_counter+1;
+            const uint32_t segment_count = (entry_count + kTokenSegmentSize - 1)/kTokenSegmentSize;
+
+            std::vector<update_token_type> tokens(entry_count);
+            std::vector<index_type> masks(entry_count);
+
+            auto walk_segment = [&](uint32_t s)
+            {
+                uint32_t begin = s*kTokenSegmentSize;
+                uint32_t end = std::min(begin + kTokenSegmentSize, entry_count);
+
+                // the entry at offset o in the walk is the one of counter
+                // kw_counter-o
+                search_token_type st = inverse_tdp().invert_mult(st_0, kw_counter - begin);
+
+                for (uint32_t o = begin; o < end; o++) {
+                    kernel.derive(st, tokens[o], masks[o]);
+                    if (o+1 < end) {
+                        st = inverse_tdp().eval(st);
+                    }
+                }
+            };
+
+            // the walkers take the segments in order, so that the first ones
+            // are ready first. The calling thread posts them (or walks them
+            // itself if there is a single walker).
+            std::atomic<uint32_t> next_segment(0);
+            std::atomic_bool stopped(false);
+            std::vector<bool> done(segment_count, false);
+            std::mutex done_mtx;
+            std::condition_variable done_cv;
+
+            auto walker = [&]()
+            {
+                for (uint32_t s = next_segment++; s < segment_count && !stopped; s = next_segment++) {
+                    walk_segment(s);
+                    {
+                        std::lock_guard<std::mutex> lock(done_mtx);
+                        done[s] = true;
+                    }
+                    done_cv.notify_all();
+                }
+            };
+
+            std::vector<std::thread> walkers;
+            if (thread_count > 1 && segment_count > 1) {
+                for (unsigned t = 0; t < std::min<unsigned>(thread_count, segment_count); t++) {
+                    walkers.push_back(std::thread(walker));
+                }
+            }
+
+            for (uint32_t s = 0; s < segment_count; s++) {
+                if (walkers.empty()) {
+                    walk_segment(s);
+                }else{
+                    std::unique_lock<std::mutex> lock(done_mtx);
+                    done_cv.wait(lock, [&]{ return done[s]; });
+                }
+
+                uint32_t begin = s*kTokenSegmentSize;
+                uint32_t end = std::min(begin + kTokenSegmentSize, entry_count);
+
+                if (!post_segment(tokens.data() + begin, masks.data() + begin, end - begin)) {
+                    stopped = true;
+                    break;
+                }
+            }
+
+            for (std::thread& t : walkers) {
+                t.join();
+            }
+
+            return entry_count;
+        }
+        
         UpdateRequest   MediumStorageSophosClient::update_request(const std::string &keyword, const index_type index)
         {
             bool found = false;
@@ -264,10 +549,9 @@ namespace sse {
             
             auto derivation_prf = crypto::Prf<kUpdateTokenSize>(deriv_key);
             
-            std::string st_string(reinterpret_cast<char*>(st.data()), st.size());
-            
-            req.token = derivation_prf.prf(st_string + '0');
-            req.index = xor_mask(index, derivation_prf.prf(st_string + '1'));
+            index_type mask;
+            DerivationKernel(derivation_prf).derive(st, req.token, mask);
+            req.index = index ^ mask;
             
             if (logger::severity() <= logger::DBG) {
                 logger::log(logger::DBG) << "Update token: (" << hex_string(req.token) << ", " << std::hex << req.index << ")" << std::endl;
@@ -530,6 +814,7 @@ namespace sse {
             }else{
                 client_ptr = handler.client();
                 client_ptr->write_keys(dir_path);
+                client_ptr->open_result_cache(dir_path + "/" + result_cache_file__);
             }
             
             
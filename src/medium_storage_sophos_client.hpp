@@ -53,6 +53,58 @@ namespace sse {
             UpdateRequest   update_request(const std::string &keyword, const index_type index);
             
             SearchRequest   random_search_request() const;
+            
+            // Bounded searches (see SearchRequest::limit): the window request
+            // only asks for the entries of counters first to last (clamped to
+            // the keyword's last counter), the newest one for the count most
+            // recent entries. The search token is ST_last, computed directly
+            // from the keyword's first token. The results come back newest
+            // first.
+            SearchRequest   window_search_request(const std::string &keyword, uint32_t first, uint32_t last) const;
+            SearchRequest   newest_search_request(const std::string &keyword, uint32_t count) const;
+            
+            // Number of chain checkpoints added to the search requests, so
+            // that the server can walk the chains in parallel (see
+            // SearchRequest::checkpoints). 0 (the default) disables them.
+            void set_search_checkpoint_count(uint32_t count);
+            uint32_t search_checkpoint_count() const;
+
+            // Client-assisted searches: walks the keyword's chain and derives
+            // the update token and the mask of every entry, newest first.
+            // The chain is split in segments of kTokenSegmentSize entries
+            // walked by thread_count threads, each one jumping to the start
+            // of its segment with invert_mult. post_segment is called from
+            // the calling thread on the segments, in order, and can stop the
+            // walk by returning false. Returns the number of entries of the
+            // chain (0 if the keyword is unknown).
+            static constexpr uint32_t kTokenSegmentSize = 4096;
+            typedef std::function<bool(const update_token_type*, const index_type*, size_t)> token_segment_callback;
+
+            uint32_t search_tokens(const std::string& keyword, const token_segment_callback& post_segment, unsigned thread_count) const;
+            
+            // handle of the keyword's searches (see sse::sophos::keyword_handle),
+            // sent with its token searches
+            std::string search_handle(const std::string& keyword) const;
+
+            // Client-side result cache: the results of the last complete
+            // search of each keyword, with the number of entries of the
+            // chain they cover, compressed in a local database. Opened in the
+            // client's directory by construct_from_directory,
+            // init_in_directory and construct_from_json.
+            bool open_result_cache(const std::string& path);
+            bool has_result_cache() const;
+            
+            // Delta searches: cached_results is filled with the cached results
+            // of the keyword, and the returned request only asks for the
+            // entries added since (a window search, see
+            // window_search_request). Its add_count is 0 if the cached
+            // results are up to date. Without cached results, this is
+            // search_request.
+            SearchRequest   delta_search_request(const std::string &keyword, std::vector<index_type>& cached_results) const;
+            
+            // Stores the results of the first add_count entries of the
+            // keyword's chain. results is sorted.
+            bool cache_search_results(const std::string &keyword, uint32_t add_count, std::vector<index_type>& results);
 
             
             std::string rsa_prg_key() const;
@@ -71,17 +123,27 @@ namespace sse {
         private:
             static const std::string rsa_prg_key_file__;
             static const std::string counter_map_file__;
+            static const std::string result_cache_file__;
 
             class JSONHandler;
             friend JSONHandler;
             
             keyword_index_type get_keyword_index(const std::string &kw) const;
             
+            bool get_cached_results(const keyword_index_type& kw_index, uint32_t& add_count, std::vector<index_type>& results) const;
+            
+            // fills req.token, and the checkpoints, from the keyword's first
+            // search token
+            void set_search_tokens(SearchRequest& req, const search_token_type& st_0, uint32_t kw_counter) const;
+            
             crypto::Prf<crypto::Tdp::kRSAPrgSize> rsa_prg_;
             
             ssdmap::bucket_map< keyword_index_type, uint32_t, IndexHasher> counter_map_;
             std::mutex token_map_mtx_;
             std::atomic_uint keyword_counter_;
+            std::atomic<uint32_t> checkpoint_count_;
+            
+            std::unique_ptr<RockDBWrapper> result_cache_;
         };
     }
 }
\ No newline at end of file
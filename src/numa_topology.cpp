@@ -0,0 +1,196 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "numa_topology.hpp"
+
+#include "logger.hpp"
+#include "utils.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <algorithm>
+#include <cctype>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace sse {
+namespace sophos {
+
+static const std::string kSysfsNodePath = "/sys/devices/system/node";
+
+NumaTopology::NumaTopology()
+{
+    std::vector<unsigned> cpus(std::max(std::thread::hardware_concurrency(), 1U));
+    for (unsigned i = 0; i < cpus.size(); i++) {
+        cpus[i] = i;
+    }
+    nodes_.push_back(cpus);
+}
+
+NumaTopology::NumaTopology(const std::vector<std::vector<unsigned>>& node_cpus)
+{
+    for (const auto& cpus : node_cpus) {
+        if (!cpus.empty()) {
+            nodes_.push_back(cpus);
+        }
+    }
+    if (nodes_.empty()) {
+        *this = NumaTopology();
+    }
+}
+
+NumaTopology NumaTopology::detect()
+{
+    std::vector<std::vector<unsigned>> node_cpus;
+    
+    // the node ids are not necessarily contiguous, but they are small
+    constexpr unsigned kMaxNodeId = 1024;
+    
+    if (!is_directory(kSysfsNodePath)) {
+        return NumaTopology();
+    }
+    
+    for (unsigned node = 0; node < kMaxNodeId; node++) {
+        std::string node_path = kSysfsNodePath + "/node" + std::to_string(node);
+        if (!is_directory(node_path)) {
+            continue;
+        }
+        
+        std::ifstream in(node_path + "/cpulist");
+        std::string list;
+        std::vector<unsigned> cpus;
+        
+        if (!std::getline(in, list) || !parse_cpu_list(list, cpus)) {
+            logger::log(logger::WARNING) << "Unable to read the CPUs of NUMA node " << node << std::endl;
+            continue;
+        }
+        node_cpus.push_back(cpus);
+    }
+    
+    return NumaTopology(node_cpus);
+}
+
+size_t NumaTopology::node_count() const
+{
+    return nodes_.size();
+}
+
+size_t NumaTopology::cpu_count() const
+{
+    size_t n = 0;
+    for (const auto& cpus : nodes_) {
+        n += cpus.size();
+    }
+    return n;
+}
+
+const std::vector<unsigned>& NumaTopology::cpus(size_t node) const
+{
+    return nodes_[node];
+}
+
+bool NumaTopology::parse_cpu_list(const std::string& list, std::vector<unsigned>& cpus)
+{
+    std::istringstream in(list);
+    std::string range;
+    
+    cpus.clear();
+    
+    while (std::getline(in, range, ',')) {
+        // trailing newline or spaces
+        range.erase(std::remove_if(range.begin(), range.end(), ::isspace), range.end());
+        if (range.empty()) {
+            continue;
+        }
+        
+        try {
+            size_t dash = range.find('-');
+            unsigned first = std::stoul(range.substr(0, dash));
+            unsigned last = (dash == std::string::npos) ? first : std::stoul(range.substr(dash + 1));
+            
+            if (last < first) {
+                return false;
+            }
+            for (unsigned c = first; c <= last; c++) {
+                cpus.push_back(c);
+            }
+        } catch (std::exception& e) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+#ifdef __linux__
+
+bool NumaTopology::bind_current_thread(const std::vector<unsigned>& cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    
+    for (unsigned c : cpus) {
+        if (c < CPU_SETSIZE) {
+            CPU_SET(c, &set);
+        }
+    }
+    if (CPU_COUNT(&set) == 0) {
+        return false;
+    }
+    
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+std::vector<unsigned> NumaTopology::current_thread_cpus()
+{
+    std::vector<unsigned> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (unsigned c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &set)) {
+                cpus.push_back(c);
+            }
+        }
+    }
+    return cpus;
+}
+
+#else
+
+bool NumaTopology::bind_current_thread(const std::vector<unsigned>& cpus)
+{
+    return false;
+}
+
+std::vector<unsigned> NumaTopology::current_thread_cpus()
+{
+    return std::vector<unsigned>();
+}
+
+#endif
+
+} // namespace sophos
+} // namespace sse
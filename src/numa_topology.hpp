@@ -0,0 +1,61 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace sse {
+namespace sophos {
+
+// NUMA nodes of the machine and their CPUs.
+// On Linux, they are read from sysfs. Elsewhere (or if sysfs is not
+// readable), the machine is seen as a single node with every CPU.
+class NumaTopology {
+public:
+    // a single node with the CPUs [0, hardware_concurrency)
+    NumaTopology();
+    // nodes without CPUs are ignored
+    explicit NumaTopology(const std::vector<std::vector<unsigned>>& node_cpus);
+    
+    static NumaTopology detect();
+    
+    size_t node_count() const;
+    size_t cpu_count() const;
+    const std::vector<unsigned>& cpus(size_t node) const;
+    
+    // Restricts the calling thread to the given CPUs. Returns false if thread
+    // affinities are not supported, or if the call failed.
+    static bool bind_current_thread(const std::vector<unsigned>& cpus);
+    // CPUs the calling thread can run on (empty if unknown)
+    static std::vector<unsigned> current_thread_cpus();
+    
+    // Parses a CPU list in the format of the kernel (e.g. "0-3,8,10-11")
+    static bool parse_cpu_list(const std::string& list, std::vector<unsigned>& cpus);
+    
+private:
+    std::vector<std::vector<unsigned>> nodes_;
+};
+
+} // namespace sophos
+} // namespace sse
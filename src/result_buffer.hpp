@@ -0,0 +1,334 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <iterator>
+#include <algorithm>
+#include <utility>
+
+namespace sse {
+namespace sophos {
+
+// Append-only sequence of values (search results), stored in contiguous
+// chunks.
+// The chunks grow geometrically up to kMaxChunkSize values: a buffer of n
+// values costs O(log(n) + n/kMaxChunkSize) allocations, instead of one per
+// value for a list. Two buffers are concatenated by moving their chunks,
+// without copying the values.
+template <class T>
+class ResultBuffer {
+public:
+    static constexpr size_t kMinChunkSize = 64;
+    static constexpr size_t kMaxChunkSize = 1 << 16;
+
+    class const_iterator;
+    typedef T value_type;
+    typedef const_iterator iterator;
+
+    ResultBuffer();
+    ResultBuffer(ResultBuffer&& b);
+    ResultBuffer(const ResultBuffer& b);
+
+    ResultBuffer& operator=(ResultBuffer&& b);
+    ResultBuffer& operator=(const ResultBuffer& b);
+
+    size_t size() const;
+    bool empty() const;
+    void clear();
+
+    // makes sure that the next n values can be appended without allocation
+    void reserve(size_t n);
+
+    void push_back(const T& v);
+
+    template <class InputIt>
+    void append(InputIt first, InputIt last);
+
+    // moves the chunks of b at the end of the buffer, and leaves b empty
+    void append(ResultBuffer&& b);
+
+    const_iterator begin() const;
+    const_iterator end() const;
+
+    // calls f(const T* data, size_t count) on every chunk, in order
+    template <class F>
+    void for_each_chunk(F f) const;
+
+    // number of bytes allocated for the values
+    size_t memory_size() const;
+
+private:
+    struct Chunk
+    {
+        std::unique_ptr<T[]> data;
+        size_t size;
+        size_t capacity;
+    };
+
+    void add_chunk(size_t capacity);
+
+    std::vector<Chunk> chunks_;
+    size_t size_;
+};
+
+template <class T>
+class ResultBuffer<T>::const_iterator : public std::iterator<std::forward_iterator_tag, T, std::ptrdiff_t, const T*, const T&> {
+public:
+    const_iterator() : chunks_(nullptr), chunk_(0), pos_(0) {}
+
+    const T& operator*() const { return (*chunks_)[chunk_].data[pos_]; }
+    const T* operator->() const { return &(**this); }
+
+    const_iterator& operator++()
+    {
+        if (++pos_ == (*chunks_)[chunk_].size) {
+            pos_ = 0;
+            chunk_++;
+            skip_empty();
+        }
+        return *this;
+    }
+
+    const_iterator operator++(int)
+    {
+        const_iterator it(*this);
+        ++(*this);
+        return it;
+    }
+
+    bool operator==(const const_iterator& it) const { return chunk_ == it.chunk_ && pos_ == it.pos_; }
+    bool operator!=(const const_iterator& it) const { return !(*this == it); }
+
+private:
+    friend class ResultBuffer<T>;
+
+    const_iterator(const std::vector<Chunk>* chunks, size_t chunk) : chunks_(chunks), chunk_(chunk), pos_(0)
+    {
+        skip_empty();
+    }
+
+    void skip_empty()
+    {
+        while (chunk_ < chunks_->size() && (*chunks_)[chunk_].size == 0) {
+            chunk_++;
+        }
+    }
+
+    const std::vector<Chunk>* chunks_;
+    size_t chunk_;
+    size_t pos_;
+};
+
+// One buffer per thread, so that threads can collect results without
+// synchronization. The buffers are padded so that they are not on the same
+// cache lines.
+template <class T>
+class ShardedResultBuffer {
+public:
+    explicit ShardedResultBuffer(size_t shard_count) : shards_(std::max<size_t>(shard_count, 1)) {}
+
+    size_t shard_count() const { return shards_.size(); }
+    ResultBuffer<T>& shard(size_t i) { return shards_[i].buffer; }
+
+    // concatenates the buffers (without copying the values), and leaves them
+    // empty
+    ResultBuffer<T> merge()
+    {
+        ResultBuffer<T> res(std::move(shards_[0].buffer));
+        for (size_t i = 1; i < shards_.size(); i++) {
+            res.append(std::move(shards_[i].buffer));
+        }
+        return res;
+    }
+
+private:
+    static constexpr size_t kCacheLineSize = 64;
+
+    struct Shard
+    {
+        ResultBuffer<T> buffer;
+        char padding[kCacheLineSize];
+    };
+
+    std::vector<Shard> shards_;
+};
+
+template <class T>
+constexpr size_t ResultBuffer<T>::kMinChunkSize;
+template <class T>
+constexpr size_t ResultBuffer<T>::kMaxChunkSize;
+
+template <class T>
+ResultBuffer<T>::ResultBuffer() : size_(0)
+{
+}
+
+template <class T>
+ResultBuffer<T>::ResultBuffer(ResultBuffer&& b) : chunks_(std::move(b.chunks_)), size_(b.size_)
+{
+    b.chunks_.clear();
+    b.size_ = 0;
+}
+
+template <class T>
+ResultBuffer<T>::ResultBuffer(const ResultBuffer& b) : size_(0)
+{
+    reserve(b.size());
+    append(b.begin(), b.end());
+}
+
+template <class T>
+ResultBuffer<T>& ResultBuffer<T>::operator=(ResultBuffer&& b)
+{
+    if (this != &b) {
+        chunks_ = std::move(b.chunks_);
+        size_ = b.size_;
+        b.chunks_.clear();
+        b.size_ = 0;
+    }
+    return *this;
+}
+
+template <class T>
+ResultBuffer<T>& ResultBuffer<T>::operator=(const ResultBuffer& b)
+{
+    if (this != &b) {
+        clear();
+        reserve(b.size());
+        append(b.begin(), b.end());
+    }
+    return *this;
+}
+
+template <class T>
+size_t ResultBuffer<T>::size() const
+{
+    return size_;
+}
+
+template <class T>
+bool ResultBuffer<T>::empty() const
+{
+    return size_ == 0;
+}
+
+template <class T>
+void ResultBuffer<T>::clear()
+{
+    chunks_.clear();
+    size_ = 0;
+}
+
+template <class T>
+void ResultBuffer<T>::add_chunk(size_t capacity)
+{
+    Chunk c;
+    c.data.reset(new T[capacity]);
+    c.size = 0;
+    c.capacity = capacity;
+    chunks_.push_back(std::move(c));
+}
+
+template <class T>
+void ResultBuffer<T>::reserve(size_t n)
+{
+    size_t available = chunks_.empty() ? 0 : chunks_.back().capacity - chunks_.back().size;
+
+    if (available < n) {
+        add_chunk(n);
+    }
+}
+
+template <class T>
+void ResultBuffer<T>::push_back(const T& v)
+{
+    if (chunks_.empty() || chunks_.back().size == chunks_.back().capacity) {
+        // double the capacity of the buffer
+        add_chunk(std::min(std::max(size_, kMinChunkSize), kMaxChunkSize));
+    }
+    Chunk& c = chunks_.back();
+    c.data[c.size++] = v;
+    size_++;
+}
+
+template <class T>
+template <class InputIt>
+void ResultBuffer<T>::append(InputIt first, InputIt last)
+{
+    for (; first != last; ++first) {
+        push_back(*first);
+    }
+}
+
+template <class T>
+void ResultBuffer<T>::append(ResultBuffer&& b)
+{
+    if (&b == this) {
+        return;
+    }
+    chunks_.reserve(chunks_.size() + b.chunks_.size());
+    for (Chunk& c : b.chunks_) {
+        chunks_.push_back(std::move(c));
+    }
+    size_ += b.size_;
+
+    b.clear();
+}
+
+template <class T>
+typename ResultBuffer<T>::const_iterator ResultBuffer<T>::begin() const
+{
+    return const_iterator(&chunks_, 0);
+}
+
+template <class T>
+typename ResultBuffer<T>::const_iterator ResultBuffer<T>::end() const
+{
+    return const_iterator(&chunks_, chunks_.size());
+}
+
+template <class T>
+template <class F>
+void ResultBuffer<T>::for_each_chunk(F f) const
+{
+    for (const Chunk& c : chunks_) {
+        if (c.size > 0) {
+            f(c.data.get(), c.size);
+        }
+    }
+}
+
+template <class T>
+size_t ResultBuffer<T>::memory_size() const
+{
+    size_t s = 0;
+    for (const Chunk& c : chunks_) {
+        s += c.capacity * sizeof(T);
+    }
+    return s;
+}
+
+} // namespace sophos
+} // namespace sse
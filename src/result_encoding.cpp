@@ -0,0 +1,138 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "result_encoding.hpp"
+
+#include <algorithm>
+#include <limits>
+
+namespace sse {
+namespace sophos {
+
+result_encoding_set encoding_set(const google::protobuf::RepeatedField<int>& encodings)
+{
+    result_encoding_set res = 0;
+    for (int e : encodings) {
+        if (ResultEncoding_IsValid(e)) {
+            res |= encoding_flag(static_cast<ResultEncoding>(e));
+        }
+    }
+    return res;
+}
+
+void append_varint(uint64_t v, std::string& out)
+{
+    while (v >= 0x80) {
+        out.push_back(static_cast<char>((v & 0x7F) | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+}
+
+bool read_varint(const uint8_t*& p, const uint8_t* end, uint64_t& v)
+{
+    v = 0;
+    for (unsigned shift = 0; shift < 64 && p != end; shift += 7) {
+        uint8_t b = *p++;
+        v |= uint64_t(b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static size_t varint_size(uint64_t v)
+{
+    size_t s = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        s++;
+    }
+    return s;
+}
+
+ResultEncoding encode_results(std::vector<uint64_t>& values, result_encoding_set accepted, std::string& out)
+{
+    if (values.empty()) {
+        return RAW_RESULTS;
+    }
+
+    std::sort(values.begin(), values.end());
+
+    const size_t header_size = varint_size(values.size()) + varint_size(values.front());
+
+    size_t best_size = values.size()*sizeof(uint64_t);
+    ResultEncoding best = RAW_RESULTS;
+
+    if (accepted & encoding_flag(DELTA_VARINT)) {
+        size_t s = header_size;
+        for (size_t i = 1; i < values.size(); i++) {
+            s += varint_size(values[i] - values[i-1]);
+        }
+        if (s < best_size) {
+            best_size = s;
+            best = DELTA_VARINT;
+        }
+    }
+
+    if ((accepted & encoding_flag(BITMAP)) &&
+        std::adjacent_find(values.begin(), values.end()) == values.end()) {
+        uint64_t span = values.back() - values.front();
+
+        if (span < std::numeric_limits<uint64_t>::max() - 8) {
+            uint64_t s = header_size + span/8 + 1;
+            if (s < best_size) {
+                best_size = s;
+                best = BITMAP;
+            }
+        }
+    }
+
+    if (best == RAW_RESULTS) {
+        return best;
+    }
+
+    out.clear();
+    out.reserve(best_size);
+
+    append_varint(values.size(), out);
+    append_varint(values.front(), out);
+
+    if (best == DELTA_VARINT) {
+        for (size_t i = 1; i < values.size(); i++) {
+            append_varint(values[i] - values[i-1], out);
+        }
+    }else{
+        size_t offset = out.size();
+        out.resize(best_size, 0);
+
+        for (uint64_t v : values) {
+            uint64_t bit = v - values.front();
+            out[offset + bit/8] |= static_cast<char>(1 << (bit % 8));
+        }
+    }
+
+    return best;
+}
+
+} // namespace sophos
+} // namespace sse
@@ -0,0 +1,113 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include "sophos.pb.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace sse {
+namespace sophos {
+
+// Compressed encodings of the batches of search results (see ResultEncoding
+// in sophos.proto). The order of the results is not preserved.
+//
+//  - DELTA_VARINT: count, first value, then the differences between
+//    consecutive sorted values, all as varints;
+//  - BITMAP: count, smallest value (as varints), then a bitmap whose bit i
+//    (in little endian order) is set if smallest + i is a result. It cannot
+//    represent duplicates.
+
+typedef uint32_t result_encoding_set;
+
+inline result_encoding_set encoding_flag(ResultEncoding encoding)
+{
+    return result_encoding_set(1) << encoding;
+}
+
+// set of the encodings of a SearchRequestMessage
+result_encoding_set encoding_set(const google::protobuf::RepeatedField<int>& encodings);
+
+// Encodes the values with the most compact accepted encoding, and returns
+// it. values is sorted in place. If no accepted encoding is smaller than the
+// raw values, RAW_RESULTS is returned and out is left untouched.
+ResultEncoding encode_results(std::vector<uint64_t>& values, result_encoding_set accepted, std::string& out);
+
+void append_varint(uint64_t v, std::string& out);
+bool read_varint(const uint8_t*& p, const uint8_t* end, uint64_t& v);
+
+// Calls sink(v) for every encoded value. Returns false if the data is not
+// valid (the values decoded before the error have been passed to sink).
+template <class Sink>
+bool decode_results(ResultEncoding encoding, const std::string& data, Sink&& sink);
+
+template <class Sink>
+bool decode_results(ResultEncoding encoding, const std::string& data, Sink&& sink)
+{
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data());
+    const uint8_t* end = p + data.size();
+
+    if (p == end) {
+        return true;
+    }
+
+    uint64_t count, v;
+    if (!read_varint(p, end, count) || !read_varint(p, end, v) || count == 0) {
+        return false;
+    }
+
+    switch (encoding) {
+        case DELTA_VARINT:
+        {
+            sink(v);
+            for (uint64_t i = 1; i < count; i++) {
+                uint64_t delta;
+                if (!read_varint(p, end, delta)) {
+                    return false;
+                }
+                v += delta;
+                sink(v);
+            }
+            return p == end;
+        }
+
+        case BITMAP:
+        {
+            uint64_t decoded = 0;
+            for (uint64_t base = v; p != end; p++, base += 8) {
+                for (unsigned byte = *p; byte != 0; byte &= byte - 1) {
+                    sink(base + __builtin_ctz(byte));
+                    decoded++;
+                }
+            }
+            return decoded == count;
+        }
+
+        default:
+            return false;
+    }
+}
+
+} // namespace sophos
+} // namespace sse
@@ -0,0 +1,209 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <utility>
+
+namespace sse {
+namespace sophos {
+
+constexpr size_t kRingCacheLineSize = 64;
+
+// index of a ring, alone on its cache line
+struct RingIndex
+{
+    char padding[kRingCacheLineSize];
+    std::atomic<size_t> value;
+    
+    explicit RingIndex(size_t v) : value(v) {}
+};
+
+// rounds n up to a power of 2 (at least 2)
+inline size_t ring_capacity(size_t n)
+{
+    size_t c = 2;
+    while (c < n) {
+        c <<= 1;
+    }
+    return c;
+}
+
+// Bounded lock-free ring for a single producer and a single consumer.
+// The items are moved in and out of the ring, which never allocates after
+// its construction.
+template <class T>
+class SpscRing {
+public:
+    // the capacity is rounded up to a power of 2
+    explicit SpscRing(size_t capacity);
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // producer only. If the ring is full, returns false and leaves item
+    // untouched.
+    bool try_push(T&& item);
+    // consumer only
+    bool try_pop(T& item);
+
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    const size_t mask_;
+    std::unique_ptr<T[]> items_;
+
+    // head_ is written by the consumer, tail_ by the producer: keep them on
+    // separate cache lines
+    RingIndex head_;
+    RingIndex tail_;
+};
+
+// Bounded lock-free ring for several producers and a single consumer
+// (Vyukov's bounded queue: every cell carries a sequence number telling
+// whether it is ready to be written or read).
+template <class T>
+class MpscRing {
+public:
+    // the capacity is rounded up to a power of 2
+    explicit MpscRing(size_t capacity);
+
+    MpscRing(const MpscRing&) = delete;
+    MpscRing& operator=(const MpscRing&) = delete;
+
+    // any thread. If the ring is full, returns false and leaves item
+    // untouched.
+    bool try_push(T&& item);
+    // consumer only
+    bool try_pop(T& item);
+
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T item;
+    };
+
+    const size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+
+    RingIndex head_;
+    RingIndex tail_;
+};
+
+template <class T>
+SpscRing<T>::SpscRing(size_t capacity) :
+mask_(ring_capacity(capacity) - 1), items_(new T[mask_ + 1]), head_(0), tail_(0)
+{
+}
+
+template <class T>
+bool SpscRing<T>::try_push(T&& item)
+{
+    size_t tail = tail_.value.load(std::memory_order_relaxed);
+
+    if (tail - head_.value.load(std::memory_order_acquire) > mask_) {
+        // full
+        return false;
+    }
+    items_[tail & mask_] = std::move(item);
+    tail_.value.store(tail + 1, std::memory_order_release);
+
+    return true;
+}
+
+template <class T>
+bool SpscRing<T>::try_pop(T& item)
+{
+    size_t head = head_.value.load(std::memory_order_relaxed);
+
+    if (head == tail_.value.load(std::memory_order_acquire)) {
+        // empty
+        return false;
+    }
+    item = std::move(items_[head & mask_]);
+    head_.value.store(head + 1, std::memory_order_release);
+
+    return true;
+}
+
+template <class T>
+MpscRing<T>::MpscRing(size_t capacity) :
+mask_(ring_capacity(capacity) - 1), cells_(new Cell[mask_ + 1]), head_(0), tail_(0)
+{
+    for (size_t i = 0; i <= mask_; i++) {
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+template <class T>
+bool MpscRing<T>::try_push(T&& item)
+{
+    size_t pos = tail_.value.load(std::memory_order_relaxed);
+
+    for (;;) {
+        Cell& cell = cells_[pos & mask_];
+        size_t seq = cell.sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            // the cell is free: claim it
+            if (tail_.value.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                cell.item = std::move(item);
+                cell.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }else if (diff < 0) {
+            // full
+            return false;
+        }else{
+            // another producer claimed the cell
+            pos = tail_.value.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+template <class T>
+bool MpscRing<T>::try_pop(T& item)
+{
+    size_t pos = head_.value.load(std::memory_order_relaxed);
+    Cell& cell = cells_[pos & mask_];
+    size_t seq = cell.sequence.load(std::memory_order_acquire);
+
+    if ((intptr_t)seq - (intptr_t)(pos + 1) < 0) {
+        // empty (or the producer of the cell is not done yet)
+        return false;
+    }
+    item = std::move(cell.item);
+    cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+    head_.value.store(pos + 1, std::memory_order_relaxed);
+
+    return true;
+}
+
+} // namespace sophos
+} // namespace sse
@@ -27,8 +27,10 @@
 #include <rocksdb/table.h>
 #include <rocksdb/memtablerep.h>
 #include <rocksdb/options.h>
+#include <rocksdb/write_batch.h>
 
 #include <iostream>
+#include <vector>
 
 namespace sse {
     namespace sophos {
@@ -36,22 +38,35 @@ namespace sse {
         class RockDBWrapper {
         public:
             RockDBWrapper() = delete;
-            inline RockDBWrapper(const std::string &path);
+            inline RockDBWrapper(const std::string &path, bool fixed_size_values = true);
             inline ~RockDBWrapper();
             
+            // false if the database could not be opened
+            inline bool is_open() const;
+            
             inline bool get(const std::string &key, std::string &data) const;
+            inline bool put(const std::string &key, const std::string &data);
+            inline bool remove(const std::string &key);
             template <size_t N, typename V>
             inline bool get(const std::array<uint8_t, N> &key, V &data) const;
             
+            template <size_t N, typename V>
+            inline size_t multi_get(const std::vector<std::array<uint8_t, N>> &keys, std::vector<V> &data, std::vector<bool> &found) const;
+            
             template <size_t N, typename V>
             inline bool put(const std::array<uint8_t, N> &key, const V &data);
             
+            template <size_t N>
+            inline bool remove(const std::vector<std::array<uint8_t, N>> &keys);
+            
         private:
             rocksdb::DB* db_;
             
         };
         
-        RockDBWrapper::RockDBWrapper(const std::string &path)
+        // The cuckoo table format only supports values of a fixed size.
+        // Use fixed_size_values = false to store values of arbitrary length.
+        RockDBWrapper::RockDBWrapper(const std::string &path, bool fixed_size_values)
         : db_(NULL)
         {
             rocksdb::Options options;
@@ -72,9 +87,11 @@ namespace sse {
             
             
             
-            options.table_factory.reset(rocksdb::NewCuckooTableFactory(cuckoo_options));
-            
-            options.memtable_factory.reset(new rocksdb::VectorRepFactory());
+            if (fixed_size_values) {
+                options.table_factory.reset(rocksdb::NewCuckooTableFactory(cuckoo_options));
+                
+                options.memtable_factory.reset(new rocksdb::VectorRepFactory());
+            }
             
             options.compression = rocksdb::kNoCompression;
             options.bottommost_compression = rocksdb::kDisableCompressionOption;
@@ -118,6 +135,11 @@ namespace sse {
             }
         }
         
+        bool RockDBWrapper::is_open() const
+        {
+            return db_ != NULL;
+        }
+        
         bool RockDBWrapper::get(const std::string &key, std::string &data) const
         {
             rocksdb::Status s = db_->Get(rocksdb::ReadOptions(), key, &data);
@@ -125,6 +147,24 @@ namespace sse {
             return s.ok();
         }
         
+        bool RockDBWrapper::put(const std::string &key, const std::string &data)
+        {
+            rocksdb::Status s = db_->Put(rocksdb::WriteOptions(), key, data);
+            
+            if (!s.ok()) {
+                logger::log(logger::ERROR) << "Unable to insert pair in the database: " << s.ToString() << std::endl;
+            }
+            
+            return s.ok();
+        }
+        
+        bool RockDBWrapper::remove(const std::string &key)
+        {
+            rocksdb::Status s = db_->Delete(rocksdb::WriteOptions(), key);
+            
+            return s.ok();
+        }
+        
         template <size_t N, typename V>
         bool RockDBWrapper::get(const std::array<uint8_t, N> &key, V &data) const
         {
@@ -140,6 +180,37 @@ namespace sse {
             return s.ok();
         }
         
+        // Look up a block of keys with a single MultiGet call.
+        // On return, data[i] is only meaningful if found[i] is true.
+        // Returns the number of keys that were found.
+        template <size_t N, typename V>
+        size_t RockDBWrapper::multi_get(const std::vector<std::array<uint8_t, N>> &keys, std::vector<V> &data, std::vector<bool> &found) const
+        {
+            std::vector<rocksdb::Slice> k_s;
+            std::vector<std::string> values;
+            
+            k_s.reserve(keys.size());
+            for (const auto &key : keys) {
+                k_s.push_back(rocksdb::Slice(reinterpret_cast<const char*>( key.data() ),N));
+            }
+            
+            std::vector<rocksdb::Status> s = db_->MultiGet(rocksdb::ReadOptions(false,true), k_s, &values);
+            
+            data.resize(keys.size());
+            found.assign(keys.size(), false);
+            
+            size_t found_count = 0;
+            for (size_t i = 0; i < keys.size(); i++) {
+                if (s[i].ok()) {
+                    ::memcpy(&data[i], values[i].data(), sizeof(V));
+                    found[i] = true;
+                    found_count++;
+                }
+            }
+            
+            return found_count;
+        }
+        
         template <size_t N, typename V>
         bool RockDBWrapper::put(const std::array<uint8_t, N> &key, const V &data)
         {
@@ -158,5 +229,24 @@ namespace sse {
             return s.ok();
         }
         
+        // Remove a set of keys atomically
+        template <size_t N>
+        bool RockDBWrapper::remove(const std::vector<std::array<uint8_t, N>> &keys)
+        {
+            rocksdb::WriteBatch batch;
+            
+            for (const auto &key : keys) {
+                batch.Delete(rocksdb::Slice(reinterpret_cast<const char*>(key.data()),N));
+            }
+            
+            rocksdb::Status s = db_->Write(rocksdb::WriteOptions(), &batch);
+            
+            if (!s.ok()) {
+                logger::log(logger::ERROR) << "Unable to remove " << std::dec << keys.size() << " keys from the database: " << s.ToString() << std::endl;
+            }
+            
+            return s.ok();
+        }
+        
     }
 }
\ No newline at end of file
@@ -0,0 +1,339 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "search_executor.hpp"
+
+#include "logger.hpp"
+
+#include <algorithm>
+
+namespace sse {
+namespace sophos {
+
+constexpr size_t SearchExecutor::kDefaultHighWatermark;
+constexpr size_t SearchExecutor::kDefaultLowWatermark;
+
+SearchExecutor::SearchExecutor(size_t thread_count) :
+thread_count_(std::max<size_t>(thread_count, 1)), numa_aware_(false),
+node_load_(new std::atomic_size_t[1]), next_node_(0),
+high_watermark_(kDefaultHighWatermark), low_watermark_(kDefaultLowWatermark),
+max_stage_backlog_(0), backpressure_count_(0)
+{
+    node_load_[0] = 0;
+    pools_.emplace_back(new WorkStealingThreadPool(thread_count_, [this](size_t){ current_context() = NodeContext{this, 0}; }));
+}
+
+SearchExecutor::SearchExecutor(size_t thread_count, const NumaTopology& topology) :
+thread_count_(0), numa_aware_(true),
+node_load_(new std::atomic_size_t[topology.node_count()]), next_node_(0),
+high_watermark_(kDefaultHighWatermark), low_watermark_(kDefaultLowWatermark),
+max_stage_backlog_(0), backpressure_count_(0)
+{
+    thread_count = std::max<size_t>(thread_count, topology.node_count());
+    
+    // the workers read their node's CPUs as they start
+    for (size_t node = 0; node < topology.node_count(); node++) {
+        node_cpus_.push_back(topology.cpus(node));
+        node_load_[node] = 0;
+    }
+    
+    for (size_t node = 0; node < topology.node_count(); node++) {
+        size_t node_threads = std::max<size_t>((thread_count*node_cpus_[node].size() + topology.cpu_count()/2)/topology.cpu_count(), 1);
+        
+        
+        pools_.emplace_back(new WorkStealingThreadPool(node_threads, [this, node](size_t)
+                                                       {
+                                                           current_context() = NodeContext{this, node};
+                                                           if (!NumaTopology::bind_current_thread(node_cpus_[node])) {
+                                                               logger::log(logger::WARNING) << "Unable to pin a search worker to NUMA node " << node << std::endl;
+                                                           }
+                                                       }));
+        thread_count_ += node_threads;
+    }
+    
+    logger::log(logger::INFO) << "NUMA-aware search executor: " << thread_count_ << " threads on " << pools_.size() << " nodes" << std::endl;
+}
+
+SearchExecutor::NodeContext& SearchExecutor::current_context()
+{
+    static thread_local NodeContext context = {nullptr, 0};
+    return context;
+}
+
+WorkStealingThreadPool& SearchExecutor::current_pool()
+{
+    const NodeContext& context = current_context();
+    
+    if (context.executor == this) {
+        return *pools_[context.node];
+    }
+    return *pools_[(next_node_++) % pools_.size()];
+}
+
+size_t SearchExecutor::thread_count() const
+{
+    return thread_count_;
+}
+
+size_t SearchExecutor::node_count() const
+{
+    return pools_.size();
+}
+
+size_t SearchExecutor::node_thread_count(size_t node) const
+{
+    return pools_[node]->size();
+}
+
+bool SearchExecutor::numa_aware() const
+{
+    return numa_aware_;
+}
+
+void SearchExecutor::set_stage_watermarks(size_t high, size_t low)
+{
+    if (low > high) {
+        logger::log(logger::WARNING) << "Stage low watermark above the high watermark, using " << high << std::endl;
+        low = high;
+    }
+    high_watermark_ = high;
+    low_watermark_ = low;
+}
+
+size_t SearchExecutor::stage_high_watermark() const
+{
+    return high_watermark_;
+}
+
+size_t SearchExecutor::stage_low_watermark() const
+{
+    return low_watermark_;
+}
+
+size_t SearchExecutor::max_stage_backlog() const
+{
+    return max_stage_backlog_;
+}
+
+size_t SearchExecutor::backpressure_count() const
+{
+    return backpressure_count_;
+}
+
+void SearchExecutor::record_backlog(size_t backlog)
+{
+    size_t current = max_stage_backlog_;
+    while (backlog > current && !max_stage_backlog_.compare_exchange_weak(current, backlog)) {
+    }
+}
+
+std::ostream& SearchExecutor::print_stats(std::ostream& out) const
+{
+    out << "Search executor: " << thread_count_ << " threads; ";
+    out << "Stage watermarks: " << high_watermark_ << "/" << low_watermark_ << "; ";
+    out << "Max stage backlog: " << max_stage_backlog_ << "; ";
+    out << "Backpressure events: " << backpressure_count_;
+    out << "; Max queued tasks:";
+    for (const auto& pool : pools_) {
+        out << " " << pool->max_queue_size();
+    }
+    out << std::endl;
+    
+    return out;
+}
+
+SearchExecutor::Placement::Placement(SearchExecutor& executor, size_t worker_count) :
+executor_(executor), placed_(false), node_(0)
+{
+    if (!executor_.numa_aware_ || current_context().executor == &executor_) {
+        // already on a node (e.g. a search run from a task)
+        return;
+    }
+    
+    size_t min_load = 0;
+    for (size_t n = 0; n < executor_.pools_.size(); n++) {
+        if (executor_.pools_[n]->size() < worker_count) {
+            continue;
+        }
+        size_t load = executor_.node_load_[n];
+        if (!placed_ || load < min_load) {
+            placed_ = true;
+            node_ = n;
+            min_load = load;
+        }
+    }
+    if (!placed_) {
+        return;
+    }
+    
+    executor_.node_load_[node_]++;
+    current_context() = NodeContext{&executor_, node_};
+    
+    previous_cpus_ = NumaTopology::current_thread_cpus();
+    NumaTopology::bind_current_thread(executor_.node_cpus_[node_]);
+}
+
+SearchExecutor::Placement::~Placement()
+{
+    if (!placed_) {
+        return;
+    }
+    
+    if (!previous_cpus_.empty()) {
+        NumaTopology::bind_current_thread(previous_cpus_);
+    }
+    current_context() = NodeContext{nullptr, 0};
+    executor_.node_load_[node_]--;
+}
+
+bool SearchExecutor::Placement::placed() const
+{
+    return placed_;
+}
+
+SearchExecutor::TaskGroup::TaskGroup(SearchExecutor& executor) :
+executor_(executor), pool_(executor.current_pool()), pending_(0)
+{
+}
+
+SearchExecutor::TaskGroup::~TaskGroup()
+{
+    wait();
+}
+
+void SearchExecutor::TaskGroup::task_started()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    pending_++;
+}
+
+void SearchExecutor::TaskGroup::task_done()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    // notify under the lock: the group can be destroyed as soon as wait() returns
+    if (--pending_ == 0) {
+        done_cv_.notify_all();
+    }
+}
+
+void SearchExecutor::TaskGroup::wait()
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    done_cv_.wait(lock, [this]{ return pending_ == 0; });
+}
+
+SearchExecutor::Stage::Stage(TaskGroup& group, size_t max_concurrency) :
+group_(group), executor_(group.executor_), max_concurrency_(std::max<size_t>(max_concurrency, 1)),
+high_watermark_(executor_.stage_high_watermark()), low_watermark_(executor_.stage_low_watermark()),
+active_(0), scheduled_(0), max_backlog_(0)
+{
+}
+
+size_t SearchExecutor::Stage::max_backlog() const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return max_backlog_;
+}
+
+void SearchExecutor::Stage::submit(InlineTask item)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    
+    items_.push(std::move(item));
+    if (items_.size() > max_backlog_) {
+        max_backlog_ = items_.size();
+        executor_.record_backlog(max_backlog_);
+    }
+    
+    if (high_watermark_ > 0 && items_.size() > high_watermark_) {
+        // the producer is faster than the stage
+        executor_.backpressure_count_++;
+        
+        // only wait for items that are being processed (not for drain tasks
+        // that might be stuck in the executor's queues behind us)
+        space_cv_.wait(lock, [this]{ return items_.size() <= low_watermark_ || active_ < max_concurrency_; });
+        
+        if (items_.size() > low_watermark_) {
+            // help
+            active_++;
+            run_items(lock, low_watermark_);
+            active_--;
+            space_cv_.notify_all();
+        }
+        
+        // somebody has to process the remaining items
+        schedule_if_needed();
+        return;
+    }
+    
+    schedule_if_needed();
+}
+
+void SearchExecutor::Stage::schedule_if_needed()
+{
+    if (items_.empty() || active_ + scheduled_ >= max_concurrency_) {
+        return;
+    }
+    scheduled_++;
+    
+    group_.run([this](){ drain(); });
+}
+
+void SearchExecutor::Stage::run_items(std::unique_lock<std::mutex>& lock, size_t limit)
+{
+    while (items_.size() > limit) {
+        InlineTask item = items_.pop();
+        
+        if (items_.size() <= low_watermark_) {
+            space_cv_.notify_all();
+        }
+        
+        lock.unlock();
+        try {
+            item();
+        } catch (std::exception& e) {
+            logger::log(logger::ERROR) << "Exception in search stage: " << e.what() << std::endl;
+        }
+        lock.lock();
+    }
+}
+
+void SearchExecutor::Stage::drain()
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    
+    scheduled_--;
+    if (active_ >= max_concurrency_) {
+        // producers are processing the items, but they stop at the low
+        // watermark: they will schedule a new task if needed
+        return;
+    }
+    
+    active_++;
+    run_items(lock, 0);
+    active_--;
+    
+    space_cv_.notify_all();
+}
+
+} // namespace sophos
+} // namespace sse
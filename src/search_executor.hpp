@@ -0,0 +1,340 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include "work_stealing_thread_pool.hpp"
+#include "task.hpp"
+#include "numa_topology.hpp"
+#include "ring_buffer.hpp"
+#include "logger.hpp"
+
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <ostream>
+
+namespace sse {
+namespace sophos {
+
+// Long-lived pool of worker threads shared by all the searches of a server.
+// Searches submit their tasks through a TaskGroup, which tracks their
+// completion without stopping the pool (as ThreadPool::join() does).
+//
+// Tasks must never wait for other tasks: the workers are shared, and a
+// blocked worker could prevent the tasks it waits for from running.
+// The only exception is the backpressure of the stages (see Stage::submit),
+// which only waits for items that are already being processed.
+//
+// A NUMA-aware executor has one pool of workers per node, pinned to the CPUs
+// of the node. The tasks of a search run on a single node when it has enough
+// workers (see Placement): with the kernel's first-touch policy, the blocks
+// of tokens and results they allocate stay in the node's memory.
+class SearchExecutor {
+public:
+    // number of pending items of a stage above which producers are slowed
+    // down, and below which they can resume
+    static constexpr size_t kDefaultHighWatermark = 64;
+    static constexpr size_t kDefaultLowWatermark = 32;
+
+    explicit SearchExecutor(size_t thread_count = std::thread::hardware_concurrency());
+    // NUMA-aware executor: the threads are split among the nodes of the
+    // topology, in proportion to their CPUs
+    SearchExecutor(size_t thread_count, const NumaTopology& topology);
+
+    size_t thread_count() const;
+    size_t node_count() const;
+    size_t node_thread_count(size_t node) const;
+    bool numa_aware() const;
+
+    // watermarks of the stages created afterwards
+    void set_stage_watermarks(size_t high, size_t low);
+    size_t stage_high_watermark() const;
+    size_t stage_low_watermark() const;
+
+    // largest number of pending items reached by a stage
+    size_t max_stage_backlog() const;
+    // number of times a producer had to process or wait for the items of a
+    // full stage
+    size_t backpressure_count() const;
+
+    std::ostream& print_stats(std::ostream& out) const;
+
+    // Runs f(i) for i in [begin, end) on the workers and on the calling
+    // thread, which takes part in the loop: it can be called from a task.
+    template <class F>
+    void parallel_for(size_t begin, size_t end, const F& f, size_t min_chunk = 1);
+
+    // Runs f(t, n) for t in [0, n) on the calling thread and on the workers
+    // that start right away (see WorkStealingThreadPool::run_team), n being
+    // at most max_count. Returns n.
+    template <class F>
+    size_t run_team(size_t max_count, const F& f);
+
+    class Stage;
+
+    // Places the searches run by the calling thread on a single node, for
+    // the lifetime of the object: the tasks of their groups and their
+    // parallel loops go to the node's workers, and the calling thread (which
+    // takes part in the loops) is pinned to the node.
+    // The node is the least loaded one with at least worker_count workers.
+    // If there is none (or if the executor is not NUMA-aware), the searches
+    // are not placed, and their groups are spread among the nodes.
+    class Placement {
+    public:
+        Placement(SearchExecutor& executor, size_t worker_count);
+        ~Placement();
+
+        Placement(const Placement&) = delete;
+        Placement& operator=(const Placement&) = delete;
+
+        bool placed() const;
+
+    private:
+        SearchExecutor& executor_;
+        bool placed_;
+        size_t node_;
+        std::vector<unsigned> previous_cpus_;
+    };
+
+    // Completion handle of the tasks of a single search.
+    class TaskGroup {
+    public:
+        explicit TaskGroup(SearchExecutor& executor);
+        // waits for the remaining tasks
+        ~TaskGroup();
+
+        // Submits a task to the executor. Tasks can submit new tasks to
+        // their group.
+        template <class F>
+        void run(F&& task);
+
+        // Waits until every task submitted to the group (including the ones
+        // submitted by other tasks) is done.
+        void wait();
+
+    private:
+        friend class Stage;
+        
+        template <class F> struct GroupTask;
+        
+        void task_started();
+        void task_done();
+
+        SearchExecutor& executor_;
+        WorkStealingThreadPool& pool_;
+        size_t pending_;
+        std::mutex mtx_;
+        std::condition_variable done_cv_;
+    };
+
+    // Runs the items submitted to a search stage on the tasks of a group,
+    // with at most max_concurrency items processed at the same time.
+    // With max_concurrency == 1, the items are processed one after the other,
+    // as if by a single dedicated thread.
+    // A stage must outlive the tasks of its group: wait for the group before
+    // destroying it.
+    class Stage {
+    public:
+        Stage(TaskGroup& group, size_t max_concurrency);
+
+        // Queues an item. If the stage has more than its high watermark of
+        // pending items, the caller processes them itself until there are
+        // less than the low watermark or, if max_concurrency items are
+        // already being processed, waits until this is the case.
+        void submit(InlineTask item);
+
+        size_t max_backlog() const;
+
+    private:
+        void drain();
+        // runs items until there are at most limit left, with a slot
+        // already taken. Must be called with the lock held.
+        void run_items(std::unique_lock<std::mutex>& lock, size_t limit);
+        void schedule_if_needed();
+
+        TaskGroup& group_;
+        SearchExecutor& executor_;
+        const size_t max_concurrency_;
+        const size_t high_watermark_;
+        const size_t low_watermark_;
+
+        size_t active_;     // threads processing items
+        size_t scheduled_;  // drain tasks not started yet
+        size_t max_backlog_;
+
+        TaskRing items_;
+        mutable std::mutex mtx_;
+        std::condition_variable space_cv_;
+    };
+
+    // Stage of a ring pipeline: the batches pushed in its ring are processed
+    // in order, one at a time, by a drain task of the group (the single
+    // consumer of the ring), which lives as long as the ring is not empty:
+    // the hand-offs do not take locks nor allocate tasks.
+    // push() never waits: when the ring is full, the producer processes its
+    // batch itself, so process can be called concurrently.
+    // Ring is SpscRing (a single thread pushes) or MpscRing. As a Stage, a
+    // RingStage must outlive the tasks of its group.
+    template <class T, template <class> class Ring>
+    class RingStage {
+    public:
+        RingStage(TaskGroup& group, size_t capacity, std::function<void(T&)> process);
+
+        void push(T&& batch);
+
+        // number of batches processed by the producers
+        size_t overflow_count() const;
+
+    private:
+        void drain();
+
+        TaskGroup& group_;
+        Ring<T> ring_;
+        std::function<void(T&)> process_;
+
+        // batches pushed but not processed yet: the thread that makes it
+        // non-zero schedules the drain task
+        std::atomic_size_t pending_;
+        std::atomic_size_t overflow_count_;
+    };
+
+private:
+    // node of the executor's workers, and of the placed threads
+    struct NodeContext
+    {
+        const SearchExecutor* executor;
+        size_t node;
+    };
+    static NodeContext& current_context();
+
+    // the pool of the calling thread's node or, if it is not placed, of the
+    // next node
+    WorkStealingThreadPool& current_pool();
+
+    void record_backlog(size_t backlog);
+
+    size_t thread_count_;
+    bool numa_aware_;
+    std::vector<std::vector<unsigned>> node_cpus_;
+    std::vector<std::unique_ptr<WorkStealingThreadPool>> pools_;
+
+    // number of placed threads per node
+    std::unique_ptr<std::atomic_size_t[]> node_load_;
+    std::atomic_size_t next_node_;
+
+    std::atomic_size_t high_watermark_;
+    std::atomic_size_t low_watermark_;
+
+    std::atomic_size_t max_stage_backlog_;
+    std::atomic_size_t backpressure_count_;
+};
+
+// runs a task of a group, and signals its completion
+template <class F>
+struct SearchExecutor::TaskGroup::GroupTask
+{
+    TaskGroup* group;
+    F task;
+    
+    void operator()()
+    {
+        try {
+            task();
+        } catch (std::exception& e) {
+            logger::log(logger::ERROR) << "Exception in search task: " << e.what() << std::endl;
+        }
+        group->task_done();
+    }
+};
+
+template <class F>
+void SearchExecutor::parallel_for(size_t begin, size_t end, const F& f, size_t min_chunk)
+{
+    current_pool().parallel_for(begin, end, f, min_chunk);
+}
+
+template <class F>
+size_t SearchExecutor::run_team(size_t max_count, const F& f)
+{
+    return current_pool().run_team(max_count, f);
+}
+
+template <class F>
+void SearchExecutor::TaskGroup::run(F&& task)
+{
+    task_started();
+    
+    pool_.post(GroupTask<typename std::decay<F>::type>{this, std::forward<F>(task)});
+}
+
+template <class T, template <class> class Ring>
+SearchExecutor::RingStage<T, Ring>::RingStage(TaskGroup& group, size_t capacity, std::function<void(T&)> process) :
+group_(group), ring_(capacity), process_(std::move(process)), pending_(0), overflow_count_(0)
+{
+}
+
+template <class T, template <class> class Ring>
+void SearchExecutor::RingStage<T, Ring>::push(T&& batch)
+{
+    if (!ring_.try_push(std::move(batch))) {
+        // the consumer is behind: slow the producer down
+        overflow_count_++;
+        process_(batch);
+        return;
+    }
+    
+    if (pending_.fetch_add(1) == 0) {
+        group_.run([this](){ drain(); });
+    }
+}
+
+template <class T, template <class> class Ring>
+void SearchExecutor::RingStage<T, Ring>::drain()
+{
+    T batch;
+    
+    do {
+        // the batch was pushed before pending_ was incremented, but an
+        // MpscRing cell might still be being written
+        while (!ring_.try_pop(batch)) {
+            std::this_thread::yield();
+        }
+        try {
+            process_(batch);
+        } catch (std::exception& e) {
+            logger::log(logger::ERROR) << "Exception in search stage: " << e.what() << std::endl;
+        }
+    } while (pending_.fetch_sub(1) > 1);
+}
+
+template <class T, template <class> class Ring>
+size_t SearchExecutor::RingStage<T, Ring>::overflow_count() const
+{
+    return overflow_count_;
+}
+
+} // namespace sophos
+} // namespace sse
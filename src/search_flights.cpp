@@ -0,0 +1,352 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "search_flights.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+namespace sse {
+namespace sophos {
+
+// waiting followers check whether they were cancelled at this interval
+constexpr std::chrono::milliseconds kFollowPollInterval(10);
+
+// the followers are woken up once every kPublishBlockSize results published
+// one by one (the others are picked up at the next poll)
+constexpr size_t kPublishBlockSize = 64;
+
+class SearchFlights::Flight {
+public:
+    Flight(const key_type& key, size_t max_replay_count) :
+    key(key), follower_count(0), done(false), complete(false), sealed(false), max_replay_count_(max_replay_count), abandoned_(false)
+    {
+    }
+    
+    // true once all the searches of the flight are cancelled. It stays
+    // true: the flight does not take new searches anymore.
+    bool abandoned()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        
+        if (!abandoned_) {
+            abandoned_ = std::all_of(searches.begin(), searches.end(),
+                                     [](const std::shared_ptr<SearchCancellation>& c)
+                                     {
+                                         return c && c->cancelled();
+                                     });
+        }
+        return abandoned_;
+    }
+    
+    // must be called with the lock held
+    bool joinable() const
+    {
+        return !done && !abandoned_ && !sealed.load(std::memory_order_relaxed);
+    }
+    
+    // Returns true, with the lock held, if the results have to be kept for
+    // the (current or future) followers. A flight without followers that
+    // kept max_replay_count results is sealed: its results are released,
+    // and the next ones are dropped without taking the lock.
+    bool buffered(std::unique_lock<std::mutex>& lock)
+    {
+        if (sealed.load(std::memory_order_acquire)) {
+            return false;
+        }
+        lock.lock();
+        if (follower_count == 0 && results.size() >= max_replay_count_) {
+            sealed.store(true, std::memory_order_release);
+            std::vector<index_type>().swap(results);
+            lock.unlock();
+            return false;
+        }
+        return true;
+    }
+    
+    const key_type key;
+    std::shared_ptr<SearchCancellation> walk_cancellation;
+    
+    // the cancellations of the searches in the flight (null for the searches
+    // which cannot be cancelled)
+    std::vector<std::shared_ptr<SearchCancellation>> searches;
+    size_t follower_count;
+    std::vector<index_type> results;
+    bool done;
+    bool complete;
+    
+    // set (with the lock held) once the results are not kept anymore
+    std::atomic<bool> sealed;
+    
+    std::mutex mtx;
+    std::condition_variable cv;
+    
+private:
+    const size_t max_replay_count_;
+    bool abandoned_;
+};
+
+SearchFlights::SearchFlights(size_t max_replay_count) :
+max_replay_count_(max_replay_count), led_count_(0), followed_count_(0), incomplete_count_(0)
+{
+}
+
+SearchFlights::key_type SearchFlights::flight_key(const SearchRequest& req)
+{
+    key_type key(req.token.begin(), req.token.end());
+    
+    key.append(reinterpret_cast<const char*>(&req.add_count), sizeof(req.add_count));
+    key.append(reinterpret_cast<const char*>(&req.limit), sizeof(req.limit));
+    key.append(reinterpret_cast<const char*>(&req.checkpoint_stride), sizeof(req.checkpoint_stride));
+    
+    uint32_t checkpoint_count = static_cast<uint32_t>(req.checkpoints.size());
+    key.append(reinterpret_cast<const char*>(&checkpoint_count), sizeof(checkpoint_count));
+    for (const search_token_type& checkpoint : req.checkpoints) {
+        key.append(checkpoint.begin(), checkpoint.end());
+    }
+    key.append(req.derivation_key);
+    
+    return key;
+}
+
+SearchFlights::Seat SearchFlights::join(const SearchRequest& req)
+{
+    key_type key = flight_key(req);
+    
+    std::lock_guard<std::mutex> lock(mtx_);
+    
+    auto it = flights_.find(key);
+    if (it != flights_.end()) {
+        std::shared_ptr<Flight> flight = it->second;
+        std::lock_guard<std::mutex> flight_lock(flight->mtx);
+        
+        if (flight->joinable()) {
+            flight->searches.push_back(req.cancellation);
+            flight->follower_count++;
+            followed_count_++;
+            
+            return Seat(this, flight, req.cancellation, false);
+        }
+    }
+    
+    // start a new flight, which replaces the abandoned one if any
+    auto flight = std::make_shared<Flight>(key, max_replay_count_);
+    std::weak_ptr<Flight> weak_flight = flight;
+    
+    flight->searches.push_back(req.cancellation);
+    flight->walk_cancellation = std::make_shared<SearchCancellation>([weak_flight]()
+                                                                     {
+                                                                         auto f = weak_flight.lock();
+                                                                         return !f || f->abandoned();
+                                                                     });
+    flights_[key] = flight;
+    led_count_++;
+    
+    return Seat(this, flight, req.cancellation, true);
+}
+
+void SearchFlights::end(const std::shared_ptr<Flight>& flight, bool complete)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        
+        auto it = flights_.find(flight->key);
+        if (it != flights_.end() && it->second == flight) {
+            flights_.erase(it);
+        }
+        if (!complete) {
+            incomplete_count_++;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(flight->mtx);
+        flight->done = true;
+        flight->complete = complete;
+    }
+    flight->cv.notify_all();
+}
+
+size_t SearchFlights::flight_count() const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return flights_.size();
+}
+
+std::ostream& SearchFlights::print_stats(std::ostream& out) const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    
+    out << "Search flights: " << led_count_ << " led; " << followed_count_ << " coalesced; ";
+    out << incomplete_count_ << " incomplete; " << flights_.size() << " running" << std::endl;
+    
+    return out;
+}
+
+SearchFlights::Seat::Seat() :
+flights_(nullptr), leader_(false)
+{
+}
+
+SearchFlights::Seat::Seat(SearchFlights* flights, std::shared_ptr<Flight> flight, std::shared_ptr<SearchCancellation> cancellation, bool leader) :
+flights_(flights), flight_(std::move(flight)), cancellation_(std::move(cancellation)), leader_(leader)
+{
+}
+
+SearchFlights::Seat::Seat(Seat&& s) :
+flights_(s.flights_), flight_(std::move(s.flight_)), cancellation_(std::move(s.cancellation_)), leader_(s.leader_)
+{
+    s.flights_ = nullptr;
+}
+
+SearchFlights::Seat& SearchFlights::Seat::operator=(Seat&& s)
+{
+    if (this != &s) {
+        leave();
+        
+        flights_ = s.flights_;
+        flight_ = std::move(s.flight_);
+        cancellation_ = std::move(s.cancellation_);
+        leader_ = s.leader_;
+        
+        s.flights_ = nullptr;
+    }
+    return *this;
+}
+
+SearchFlights::Seat::~Seat()
+{
+    leave();
+}
+
+void SearchFlights::Seat::leave()
+{
+    if (!flight_) {
+        return;
+    }
+    
+    if (leader_) {
+        bool done;
+        {
+            std::lock_guard<std::mutex> lock(flight_->mtx);
+            done = flight_->done;
+        }
+        if (!done) {
+            flights_->end(flight_, false);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(flight_->mtx);
+        
+        auto it = std::find(flight_->searches.begin(), flight_->searches.end(), cancellation_);
+        if (it != flight_->searches.end()) {
+            flight_->searches.erase(it);
+        }
+        if (!leader_) {
+            flight_->follower_count--;
+        }
+    }
+    flight_.reset();
+}
+
+bool SearchFlights::Seat::leader() const
+{
+    return leader_;
+}
+
+std::shared_ptr<SearchCancellation> SearchFlights::Seat::walk_cancellation() const
+{
+    return flight_->walk_cancellation;
+}
+
+void SearchFlights::Seat::publish(index_type v)
+{
+    std::unique_lock<std::mutex> lock(flight_->mtx, std::defer_lock);
+    if (!flight_->buffered(lock)) {
+        return;
+    }
+    
+    flight_->results.push_back(v);
+    // without followers, nobody waits
+    bool notify = (flight_->follower_count > 0 && flight_->results.size() % kPublishBlockSize == 0);
+    lock.unlock();
+    
+    if (notify) {
+        flight_->cv.notify_all();
+    }
+}
+
+void SearchFlights::Seat::publish(const index_type* values, size_t count)
+{
+    std::unique_lock<std::mutex> lock(flight_->mtx, std::defer_lock);
+    if (!flight_->buffered(lock)) {
+        return;
+    }
+    
+    flight_->results.insert(flight_->results.end(), values, values + count);
+    bool notify = (flight_->follower_count > 0);
+    lock.unlock();
+    
+    if (notify) {
+        flight_->cv.notify_all();
+    }
+}
+
+void SearchFlights::Seat::complete(bool complete)
+{
+    flights_->end(flight_, complete);
+}
+
+bool SearchFlights::Seat::follow(const std::function<void(index_type)>& post)
+{
+    std::vector<index_type> batch;
+    size_t posted = 0;
+    
+    std::unique_lock<std::mutex> lock(flight_->mtx);
+    
+    while (true) {
+        if (cancellation_ && cancellation_->cancelled()) {
+            return false;
+        }
+        
+        if (posted < flight_->results.size()) {
+            // post the new results without holding the lock
+            batch.assign(flight_->results.begin() + posted, flight_->results.end());
+            posted = flight_->results.size();
+            
+            lock.unlock();
+            for (index_type v : batch) {
+                post(v);
+            }
+            lock.lock();
+            continue;
+        }
+        
+        if (flight_->done) {
+            return flight_->complete;
+        }
+        
+        flight_->cv.wait_for(lock, kFollowPollInterval);
+    }
+}
+
+} // namespace sophos
+} // namespace sse
@@ -0,0 +1,138 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include "sophos_core.hpp"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <string>
+#include <vector>
+#include <ostream>
+
+namespace sse {
+namespace sophos {
+
+// Single-flight coalescing of identical concurrent searches.
+//
+// The searches of the same entries of a chain (same search token, derivation
+// key, number of entries, limit and checkpoints) that run at the same time
+// share a flight. The first one, the leader, walks the chain and publishes its
+// results in the flight. The following ones, the followers, do not walk the
+// chain: they replay the results published so far, then receive the new ones
+// as they are published.
+// The walk of a flight is only cancelled once all its searches are (see
+// Seat::walk_cancellation): the leader keeps walking for the followers when
+// its own client is gone.
+// A flight keeps the results published by its leader until its last search
+// is done, so that the searches joining it late replay them. Past
+// max_replay_count results, a flight without followers is sealed: its results
+// are dropped, and the identical searches that come later start their own
+// flight.
+class SearchFlights {
+    class Flight;
+    
+public:
+    static constexpr size_t kDefaultMaxReplayCount = 1 << 20;
+    
+    explicit SearchFlights(size_t max_replay_count = kDefaultMaxReplayCount);
+    
+    // A search's place in a flight. The search leaves the flight when its
+    // seat is destroyed; the flight of a leader ends (incomplete, if the
+    // leader did not complete it).
+    class Seat {
+    public:
+        // no flight
+        Seat();
+        Seat(Seat&& s);
+        Seat& operator=(Seat&& s);
+        ~Seat();
+        
+        Seat(const Seat&) = delete;
+        Seat& operator=(const Seat&) = delete;
+        
+        bool leader() const;
+        
+        // Leader only. Cancelled once all the searches of the flight are:
+        // the leader must walk with it.
+        std::shared_ptr<SearchCancellation> walk_cancellation() const;
+        
+        // Leader only. The results are replayed to the followers in the
+        // order of publication. Publishing blocks of results is cheaper when
+        // the flight has followers. Can be called concurrently.
+        void publish(index_type v);
+        void publish(const index_type* values, size_t count);
+        // Ends the flight. complete is false if the walk was interrupted.
+        void complete(bool complete);
+        
+        // Follower only. Calls post on all the results of the flight, in
+        // order, until the flight ends or the search is cancelled. Returns
+        // true if the flight completed and all its results were posted.
+        bool follow(const std::function<void(index_type)>& post);
+        
+    private:
+        friend class SearchFlights;
+        
+        Seat(SearchFlights* flights, std::shared_ptr<Flight> flight, std::shared_ptr<SearchCancellation> cancellation, bool leader);
+        
+        void leave();
+        
+        SearchFlights* flights_;
+        std::shared_ptr<Flight> flight_;
+        // the search's own cancellation, can be null
+        std::shared_ptr<SearchCancellation> cancellation_;
+        bool leader_;
+    };
+    
+    // Joins the running flight of req, or starts a new one, led by the
+    // returned seat. The search is registered with req.cancellation.
+    Seat join(const SearchRequest& req);
+    
+    size_t flight_count() const;
+    
+    std::ostream& print_stats(std::ostream& out) const;
+    
+private:
+    typedef std::string key_type;
+    
+    static key_type flight_key(const SearchRequest& req);
+    
+    void end(const std::shared_ptr<Flight>& flight, bool complete);
+    
+    // running flights
+    std::map<key_type, std::shared_ptr<Flight>> flights_;
+    
+    const size_t max_replay_count_;
+    
+    size_t led_count_;
+    size_t followed_count_;
+    size_t incomplete_count_;
+    
+    mutable std::mutex mtx_;
+};
+
+} // namespace sophos
+} // namespace sse
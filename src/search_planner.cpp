@@ -0,0 +1,474 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "search_planner.hpp"
+
+#include "logger.hpp"
+
+#include <fstream>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+namespace sse {
+namespace sophos {
+
+const std::string SearchPlanner::kProfileFile = "search_profile.txt";
+
+// number of measured entries per stage, for quick calibration and autotuning
+constexpr size_t kCalibrationTdpCount = 256;
+constexpr size_t kCalibrationPrfCount = 4096;
+constexpr size_t kCalibrationEdbCount = 4096;
+constexpr size_t kCalibrationTeamCount = 64;
+constexpr size_t kAutotuneFactor = 16;
+
+// weight of a new measure of the RPC write cost
+constexpr double kRpcWriteSmoothing = 0.1;
+
+SearchCostProfile::SearchCostProfile() :
+tdp_eval(20.), tdp_stride(20.), prf_derive(1.), edb_get(2.), rpc_write(5.), task_dispatch(5.),
+cpu_contention(0.), edb_contention(0.)
+{
+}
+
+bool SearchCostProfile::load(const std::string& path)
+{
+    std::ifstream in(path.c_str());
+
+    if (!in.is_open()) {
+        return false;
+    }
+
+    SearchCostProfile p;
+    std::string name;
+    double value;
+    size_t read_count = 0;
+    bool stride_read = false;
+
+    while (in >> name >> value) {
+        if (name == "tdp_eval") {
+            p.tdp_eval = value;
+        }else if (name == "tdp_stride") {
+            p.tdp_stride = value;
+            stride_read = true;
+        }else if (name == "prf_derive") {
+            p.prf_derive = value;
+        }else if (name == "edb_get") {
+            p.edb_get = value;
+        }else if (name == "rpc_write") {
+            p.rpc_write = value;
+        }else if (name == "task_dispatch") {
+            p.task_dispatch = value;
+        }else if (name == "thread_start") {
+            // cost of a std::thread, measured by older versions: it
+            // overestimates the dispatch on the executor, keep the default
+            continue;
+        }else if (name == "cpu_contention") {
+            p.cpu_contention = value;
+        }else if (name == "edb_contention") {
+            p.edb_contention = value;
+        }else{
+            logger::log(logger::WARNING) << "Unknown entry in search profile " << path << ": " << name << std::endl;
+            continue;
+        }
+        read_count++;
+    }
+
+    if (read_count == 0) {
+        logger::log(logger::ERROR) << "Invalid search profile: " << path << std::endl;
+        return false;
+    }
+
+    // profiles saved before the stride cost was measured
+    if (!stride_read) {
+        p.tdp_stride = p.tdp_eval;
+    }
+
+    *this = p;
+    return true;
+}
+
+bool SearchCostProfile::save(const std::string& path) const
+{
+    std::ofstream out(path.c_str());
+
+    if (!out.is_open()) {
+        logger::log(logger::ERROR) << "Unable to write the search profile to " << path << std::endl;
+        return false;
+    }
+
+    out << "tdp_eval " << tdp_eval << "\n";
+    out << "tdp_stride " << tdp_stride << "\n";
+    out << "prf_derive " << prf_derive << "\n";
+    out << "edb_get " << edb_get << "\n";
+    out << "rpc_write " << rpc_write << "\n";
+    out << "task_dispatch " << task_dispatch << "\n";
+    out << "cpu_contention " << cpu_contention << "\n";
+    out << "edb_contention " << edb_contention << "\n";
+
+    return out.good();
+}
+
+std::ostream& operator<<(std::ostream& out, const SearchCostProfile& p)
+{
+    out << "Search costs (us): TDP " << p.tdp_eval << " (stride " << p.tdp_stride << "), PRF " << p.prf_derive;
+    out << ", EDB " << p.edb_get << ", RPC " << p.rpc_write << ", dispatch " << p.task_dispatch;
+    out << "; contention: CPU " << p.cpu_contention << ", EDB " << p.edb_contention;
+
+    return out;
+}
+
+unsigned SearchPlan::worker_count() const
+{
+    switch (engine) {
+        case SEQUENTIAL:
+        case BOUNDED:
+            return 1;
+        case PARALLEL_LIGHT:
+        case CHECKPOINTS:
+            return rsa_threads;
+        case PIPELINE:
+        case RING_PIPELINE:
+            return rsa_threads + access_threads + post_threads;
+        case READ_POOL:
+            return rsa_threads + access_threads + read_threads;
+    }
+    return 1;
+}
+
+std::ostream& operator<<(std::ostream& out, const SearchPlan& plan)
+{
+    switch (plan.engine) {
+        case SearchPlan::SEQUENTIAL:
+            out << "sequential";
+            break;
+        case SearchPlan::PARALLEL_LIGHT:
+            out << "parallel light (" << (unsigned)plan.rsa_threads << " threads)";
+            break;
+        case SearchPlan::PIPELINE:
+            out << "pipeline (" << (unsigned)plan.rsa_threads << " rsa, " << (unsigned)plan.access_threads << " access, " << (unsigned)plan.post_threads << " post)";
+            break;
+        case SearchPlan::RING_PIPELINE:
+            out << "ring pipeline (" << (unsigned)plan.access_threads << " lookup stages)";
+            break;
+        case SearchPlan::READ_POOL:
+            out << "read pool (" << (unsigned)plan.access_threads << " compute threads, " << (unsigned)plan.read_threads << " reads)";
+            break;
+        case SearchPlan::CHECKPOINTS:
+            out << "checkpoints (" << (unsigned)plan.rsa_threads << " walkers)";
+            break;
+        case SearchPlan::BOUNDED:
+            out << "bounded";
+            break;
+    }
+    out << ", expected " << plan.expected_time << " us";
+
+    return out;
+}
+
+SearchPlanner::SearchPlanner(unsigned core_count) :
+core_count_(std::max(core_count, 1U))
+{
+}
+
+// Cost of each step of eval(st, stride), as paid by the stride walkers: the
+// widest stride the planner can choose is measured.
+static double stride_cost(const SophosServer& server, size_t count, unsigned core_count)
+{
+    unsigned stride = std::max(std::min(core_count, server.maximum_tdp_stride()), 2U);
+    
+    return server.benchmark_search_stage(TDP_EVAL, count, 1, stride)/(count*stride);
+}
+
+void SearchPlanner::calibrate(const SophosServer& server)
+{
+    SearchCostProfile p = profile();
+
+    p.tdp_eval = server.benchmark_search_stage(TDP_EVAL, kCalibrationTdpCount, 1)/kCalibrationTdpCount;
+    p.tdp_stride = stride_cost(server, kCalibrationTdpCount, core_count_);
+    p.prf_derive = server.benchmark_search_stage(PRF_DERIVE, kCalibrationPrfCount, 1)/kCalibrationPrfCount;
+    p.edb_get = server.benchmark_search_stage(EDB_LOOKUP, kCalibrationEdbCount, 1)/kCalibrationEdbCount;
+    p.task_dispatch = server.benchmark_task_dispatch(kCalibrationTeamCount);
+
+    set_profile(p);
+
+    logger::log(logger::INFO) << p << std::endl;
+}
+
+static const char* stage_name(SearchStage stage)
+{
+    switch (stage) {
+        case TDP_EVAL:
+            return "TDP";
+        case PRF_DERIVE:
+            return "PRF";
+        case EDB_LOOKUP:
+            return "EDB";
+    }
+    return "";
+}
+
+// Fits c in t_k = t_1 * (1 + c*(k-1)), where t_k is the time spent by k
+// threads each processing the same number of entries.
+// The k threads of the TDP stage run eval(st, k), as the stride walkers do:
+// t_1 is then measured with the same stride.
+static double fit_contention(const SophosServer& server, SearchStage stage, size_t count, unsigned core_count)
+{
+    double t_1 = server.benchmark_search_stage(stage, count, 1);
+    double num = 0., den = 0.;
+
+    for (unsigned k = 2; k <= core_count; k *= 2) {
+        unsigned stride = (stage == TDP_EVAL) ? std::min(k, server.maximum_tdp_stride()) : 1;
+        if (stride > 1) {
+            t_1 = server.benchmark_search_stage(stage, count, 1, stride);
+        }
+        double t_k = server.benchmark_search_stage(stage, count*k, k, stride);
+
+        logger::log(logger::INFO) << stage_name(stage) << " stage, " << k << " threads: " << t_k/count << " us/entry/thread" << std::endl;
+
+        num += (k-1)*(t_k/t_1 - 1.);
+        den += (k-1)*(k-1);
+    }
+
+    return (den > 0.) ? std::max(num/den, 0.) : 0.;
+}
+
+void SearchPlanner::autotune(const SophosServer& server)
+{
+    SearchCostProfile p = profile();
+
+    size_t tdp_count = kAutotuneFactor*kCalibrationTdpCount;
+    size_t prf_count = kAutotuneFactor*kCalibrationPrfCount;
+    size_t edb_count = kAutotuneFactor*kCalibrationEdbCount;
+
+    p.tdp_eval = server.benchmark_search_stage(TDP_EVAL, tdp_count, 1)/tdp_count;
+    p.tdp_stride = stride_cost(server, tdp_count, core_count_);
+    p.prf_derive = server.benchmark_search_stage(PRF_DERIVE, prf_count, 1)/prf_count;
+    p.edb_get = server.benchmark_search_stage(EDB_LOOKUP, edb_count, 1)/edb_count;
+
+    p.task_dispatch = server.benchmark_task_dispatch(kAutotuneFactor*kCalibrationTeamCount);
+
+    // the PRF stage is much cheaper than the TDP stage, use the latter (with
+    // the walkers' strides) for the CPU
+    p.cpu_contention = fit_contention(server, TDP_EVAL, kCalibrationTdpCount, core_count_);
+    p.edb_contention = fit_contention(server, EDB_LOOKUP, kCalibrationEdbCount, core_count_);
+
+    set_profile(p);
+
+    logger::log(logger::INFO) << p << std::endl;
+}
+
+SearchCostProfile SearchPlanner::profile() const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return profile_;
+}
+
+void SearchPlanner::set_profile(const SearchCostProfile& profile)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    profile_ = profile;
+}
+
+unsigned SearchPlanner::core_count() const
+{
+    return core_count_;
+}
+
+SearchPlan SearchPlanner::plan(uint32_t walk_count, bool streaming, unsigned worker_budget, size_t checkpoint_count) const
+{
+    const SearchCostProfile p = profile();
+    const double n = walk_count;
+
+    unsigned budget = std::min(std::max(worker_budget, 1U), core_count_);
+    budget = std::min(budget, (unsigned)std::numeric_limits<uint8_t>::max());
+
+    auto scaled = [](double cost, double contention, unsigned k)
+    {
+        return cost*(1. + contention*(k-1));
+    };
+
+    // TDP cost of each entry for a walker jumping stride entries at a time
+    auto walk_cost = [&p](unsigned stride)
+    {
+        return (stride > 1) ? stride*p.tdp_stride : p.tdp_eval;
+    };
+
+    // the results are written one by one, whatever the engine
+    const double write_time = n*p.rpc_write;
+
+    SearchPlan best;
+    best.engine = SearchPlan::SEQUENTIAL;
+    best.rsa_threads = 1;
+    best.access_threads = 0;
+    best.post_threads = 0;
+    best.read_threads = 0;
+    best.expected_time = n*(p.tdp_eval + p.prf_derive + p.edb_get) + write_time;
+
+    // each thread walks every k-th entry of the chain, with eval(st, k): the
+    // TDP work is not divided among the threads
+    for (unsigned k = 2; k <= std::min<unsigned>(budget, walk_count); k++) {
+        double per_entry = scaled(walk_cost(k) + p.prf_derive, p.cpu_contention, k) + scaled(p.edb_get, p.edb_contention, k);
+        double t = n/k*per_entry + k*p.task_dispatch + write_time;
+
+        if (t < best.expected_time) {
+            best.engine = SearchPlan::PARALLEL_LIGHT;
+            best.rsa_threads = k;
+            best.expected_time = t;
+        }
+    }
+
+    // independent walkers from the client's checkpoints: the only engine whose
+    // TDP work is parallel
+    if (checkpoint_count > 0) {
+        const size_t segments = std::min(checkpoint_count, kMaxCheckpointCount) + 1;
+        
+        for (unsigned k = 2; k <= std::min<size_t>(budget, segments); k++) {
+            double per_entry = scaled(p.tdp_eval + p.prf_derive, p.cpu_contention, k) + scaled(p.edb_get, p.edb_contention, k);
+            // the slowest walker has ceil(segments/k) segments
+            double t = ((segments + k - 1)/k)*(n/segments)*per_entry + k*p.task_dispatch + write_time;
+            
+            if (t < best.expected_time) {
+                best.engine = SearchPlan::CHECKPOINTS;
+                best.rsa_threads = k;
+                best.expected_time = t;
+            }
+        }
+    }
+    
+    // rsa -> access -> post pipeline: the slowest stage sets the pace
+    if (budget >= 3 && walk_count >= 2*kLookupBlockSize) {
+        const unsigned post = 1;
+
+        for (unsigned access = 1; access + post < budget; access++) {
+            unsigned rsa = budget - post - access;
+
+            // each rsa thread walks every rsa-th entry, with eval(st, rsa)
+            double rsa_time = n/rsa*scaled(walk_cost(rsa), p.cpu_contention, rsa + access);
+            double access_time = n/access*(scaled(p.prf_derive, p.cpu_contention, rsa + access) + scaled(p.edb_get, p.edb_contention, access));
+            double post_time = streaming ? write_time : 0.;
+
+            // fill the pipeline with the first block
+            double latency = kLookupBlockSize*(p.tdp_eval + p.prf_derive + p.edb_get);
+
+            double t = std::max(std::max(rsa_time, access_time), post_time) + latency + (rsa + access + post)*p.task_dispatch;
+            if (!streaming) {
+                t += write_time;
+            }
+
+            if (t < best.expected_time) {
+                best.engine = SearchPlan::PIPELINE;
+                best.rsa_threads = rsa;
+                best.access_threads = access;
+                best.post_threads = post;
+                best.expected_time = t;
+            }
+        }
+        
+        // a single walker feeding lookup stages: no TDP contention, but the
+        // walk is sequential
+        for (unsigned lookup = 1; lookup + 2 <= budget; lookup++) {
+            double rsa_time = n*scaled(p.tdp_eval, p.cpu_contention, lookup + 1);
+            double lookup_time = n/lookup*(scaled(p.prf_derive, p.cpu_contention, lookup + 1) + scaled(p.edb_get, p.edb_contention, lookup));
+            double post_time = streaming ? write_time : 0.;
+            
+            double latency = kLookupBlockSize*(p.tdp_eval + p.prf_derive + p.edb_get);
+            
+            double t = std::max(std::max(rsa_time, lookup_time), post_time) + latency + (lookup + 2)*p.task_dispatch;
+            if (!streaming) {
+                t += write_time;
+            }
+            
+            if (t < best.expected_time) {
+                best.engine = SearchPlan::RING_PIPELINE;
+                best.rsa_threads = 1;
+                best.access_threads = lookup;
+                best.post_threads = 1;
+                best.expected_time = t;
+            }
+        }
+    }
+    
+    // a single walker, with the lookups run by the EDB read pool while the
+    // compute threads derive and decrypt: the reads block the pool's threads,
+    // which are taken from the budget
+    if (budget >= 3 && walk_count >= 2*kReadPoolBlockSize) {
+        for (unsigned compute = 1; compute + 2 <= budget; compute++) {
+            for (unsigned reads = 1; compute + 1 + reads <= budget; reads++) {
+                double rsa_time = n*scaled(p.tdp_eval, p.cpu_contention, compute + 1);
+                double compute_time = n/compute*scaled(p.prf_derive, p.cpu_contention, compute + 1);
+                double read_time = n/reads*scaled(p.edb_get, p.edb_contention, reads);
+                
+                // the results are posted by the compute threads
+                if (streaming) {
+                    compute_time += n/compute*p.rpc_write;
+                }
+                
+                double latency = kReadPoolBlockSize*(p.tdp_eval + p.prf_derive + p.edb_get);
+                
+                double t = std::max(std::max(rsa_time, compute_time), read_time) + latency + (compute + 1)*p.task_dispatch;
+                if (!streaming) {
+                    t += write_time;
+                }
+                
+                if (t < best.expected_time) {
+                    best.engine = SearchPlan::READ_POOL;
+                    best.rsa_threads = 1;
+                    best.access_threads = compute;
+                    best.post_threads = 0;
+                    best.read_threads = reads;
+                    best.expected_time = t;
+                }
+            }
+        }
+    }
+
+    return best;
+}
+
+SearchPlan SearchPlanner::plan_bounded(uint32_t walk_count) const
+{
+    const SearchCostProfile p = profile();
+    
+    SearchPlan plan;
+    plan.engine = SearchPlan::BOUNDED;
+    plan.rsa_threads = 1;
+    plan.access_threads = 0;
+    plan.post_threads = 0;
+    plan.read_threads = 0;
+    plan.expected_time = walk_count*(p.tdp_eval + p.prf_derive + p.edb_get + p.rpc_write);
+    
+    return plan;
+}
+
+void SearchPlanner::record_rpc_writes(size_t count, double time)
+{
+    if (count == 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    profile_.rpc_write = (1. - kRpcWriteSmoothing)*profile_.rpc_write + kRpcWriteSmoothing*(time/count);
+}
+
+} // namespace sophos
+} // namespace sse
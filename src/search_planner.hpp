@@ -0,0 +1,131 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include "sophos_core.hpp"
+
+#include <string>
+#include <ostream>
+#include <mutex>
+#include <atomic>
+#include <thread>
+
+namespace sse {
+namespace sophos {
+
+// Costs of the stages of a search, in microseconds per entry (or per worker
+// for task_dispatch, the cost of starting a worker of the search executor).
+// The walkers of the parallel engines jump k entries at a time with
+// eval(st, k): tdp_stride is the cost of each of these k steps, so that such
+// a walker pays k*tdp_stride per entry.
+// When k threads run the same stage concurrently, the cost of each entry is
+// multiplied by (1 + contention*(k-1)).
+struct SearchCostProfile
+{
+    double tdp_eval;
+    double tdp_stride;
+    double prf_derive;
+    double edb_get;
+    double rpc_write;
+    double task_dispatch;
+
+    double cpu_contention;  // for the TDP and PRF stages
+    double edb_contention;
+
+    SearchCostProfile();
+
+    bool load(const std::string& path);
+    bool save(const std::string& path) const;
+};
+
+std::ostream& operator<<(std::ostream& out, const SearchCostProfile& profile);
+
+struct SearchPlan
+{
+    typedef enum{
+        SEQUENTIAL = 0,     // search / search_callback
+        PARALLEL_LIGHT,     // search_parallel_light(_callback), with rsa_threads threads
+        PIPELINE,           // search_parallel_callback
+        RING_PIPELINE,      // search_pipeline(_callback), with access_threads lookup stages
+        READ_POOL,          // search_read_pool(_callback), with access_threads compute threads and read_threads reads
+        CHECKPOINTS,        // search_checkpoints(_callback), with rsa_threads walkers
+        BOUNDED             // search_bounded(_callback), for bounded requests
+    } Engine;
+
+    Engine engine;
+    uint8_t rsa_threads;
+    uint8_t access_threads;
+    uint8_t post_threads;
+    uint8_t read_threads; // threads of the EDB read pool blocked by the plan
+
+    double expected_time; // in microseconds
+    
+    // number of workers used by the plan
+    unsigned worker_count() const;
+};
+
+std::ostream& operator<<(std::ostream& out, const SearchPlan& plan);
+
+// Chooses the search engine and its thread counts for each request, using a
+// cost model of the search stages and the number of workers granted to the
+// search (see SearchScheduler).
+class SearchPlanner {
+public:
+    static const std::string kProfileFile;
+
+    explicit SearchPlanner(unsigned core_count = std::thread::hardware_concurrency());
+
+    // Quick measure of the stages' costs (a few milliseconds).
+    void calibrate(const SophosServer& server);
+
+    // Offline tuning: measures every stage with an increasing number of
+    // threads to fit the contention coefficients.
+    void autotune(const SophosServer& server);
+
+    SearchCostProfile profile() const;
+    void set_profile(const SearchCostProfile& profile);
+
+    unsigned core_count() const;
+
+    // Plans a search walking walk_count entries (see
+    // SophosServer::search_walk_count), using at most worker_budget workers.
+    // If streaming is true, the results are written to the client as soon as
+    // they are found. checkpoint_count is the number of chain checkpoints
+    // sent by the client within the walked entries.
+    SearchPlan plan(uint32_t walk_count, bool streaming, unsigned worker_budget, size_t checkpoint_count = 0) const;
+    
+    // Plans a bounded search walking walk_count entries: the chain order is
+    // only kept by the bounded engine.
+    SearchPlan plan_bounded(uint32_t walk_count) const;
+
+    // Refines the cost of RPC writes from an actual search.
+    void record_rpc_writes(size_t count, double time);
+
+private:
+    unsigned core_count_;
+    SearchCostProfile profile_;
+
+    mutable std::mutex mtx_;
+};
+
+} // namespace sophos
+} // namespace sse
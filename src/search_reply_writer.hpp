@@ -0,0 +1,368 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include "sophos.pb.h"
+#include "result_encoding.hpp"
+#include "timer_queue.hpp"
+
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+
+namespace sse {
+namespace sophos {
+
+// Coalesces the results of a search in batched SearchReply messages before
+// writing them to a stream (a grpc::ServerWriter<SearchReply>, or anything
+// with a bool Write(const SearchReply&) method).
+// A batch is written when it holds max_count results or max_bytes bytes of
+// results or, if max_delay is not zero, once its first result waited for
+// max_delay (so that the results of slow searches still stream). The delay is
+// checked when a result is added and, if a flush timer is given, when it
+// expires: the timer's thread then writes the batch, even if no other result
+// comes (the writes of the writer should not block for long, as the thread is
+// shared). Without a timer, a batch that stops growing waits for the next
+// result, or for flush().
+// If the client does not accept batches, every result is written in its own
+// message, as before. If it accepts compressed encodings, the batches are
+// encoded (by the thread that fills them) with the most compact one.
+// write() can be called concurrently: the messages are written one at a time,
+// and the batches in the order in which they were filled.
+template <class Writer>
+class SearchReplyWriter {
+public:
+    static constexpr size_t kDefaultMaxCount = 4096;
+    static constexpr size_t kDefaultMaxBytes = 64*1024;
+    static constexpr std::chrono::microseconds::rep kDefaultMaxDelay = 5000; // microseconds
+
+    SearchReplyWriter(Writer* writer, bool batched, result_encoding_set encodings = 0,
+                      TimerQueue* flush_timer = nullptr,
+                      size_t max_count = kDefaultMaxCount,
+                      size_t max_bytes = kDefaultMaxBytes,
+                      std::chrono::microseconds max_delay = std::chrono::microseconds(kDefaultMaxDelay));
+    // writes the pending results
+    ~SearchReplyWriter();
+
+    SearchReplyWriter(const SearchReplyWriter&) = delete;
+    SearchReplyWriter& operator=(const SearchReplyWriter&) = delete;
+
+    void write(uint64_t result);
+
+    // writes the pending results now
+    void flush();
+    // flushes, and waits for the batch written by the flush timer, if any.
+    // Must be called before the end of the RPC.
+    void close();
+
+    // false if a write failed (e.g. the client is gone): the next results
+    // are dropped
+    bool ok() const;
+
+    size_t result_count() const;
+    size_t message_count() const;
+    // time spent writing messages, in microseconds
+    double write_time() const;
+
+private:
+    // returns the sequence number of the batch
+    uint64_t take_batch(SearchReply& reply);
+    void encode_batch(SearchReply& reply) const;
+    void write_message(const SearchReply& reply);
+    // writes the batch once all the batches taken before are written
+    void write_batch(const SearchReply& reply, uint64_t seq);
+    void write_locked(const SearchReply& reply);
+
+    // must be called with pending_mtx_ held
+    void arm_timer(std::chrono::steady_clock::time_point when);
+    void on_timer();
+
+    Writer* writer_;
+    const bool batched_;
+    const result_encoding_set encodings_;
+    const size_t max_count_;
+    const std::chrono::microseconds max_delay_;
+
+    // results waiting to be written
+    SearchReply pending_;
+    std::chrono::steady_clock::time_point pending_since_;
+    uint64_t taken_count_;
+    std::mutex pending_mtx_;
+
+    // flush timer, guarded by pending_mtx_
+    TimerQueue* flush_timer_;
+    TimerQueue::handle_type timer_handle_;
+    bool timer_armed_;
+    bool timer_writing_;
+    bool closed_;
+    std::condition_variable timer_cv_;
+
+    // serializes the writes
+    std::mutex write_mtx_;
+    std::condition_variable write_cv_;
+    uint64_t written_count_;
+    std::atomic_bool ok_;
+    std::atomic_size_t result_count_;
+    std::atomic_size_t message_count_;
+    double write_time_;
+};
+
+template <class Writer>
+constexpr size_t SearchReplyWriter<Writer>::kDefaultMaxCount;
+template <class Writer>
+constexpr size_t SearchReplyWriter<Writer>::kDefaultMaxBytes;
+template <class Writer>
+constexpr std::chrono::microseconds::rep SearchReplyWriter<Writer>::kDefaultMaxDelay;
+
+template <class Writer>
+SearchReplyWriter<Writer>::SearchReplyWriter(Writer* writer, bool batched, result_encoding_set encodings, TimerQueue* flush_timer, size_t max_count, size_t max_bytes, std::chrono::microseconds max_delay) :
+writer_(writer), batched_(batched), encodings_(encodings),
+max_count_(std::max<size_t>(std::min(max_count, max_bytes/sizeof(uint64_t)), 1)), max_delay_(max_delay),
+taken_count_(0),
+flush_timer_(flush_timer), timer_handle_(TimerQueue::kNoHandle), timer_armed_(false), timer_writing_(false), closed_(false),
+written_count_(0), ok_(true), result_count_(0), message_count_(0), write_time_(0)
+{
+    if (batched_) {
+        pending_.mutable_results()->Reserve(static_cast<int>(max_count_));
+    }
+}
+
+template <class Writer>
+SearchReplyWriter<Writer>::~SearchReplyWriter()
+{
+    close();
+}
+
+template <class Writer>
+bool SearchReplyWriter<Writer>::ok() const
+{
+    return ok_;
+}
+
+template <class Writer>
+size_t SearchReplyWriter<Writer>::result_count() const
+{
+    return result_count_;
+}
+
+template <class Writer>
+size_t SearchReplyWriter<Writer>::message_count() const
+{
+    return message_count_;
+}
+
+template <class Writer>
+double SearchReplyWriter<Writer>::write_time() const
+{
+    return write_time_;
+}
+
+template <class Writer>
+void SearchReplyWriter<Writer>::write(uint64_t result)
+{
+    result_count_++;
+
+    if (!batched_) {
+        SearchReply reply;
+        reply.set_result(result);
+        write_message(reply);
+        return;
+    }
+
+    SearchReply batch;
+    uint64_t seq;
+    {
+        std::lock_guard<std::mutex> lock(pending_mtx_);
+
+        if (pending_.results_size() == 0 && max_delay_.count() > 0) {
+            pending_since_ = std::chrono::steady_clock::now();
+            // an armed timer is re-armed for this batch when it expires
+            if (!timer_armed_) {
+                arm_timer(pending_since_ + max_delay_);
+            }
+        }
+        pending_.add_results(result);
+
+        // the batch is written when it is full, or when it waited long enough
+        if (static_cast<size_t>(pending_.results_size()) < max_count_ &&
+            (max_delay_.count() == 0 || std::chrono::steady_clock::now() < pending_since_ + max_delay_)) {
+            return;
+        }
+        seq = take_batch(batch);
+    }
+    // encode outside of the lock, so that the producers can go on
+    encode_batch(batch);
+    write_batch(batch, seq);
+}
+
+template <class Writer>
+void SearchReplyWriter<Writer>::flush()
+{
+    if (!batched_) {
+        return;
+    }
+
+    SearchReply batch;
+    uint64_t seq;
+    {
+        std::lock_guard<std::mutex> lock(pending_mtx_);
+        
+        if (pending_.results_size() == 0) {
+            return;
+        }
+        seq = take_batch(batch);
+    }
+    encode_batch(batch);
+    write_batch(batch, seq);
+}
+
+template <class Writer>
+void SearchReplyWriter<Writer>::close()
+{
+    TimerQueue::handle_type handle = TimerQueue::kNoHandle;
+    {
+        std::lock_guard<std::mutex> lock(pending_mtx_);
+        closed_ = true;
+        if (timer_armed_) {
+            handle = timer_handle_;
+            timer_armed_ = false;
+        }
+    }
+    // outside of the lock: the callback might be running, and wait for it
+    if (handle != TimerQueue::kNoHandle) {
+        flush_timer_->cancel(handle);
+    }
+    {
+        std::unique_lock<std::mutex> lock(pending_mtx_);
+        timer_cv_.wait(lock, [this]{ return !timer_writing_; });
+    }
+    flush();
+}
+
+template <class Writer>
+void SearchReplyWriter<Writer>::arm_timer(std::chrono::steady_clock::time_point when)
+{
+    if (!flush_timer_ || closed_) {
+        return;
+    }
+    timer_handle_ = flush_timer_->schedule(when, [this](){ on_timer(); });
+    timer_armed_ = true;
+}
+
+template <class Writer>
+void SearchReplyWriter<Writer>::on_timer()
+{
+    SearchReply batch;
+    uint64_t seq;
+    {
+        std::lock_guard<std::mutex> lock(pending_mtx_);
+        
+        timer_armed_ = false;
+        if (closed_ || pending_.results_size() == 0) {
+            return;
+        }
+        // the batch that armed the timer was written, and a new one started
+        if (std::chrono::steady_clock::now() < pending_since_ + max_delay_) {
+            arm_timer(pending_since_ + max_delay_);
+            return;
+        }
+        seq = take_batch(batch);
+        timer_writing_ = true;
+    }
+    encode_batch(batch);
+    write_batch(batch, seq);
+    
+    // notify under the lock: close() can return as soon as the flag is
+    // cleared
+    std::lock_guard<std::mutex> lock(pending_mtx_);
+    timer_writing_ = false;
+    timer_cv_.notify_all();
+}
+
+template <class Writer>
+uint64_t SearchReplyWriter<Writer>::take_batch(SearchReply& reply)
+{
+    reply.Swap(&pending_);
+    pending_.mutable_results()->Reserve(static_cast<int>(max_count_));
+    
+    return taken_count_++;
+}
+
+template <class Writer>
+void SearchReplyWriter<Writer>::encode_batch(SearchReply& reply) const
+{
+    if (encodings_ == 0) {
+        return;
+    }
+
+    std::vector<uint64_t> values(reply.results().begin(), reply.results().end());
+    std::string encoded;
+
+    ResultEncoding encoding = encode_results(values, encodings_, encoded);
+
+    if (encoding != RAW_RESULTS) {
+        reply.clear_results();
+        reply.set_encoding(encoding);
+        reply.set_encoded_results(std::move(encoded));
+    }
+}
+
+template <class Writer>
+void SearchReplyWriter<Writer>::write_message(const SearchReply& reply)
+{
+    std::lock_guard<std::mutex> lock(write_mtx_);
+    write_locked(reply);
+}
+
+template <class Writer>
+void SearchReplyWriter<Writer>::write_batch(const SearchReply& reply, uint64_t seq)
+{
+    {
+        std::unique_lock<std::mutex> lock(write_mtx_);
+        
+        write_cv_.wait(lock, [this, seq]{ return written_count_ == seq; });
+        write_locked(reply);
+        written_count_++;
+    }
+    write_cv_.notify_all();
+}
+
+template <class Writer>
+void SearchReplyWriter<Writer>::write_locked(const SearchReply& reply)
+{
+    if (!ok_) {
+        return;
+    }
+
+    auto begin = std::chrono::high_resolution_clock::now();
+    if (!writer_->Write(reply)) {
+        ok_ = false;
+    }
+    write_time_ += std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - begin).count();
+    message_count_++;
+}
+
+} // namespace sophos
+} // namespace sse
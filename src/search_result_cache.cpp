@@ -0,0 +1,203 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "search_result_cache.hpp"
+
+#include "logger.hpp"
+
+namespace sse {
+namespace sophos {
+
+constexpr size_t SearchResultCache::kDefaultMemoryBudget;
+
+SearchResultCache::SearchResultCache(size_t memory_budget) :
+memory_budget_(memory_budget), memory_usage_(0), hits_(0), misses_(0)
+{
+}
+
+size_t SearchResultCache::entry_memory_size(const std::string& key, const result_list_type& results)
+{
+    return sizeof(Entry) + 2*key.capacity() + results.capacity()*sizeof(index_type);
+}
+
+uint32_t SearchResultCache::get(const SearchRequest& req, result_list_ptr& cached, search_token_type& token)
+{
+    cached.reset();
+    
+    if (!enabled()) {
+        return req.add_count;
+    }
+    
+    std::lock_guard<std::mutex> lock(mtx_);
+    
+    auto it = entries_.find(req.derivation_key);
+    
+    if (it == entries_.end()) {
+        misses_++;
+        return req.add_count;
+    }
+    
+    const Entry& e = it->second;
+    
+    // the chain can only have grown since the cached search, and if it did
+    // not, the search token must be the cached one
+    if (e.add_count > req.add_count || (e.add_count == req.add_count && e.token != req.token)) {
+        misses_++;
+        return req.add_count;
+    }
+    
+    lru_list_.splice(lru_list_.begin(), lru_list_, e.lru_it);
+    hits_++;
+    
+    cached = e.results;
+    token = e.token;
+    return req.add_count - e.add_count;
+}
+
+uint32_t SearchResultCache::walk_count(const SearchRequest& req) const
+{
+    if (!enabled()) {
+        return req.add_count;
+    }
+    
+    std::lock_guard<std::mutex> lock(mtx_);
+    
+    auto it = entries_.find(req.derivation_key);
+    
+    if (it == entries_.end()) {
+        return req.add_count;
+    }
+    
+    const Entry& e = it->second;
+    
+    if (e.add_count > req.add_count || (e.add_count == req.add_count && e.token != req.token)) {
+        return req.add_count;
+    }
+    return req.add_count - e.add_count;
+}
+
+void SearchResultCache::put(const SearchRequest& req, const result_list_ptr& results)
+{
+    if (!enabled()) {
+        return;
+    }
+    
+    size_t budget = memory_budget_;
+    size_t mem_size = entry_memory_size(req.derivation_key, *results);
+    
+    if (mem_size > budget) {
+        // do not flush the whole cache for a single huge list
+        return;
+    }
+    
+    std::lock_guard<std::mutex> lock(mtx_);
+    
+    auto it = entries_.find(req.derivation_key);
+    
+    if (it != entries_.end()) {
+        if (it->second.add_count > req.add_count) {
+            // a concurrent search already cached a longer chain
+            return;
+        }
+        memory_usage_ -= it->second.memory_size;
+        lru_list_.erase(it->second.lru_it);
+        entries_.erase(it);
+    }
+    
+    evict(budget - mem_size);
+    
+    lru_list_.push_front(req.derivation_key);
+    
+    Entry e;
+    e.token = req.token;
+    e.add_count = req.add_count;
+    e.results = results;
+    e.memory_size = mem_size;
+    e.lru_it = lru_list_.begin();
+    
+    entries_.insert(std::make_pair(req.derivation_key, std::move(e)));
+    memory_usage_ += mem_size;
+}
+
+// must be called with mtx_ locked
+void SearchResultCache::evict(size_t target)
+{
+    while (memory_usage_ > target && !lru_list_.empty()) {
+        auto it = entries_.find(lru_list_.back());
+        
+        memory_usage_ -= it->second.memory_size;
+        entries_.erase(it);
+        lru_list_.pop_back();
+    }
+}
+
+bool SearchResultCache::enabled() const
+{
+    return memory_budget_ > 0;
+}
+
+size_t SearchResultCache::memory_budget() const
+{
+    return memory_budget_;
+}
+
+void SearchResultCache::set_memory_budget(size_t budget)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    
+    memory_budget_ = budget;
+    evict(memory_budget_);
+}
+
+size_t SearchResultCache::memory_usage() const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return memory_usage_;
+}
+
+size_t SearchResultCache::size() const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return entries_.size();
+}
+
+void SearchResultCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    entries_.clear();
+    lru_list_.clear();
+    memory_usage_ = 0;
+}
+
+std::ostream& SearchResultCache::print_stats(std::ostream& out) const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    out << "Search cache: " << std::dec << entries_.size() << " keywords";
+    out << "; Memory: " << memory_usage_ << "/" << memory_budget_ << " bytes";
+    out << "; Hits: " << hits_ << "; Misses: " << misses_ << std::endl;
+    
+    return out;
+}
+
+} // namespace sophos
+} // namespace sse
@@ -0,0 +1,104 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#pragma once
+
+#include "sophos_core.hpp"
+
+#include <string>
+#include <list>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+
+namespace sse {
+namespace sophos {
+
+// Memory-bounded cache of search results, used by SophosServer to avoid
+// re-walking the part of a keyword's chain that was already searched.
+//
+// As the search token of a keyword reveals the whole chain below it, after a
+// search with token ST_n (and n+1 entries), a later search with ST_m (m > n)
+// only has to walk down to ST_n and append the results cached for ST_n.
+// The entries are indexed by the derivation key (which is constant for a
+// keyword), and store the last search token and the number of entries it
+// covers.
+class SearchResultCache {
+public:
+    typedef std::vector<index_type> result_list_type;
+    typedef std::shared_ptr<const result_list_type> result_list_ptr;
+    
+    static constexpr size_t kDefaultMemoryBudget = 64 << 20; // 64 MB
+    
+    explicit SearchResultCache(size_t memory_budget = kDefaultMemoryBudget);
+    
+    // Returns the number of entries of the request's chain that have to be
+    // walked. If the last ones are covered by a previous search, cached is set
+    // to their results, and token to the search token of the newest of them:
+    // as the entry counts are given by the clients, the walk must check that
+    // it reaches this token before using the results.
+    uint32_t get(const SearchRequest& req, result_list_ptr& cached, search_token_type& token);
+    
+    // Same count as get, without counting a hit or a miss, nor refreshing
+    // the entry.
+    uint32_t walk_count(const SearchRequest& req) const;
+    
+    // Stores the (complete) results of a search, evicting the least recently
+    // used entries if needed.
+    void put(const SearchRequest& req, const result_list_ptr& results);
+    
+    bool enabled() const;
+    size_t memory_budget() const;
+    void set_memory_budget(size_t budget);
+    size_t memory_usage() const;
+    size_t size() const;
+    void clear();
+
+    std::ostream& print_stats(std::ostream& out) const;
+
+private:
+    struct Entry
+    {
+        search_token_type   token;
+        uint32_t            add_count;
+        result_list_ptr     results;
+        size_t              memory_size;
+        std::list<std::string>::iterator lru_it;
+    };
+    
+    static size_t entry_memory_size(const std::string& key, const result_list_type& results);
+    void evict(size_t target);
+    
+    std::unordered_map<std::string, Entry> entries_;
+    std::list<std::string> lru_list_; // most recently used first
+    
+    std::atomic_size_t memory_budget_;
+    size_t memory_usage_;
+    
+    size_t hits_;
+    size_t misses_;
+    
+    mutable std::mutex mtx_;
+};
+
+} // namespace sophos
+} // namespace sse
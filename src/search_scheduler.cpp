@@ -0,0 +1,338 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "search_scheduler.hpp"
+
+#include "logger.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <utility>
+#include <vector>
+
+namespace sse {
+namespace sophos {
+
+constexpr uint32_t SearchScheduler::kDefaultInteractiveMaxCount;
+constexpr size_t SearchScheduler::kDefaultMaxQueued;
+
+// the searches waiting in admit(req, walk_count) check whether they were
+// cancelled at this interval
+constexpr std::chrono::milliseconds kCancellationPollInterval(10);
+
+SearchScheduler::SearchScheduler(unsigned worker_budget) :
+worker_budget_(std::max(worker_budget, 1U)),
+reserved_(worker_budget_ > 1 ? std::max(worker_budget_/4, 1U) : 0),
+interactive_max_count_(kDefaultInteractiveMaxCount), max_queued_(kDefaultMaxQueued),
+rejected_count_(0)
+{
+    for (size_t l = 0; l < kLaneCount; l++) {
+        used_[l] = 0;
+        running_[l] = 0;
+        admitted_count_[l] = 0;
+        wait_time_[l] = 0.;
+    }
+}
+
+SearchScheduler::Lane SearchScheduler::lane(uint32_t walk_count) const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return (walk_count <= interactive_max_count_) ? INTERACTIVE : BULK;
+}
+
+unsigned SearchScheduler::available(Lane lane) const
+{
+    const unsigned free = worker_budget_ - used_[INTERACTIVE] - used_[BULK];
+    
+    if (lane == INTERACTIVE) {
+        return free;
+    }
+    
+    // the interactive searches go first, and the reserved workers are theirs
+    if (!queues_[INTERACTIVE].empty() || used_[BULK] + reserved_ >= worker_budget_) {
+        return 0;
+    }
+    return std::min(free, worker_budget_ - reserved_ - used_[BULK]);
+}
+
+unsigned SearchScheduler::fair_share(Lane lane) const
+{
+    const unsigned capacity = (lane == INTERACTIVE) ? worker_budget_ : worker_budget_ - reserved_;
+    // share with the running searches, the one being admitted and the ones
+    // waiting after it
+    const size_t searches = running_[lane] + 1 + queues_[lane].size();
+    
+    return std::max<unsigned>(capacity/searches, 1);
+}
+
+void SearchScheduler::admit(uint32_t walk_count, std::shared_ptr<SearchCancellation> cancellation, Admission admitted)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    
+    const Lane lane = (walk_count <= interactive_max_count_) ? INTERACTIVE : BULK;
+    std::deque<Waiter>& queue = queues_[lane];
+    
+    if (queue.size() >= max_queued_) {
+        rejected_count_++;
+        logger::log(logger::DBG) << "Search rejected: " << queue.size() << " searches already waiting" << std::endl;
+        lock.unlock();
+        admitted(Ticket());
+        return;
+    }
+    
+    queue.push_back(Waiter{std::move(cancellation), std::move(admitted), std::chrono::steady_clock::now()});
+    dispatch(lock);
+}
+
+SearchScheduler::Ticket SearchScheduler::admit(const SearchRequest& req, uint32_t walk_count)
+{
+    // the ticket can be handed over by another thread once this one stopped
+    // waiting: the state is shared with the callback
+    struct Admitted
+    {
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool done = false;
+        Ticket ticket;
+    };
+    auto state = std::make_shared<Admitted>();
+    
+    admit(walk_count, req.cancellation, [state](Ticket&& ticket)
+          {
+              std::lock_guard<std::mutex> lock(state->mtx);
+              state->ticket = std::move(ticket);
+              state->done = true;
+              state->cv.notify_all();
+          });
+    
+    std::unique_lock<std::mutex> lock(state->mtx);
+    while (!state->cv.wait_for(lock, kCancellationPollInterval, [&state]{ return state->done; })) {
+        if (req.cancelled()) {
+            lock.unlock();
+            drop_cancelled();
+            lock.lock();
+        }
+    }
+    return std::move(state->ticket);
+}
+
+void SearchScheduler::drop_cancelled()
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    
+    std::vector<Admission> dropped;
+    for (size_t l = 0; l < kLaneCount; l++) {
+        std::deque<Waiter>& queue = queues_[l];
+        
+        for (auto it = queue.begin(); it != queue.end(); ) {
+            if (it->cancellation && it->cancellation->cancelled()) {
+                dropped.push_back(std::move(it->admitted));
+                it = queue.erase(it);
+            }else{
+                ++it;
+            }
+        }
+    }
+    
+    // the next searches might be first now
+    dispatch(lock);
+    
+    for (Admission& admitted : dropped) {
+        admitted(Ticket());
+    }
+}
+
+void SearchScheduler::dispatch(std::unique_lock<std::mutex>& lock)
+{
+    std::vector<std::pair<Admission, Ticket>> ready;
+    const auto now = std::chrono::steady_clock::now();
+    
+    // the bulk searches are not admitted while interactive ones wait (see
+    // available())
+    for (size_t l = 0; l < kLaneCount; l++) {
+        const Lane lane = static_cast<Lane>(l);
+        std::deque<Waiter>& queue = queues_[lane];
+        
+        while (!queue.empty()) {
+            if (queue.front().cancellation && queue.front().cancellation->cancelled()) {
+                ready.emplace_back(std::move(queue.front().admitted), Ticket());
+                queue.pop_front();
+                continue;
+            }
+            if (available(lane) == 0) {
+                break;
+            }
+            
+            Waiter waiter = std::move(queue.front());
+            queue.pop_front();
+            
+            unsigned workers = std::min(available(lane), fair_share(lane));
+            used_[lane] += workers;
+            running_[lane]++;
+            
+            admitted_count_[lane]++;
+            wait_time_[lane] += std::chrono::duration<double, std::micro>(now - waiter.since).count();
+            
+            ready.emplace_back(std::move(waiter.admitted), Ticket(this, lane, workers));
+        }
+    }
+    
+    lock.unlock();
+    
+    for (auto& r : ready) {
+        r.first(std::move(r.second));
+    }
+}
+
+void SearchScheduler::give_back(Lane lane, unsigned workers, bool done)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    used_[lane] -= workers;
+    if (done) {
+        running_[lane]--;
+    }
+    dispatch(lock);
+}
+
+unsigned SearchScheduler::worker_budget() const
+{
+    return worker_budget_;
+}
+
+void SearchScheduler::set_interactive_max_count(uint32_t count)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    interactive_max_count_ = count;
+}
+
+void SearchScheduler::set_max_queued(size_t max_queued)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    max_queued_ = max_queued;
+}
+
+size_t SearchScheduler::max_queued() const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return max_queued_;
+}
+
+size_t SearchScheduler::queued_count(Lane lane) const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return queues_[lane].size();
+}
+
+size_t SearchScheduler::rejected_count() const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return rejected_count_;
+}
+
+std::ostream& SearchScheduler::print_stats(std::ostream& out) const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    
+    static const char* lane_names[kLaneCount] = {"interactive", "bulk"};
+    
+    out << "Search scheduler: " << worker_budget_ << " workers (" << reserved_ << " reserved for interactive searches)";
+    for (size_t l = 0; l < kLaneCount; l++) {
+        out << "; " << lane_names[l] << ": " << admitted_count_[l] << " admitted";
+        if (admitted_count_[l] > 0) {
+            out << ", " << wait_time_[l]/admitted_count_[l] << " us average wait";
+        }
+    }
+    out << "; Rejected: " << rejected_count_ << std::endl;
+    
+    return out;
+}
+
+SearchScheduler::Ticket::Ticket() :
+scheduler_(nullptr), lane_(INTERACTIVE), workers_(0)
+{
+}
+
+SearchScheduler::Ticket::Ticket(SearchScheduler* scheduler, Lane lane, unsigned workers) :
+scheduler_(scheduler), lane_(lane), workers_(workers)
+{
+}
+
+SearchScheduler::Ticket::Ticket(Ticket&& t) :
+scheduler_(t.scheduler_), lane_(t.lane_), workers_(t.workers_)
+{
+    t.scheduler_ = nullptr;
+    t.workers_ = 0;
+}
+
+SearchScheduler::Ticket& SearchScheduler::Ticket::operator=(Ticket&& t)
+{
+    if (this != &t) {
+        release();
+        scheduler_ = t.scheduler_;
+        lane_ = t.lane_;
+        workers_ = t.workers_;
+        t.scheduler_ = nullptr;
+        t.workers_ = 0;
+    }
+    return *this;
+}
+
+SearchScheduler::Ticket::~Ticket()
+{
+    release();
+}
+
+bool SearchScheduler::Ticket::admitted() const
+{
+    return scheduler_ != nullptr;
+}
+
+SearchScheduler::Lane SearchScheduler::Ticket::lane() const
+{
+    return lane_;
+}
+
+unsigned SearchScheduler::Ticket::workers() const
+{
+    return workers_;
+}
+
+void SearchScheduler::Ticket::shrink(unsigned count)
+{
+    count = std::max(count, 1U);
+    
+    if (scheduler_ && count < workers_) {
+        scheduler_->give_back(lane_, workers_ - count, false);
+        workers_ = count;
+    }
+}
+
+void SearchScheduler::Ticket::release()
+{
+    if (scheduler_) {
+        scheduler_->give_back(lane_, workers_, true);
+        scheduler_ = nullptr;
+        workers_ = 0;
+    }
+}
+
+} // namespace sophos
+} // namespace sse
@@ -0,0 +1,173 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include "sophos_core.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <ostream>
+
+namespace sse {
+namespace sophos {
+
+// Admission control of the searches of a server.
+//
+// The searches share a global budget of workers (one per core by default):
+// a search is admitted once at least one worker is free, and is granted a
+// fair share of the lane's workers, to be used by its engine (see
+// SearchPlanner::plan). The shares are computed at admission: a running
+// search keeps its workers until it is done.
+//
+// The searches are sorted in two lanes by the number of entries they walk
+// (the ones covered by cached results or consolidated records are not). Small,
+// interactive searches have a quarter of the budget reserved for them, and
+// are admitted before the large ones that are waiting, so that they are not
+// delayed by large scans. In each lane, the searches are admitted in order.
+// When max_queued searches are already waiting in a lane, the new ones are
+// rejected: the server is overloaded.
+class SearchScheduler {
+public:
+    typedef enum{
+        INTERACTIVE = 0,
+        BULK,
+        kLaneCount
+    } Lane;
+
+    static constexpr uint32_t kDefaultInteractiveMaxCount = 4096;
+    static constexpr size_t kDefaultMaxQueued = 64;
+
+    explicit SearchScheduler(unsigned worker_budget = std::thread::hardware_concurrency());
+
+    // Workers granted to an admitted search, given back when it is destroyed.
+    class Ticket {
+    public:
+        // not admitted
+        Ticket();
+        Ticket(Ticket&& t);
+        // releases the ticket's workers first
+        Ticket& operator=(Ticket&& t);
+        ~Ticket();
+
+        Ticket(const Ticket&) = delete;
+        Ticket& operator=(const Ticket&) = delete;
+
+        bool admitted() const;
+        Lane lane() const;
+        unsigned workers() const;
+
+        // gives the workers above count back (e.g. the ones the plan of the
+        // search does not use)
+        void shrink(unsigned count);
+        void release();
+
+    private:
+        friend class SearchScheduler;
+
+        Ticket(SearchScheduler* scheduler, Lane lane, unsigned workers);
+
+        SearchScheduler* scheduler_;
+        Lane lane_;
+        unsigned workers_;
+    };
+
+    // called with the ticket of a search once it is admitted
+    typedef std::function<void(Ticket&&)> Admission;
+
+    // Queues a search walking walk_count entries (see
+    // SophosServer::search_walk_count), and returns without waiting.
+    // admitted is called with the search's ticket once it is admitted, by the
+    // calling thread if workers are free, or by the thread that frees them
+    // later: it should only hand the ticket over (e.g. post the search to a
+    // pool). The ticket is not admitted if the lane's queue is full, or if
+    // cancellation (which can be null) is cancelled before the search is
+    // admitted (see drop_cancelled).
+    void admit(uint32_t walk_count, std::shared_ptr<SearchCancellation> cancellation, Admission admitted);
+
+    // Waits until the search can be admitted (see above). The returned ticket
+    // is not admitted if the lane's queue is full, or if the request was
+    // cancelled while waiting.
+    Ticket admit(const SearchRequest& req, uint32_t walk_count);
+
+    // Gives the waiting searches that were cancelled tickets that are not
+    // admitted. The waiting searches are not polled: this is to be called
+    // when one of them might have been cancelled.
+    void drop_cancelled();
+
+    // lane of the searches walking walk_count entries
+    Lane lane(uint32_t walk_count) const;
+
+    unsigned worker_budget() const;
+    // searches walking at most count entries are interactive
+    void set_interactive_max_count(uint32_t count);
+    void set_max_queued(size_t max_queued);
+    size_t max_queued() const;
+
+    size_t queued_count(Lane lane) const;
+    size_t rejected_count() const;
+
+    std::ostream& print_stats(std::ostream& out) const;
+
+private:
+    // workers that a search of the lane can get. Must be called with the
+    // lock held.
+    unsigned available(Lane lane) const;
+    unsigned fair_share(Lane lane) const;
+
+    void give_back(Lane lane, unsigned workers, bool done);
+
+    // Admits the searches at the front of the queues while workers are
+    // free (and drops the cancelled ones), then calls their callbacks once
+    // the lock is released. lock holds mtx_.
+    void dispatch(std::unique_lock<std::mutex>& lock);
+
+    struct Waiter
+    {
+        std::shared_ptr<SearchCancellation> cancellation;
+        Admission admitted;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    const unsigned worker_budget_;
+    const unsigned reserved_;   // for the interactive lane
+
+    uint32_t interactive_max_count_;
+    size_t max_queued_;
+
+    unsigned used_[kLaneCount];
+    unsigned running_[kLaneCount];
+    std::deque<Waiter> queues_[kLaneCount];
+
+    size_t admitted_count_[kLaneCount];
+    size_t rejected_count_;
+    double wait_time_[kLaneCount]; // in microseconds
+
+    mutable std::mutex mtx_;
+};
+
+} // namespace sophos
+} // namespace sse
@@ -23,16 +23,18 @@
 #include "sophos_client_runner.hpp"
 
 #include "sophos_net_types.hpp"
+#include "result_encoding.hpp"
 #include "large_storage_sophos_client.hpp"
 #include "medium_storage_sophos_client.hpp"
 
-#include "thread_pool.hpp"
+#include "work_stealing_thread_pool.hpp"
 #include "utils.hpp"
 #include "logger.hpp"
 
 #include <sse/dbparser/DBParserJSON.h>
 
 #include <chrono>
+#include <deque>
 #include <iostream>
 #include <memory>
 #include <random>
@@ -48,6 +50,11 @@
 namespace sse {
 namespace sophos {
 
+// number of keyword lists processed by a task when loading an inverted index
+static const size_t kLoadChunkSize = 16;
+
+// number of update tokens per message of a token search
+static const size_t kTokenBatchSize = 1024;
 
 SophosClientRunner::SophosClientRunner(const std::string& address, const std::string& path, size_t setup_size, uint32_t n_keywords)
     : bulk_update_state_{0}, update_launched_count_(0), update_completed_count_(0)
@@ -151,27 +158,144 @@ const SophosClient& SophosClientRunner::client() const
     return *client_;
 }
     
-std::list<uint64_t> SophosClientRunner::search(const std::string& keyword, std::function<void(uint64_t)> receive_callback) const
+void SophosClientRunner::set_search_checkpoint_count(uint32_t count)
+{
+    MediumStorageSophosClient* client = dynamic_cast<MediumStorageSophosClient*>(client_.get());
+    
+    if (!client) {
+        throw std::logic_error("Invalid state");
+    }
+    client->set_search_checkpoint_count(count);
+}
+    
+ResultBuffer<uint64_t> SophosClientRunner::search(const std::string& keyword, std::function<void(uint64_t)> receive_callback) const
 {
     logger::log(logger::TRACE) << "Search " << keyword << std::endl;
     
+    return send_search(client_->search_request(keyword), receive_callback);
+}
+
+ResultBuffer<uint64_t> SophosClientRunner::search_newest(const std::string& keyword, uint32_t count, std::function<void(uint64_t)> receive_callback) const
+{
+    logger::log(logger::TRACE) << "Search the " << count << " newest entries of " << keyword << std::endl;
+    
+    return send_search(medium_storage_client().newest_search_request(keyword, count), receive_callback);
+}
+
+ResultBuffer<uint64_t> SophosClientRunner::search_window(const std::string& keyword, uint32_t first, uint32_t last, std::function<void(uint64_t)> receive_callback) const
+{
+    logger::log(logger::TRACE) << "Search the entries " << first << " to " << last << " of " << keyword << std::endl;
+    
+    return send_search(medium_storage_client().window_search_request(keyword, first, last), receive_callback);
+}
+
+ResultBuffer<uint64_t> SophosClientRunner::delta_search(const std::string& keyword, std::function<void(uint64_t)> receive_callback)
+{
+    logger::log(logger::TRACE) << "Delta search " << keyword << std::endl;
+    
+    MediumStorageSophosClient& client = medium_storage_client();
+    std::vector<index_type> cached;
+    
+    SearchRequest req = client.delta_search_request(keyword, cached);
+    ResultBuffer<uint64_t> results;
+    
+    results.append(cached.begin(), cached.end());
+    if (receive_callback != NULL) {
+        for (uint64_t r : cached) {
+            receive_callback(r);
+        }
+    }
+    
+    if (req.add_count == 0) {
+        // the cached results are up to date (or the keyword is unknown)
+        return results;
+    }
+    
+    ResultBuffer<uint64_t> new_results = send_search(req, receive_callback);
+    
+    // every entry of the chain holds one result: a missing one (an update
+    // not received by the server yet, a failed search, ...) would be missing
+    // from all the following delta searches
+    if (new_results.size() == req.walk_count()) {
+        cached.insert(cached.end(), new_results.begin(), new_results.end());
+        client.cache_search_results(keyword, req.add_count, cached);
+    }else{
+        logger::log(logger::WARNING) << "Incomplete search of " << keyword << " (" << new_results.size() << " results for " << req.walk_count() << " entries): the results are not cached" << std::endl;
+    }
+    
+    results.append(std::move(new_results));
+    
+    return results;
+}
+
+MediumStorageSophosClient& SophosClientRunner::medium_storage_client()
+{
+    MediumStorageSophosClient* client = dynamic_cast<MediumStorageSophosClient*>(client_.get());
+    
+    if (!client) {
+        throw std::logic_error("Invalid state");
+    }
+    return *client;
+}
+
+const MediumStorageSophosClient& SophosClientRunner::medium_storage_client() const
+{
+    const MediumStorageSophosClient* client = dynamic_cast<const MediumStorageSophosClient*>(client_.get());
+    
+    if (!client) {
+        throw std::logic_error("Invalid state");
+    }
+    return *client;
+}
+
+ResultBuffer<uint64_t> SophosClientRunner::send_search(const SearchRequest& req, std::function<void(uint64_t)> receive_callback) const
+{
     grpc::ClientContext context;
     sophos::SearchRequestMessage message;
     sophos::SearchReply reply;
     
-    message = request_to_message(client_->search_request(keyword));
+    message = request_to_message(req);
     
     std::unique_ptr<grpc::ClientReader<sophos::SearchReply> > reader( stub_->search(&context, message) );
-    std::list<uint64_t> results;
+    ResultBuffer<uint64_t> results;
     
     
     while (reader->Read(&reply)) {
 //        logger::log(logger::TRACE) << "New result received: "
 //        << std::dec << reply.result() << std::endl;
-        results.push_back(reply.result());
+        
+        if (reply.encoding() != RAW_RESULTS) {
+            // compressed batch: decode it directly in the results
+            auto sink = [&results, &receive_callback](uint64_t r)
+            {
+                results.push_back(r);
+                if (receive_callback != NULL) {
+                    receive_callback(r);
+                }
+            };
+            if (!decode_results(reply.encoding(), reply.encoded_results(), sink)) {
+                logger::log(logger::ERROR) << "Invalid encoded search results" << std::endl;
+            }
+            continue;
+        }
+        
+        // servers which do not batch the results send them one by one
+        if (reply.results_size() == 0) {
+            results.push_back(reply.result());
+            
+            if (receive_callback != NULL) {
+                receive_callback(reply.result());
+            }
+            continue;
+        }
+        
+        results.reserve(reply.results_size());
+        results.append(reply.results().begin(), reply.results().end());
         
         if (receive_callback != NULL) {
-            receive_callback(reply.result());
+            for (uint64_t r : reply.results()) {
+                receive_callback(r);
+            }
         }
     }
     grpc::Status status = reader->Finish();
@@ -185,6 +309,129 @@ std::list<uint64_t> SophosClientRunner::search(const std::string& keyword, std::
     return results;
 }
 
+ResultBuffer<uint64_t> SophosClientRunner::token_search(const std::string& keyword, bool send_masks, unsigned walker_threads, std::function<void(uint64_t)> receive_callback) const
+{
+    logger::log(logger::TRACE) << "Token search " << keyword << std::endl;
+    
+    const MediumStorageSophosClient* client = dynamic_cast<const MediumStorageSophosClient*>(client_.get());
+    
+    if (!client) {
+        throw std::logic_error("Invalid state");
+    }
+    
+    grpc::ClientContext context;
+    std::unique_ptr<grpc::ClientReaderWriter<sophos::TokenSearchMessage, sophos::SearchReply>> stream(stub_->token_search(&context));
+    ResultBuffer<uint64_t> results;
+    
+    // without send_masks, the masks of the messages whose reply was not
+    // received yet
+    std::deque<std::vector<index_type>> pending_masks;
+    std::mutex pending_mtx;
+    
+    auto sink = [&results, &receive_callback](uint64_t r)
+    {
+        results.push_back(r);
+        if (receive_callback != NULL) {
+            receive_callback(r);
+        }
+    };
+    
+    // the server replies once per message, in order
+    std::thread reader([&]()
+    {
+        sophos::SearchReply reply;
+        
+        while (stream->Read(&reply)) {
+            // the masked results (the entries found in the EDB) are newer
+            // than the consolidated ones, in results
+            if (!send_masks) {
+                std::vector<index_type> masks;
+                {
+                    std::lock_guard<std::mutex> lock(pending_mtx);
+                    if (pending_masks.empty()) {
+                        logger::log(logger::ERROR) << "Unexpected token search reply" << std::endl;
+                    }else{
+                        masks.swap(pending_masks.front());
+                        pending_masks.pop_front();
+                    }
+                }
+                
+                // the missing positions are sorted
+                auto missing = reply.missing().begin();
+                for (int i = 0; i < reply.masked_results_size() && static_cast<size_t>(i) < masks.size(); i++) {
+                    if (missing != reply.missing().end() && *missing == static_cast<uint32_t>(i)) {
+                        ++missing;
+                        continue;
+                    }
+                    sink(reply.masked_results(i) ^ masks[i]);
+                }
+            }
+            
+            if (reply.encoding() != RAW_RESULTS) {
+                if (!decode_results(reply.encoding(), reply.encoded_results(), sink)) {
+                    logger::log(logger::ERROR) << "Invalid encoded search results" << std::endl;
+                }
+            }else{
+                for (uint64_t r : reply.results()) {
+                    sink(r);
+                }
+            }
+        }
+    });
+    
+    bool first = true;
+    auto post_segment = [&](const update_token_type* tokens, const index_type* masks, size_t count)
+    {
+        for (size_t b = 0; b < count; b += kTokenBatchSize) {
+            size_t n = std::min(kTokenBatchSize, count - b);
+            sophos::TokenSearchMessage mes;
+            
+            if (first) {
+                mes.add_result_encodings(DELTA_VARINT);
+                mes.add_result_encodings(BITMAP);
+                mes.set_keyword_handle(client->search_handle(keyword));
+                first = false;
+            }
+            for (size_t i = b; i < b + n; i++) {
+                mes.add_update_tokens(tokens[i].data(), tokens[i].size());
+                if (send_masks) {
+                    mes.add_masks(masks[i]);
+                }
+            }
+            if (!send_masks) {
+                std::lock_guard<std::mutex> lock(pending_mtx);
+                pending_masks.emplace_back(masks + b, masks + b + n);
+            }
+            
+            if (!stream->Write(mes)) {
+                // the server does not need the rest of the chain (or is gone)
+                return false;
+            }
+        }
+        return true;
+    };
+    
+    uint32_t entry_count = client->search_tokens(keyword, post_segment, walker_threads);
+    
+    stream->WritesDone();
+    reader.join();
+    
+    grpc::Status status = stream->Finish();
+    if (status.ok()) {
+        logger::log(logger::TRACE) << "Token search succeeded." << std::endl;
+        
+        // every entry has exactly one result, consolidated or not
+        if (results.size() != entry_count) {
+            logger::log(logger::ERROR) << "Token search returned " << results.size() << " results for " << entry_count << " entries" << std::endl;
+        }
+    } else {
+        logger::log(logger::ERROR) << "Token search failed:" << std::endl;
+        logger::log(logger::ERROR) << status.error_message() << std::endl;
+    }
+    
+    return results;
+}
+
 void SophosClientRunner::update(const std::string& keyword, uint64_t index)
 {
     grpc::ClientContext context;
@@ -334,25 +581,36 @@ bool SophosClientRunner::load_inverted_index(const std::string& path)
     try {
         
         dbparser::DBParserJSON parser(path.c_str());
-        ThreadPool pool(std::thread::hardware_concurrency());
+        WorkStealingThreadPool pool(std::thread::hardware_concurrency());
         
         std::atomic_size_t counter(0);
         
-        auto add_list_callback = [this,&pool,&counter](const string kw, const list<unsigned> docs)
+        typedef std::pair<string, list<unsigned>> keyword_list_type;
+        
+        auto work = [this,&counter](const std::vector<keyword_list_type>& lists)
         {
-            auto work = [this,&counter](const string& keyword, const list<unsigned> &documents)
-            {
-                for (unsigned doc : documents) {
-                    this->async_update(keyword, doc);
+            for (const keyword_list_type& l : lists) {
+                for (unsigned doc : l.second) {
+                    this->async_update(l.first, doc);
                 }
                 counter++;
                 
                 if ((counter % 100) == 0) {
                     logger::log(sse::logger::INFO) << "\rLoading: " << counter << " keywords processed" << std::flush;
                 }
-            };
-            pool.enqueue(work,kw,docs);
-            
+            }
+        };
+        
+        // most lists are short: give them to the pool in chunks, to amortize
+        // the cost of a task over several keywords
+        ChunkedDispatcher<keyword_list_type> dispatcher(kLoadChunkSize, [&pool,&work](std::vector<keyword_list_type>&& lists)
+                                                        {
+                                                            pool.post(std::bind(work, std::move(lists)));
+                                                        });
+        
+        auto add_list_callback = [&dispatcher](const string kw, const list<unsigned> docs)
+        {
+            dispatcher.push(keyword_list_type(kw, docs));
         };
         
         parser.addCallbackList(add_list_callback);
@@ -360,6 +618,7 @@ bool SophosClientRunner::load_inverted_index(const std::string& path)
         start_update_session();
 
         parser.parse();
+        dispatcher.flush();
         
         pool.join();
         logger::log(sse::logger::INFO) << "\rLoading: " << counter << " keywords processed" << std::endl;
@@ -411,13 +670,23 @@ void SophosClientRunner::random_search() const
     message = request_to_message(dynamic_cast<MediumStorageSophosClient*>(client_.get())->random_search_request());
     
     std::unique_ptr<grpc::ClientReader<sophos::SearchReply> > reader( stub_->search(&context, message) );
-    std::list<uint64_t> results;
+    ResultBuffer<uint64_t> results;
     
     
     while (reader->Read(&reply)) {
-        logger::log(logger::TRACE) << "New result: "
-        << std::dec << reply.result() << std::endl;
-        results.push_back(reply.result());
+        if (reply.encoding() != RAW_RESULTS) {
+            if (!decode_results(reply.encoding(), reply.encoded_results(), [&results](uint64_t r){ results.push_back(r); })) {
+                logger::log(logger::ERROR) << "Invalid encoded search results" << std::endl;
+            }
+        }else if (reply.results_size() == 0) {
+            logger::log(logger::TRACE) << "New result: "
+            << std::dec << reply.result() << std::endl;
+            results.push_back(reply.result());
+        }else{
+            logger::log(logger::TRACE) << "New results: "
+            << std::dec << reply.results_size() << std::endl;
+            results.append(reply.results().begin(), reply.results().end());
+        }
     }
     grpc::Status status = reader->Finish();
     if (status.ok()) {
@@ -445,6 +714,15 @@ SearchRequestMessage request_to_message(const SearchRequest& req)
     mes.set_add_count(req.add_count);
     mes.set_derivation_key(req.derivation_key);
     mes.set_search_token(req.token.data(), req.token.size());
+    mes.set_batched_results(true);
+    mes.add_result_encodings(DELTA_VARINT);
+    mes.add_result_encodings(BITMAP);
+    
+    for (const search_token_type& cp : req.checkpoints) {
+        mes.add_checkpoints(cp.data(), cp.size());
+    }
+    mes.set_checkpoint_stride(req.checkpoint_stride);
+    mes.set_limit(req.limit);
     
     return mes;
 }
@@ -36,6 +36,8 @@
 namespace sse {
 namespace sophos {
 
+class MediumStorageSophosClient;
+
 class SophosClientRunner {
 public:
     SophosClientRunner(const std::string& address, const std::string& path, size_t setup_size = 1e5, uint32_t n_keywords = 1e4);
@@ -44,7 +46,32 @@ public:
     
     const SophosClient& client() const;
     
-    std::list<uint64_t> search(const std::string& keyword, std::function<void(uint64_t)> receive_callback = NULL) const;
+    // see MediumStorageSophosClient::set_search_checkpoint_count
+    void set_search_checkpoint_count(uint32_t count);
+    
+    ResultBuffer<uint64_t> search(const std::string& keyword, std::function<void(uint64_t)> receive_callback = NULL) const;
+    
+    // Bounded searches: only the count newest entries of the keyword, or the
+    // ones of counters first to last (see
+    // MediumStorageSophosClient::window_search_request). The results are
+    // received newest first.
+    ResultBuffer<uint64_t> search_newest(const std::string& keyword, uint32_t count, std::function<void(uint64_t)> receive_callback = NULL) const;
+    ResultBuffer<uint64_t> search_window(const std::string& keyword, uint32_t first, uint32_t last, std::function<void(uint64_t)> receive_callback = NULL) const;
+    
+    // Search through the client's result cache: only the entries added since
+    // the last delta search of the keyword are asked to the server (see
+    // MediumStorageSophosClient::delta_search_request). The cached results
+    // are passed to receive_callback first. The merged results are only
+    // cached if the server found all the new entries.
+    ResultBuffer<uint64_t> delta_search(const std::string& keyword, std::function<void(uint64_t)> receive_callback = NULL);
+    
+    // Client-assisted search: the chain is walked here by walker_threads
+    // threads (see MediumStorageSophosClient::search_tokens), and the update
+    // tokens are streamed to the server, which only looks them up. If
+    // send_masks is false, the server returns the masked indices, and they
+    // are unmasked here.
+    ResultBuffer<uint64_t> token_search(const std::string& keyword, bool send_masks = true, unsigned walker_threads = std::thread::hardware_concurrency(), std::function<void(uint64_t)> receive_callback = NULL) const;
+    
     void update(const std::string& keyword, uint64_t index);
     void async_update(const std::string& keyword, uint64_t index);
 
@@ -66,6 +93,10 @@ private:
     
     bool send_setup(const size_t setup_size) const;
     
+    ResultBuffer<uint64_t> send_search(const SearchRequest& req, std::function<void(uint64_t)> receive_callback) const;
+    const MediumStorageSophosClient& medium_storage_client() const;
+    MediumStorageSophosClient& medium_storage_client();
+    
     std::unique_ptr<sophos::Sophos::Stub> stub_;
     std::unique_ptr<SophosClient> client_;
     
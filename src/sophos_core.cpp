@@ -20,19 +20,95 @@
 
 
 #include "sophos_core.hpp"
+#include "search_result_cache.hpp"
+#include "search_executor.hpp"
+#include "edb_read_pool.hpp"
 
 #include "utils.hpp"
 #include "logger.hpp"
-#include "thread_pool.hpp"
 
 #include <iostream>
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iterator>
 
 namespace sse {
 namespace sophos {
     
     const std::string SophosClient::tdp_sk_file__ = "tdp_sk.key";
     const std::string SophosClient::derivation_key_file__ = "derivation_master.key";
+    
+    const std::string SophosServer::kConsolidatedSuffix = ".consolidated";
+
+DerivationKernel::DerivationKernel(const crypto::Prf<kUpdateTokenSize>& derivation_prf) :
+prf_(derivation_prf)
+{
+}
+
+// st || label, on the stack
+typedef std::array<uint8_t, kSearchTokenSize + 1> derivation_input_type;
+
+static inline void set_input_token(derivation_input_type& input, const search_token_type& st)
+{
+    std::copy(st.begin(), st.end(), input.begin());
+}
+
+static inline index_type mask_value(const update_token_type& prf_output)
+{
+    return xor_mask(0, prf_output);
+}
+
+update_token_type DerivationKernel::token(const search_token_type& st) const
+{
+    derivation_input_type input;
+    set_input_token(input, st);
+    input[kSearchTokenSize] = '0';
+    
+    return prf_.prf(input.data(), input.size());
+}
+
+index_type DerivationKernel::mask(const search_token_type& st) const
+{
+    derivation_input_type input;
+    set_input_token(input, st);
+    input[kSearchTokenSize] = '1';
+    
+    return mask_value(prf_.prf(input.data(), input.size()));
+}
+
+void DerivationKernel::derive(const search_token_type& st, update_token_type& token, index_type& mask) const
+{
+    derive(&st, 1, &token, &mask);
+}
+
+void DerivationKernel::derive_tokens(const search_token_type* st, size_t count, update_token_type* tokens) const
+{
+    derivation_input_type input;
+    input[kSearchTokenSize] = '0';
+    
+    for (size_t i = 0; i < count; i++) {
+        set_input_token(input, st[i]);
+        tokens[i] = prf_.prf(input.data(), input.size());
+    }
+}
+
+void DerivationKernel::derive(const search_token_type* st, size_t count, update_token_type* tokens, index_type* masks) const
+{
+    derivation_input_type input;
+    
+    // the token is copied once for both outputs: only the label changes
+    for (size_t i = 0; i < count; i++) {
+        set_input_token(input, st[i]);
+        
+        input[kSearchTokenSize] = '0';
+        tokens[i] = prf_.prf(input.data(), input.size());
+        
+        input[kSearchTokenSize] = '1';
+        masks[i] = mask_value(prf_.prf(input.data(), input.size()));
+    }
+}
 
 size_t TokenHasher::operator()(const update_token_type& ut) const
 {
@@ -112,15 +188,56 @@ void SophosClient::write_keys(const std::string& dir_path) const
 
 }
     
+SearchCancellation::SearchCancellation() :
+cancelled_(false), deadline_(clock_type::time_point::max())
+{
+}
+
+SearchCancellation::SearchCancellation(std::function<bool()> probe, clock_type::time_point deadline) :
+cancelled_(false), probe_(std::move(probe)), deadline_(deadline)
+{
+}
+
+void SearchCancellation::cancel()
+{
+    cancelled_ = true;
+}
+
+bool SearchCancellation::cancelled() const
+{
+    if (cancelled_.load(std::memory_order_relaxed)) {
+        return true;
+    }
+    if (deadline_exceeded() || (probe_ && probe_())) {
+        cancelled_ = true;
+        return true;
+    }
+    return false;
+}
+
+bool SearchCancellation::deadline_exceeded() const
+{
+    return deadline_ != clock_type::time_point::max() && clock_type::now() >= deadline_;
+}
+
 SophosServer::SophosServer(const std::string& db_path, const std::string& tdp_pk) :
-edb_(db_path), public_tdp_(tdp_pk, 2*std::thread::hardware_concurrency())
+edb_(db_path), consolidated_edb_(db_path + kConsolidatedSuffix, false),
+public_tdp_(tdp_pk, 2*std::thread::hardware_concurrency()),
+search_cache_(new SearchResultCache()), executor_(new SearchExecutor()), consolidate_searches_(false)
 {
     
 }
 
 SophosServer::SophosServer(const std::string& db_path, const size_t tm_setup_size, const std::string& tdp_pk) :
     edb_(db_path), /*edb_(db_path, tm_setup_size),*/
-    public_tdp_(tdp_pk, 2*std::thread::hardware_concurrency())
+    consolidated_edb_(db_path + kConsolidatedSuffix, false),
+    public_tdp_(tdp_pk, 2*std::thread::hardware_concurrency()),
+    search_cache_(new SearchResultCache()), executor_(new SearchExecutor()), consolidate_searches_(false)
+{
+    
+}
+
+SophosServer::~SophosServer()
 {
     
 }
@@ -130,9 +247,429 @@ const std::string SophosServer::public_key() const
     return public_tdp_.public_key();
 }
 
-std::list<index_type> SophosServer::search(const SearchRequest& req)
+void SophosServer::derive_block(const crypto::Prf<kUpdateTokenSize>& derivation_prf, const std::vector<search_token_type>& st_block, std::vector<update_token_type>& tokens, std::vector<index_type>& masks) const
+{
+    tokens.resize(st_block.size());
+    masks.resize(st_block.size());
+    
+    DerivationKernel(derivation_prf).derive(st_block.data(), st_block.size(), tokens.data(), masks.data());
+    
+    if (logger::severity() <= logger::DBG) {
+        for (const update_token_type& ut : tokens) {
+            logger::log(logger::DBG) << "Derived token: " << hex_string(ut) << std::endl;
+        }
+    }
+}
+
+void SophosServer::decrypt_block(const std::vector<search_token_type>& st_block, const std::vector<update_token_type>& tokens, const std::vector<index_type>& masks, const std::vector<index_type>& values, const std::vector<bool>& found, std::vector<index_type>& results) const
+{
+    for (size_t i = 0; i < st_block.size(); i++) {
+        if (found[i]) {
+            if (logger::severity() <= logger::DBG) {
+                logger::log(logger::DBG) << "Found: " << std::hex << values[i] << std::endl;
+            }
+            
+            results.push_back(values[i] ^ masks[i]);
+        }else{
+            logger::log(logger::ERROR) << "We were supposed to find a value mapped to key " << hex_string(tokens[i]);
+            logger::log(logger::ERROR) << " (derived from search token " << hex_string(st_block[i]) << ")" << std::endl;
+        }
+    }
+}
+
+void SophosServer::lookup_block(const crypto::Prf<kUpdateTokenSize>& derivation_prf, const std::vector<search_token_type>& st_block, std::vector<index_type>& results, std::vector<update_token_type>& tokens) const
+{
+    std::vector<index_type> masks;
+    std::vector<index_type> values;
+    std::vector<bool> found;
+    
+    derive_block(derivation_prf, st_block, tokens, masks);
+    edb_.multi_get(tokens, values, found);
+    decrypt_block(st_block, tokens, masks, values, found, results);
+}
+
+// Runs walker(t, n) for t in [0, n) on the executor, one walker per thread,
+// where n <= count is the number of threads that are available right away
+// (the calling thread, which would be idle otherwise, is one of them).
+// The strided walkers step with eval(st, n): running them one after the
+// other would cost n times a sequential walk. When the workers are busy,
+// the chain is split among fewer walkers instead.
+static void run_walkers(SearchExecutor& executor, uint8_t count, const std::function<void(uint8_t, uint8_t)>& walker)
+{
+    executor.run_team(count, [&walker](size_t t, size_t n){ walker(static_cast<uint8_t>(t), static_cast<uint8_t>(n)); });
+}
+
+// Consolidated chains are stored in consolidated_edb_ as two records:
+//  - a marker, mapped to a key derived from the derivation key, containing the
+//    number of entries covered by the consolidation and the search token of the
+//    newest one;
+//  - the posting list, in the chain order (newest first), mapped to the update
+//    token derived from this search token. It is split in blocks of
+//    kConsolidatedBlockSize results (the key is followed by the block's
+//    number), so that the result of the entry of counter c is at position
+//    count-1-c, and can be read alone.
+// The per-update entries of the covered part of the chain are removed from edb_.
+
+static const std::string kConsolidationMarkerLabel = "consolidated";
+
+static std::string marker_key(const crypto::Prf<kUpdateTokenSize>& derivation_prf)
+{
+    update_token_type k = derivation_prf.prf(kConsolidationMarkerLabel);
+    return std::string(k.begin(), k.end());
+}
+
+static std::string record_key(const crypto::Prf<kUpdateTokenSize>& derivation_prf, const search_token_type& st)
+{
+    update_token_type k = DerivationKernel(derivation_prf).token(st);
+    return std::string(k.begin(), k.end());
+}
+
+// reads the number of entries of a consolidated chain and the search token of
+// the newest one
+static bool read_marker(const RockDBWrapper& db, const crypto::Prf<kUpdateTokenSize>& derivation_prf, uint32_t& count, search_token_type& token)
+{
+    std::string marker;
+    
+    if (!db.get(marker_key(derivation_prf), marker) || marker.size() != sizeof(uint32_t) + kSearchTokenSize) {
+        return false;
+    }
+    ::memcpy(&count, marker.data(), sizeof(uint32_t));
+    std::copy(marker.begin() + sizeof(uint32_t), marker.end(), token.begin());
+    
+    return true;
+}
+
+static std::string record_block_key(const std::string& record_key, size_t block)
+{
+    uint32_t b = static_cast<uint32_t>(block);
+    return record_key + std::string(reinterpret_cast<const char*>(&b), sizeof(b));
+}
+
+// Appends the results of the blocks [first_block, last_block) of a posting
+// list to list. Returns false if one of them is missing or invalid.
+static bool read_record_blocks(const RockDBWrapper& db, const std::string& record_key, size_t first_block, size_t last_block, std::vector<index_type>& list)
+{
+    std::string block;
+    
+    for (size_t b = first_block; b < last_block; b++) {
+        if (!db.get(record_block_key(record_key, b), block) || block.empty() || block.size() % sizeof(index_type) != 0 || block.size() > kConsolidatedBlockSize*sizeof(index_type)) {
+            return false;
+        }
+        size_t offset = list.size();
+        
+        list.resize(offset + block.size()/sizeof(index_type));
+        ::memcpy(list.data() + offset, block.data(), block.size());
+    }
+    return true;
+}
+
+static bool write_record(RockDBWrapper& db, const std::string& record_key, const std::vector<index_type>& list)
+{
+    for (size_t b = 0; b*kConsolidatedBlockSize < list.size(); b++) {
+        size_t count = std::min(kConsolidatedBlockSize, list.size() - b*kConsolidatedBlockSize);
+        std::string block(reinterpret_cast<const char*>(list.data() + b*kConsolidatedBlockSize), count*sizeof(index_type));
+        
+        if (!db.put(record_block_key(record_key, b), block)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void remove_record(RockDBWrapper& db, const std::string& record_key, size_t count)
+{
+    for (size_t b = 0; b*kConsolidatedBlockSize < count; b++) {
+        db.remove(record_block_key(record_key, b));
+    }
+}
+
+static const std::string kKeywordHandleLabel = "handle";
+
+std::string keyword_handle(const std::string& derivation_key)
+{
+    return crypto::Prf<kUpdateTokenSize>(derivation_key).prf_string(kKeywordHandleLabel);
+}
+
+SophosServer::ActiveSearch::ActiveSearch(SophosServer& server, const std::string& handle) :
+server_(server), handle_(handle)
+{
+    std::lock_guard<std::mutex> lock(server_.active_searches_mtx_);
+    server_.active_searches_[handle_]++;
+}
+
+SophosServer::ActiveSearch::~ActiveSearch()
+{
+    std::lock_guard<std::mutex> lock(server_.active_searches_mtx_);
+    
+    auto it = server_.active_searches_.find(handle_);
+    if (--(it->second) == 0) {
+        server_.active_searches_.erase(it);
+    }
+}
+
+const std::string& SophosServer::ActiveSearch::handle() const
+{
+    return handle_;
+}
+
+// The part of a keyword's chain whose results are already known, either from
+// the search cache or from a consolidated record.
+// It also gathers the results (and the tokens) of the rest of the walk, so
+// they can be cached and consolidated once the search is complete.
+class SophosServer::SearchPrefix {
+public:
+    SearchPrefix(SophosServer& server, const SearchRequest& req);
+    
+    // number of entries of the chain that still have to be walked
+    uint32_t walk_count() const;
+    
+    // the results of the rest of the chain (can be null), once the walk is
+    // over. If the walk did not reach the newest entry of the known part, it
+    // is walked too.
+    const SearchResultCache::result_list_ptr& results();
+    
+    // the i-th token of the block is the entry at offset first + i*step of
+    // the walk
+    void add_block(size_t first, size_t step, const std::vector<search_token_type>& st_block, const std::vector<index_type>& res_block, const std::vector<update_token_type>& ut_block);
+    void complete();
+    
+private:
+    void check_end();
+    
+    SophosServer& server_;
+    const SearchRequest& req_;
+    ActiveSearch active_;
+    crypto::Prf<kUpdateTokenSize> derivation_prf_;
+    
+    uint32_t walk_count_;
+    SearchResultCache::result_list_ptr results_;
+    
+    bool has_record_;
+    uint32_t record_count_;
+    search_token_type record_token_;
+    
+    // the search token the walk must lead to, and the last walked one
+    bool check_end_;
+    bool end_reached_;
+    search_token_type end_token_;
+    search_token_type last_token_;
+    
+    bool keep_results_;
+    bool keep_tokens_;
+    
+    size_t found_count_;
+    std::vector<index_type> new_results_;
+    std::vector<update_token_type> walked_tokens_;
+    std::mutex mtx_;
+};
+
+SophosServer::SearchPrefix::SearchPrefix(SophosServer& server, const SearchRequest& req) :
+server_(server), req_(req), active_(server, keyword_handle(req.derivation_key)), derivation_prf_(req.derivation_key), walk_count_(req.add_count),
+has_record_(false), record_count_(0), check_end_(false), end_reached_(false), keep_results_(false), keep_tokens_(false), found_count_(0)
+{
+    SearchResultCache::result_list_ptr cached;
+    search_token_type cached_token;
+    uint32_t cache_walk_count = server_.search_cache_->get(req_, cached, cached_token);
+
+    // look for a consolidated record
+    if (read_marker(server_.consolidated_edb_, derivation_prf_, record_count_, record_token_)) {
+        has_record_ = (record_count_ < req_.add_count || (record_count_ == req_.add_count && record_token_ == req_.token));
+    }
+    
+    uint32_t record_walk_count = has_record_ ? req_.add_count - record_count_ : req_.add_count;
+    
+    keep_tokens_ = server_.reconsolidates(record_walk_count, record_count_);
+    
+    if (cached && !keep_tokens_ && cache_walk_count <= record_walk_count) {
+        walk_count_ = cache_walk_count;
+        results_ = cached;
+        end_token_ = cached_token;
+    }else if (has_record_) {
+        auto list = std::make_shared<SearchResultCache::result_list_type>();
+        list->reserve(record_count_);
+        
+        const size_t block_count = (record_count_ + kConsolidatedBlockSize - 1)/kConsolidatedBlockSize;
+        
+        if (read_record_blocks(server_.consolidated_edb_, record_key(derivation_prf_, record_token_), 0, block_count, *list) && list->size() == record_count_) {
+            walk_count_ = record_walk_count;
+            results_ = list;
+            end_token_ = record_token_;
+        }else{
+            logger::log(logger::ERROR) << "Missing or invalid consolidated record for search token " << hex_string(record_token_) << std::endl;
+            has_record_ = false;
+            keep_tokens_ = false;
+        }
+    }
+    
+    // (when the whole chain is known, the request's token was compared)
+    check_end_ = results_ && walk_count_ > 0;
+    
+    keep_results_ = server_.search_cache_->enabled() || keep_tokens_;
+    
+    if (keep_results_) {
+        // placed in the chain order
+        new_results_.resize(walk_count_);
+    }
+}
+
+uint32_t SophosServer::SearchPrefix::walk_count() const
+{
+    return walk_count_;
+}
+
+const SearchResultCache::result_list_ptr& SophosServer::SearchPrefix::results()
+{
+    check_end();
+    return results_;
+}
+
+// The known part of the chain is found from the entry count given by the
+// client: its newest entry must be the one following the walked ones. It is
+// only checked once the walk is over (with a single evaluation of the TDP).
+// If it is not, the rest of the chain is walked sequentially, and neither the
+// cached results nor the consolidated record are used.
+void SophosServer::SearchPrefix::check_end()
+{
+    if (!check_end_) {
+        return;
+    }
+    check_end_ = false;
+    
+    if (req_.cancelled()) {
+        // the results will not be used
+        results_.reset();
+        keep_results_ = false;
+        keep_tokens_ = false;
+        return;
+    }
+    
+    if (end_reached_ && server_.public_tdp_.eval(last_token_) == end_token_) {
+        return;
+    }
+    
+    logger::log(logger::WARNING) << "The searched chain does not lead to its known part (search token " << hex_string(req_.token) << "): walking it entirely" << std::endl;
+    
+    results_.reset();
+    has_record_ = false;
+    keep_tokens_ = false;
+    // the request's entry count (or the known part) is wrong: the results
+    // must not be cached under it
+    keep_results_ = false;
+
+    if (!end_reached_) {
+        // only a cancelled walk stops before its end
+        return;
+    }
+    
+    auto list = std::make_shared<SearchResultCache::result_list_type>();
+    search_token_type st = last_token_;
+    
+    std::vector<search_token_type> st_block;
+    std::vector<update_token_type> ut_block;
+    
+    for (uint32_t i = walk_count_; i < req_.add_count && !req_.cancelled(); i++) {
+        st = server_.public_tdp_.eval(st);
+        st_block.push_back(st);
+        
+        if (st_block.size() == kLookupBlockSize || i+1 == req_.add_count) {
+            server_.lookup_block(derivation_prf_, st_block, *list, ut_block);
+            st_block.clear();
+        }
+    }
+    
+    if (req_.cancelled()) {
+        return;
+    }
+    results_ = list;
+}
+
+void SophosServer::SearchPrefix::add_block(size_t first, size_t step, const std::vector<search_token_type>& st_block, const std::vector<index_type>& res_block, const std::vector<update_token_type>& ut_block)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    found_count_ += res_block.size();
+    
+    // keep the last walked token
+    if (check_end_ && first < walk_count_ && (walk_count_ - 1 - first) % step == 0 && (walk_count_ - 1 - first)/step < st_block.size()) {
+        last_token_ = st_block[(walk_count_ - 1 - first)/step];
+        end_reached_ = true;
+    }
+    
+    // with missing entries, the positions of the results are unknown, but the
+    // walk is incomplete anyway
+    if (keep_results_ && res_block.size() == ut_block.size()) {
+        for (size_t i = 0; i < res_block.size() && first + i*step < new_results_.size(); i++) {
+            new_results_[first + i*step] = res_block[i];
+        }
+    }
+    if (keep_tokens_) {
+        walked_tokens_.insert(walked_tokens_.end(), ut_block.begin(), ut_block.end());
+    }
+}
+
+void SophosServer::SearchPrefix::complete()
+{
+    check_end();
+    
+    // only keep complete results: a missing entry might just not have been
+    // inserted yet, or the search might have been cancelled
+    if (!keep_results_ || walk_count_ == 0 || found_count_ != walk_count_) {
+        return;
+    }
+    
+    auto results = std::make_shared<SearchResultCache::result_list_type>();
+    
+    results->reserve(new_results_.size() + (results_ ? results_->size() : 0));
+    results->insert(results->end(), new_results_.begin(), new_results_.end());
+    if (results_) {
+        results->insert(results->end(), results_->begin(), results_->end());
+    }
+    
+    server_.search_cache_->put(req_, results);
+    
+    if (!keep_tokens_) {
+        return;
+    }
+    
+    std::lock_guard<std::mutex> lock(server_.active_searches_mtx_);
+    
+    // concurrent searches for the same keyword (or token searches that did
+    // not tell which keyword they read) might be reading the entries we
+    // would delete
+    auto active = server_.active_searches_.find(active_.handle());
+    if ((active != server_.active_searches_.end() && active->second > 1) || server_.active_searches_.count(std::string()) > 0) {
+        return;
+    }
+    
+    std::string marker(reinterpret_cast<const char*>(&req_.add_count), sizeof(uint32_t));
+    marker.append(reinterpret_cast<const char*>(req_.token.data()), req_.token.size());
+    
+    // write the new record before pointing the marker to it, so that an
+    // interrupted consolidation only leaves unreachable data behind
+    if (!write_record(server_.consolidated_edb_, record_key(derivation_prf_, req_.token), *results)) {
+        return;
+    }
+    if (!server_.consolidated_edb_.put(marker_key(derivation_prf_), marker)) {
+        return;
+    }
+    if (has_record_ && record_token_ != req_.token) {
+        remove_record(server_.consolidated_edb_, record_key(derivation_prf_, record_token_), record_count_);
+    }
+    
+    server_.edb_.remove(walked_tokens_);
+    
+    if (logger::severity() <= logger::DBG) {
+        logger::log(logger::DBG) << "Consolidated " << std::dec << results->size() << " entries (" << walked_tokens_.size() << " new)" << std::endl;
+    }
+}
+
+search_results_type SophosServer::search(const SearchRequest& req)
 {
-    std::list<index_type> results;
+    if (req.bounded()) {
+        return search_bounded(req);
+    }
+    
+    search_results_type results;
     
     search_token_type st = req.token;
 
@@ -145,36 +682,47 @@ std::list<index_type> SophosServer::search(const SearchRequest& req)
         logger::log(logger::DBG) << "Derivation key: " << hex_string(req.derivation_key) << std::endl;
     }
     
-    for (size_t i = 0; i < req.add_count; i++) {
-        std::string st_string(reinterpret_cast<char*>(st.data()), st.size());
-        index_type r;
-        update_token_type ut = derivation_prf.prf(st_string + '0');
-
-        if (logger::severity() <= logger::DBG) {
-            logger::log(logger::DBG) << "Derived token: " << hex_string(ut) << std::endl;
-        }
-
-        bool found = edb_.get(ut,r);
+    // only walk the part of the chain whose results are not known yet
+    SearchPrefix prefix(*this, req);
+    uint32_t walk_count = prefix.walk_count();
+    
+    std::vector<search_token_type> st_block;
+    std::vector<update_token_type> ut_block;
+    std::vector<index_type> res_block;
+    
+    st_block.reserve(std::min<size_t>(walk_count, kLookupBlockSize));
+    
+    for (size_t i = 0; i < walk_count && !req.cancelled(); i++) {
+        st_block.push_back(st);
         
-        if (found) {
-            if (logger::severity() <= logger::DBG) {
-                logger::log(logger::DBG) << "Found: " << std::hex << r << std::endl;
-            }
+        if (st_block.size() == kLookupBlockSize || i+1 == walk_count) {
+            lookup_block(derivation_prf, st_block, res_block, ut_block);
+            results.append(res_block.begin(), res_block.end());
+            prefix.add_block(i + 1 - st_block.size(), 1, st_block, res_block, ut_block);
             
-            r = xor_mask(r, derivation_prf.prf(st_string + '1'));
-            results.push_back(r);
-        }else{
-            logger::log(logger::ERROR) << "We were supposed to find something!" << std::endl;
+            st_block.clear();
+            res_block.clear();
         }
         
         st = public_tdp_.eval(st);
     }
     
+    prefix.complete();
+    
+    if (prefix.results() && !req.cancelled()) {
+        results.append(prefix.results()->begin(), prefix.results()->end());
+    }
+    
     return results;
 }
 
     void SophosServer::search_callback(const SearchRequest& req, std::function<void(index_type)> post_callback)
     {
+        if (req.bounded()) {
+            search_bounded_callback(req, post_callback);
+            return;
+        }
+        
         search_token_type st = req.token;
         
         auto derivation_prf = crypto::Prf<kUpdateTokenSize>(req.derivation_key);
@@ -184,37 +732,52 @@ std::list<index_type> SophosServer::search(const SearchRequest& req)
         
             logger::log(logger::DBG) << "Derivation key: " << hex_string(req.derivation_key) << std::endl;
         }
+        
+        // only walk the part of the chain whose results are not known yet
+        SearchPrefix prefix(*this, req);
+        uint32_t walk_count = prefix.walk_count();
+        
+        std::vector<search_token_type> st_block;
+        std::vector<update_token_type> ut_block;
+        std::vector<index_type> res_block;
+        
+        st_block.reserve(std::min<size_t>(walk_count, kLookupBlockSize));
+
+        for (size_t i = 0; i < walk_count && !req.cancelled(); i++) {
+            st_block.push_back(st);
             
-        for (size_t i = 0; i < req.add_count; i++) {
-            std::string st_string(reinterpret_cast<char*>(st.data()), st.size());
-            index_type r;
-            update_token_type ut = derivation_prf.prf(st_string + '0');
-            
-            if (logger::severity() <= logger::DBG) {
-                logger::log(logger::DBG) << "Derived token: " << hex_string(ut) << std::endl;
-            }
-            
-            bool found = edb_.get(ut,r);
-            
-            if (found) {
-                if (logger::severity() <= logger::DBG) {
-                    logger::log(logger::DBG) << "Found: " << std::hex << r << std::endl;
+            if (st_block.size() == kLookupBlockSize || i+1 == walk_count) {
+                lookup_block(derivation_prf, st_block, res_block, ut_block);
+                
+                for (index_type r : res_block) {
+                    post_callback(r);
                 }
+                prefix.add_block(i + 1 - st_block.size(), 1, st_block, res_block, ut_block);
                 
-                r = xor_mask(r, derivation_prf.prf(st_string + '1'));
-                post_callback(r);
-            }else{
-                logger::log(logger::ERROR) << "We were supposed to find something!" << std::endl;
+                st_block.clear();
+                res_block.clear();
             }
             
             st = public_tdp_.eval(st);
         }
+        
+        if (prefix.results() && !req.cancelled()) {
+            for (index_type r : *prefix.results()) {
+                post_callback(r);
+            }
+        }
+        
+        prefix.complete();
     }
     
 
-std::list<index_type> SophosServer::search_parallel_full(const SearchRequest& req)
+search_results_type SophosServer::search_parallel_full(const SearchRequest& req)
 {
-    std::list<index_type> results;
+    if (req.bounded()) {
+        return search_bounded(req);
+    }
+    
+    search_results_type results;
     
     search_token_type st = req.token;
     
@@ -226,92 +789,128 @@ std::list<index_type> SophosServer::search_parallel_full(const SearchRequest& re
         logger::log(logger::DBG) << "Derivation key: " << hex_string(req.derivation_key) << std::endl;
     }
 
-    ThreadPool prf_pool(1);
-    ThreadPool token_map_pool(1);
-    ThreadPool decrypt_pool(1);
+    // only walk the part of the chain whose results are not known yet
+    SearchPrefix prefix(*this, req);
+    uint32_t walk_count = prefix.walk_count();
+    
+    std::shared_ptr<SearchExecutor> executor = pinned_executor();
+    
+    SearchExecutor::Placement placement(*executor, rsa_thread_count(*executor, 3) + 3);
+    
+    // each stage processes its blocks one at a time
+    SearchExecutor::TaskGroup group(*executor);
+    SearchExecutor::Stage prf_stage(group, 1);
+    SearchExecutor::Stage token_map_stage(group, 1);
+    SearchExecutor::Stage decrypt_stage(group, 1);
 
-    auto decrypt_job = [&derivation_prf, &results](const index_type r, const std::string& st_string)
+    typedef std::vector<search_token_type> st_block_type;
+    typedef std::vector<update_token_type> ut_block_type;
+    
+    typedef std::vector<index_type> mask_block_type;
+    
+    auto decrypt_job = [&req, &results, &prefix](size_t first, size_t step, const st_block_type& st_block, const ut_block_type& ut_block, const mask_block_type& masks, const std::vector<index_type>& values, const std::vector<bool>& found)
     {
-        index_type v = xor_mask(r, derivation_prf.prf(st_string + '1'));
-        results.push_back(v);
+        if (req.cancelled()) {
+            return;
+        }
+        
+        std::vector<index_type> res_block;
+        
+        for (size_t i = 0; i < st_block.size(); i++) {
+            if (found[i]) {
+                res_block.push_back(values[i] ^ masks[i]);
+            }else{
+                logger::log(logger::ERROR) << "We were supposed to find a value mapped to key " << hex_string(ut_block[i]) << std::endl;
+            }
+        }
+        
+        results.append(res_block.begin(), res_block.end());
+        prefix.add_block(first, step, st_block, res_block, ut_block);
     };
 
-    auto lookup_job = [&derivation_prf, &decrypt_pool, &decrypt_job, this](const std::string& st_string, const update_token_type& token)
+    auto lookup_job = [&req, &decrypt_stage, &decrypt_job, this](size_t first, size_t step, const st_block_type& st_block, const ut_block_type& ut_block, const mask_block_type& masks)
     {
-        index_type r;
-        
-        if (logger::severity() <= logger::DBG) {
-            logger::log(logger::DBG) << "Derived token: " << hex_string(token) << std::endl;
+        if (req.cancelled()) {
+            return;
         }
         
-        bool found = edb_.get(token,r);
+        std::vector<index_type> values;
+        std::vector<bool> found;
         
-        if (found) {
-            if (logger::severity() <= logger::DBG) {
-                logger::log(logger::DBG) << "Found: " << std::hex << r << std::endl;
-            }
-            
-            decrypt_pool.enqueue(decrypt_job, r, st_string);
-
-        }else{
-            logger::log(logger::ERROR) << "We were supposed to find something!" << std::endl;
-        }
-
+        edb_.multi_get(ut_block, values, found);
+        
+        decrypt_stage.submit(std::bind(decrypt_job, first, step, st_block, ut_block, masks, std::move(values), std::move(found)));
     };
 
     
-    auto derive_job = [&derivation_prf,&token_map_pool,&lookup_job](const std::string& input_string)
+    auto derive_job = [&req, &derivation_prf,&token_map_stage,&lookup_job](size_t first, size_t step, const st_block_type& st_block)
     {
-        update_token_type ut = derivation_prf.prf(input_string + '0');
+        if (req.cancelled()) {
+            return;
+        }
+        
+        ut_block_type ut_block(st_block.size());
+        mask_block_type masks(st_block.size());
         
-        token_map_pool.enqueue(lookup_job, input_string, ut);
+        DerivationKernel(derivation_prf).derive(st_block.data(), st_block.size(), ut_block.data(), masks.data());
         
+        token_map_stage.submit(std::bind(lookup_job, first, step, st_block, std::move(ut_block), std::move(masks)));
     };
 
     // the rsa job launched with input index,max computes all the RSA tokens of order i + kN up to max
-    auto rsa_job = [this, &st, &derive_job, &prf_pool](const uint8_t index, const size_t max, const uint8_t N)
+    auto rsa_job = [this, &req, &st, &derive_job, &prf_stage](const uint8_t index, const size_t max, const uint8_t N)
     {
         search_token_type local_st = st;
+        
+        // the walker's tokens are at offsets index, index+N, ...
+        size_t block_first = index;
+        ChunkedDispatcher<search_token_type> dispatcher(kLookupBlockSize, [&derive_job, &prf_stage, &block_first, N](st_block_type&& st_block)
+                                                        {
+                                                            size_t first = block_first;
+                                                            block_first += st_block.size()*N;
+                                                            prf_stage.submit(std::bind(derive_job, first, N, std::move(st_block)));
+                                                        });
+        
         if (index != 0) {
             local_st = public_tdp_.eval(local_st, index);
         }
         
         if (index < max) {
             // this is a valid search token, we have to derive it and do a lookup
-            std::string st_string(reinterpret_cast<char*>(local_st.data()), local_st.size());
-            prf_pool.enqueue(derive_job, st_string);
+            dispatcher.push(local_st);
         }
         
-        for (size_t i = index+N; i < max; i+=N) {
+        for (size_t i = index+N; i < max && !req.cancelled(); i+=N) {
             local_st = public_tdp_.eval(local_st, N);
-            
-            std::string st_string(reinterpret_cast<char*>(local_st.data()), local_st.size());
-            prf_pool.enqueue(derive_job, st_string);
+            dispatcher.push(local_st);
         }
+        
+        dispatcher.flush();
     };
     
-    std::vector<std::thread> rsa_threads;
+    // leave a worker to each of the three other stages
+    uint8_t n_threads = rsa_thread_count(*executor, 3);
     
-    unsigned n_threads = std::thread::hardware_concurrency()-3;
+    run_walkers(*executor, n_threads, [&rsa_job, walk_count](uint8_t t, uint8_t n){ rsa_job(t, walk_count, n); });
     
-    for (uint8_t t = 0; t < n_threads; t++) {
-        rsa_threads.push_back(std::thread(rsa_job, t, req.add_count, n_threads));
-    }
- 
-    for (uint8_t t = 0; t < n_threads; t++) {
-        rsa_threads[t].join();
-    }
-
-    prf_pool.join();
-    token_map_pool.join();
+    group.wait();
     
+    prefix.complete();
+    
+    if (prefix.results() && !req.cancelled()) {
+        results.append(prefix.results()->begin(), prefix.results()->end());
+    }
     
     return results;
 }
 
-std::list<index_type> SophosServer::search_parallel(const SearchRequest& req, uint8_t access_threads)
+search_results_type SophosServer::search_parallel(const SearchRequest& req, uint8_t access_threads)
 {
-    std::list<index_type> results;
+    if (req.bounded()) {
+        return search_bounded(req);
+    }
+    
+    search_results_type results;
     std::mutex res_mutex;
     
     search_token_type st = req.token;
@@ -324,34 +923,33 @@ std::list<index_type> SophosServer::search_parallel(const SearchRequest& req, ui
         logger::log(logger::DBG) << "Derivation key: " << hex_string(req.derivation_key) << std::endl;
     }
     
-    ThreadPool access_pool(access_threads);
+    // only walk the part of the chain whose results are not known yet
+    SearchPrefix prefix(*this, req);
+    uint32_t walk_count = prefix.walk_count();
+    
+    std::shared_ptr<SearchExecutor> executor = pinned_executor();
+    
+    SearchExecutor::Placement placement(*executor, rsa_thread_count(*executor, access_threads) + access_threads);
+    
+    SearchExecutor::TaskGroup group(*executor);
+    SearchExecutor::Stage access_stage(group, access_threads);
         
-    auto access_job = [&derivation_prf, this, &results, &res_mutex, &access_threads](const std::string& st_string)
+    auto access_job = [&req, &derivation_prf, this, &results, &res_mutex, &access_threads, &prefix](size_t first, size_t step, const std::vector<search_token_type>& st_block)
     {
-        update_token_type token = derivation_prf.prf(st_string + '0');
-
-        index_type r;
-        
-        if (logger::severity() <= logger::DBG) {
-            logger::log(logger::DBG) << "Derived token: " << hex_string(token) << std::endl;
+        if (req.cancelled()) {
+            return;
         }
         
-        bool found = edb_.get(token,r);
+        std::vector<index_type> res_block;
+        std::vector<update_token_type> ut_block;
         
-        if (found) {
-            if (logger::severity() <= logger::DBG) {
-                logger::log(logger::DBG) << "Found: " << std::hex << r << std::endl;
-            }
-        }else{
-            logger::log(logger::ERROR) << "We were supposed to find something!" << std::endl;
-        }
-        
-        index_type v = xor_mask(r, derivation_prf.prf(st_string + '1'));
+        lookup_block(derivation_prf, st_block, res_block, ut_block);
+        prefix.add_block(first, step, st_block, res_block, ut_block);
         
         if (access_threads > 1) {
             res_mutex.lock();
         }
-        results.push_back(v);
+        results.append(res_block.begin(), res_block.end());
         if (access_threads > 1) {
             res_mutex.unlock();
         }
@@ -360,74 +958,78 @@ std::list<index_type> SophosServer::search_parallel(const SearchRequest& req, ui
     
     
     // the rsa job launched with input index,max computes all the RSA tokens of order i + kN up to max
-    auto rsa_job = [this, &st, &access_job, &access_pool](const uint8_t index, const size_t max, const uint8_t N)
+    auto rsa_job = [this, &req, &st, &access_job, &access_stage](const uint8_t index, const size_t max, const uint8_t N)
     {
         search_token_type local_st = st;
+        
+        // the walker's tokens are at offsets index, index+N, ...
+        size_t block_first = index;
+        ChunkedDispatcher<search_token_type> dispatcher(kLookupBlockSize, [&access_job, &access_stage, &block_first, N](std::vector<search_token_type>&& st_block)
+                                                        {
+                                                            size_t first = block_first;
+                                                            block_first += st_block.size()*N;
+                                                            access_stage.submit(std::bind(access_job, first, N, std::move(st_block)));
+                                                        });
+        
         if (index != 0) {
             local_st = public_tdp_.eval(local_st, index);
         }
         
         if (index < max) {
             // this is a valid search token, we have to derive it and do a lookup
-            std::string st_string(reinterpret_cast<char*>(local_st.data()), local_st.size());
-            access_pool.enqueue(access_job, st_string);
+            dispatcher.push(local_st);
         }
         
-        for (size_t i = index+N; i < max; i+=N) {
+        for (size_t i = index+N; i < max && !req.cancelled(); i+=N) {
             local_st = public_tdp_.eval(local_st, N);
-            
-            std::string st_string(reinterpret_cast<char*>(local_st.data()), local_st.size());
-            access_pool.enqueue(access_job, st_string);
-
+            dispatcher.push(local_st);
         }
+        
+        dispatcher.flush();
     };
     
-    std::vector<std::thread> rsa_threads;
+    uint8_t n_threads = rsa_thread_count(*executor, access_threads);
     
-    unsigned n_threads = std::thread::hardware_concurrency()-access_threads;
+    run_walkers(*executor, n_threads, [&rsa_job, walk_count](uint8_t t, uint8_t n){ rsa_job(t, walk_count, n); });
     
-    for (uint8_t t = 0; t < n_threads; t++) {
-        rsa_threads.push_back(std::thread(rsa_job, t, req.add_count, n_threads));
-    }
+    group.wait();
     
-    for (uint8_t t = 0; t < n_threads; t++) {
-        rsa_threads[t].join();
-    }
+    prefix.complete();
     
-    access_pool.join();
+    if (prefix.results() && !req.cancelled()) {
+        results.append(prefix.results()->begin(), prefix.results()->end());
+    }
     
     return results;
 }
 
-std::list<index_type> SophosServer::search_parallel_light(const SearchRequest& req, uint8_t threads_count)
+search_results_type SophosServer::search_parallel_light(const SearchRequest& req, uint8_t threads_count)
 {
     assert(threads_count > 0);
     
     
-    // use one result list per thread so to avoid using locks
-    std::list<index_type> *result_lists = new std::list<index_type>[threads_count];
+    // use one result buffer per thread so to avoid using locks
+    ShardedResultBuffer<index_type> result_buffers(threads_count);
     
-    auto callback = [&result_lists](index_type i, uint8_t thread_id)
+    auto callback = [&result_buffers](index_type i, uint8_t thread_id)
     {
-        result_lists[thread_id].push_back(i);
+        result_buffers.shard(thread_id).push_back(i);
     };
     
     search_parallel_light_callback(req, callback, threads_count);
     
-    // merge the result lists
-    std::list<index_type> results(std::move(result_lists[0]));
-    for (uint8_t i = 1; i < threads_count; i++) {
-        results.splice(results.end(), result_lists[i]);
-    }
-    
-    delete []  result_lists;
-    
-    return results;
+    // merge the result buffers
+    return result_buffers.merge();
 
 }
     
 void SophosServer::search_parallel_callback(const SearchRequest& req, std::function<void(index_type)> post_callback, uint8_t rsa_thread_count, uint8_t access_thread_count, uint8_t post_thread_count)
 {
+    if (req.bounded()) {
+        search_bounded_callback(req, post_callback);
+        return;
+    }
+    
     search_token_type st = req.token;
     
     auto derivation_prf = crypto::Prf<kUpdateTokenSize>(req.derivation_key);
@@ -437,75 +1039,89 @@ void SophosServer::search_parallel_callback(const SearchRequest& req, std::funct
     
         logger::log(logger::DBG) << "Derivation key: " << hex_string(req.derivation_key) << std::endl;
     }
-        
-    ThreadPool access_pool(access_thread_count);
-    ThreadPool post_pool(post_thread_count);
     
-    auto access_job = [&derivation_prf, this, &post_pool, &post_callback](const search_token_type st, size_t i)
+    // only walk the part of the chain whose results are not known yet
+    SearchPrefix prefix(*this, req);
+    uint32_t walk_count = prefix.walk_count();
+    
+    std::shared_ptr<SearchExecutor> executor = pinned_executor();
+    
+    SearchExecutor::Placement placement(*executor, rsa_thread_count + access_thread_count + post_thread_count);
+    
+    SearchExecutor::TaskGroup group(*executor);
+    SearchExecutor::Stage access_stage(group, access_thread_count);
+    SearchExecutor::Stage post_stage(group, post_thread_count);
+    
+    auto post_job = [&req, &post_callback](const std::vector<index_type>& res_block)
     {
-        std::string st_string(reinterpret_cast<const char*>(st.data()), st.size());
-        update_token_type token = derivation_prf.prf(st_string + '0');
-        
-        index_type r;
+        if (req.cancelled()) {
+            return;
+        }
         
-        if (logger::severity() <= logger::DBG) {
-            logger::log(logger::DBG) << "Derived token: " << hex_string(token) << std::endl;
+        for (index_type v : res_block) {
+            post_callback(v);
+        }
+    };
+    
+    auto access_job = [&req, &derivation_prf, this, &post_stage, &post_job, &prefix](size_t first, size_t step, const std::vector<search_token_type>& st_block)
+    {
+        if (req.cancelled()) {
+            return;
         }
         
-        bool found = edb_.get(token,r);
+        std::vector<index_type> res_block;
+        std::vector<update_token_type> ut_block;
         
-        if (found) {
-            if (logger::severity() <= logger::DBG) {
-                logger::log(logger::DBG) << "Found: " << std::hex << r << std::endl;
-            }
-            
-            index_type v = xor_mask(r, derivation_prf.prf(st_string + '1'));
-            
-            post_pool.enqueue(post_callback, v);
-            
-        }else{
-            logger::log(logger::ERROR) << "We were supposed to find a value mapped to key " << hex_string(token);
-            logger::log(logger::ERROR) << " (" << i << "-th derived key from search token " << st_string << ")" << std::endl;
-        }
+        lookup_block(derivation_prf, st_block, res_block, ut_block);
+        prefix.add_block(first, step, st_block, res_block, ut_block);
         
+        post_stage.submit(std::bind(post_job, std::move(res_block)));
     };
     
     
     
     // the rsa job launched with input index,max computes all the RSA tokens of order i + kN up to max
-    auto rsa_job = [this, &st, &access_job, &access_pool](const uint8_t index, const size_t max, const uint8_t N)
+    auto rsa_job = [this, &req, &st, &access_job, &access_stage](const uint8_t index, const size_t max, const uint8_t N)
     {
         search_token_type local_st = st;
+        
+        // the walker's tokens are at offsets index, index+N, ...
+        size_t block_first = index;
+        ChunkedDispatcher<search_token_type> dispatcher(kLookupBlockSize, [&access_job, &access_stage, &block_first, N](std::vector<search_token_type>&& st_block)
+                                                        {
+                                                            size_t first = block_first;
+                                                            block_first += st_block.size()*N;
+                                                            access_stage.submit(std::bind(access_job, first, N, std::move(st_block)));
+                                                        });
+        
         if (index != 0) {
             local_st = public_tdp_.eval(local_st, index);
         }
         
         if (index < max) {
             // this is a valid search token, we have to derive it and do a lookup
-            access_pool.enqueue(access_job, local_st, index);
+            dispatcher.push(local_st);
         }
         
-        for (size_t i = index+N; i < max; i+=N) {
+        for (size_t i = index+N; i < max && !req.cancelled(); i+=N) {
             local_st = public_tdp_.eval(local_st, N);
-            
-            access_pool.enqueue(access_job, local_st, i);
+            dispatcher.push(local_st);
         }
+        
+        dispatcher.flush();
     };
     
-    std::vector<std::thread> rsa_threads;
-    
-//    unsigned n_threads = std::thread::hardware_concurrency()-access_threads;
+    run_walkers(*executor, rsa_thread_count, [&rsa_job, walk_count](uint8_t t, uint8_t n){ rsa_job(t, walk_count, n); });
     
-    for (uint8_t t = 0; t < rsa_thread_count; t++) {
-        rsa_threads.push_back(std::thread(rsa_job, t, req.add_count, rsa_thread_count));
-    }
+    group.wait();
     
-    for (uint8_t t = 0; t < rsa_thread_count; t++) {
-        rsa_threads[t].join();
+    if (prefix.results() && !req.cancelled()) {
+        for (index_type v : *prefix.results()) {
+            post_callback(v);
+        }
     }
     
-    access_pool.join();
-    post_pool.join();
+    prefix.complete();
 }
 
 void SophosServer::search_parallel_light_callback(const SearchRequest& req, std::function<void(index_type)> post_callback, uint8_t thread_count)
@@ -519,6 +1135,11 @@ void SophosServer::search_parallel_light_callback(const SearchRequest& req, std:
 
 void SophosServer::search_parallel_light_callback(const SearchRequest& req, std::function<void(index_type, uint8_t)> post_callback, uint8_t thread_count)
 {
+    if (req.bounded()) {
+        search_bounded_callback(req, [&post_callback](index_type v){ post_callback(v, 0); });
+        return;
+    }
+    
     search_token_type st = req.token;
     
     auto derivation_prf = crypto::Prf<kUpdateTokenSize>(req.derivation_key);
@@ -529,69 +1150,793 @@ void SophosServer::search_parallel_light_callback(const SearchRequest& req, std:
         logger::log(logger::DBG) << "Derivation key: " << hex_string(req.derivation_key) << std::endl;
     }
     
-    auto derive_access = [&derivation_prf, this, &post_callback](const uint8_t t_id, const search_token_type st, size_t i)
+    // only walk the part of the chain whose results are not known yet
+    SearchPrefix prefix(*this, req);
+    uint32_t walk_count = prefix.walk_count();
+    
+    auto derive_access = [&req, &derivation_prf, this, &post_callback, &prefix](const uint8_t t_id, size_t first, size_t step, const std::vector<search_token_type>& st_block)
     {
-        std::string st_string(reinterpret_cast<const char*>(st.data()), st.size());
-        update_token_type token = derivation_prf.prf(st_string + '0');
-        
-        index_type r;
-        
-        if (logger::severity() <= logger::DBG) {
-            logger::log(logger::DBG) << "Derived token: " << hex_string(token) << std::endl;
+        if (req.cancelled()) {
+            return;
         }
         
-        bool found = edb_.get(token,r);
+        std::vector<index_type> res_block;
+        std::vector<update_token_type> ut_block;
         
-        if (found) {
-            if (logger::severity() <= logger::DBG) {
-                logger::log(logger::DBG) << "Found: " << std::hex << r << std::endl;
-            }
-            
-            index_type v = xor_mask(r, derivation_prf.prf(st_string + '1'));
-            
+        lookup_block(derivation_prf, st_block, res_block, ut_block);
+        
+        for (index_type v : res_block) {
             post_callback(v, t_id);
-            
-        }else{
-            logger::log(logger::ERROR) << "We were supposed to find a value mapped to key " << hex_string(token);
-            logger::log(logger::ERROR) << " (" << i << "-th derived key from search token " << st_string << ")" << std::endl;
         }
         
+        prefix.add_block(first, step, st_block, res_block, ut_block);
     };
     
     
     
     // the rsa job launched with input index,max computes all the RSA tokens of order i + kN up to max
-    auto job = [this, &st, &derivation_prf, &derive_access](const uint8_t index, const size_t max, const uint8_t N)
+    auto job = [this, &req, &st, &derive_access](const uint8_t index, const size_t max, const uint8_t N)
     {
         search_token_type local_st = st;
+        
+        // the blocks are processed by the walker itself. Its tokens are at
+        // offsets index, index+N, ...
+        size_t block_first = index;
+        ChunkedDispatcher<search_token_type> dispatcher(kLookupBlockSize, [&derive_access, index, &block_first, N](std::vector<search_token_type>&& st_block)
+                                                        {
+                                                            derive_access(index, block_first, N, st_block);
+                                                            block_first += st_block.size()*N;
+                                                        });
+        
         if (index != 0) {
             local_st = public_tdp_.eval(local_st, index);
         }
         
         if (index < max) {
             // this is a valid search token, we have to derive it and do a lookup
-
-            derive_access(index, local_st, index);
+            dispatcher.push(local_st);
         }
         
-        for (size_t i = index+N; i < max; i+=N) {
+        for (size_t i = index+N; i < max && !req.cancelled(); i+=N) {
             local_st = public_tdp_.eval(local_st, N);
+            dispatcher.push(local_st);
+        }
+        
+        dispatcher.flush();
+    };
+    
+    std::shared_ptr<SearchExecutor> executor = pinned_executor();
+    
+    SearchExecutor::Placement placement(*executor, thread_count);
+    
+    run_walkers(*executor, thread_count, [&job, walk_count](uint8_t t, uint8_t n){ job(t, walk_count, n); });
+    
+    if (prefix.results() && !req.cancelled()) {
+        for (index_type v : *prefix.results()) {
+            post_callback(v, 0);
+        }
+    }
+    
+    prefix.complete();
+}
+
+// number of blocks each ring of a pipeline search can hold
+constexpr size_t kPipelineRingCapacity = 16;
+
+// a block of consecutive search tokens, the first one being at offset first
+// of the walk
+struct WalkBlock
+{
+    size_t first;
+    std::vector<search_token_type> st_block;
+};
+
+void SophosServer::pipeline_search(const SearchRequest& req, const std::function<void(std::vector<index_type>&)>& post_block, uint8_t lookup_threads)
+{
+    if (req.bounded()) {
+        bounded_search(req, post_block);
+        return;
+    }
+    
+    typedef std::vector<index_type> res_block_type;
+    
+    lookup_threads = std::max<uint8_t>(lookup_threads, 1);
+    
+    search_token_type st = req.token;
+    
+    auto derivation_prf = crypto::Prf<kUpdateTokenSize>(req.derivation_key);
+    
+    if (logger::severity() <= logger::DBG) {
+        logger::log(logger::DBG) << "Search token: " << hex_string(req.token) << std::endl;
+        
+        logger::log(logger::DBG) << "Derivation key: " << hex_string(req.derivation_key) << std::endl;
+    }
+    
+    // only walk the part of the chain whose results are not known yet
+    SearchPrefix prefix(*this, req);
+    uint32_t walk_count = prefix.walk_count();
+    
+    std::shared_ptr<SearchExecutor> executor = pinned_executor();
+    
+    // the walker, the lookup stages and the post stage
+    SearchExecutor::Placement placement(*executor, lookup_threads + 2);
+    
+    SearchExecutor::TaskGroup group(*executor);
+    
+    SearchExecutor::RingStage<res_block_type, MpscRing> post_stage(group, kPipelineRingCapacity, [&req, &post_block](res_block_type& res_block)
+                                                                  {
+                                                                      if (!req.cancelled()) {
+                                                                          post_block(res_block);
+                                                                      }
+                                                                  });
+    
+    auto lookup_job = [&req, &derivation_prf, this, &prefix, &post_stage](WalkBlock& block)
+    {
+        if (req.cancelled()) {
+            return;
+        }
+        
+        res_block_type res_block;
+        std::vector<update_token_type> ut_block;
+        
+        lookup_block(derivation_prf, block.st_block, res_block, ut_block);
+        prefix.add_block(block.first, 1, block.st_block, res_block, ut_block);
+        
+        post_stage.push(std::move(res_block));
+    };
+    
+    // the walker is the only producer of each lookup stage
+    std::vector<std::unique_ptr<SearchExecutor::RingStage<WalkBlock, SpscRing>>> lookup_stages;
+    for (uint8_t t = 0; t < lookup_threads; t++) {
+        lookup_stages.emplace_back(new SearchExecutor::RingStage<WalkBlock, SpscRing>(group, kPipelineRingCapacity, lookup_job));
+    }
+    
+    {
+        size_t next_stage = 0;
+        size_t block_first = 0;
+        ChunkedDispatcher<search_token_type> dispatcher(kLookupBlockSize, [&lookup_stages, &next_stage, &block_first](std::vector<search_token_type>&& st_block)
+                                                        {
+                                                            WalkBlock block;
+                                                            block.first = block_first;
+                                                            block.st_block = std::move(st_block);
+                                                            block_first += block.st_block.size();
+                                                            
+                                                            lookup_stages[next_stage]->push(std::move(block));
+                                                            next_stage = (next_stage + 1) % lookup_stages.size();
+                                                        });
+        
+        for (size_t i = 0; i < walk_count && !req.cancelled(); i++) {
+            dispatcher.push(st);
+            
+            if (i+1 < walk_count) {
+                st = public_tdp_.eval(st);
+            }
+        }
+        dispatcher.flush();
+    }
+    
+    group.wait();
+    
+    if (prefix.results() && !req.cancelled()) {
+        res_block_type cached(prefix.results()->begin(), prefix.results()->end());
+        post_block(cached);
+    }
+    
+    prefix.complete();
+}
+
+search_results_type SophosServer::search_pipeline(const SearchRequest& req, uint8_t lookup_threads)
+{
+    search_results_type results;
+    std::mutex res_mutex;
+    
+    pipeline_search(req, [&results, &res_mutex](std::vector<index_type>& res_block)
+                    {
+                        std::lock_guard<std::mutex> lock(res_mutex);
+                        results.append(res_block.begin(), res_block.end());
+                    }, lookup_threads);
+    
+    return results;
+}
+
+void SophosServer::search_pipeline_callback(const SearchRequest& req, std::function<void(index_type)> post_callback, uint8_t lookup_threads)
+{
+    pipeline_search(req, [&post_callback](std::vector<index_type>& res_block)
+                    {
+                        for (index_type v : res_block) {
+                            post_callback(v);
+                        }
+                    }, lookup_threads);
+}
+
+// a block of a checkpoint search, held until the segment it belongs to is
+// trusted
+struct CheckpointBlock
+{
+    size_t first; // offset of the first token in the walk
+    std::vector<search_token_type> st_block;
+    std::vector<index_type> res_block;
+    std::vector<update_token_type> ut_block;
+};
+
+// number of segments of the chain delimited by the checkpoints of a request,
+// among the walk_count entries to walk
+size_t SearchRequest::checkpoint_segment_count(uint32_t walk_count) const
+{
+    if (checkpoints.empty() || checkpoint_stride == 0 || walk_count == 0) {
+        return 1;
+    }
+    size_t count = 1 + std::min<size_t>(checkpoints.size(), kMaxCheckpointCount);
+    
+    return std::min<size_t>(count, (walk_count - 1)/checkpoint_stride + 1);
+}
+
+void SophosServer::checkpoint_search(const SearchRequest& req, const std::function<void(std::vector<index_type>&)>& post_block, uint8_t walker_threads)
+{
+    if (req.bounded()) {
+        bounded_search(req, post_block);
+        return;
+    }
+    
+    auto derivation_prf = crypto::Prf<kUpdateTokenSize>(req.derivation_key);
+    
+    if (logger::severity() <= logger::DBG) {
+        logger::log(logger::DBG) << "Search token: " << hex_string(req.token) << std::endl;
+        
+        logger::log(logger::DBG) << "Derivation key: " << hex_string(req.derivation_key) << std::endl;
+    }
+    
+    if (req.checkpoints.size() > kMaxCheckpointCount) {
+        logger::log(logger::WARNING) << "Too many checkpoints in a search request (" << req.checkpoints.size() << "): only the first " << kMaxCheckpointCount << " are used" << std::endl;
+    }
+    
+    // only walk the part of the chain whose results are not known yet (the
+    // oldest entries, i.e. the end of the walk)
+    SearchPrefix prefix(*this, req);
+    uint32_t walk_count = prefix.walk_count();
+    
+    const size_t segment_count = req.checkpoint_segment_count(walk_count);
+    const size_t stride = (segment_count > 1) ? req.checkpoint_stride : walk_count;
+    
+    walker_threads = (uint8_t)std::max<size_t>(std::min<size_t>(walker_threads, segment_count), 1);
+    
+    // The checkpoints come from the client: the end of each segment is
+    // checked against the next checkpoint (with one more evaluation of the
+    // TDP), and the results of a segment are only used once the checkpoint
+    // it starts from is checked, as well as all the previous ones. The
+    // blocks of the segments that are not trusted yet are held.
+    std::mutex trust_mtx;
+    size_t trusted = 1;                 // segments [0, trusted) are trusted
+    size_t valid_count = segment_count; // segments [valid_count, segment_count) start from a wrong checkpoint
+    std::vector<int8_t> boundaries(segment_count, 0); // 1 if the end of a segment is its next checkpoint, -1 if not
+    std::vector<std::vector<CheckpointBlock>> held(segment_count);
+    search_token_type fallback_token;   // token following the last valid segment
+    
+    auto use_block = [&prefix, &post_block](CheckpointBlock& block)
+    {
+        prefix.add_block(block.first, 1, block.st_block, block.res_block, block.ut_block);
+        post_block(block.res_block);
+    };
+    
+    // must be called with trust_mtx locked: returns the blocks of the
+    // segments that became trusted
+    auto advance_trust = [&trusted, &valid_count, &boundaries, &held]()
+    {
+        std::vector<CheckpointBlock> blocks;
+        
+        for (; trusted < valid_count && boundaries[trusted-1] == 1; trusted++) {
+            std::move(held[trusted].begin(), held[trusted].end(), std::back_inserter(blocks));
+            held[trusted].clear();
+        }
+        return blocks;
+    };
+    
+    // each walker takes the next segment that is not walked yet
+    std::atomic_size_t next_segment(0);
+    
+    auto walker = [&](uint8_t)
+    {
+        // the blocks do not span several segments
+        size_t segment = 0;
+        size_t block_first = 0;
+        ChunkedDispatcher<search_token_type> dispatcher(kLookupBlockSize, [&](std::vector<search_token_type>&& st_block)
+                                                        {
+                                                            CheckpointBlock block;
+                                                            block.first = block_first;
+                                                            block_first += st_block.size();
+                                                            
+                                                            if (req.cancelled()) {
+                                                                return;
+                                                            }
+                                                            
+                                                            block.st_block = std::move(st_block);
+                                                            lookup_block(derivation_prf, block.st_block, block.res_block, block.ut_block);
+                                                            
+                                                            {
+                                                                std::lock_guard<std::mutex> lock(trust_mtx);
+                                                                if (segment >= valid_count) {
+                                                                    return;
+                                                                }
+                                                                if (segment >= trusted) {
+                                                                    held[segment].push_back(std::move(block));
+                                                                    return;
+                                                                }
+                                                            }
+                                                            use_block(block);
+                                                        });
+        
+        for (size_t s = next_segment++; s < segment_count && !req.cancelled(); s = next_segment++) {
+            {
+                std::lock_guard<std::mutex> lock(trust_mtx);
+                if (s >= valid_count) {
+                    break;
+                }
+            }
+            
+            search_token_type st = (s == 0) ? req.token : req.checkpoints[s-1];
+            const size_t end = std::min<size_t>((s+1)*stride, walk_count);
+            
+            dispatcher.flush();
+            segment = s;
+            block_first = s*stride;
+            
+            for (size_t i = s*stride; i < end && !req.cancelled(); i++) {
+                dispatcher.push(st);
+                
+                if (i+1 < end) {
+                    st = public_tdp_.eval(st);
+                }
+            }
+            dispatcher.flush();
+            
+            if (s+1 == segment_count || req.cancelled()) {
+                continue;
+            }
+            
+            st = public_tdp_.eval(st);
+            bool valid = (st == req.checkpoints[s]);
             
-            derive_access(index, local_st, index);
+            std::vector<CheckpointBlock> blocks;
+            {
+                std::lock_guard<std::mutex> lock(trust_mtx);
+                
+                boundaries[s] = valid ? 1 : -1;
+                if (!valid && s+1 < valid_count) {
+                    // the following segments are walked again, sequentially
+                    valid_count = s+1;
+                    fallback_token = st;
+                    for (size_t t = s+1; t < segment_count; t++) {
+                        held[t].clear();
+                    }
+                }
+                blocks = advance_trust();
+            }
+            for (CheckpointBlock& block : blocks) {
+                use_block(block);
+            }
         }
     };
     
-    std::vector<std::thread> rsa_threads;
+    std::shared_ptr<SearchExecutor> executor = pinned_executor();
     
-    //    unsigned n_threads = std::thread::hardware_concurrency()-access_threads;
+    SearchExecutor::Placement placement(*executor, walker_threads);
     
-    for (uint8_t t = 0; t < thread_count; t++) {
-        rsa_threads.push_back(std::thread(job, t, req.add_count, thread_count));
+    // the walkers take the segments one at a time: the calling thread can run
+    // the share of the workers that do not start
+    executor->parallel_for(0, walker_threads, [&walker](size_t t){ walker(static_cast<uint8_t>(t)); }, 1);
+    
+    if (valid_count < segment_count && !req.cancelled()) {
+        logger::log(logger::WARNING) << "Invalid checkpoint " << std::dec << valid_count-1 << " in a search request: walking the rest of the chain sequentially" << std::endl;
+        
+        search_token_type st = fallback_token;
+        std::vector<search_token_type> st_block;
+        
+        for (size_t i = valid_count*stride; i < walk_count && !req.cancelled(); i++) {
+            st_block.push_back(st);
+            
+            if (st_block.size() == kLookupBlockSize || i+1 == walk_count) {
+                CheckpointBlock block;
+                block.first = i + 1 - st_block.size();
+                block.st_block.swap(st_block);
+                
+                lookup_block(derivation_prf, block.st_block, block.res_block, block.ut_block);
+                use_block(block);
+            }
+            
+            if (i+1 < walk_count) {
+                st = public_tdp_.eval(st);
+            }
+        }
     }
     
-    for (uint8_t t = 0; t < thread_count; t++) {
-        rsa_threads[t].join();
+    if (prefix.results() && !req.cancelled()) {
+        std::vector<index_type> cached(prefix.results()->begin(), prefix.results()->end());
+        post_block(cached);
     }
+    
+    prefix.complete();
+}
+
+search_results_type SophosServer::search_checkpoints(const SearchRequest& req, uint8_t walker_threads)
+{
+    search_results_type results;
+    std::mutex res_mutex;
+    
+    checkpoint_search(req, [&results, &res_mutex](std::vector<index_type>& res_block)
+                      {
+                          std::lock_guard<std::mutex> lock(res_mutex);
+                          results.append(res_block.begin(), res_block.end());
+                      }, walker_threads);
+    
+    return results;
+}
+
+void SophosServer::search_checkpoints_callback(const SearchRequest& req, std::function<void(index_type)> post_callback, uint8_t walker_threads)
+{
+    checkpoint_search(req, [&post_callback](std::vector<index_type>& res_block)
+                      {
+                          for (index_type v : res_block) {
+                              post_callback(v);
+                          }
+                      }, walker_threads);
+}
+
+void SophosServer::bounded_search(const SearchRequest& req, const std::function<void(std::vector<index_type>&)>& post_block)
+{
+    search_token_type st = req.token;
+
+    auto derivation_prf = crypto::Prf<kUpdateTokenSize>(req.derivation_key);
+
+    if (logger::severity() <= logger::DBG) {
+        logger::log(logger::DBG) << "Search token: " << hex_string(req.token) << std::endl;
+
+        logger::log(logger::DBG) << "Derivation key: " << hex_string(req.derivation_key) << std::endl;
+    }
+
+    // the cache is not used, but the entries covered by a consolidation are
+    // not walked: their results are read at their position in the record
+    ActiveSearch active(*this, keyword_handle(req.derivation_key));
+    const uint32_t walk_count = req.walk_count();
+
+    uint32_t record_count = 0;
+    search_token_type record_token;
+
+    const bool has_record = read_marker(consolidated_edb_, derivation_prf, record_count, record_token);
+
+    const uint32_t edb_walk_count = (req.add_count > record_count) ? std::min(walk_count, req.add_count - record_count) : 0;
+
+    std::vector<search_token_type> st_block;
+    std::vector<update_token_type> ut_block;
+    std::vector<index_type> res_block;
+
+    st_block.reserve(std::min<size_t>(walk_count, kLookupBlockSize));
+
+    // walks the entries [begin, end) of the chain, st being the token of the
+    // entry begin
+    auto walk = [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end && !req.cancelled(); i++) {
+            st_block.push_back(st);
+            
+            if (st_block.size() == kLookupBlockSize || i+1 == end) {
+                lookup_block(derivation_prf, st_block, res_block, ut_block);
+                post_block(res_block);
+                
+                st_block.clear();
+                res_block.clear();
+            }
+            
+            if (i+1 < end) {
+                st = public_tdp_.eval(st);
+            }
+        }
+    };
+
+    walk(0, edb_walk_count);
+
+    if (edb_walk_count == walk_count || req.cancelled()) {
+        return;
+    }
+
+    // as in SearchPrefix, the record is only used if the searched chain leads
+    // to it: otherwise, the rest of the window is walked
+    bool valid_record;
+    
+    if (edb_walk_count == 0) {
+        valid_record = has_record && req.add_count == record_count && req.token == record_token;
+    } else {
+        st = public_tdp_.eval(st);
+        valid_record = (st == record_token);
+    }
+    
+    if (!valid_record) {
+        logger::log(logger::WARNING) << "The searched chain does not lead to its consolidated record (search token " << hex_string(req.token) << "): walking it" << std::endl;
+        
+        walk(edb_walk_count, walk_count);
+        return;
+    }
+
+    // positions of the rest of the entries in the record
+    const size_t first = record_count - (req.add_count - edb_walk_count);
+    const size_t end = first + (walk_count - edb_walk_count);
+    const std::string key = record_key(derivation_prf, record_token);
+
+    for (size_t b = first/kConsolidatedBlockSize; b*kConsolidatedBlockSize < end && !req.cancelled(); b++) {
+        std::vector<index_type> block;
+
+        if (!read_record_blocks(consolidated_edb_, key, b, b+1, block)) {
+            logger::log(logger::ERROR) << "Missing or invalid consolidated record for search token " << hex_string(record_token) << std::endl;
+            return;
+        }
+
+        const size_t block_first = b*kConsolidatedBlockSize;
+        const size_t begin_pos = std::max(first, block_first) - block_first;
+        const size_t end_pos = std::min(end - block_first, block.size());
+
+        if (begin_pos < end_pos) {
+            res_block.assign(block.begin() + begin_pos, block.begin() + end_pos);
+            post_block(res_block);
+        }
+    }
+}
+
+search_results_type SophosServer::search_bounded(const SearchRequest& req)
+{
+    search_results_type results;
+
+    bounded_search(req, [&results](std::vector<index_type>& res_block)
+                   {
+                       results.append(res_block.begin(), res_block.end());
+                   });
+
+    return results;
+}
+
+void SophosServer::search_bounded_callback(const SearchRequest& req, std::function<void(index_type)> post_callback)
+{
+    bounded_search(req, [&post_callback](std::vector<index_type>& res_block)
+                   {
+                       for (index_type v : res_block) {
+                           post_callback(v);
+                       }
+                   });
+}
+
+// a block of a read pool search, from its derivation to its decryption
+struct ReadPoolBlock
+{
+    size_t first; // offset of the first token in the walk
+    std::vector<search_token_type> st_block;
+    std::vector<update_token_type> ut_block;
+    std::vector<index_type> masks;
+    std::vector<index_type> values;
+    std::vector<bool> found;
+};
+
+void SophosServer::read_pool_search(const SearchRequest& req, const std::function<void(std::vector<index_type>&)>& post_block, uint8_t compute_threads, uint8_t read_threads)
+{
+    if (req.bounded()) {
+        bounded_search(req, post_block);
+        return;
+    }
+    
+    typedef std::shared_ptr<ReadPoolBlock> block_ptr;
+    
+    compute_threads = std::max<uint8_t>(compute_threads, 1);
+    read_threads = std::max<uint8_t>(read_threads, 1);
+    
+    search_token_type st = req.token;
+    
+    auto derivation_prf = crypto::Prf<kUpdateTokenSize>(req.derivation_key);
+    
+    if (logger::severity() <= logger::DBG) {
+        logger::log(logger::DBG) << "Search token: " << hex_string(req.token) << std::endl;
+        
+        logger::log(logger::DBG) << "Derivation key: " << hex_string(req.derivation_key) << std::endl;
+    }
+    
+    // only walk the part of the chain whose results are not known yet
+    SearchPrefix prefix(*this, req);
+    uint32_t walk_count = prefix.walk_count();
+    
+    EdbReadPool& read_pool = edb_read_pool();
+    
+    std::shared_ptr<SearchExecutor> executor = pinned_executor();
+    
+    SearchExecutor::Placement placement(*executor, compute_threads + 1);
+    
+    SearchExecutor::TaskGroup group(*executor);
+    SearchExecutor::Stage compute_stage(group, compute_threads);
+    
+    // blocks walked but not posted yet
+    size_t in_flight = 0;
+    std::mutex in_flight_mtx;
+    std::condition_variable in_flight_cv;
+    
+    auto block_started = [&in_flight, &in_flight_mtx]()
+    {
+        std::lock_guard<std::mutex> lock(in_flight_mtx);
+        in_flight++;
+    };
+    
+    auto block_done = [&in_flight, &in_flight_mtx, &in_flight_cv]()
+    {
+        // notify under the lock: the search can return as soon as the count
+        // reaches 0
+        std::lock_guard<std::mutex> lock(in_flight_mtx);
+        in_flight--;
+        in_flight_cv.notify_all();
+    };
+    
+    auto decrypt_job = [&req, &derivation_prf, this, &prefix, &post_block, &block_done](const block_ptr& block)
+    {
+        if (!req.cancelled()) {
+            std::vector<index_type> res_block;
+            
+            decrypt_block(block->st_block, block->ut_block, block->masks, block->values, block->found, res_block);
+            prefix.add_block(block->first, 1, block->st_block, res_block, block->ut_block);
+            post_block(res_block);
+        }
+        block_done();
+    };
+    
+    // derived blocks waiting for a read: the search has at most read_threads
+    // reads in flight, as each one blocks a thread of the pool
+    std::deque<block_ptr> read_queue;
+    size_t reads = 0;
+    std::mutex read_mtx;
+    
+    std::function<void()> start_reads;
+    start_reads = [&read_queue, &reads, &read_mtx, read_threads, &read_pool, &compute_stage, &decrypt_job, &block_done, &start_reads]()
+    {
+        std::vector<block_ptr> started;
+        {
+            std::lock_guard<std::mutex> lock(read_mtx);
+            while (reads < read_threads && !read_queue.empty()) {
+                started.push_back(std::move(read_queue.front()));
+                read_queue.pop_front();
+                reads++;
+            }
+        }
+        
+        // The decryption is submitted by the pool's thread once the values
+        // are read. As that thread is not a task of the group, the block is
+        // held until the submission (and the next reads) are done: the
+        // decryption can be done (and the search over) before.
+        for (const block_ptr& block : started) {
+            read_pool.multi_get(block->ut_block, block->values, block->found, [block, &reads, &read_mtx, &compute_stage, &decrypt_job, &block_done, &start_reads]()
+                                {
+                                    compute_stage.submit(std::bind(decrypt_job, block));
+                                    {
+                                        std::lock_guard<std::mutex> lock(read_mtx);
+                                        reads--;
+                                    }
+                                    start_reads();
+                                    block_done();
+                                });
+        }
+    };
+    
+    auto derive_job = [&req, &derivation_prf, this, &read_queue, &read_mtx, &start_reads, &block_started, &block_done](const block_ptr& block)
+    {
+        if (req.cancelled()) {
+            block_done();
+            return;
+        }
+        
+        derive_block(derivation_prf, block->st_block, block->ut_block, block->masks);
+        
+        // released by the completion of the read
+        block_started();
+        {
+            std::lock_guard<std::mutex> lock(read_mtx);
+            read_queue.push_back(block);
+        }
+        start_reads();
+    };
+    
+    {
+        size_t block_first = 0;
+        ChunkedDispatcher<search_token_type> dispatcher(kReadPoolBlockSize, [&](std::vector<search_token_type>&& st_block)
+                                                        {
+                                                            {
+                                                                std::unique_lock<std::mutex> lock(in_flight_mtx);
+                                                                in_flight_cv.wait(lock, [&in_flight](){ return in_flight < kReadPoolWindow; });
+                                                                in_flight++;
+                                                            }
+                                                            
+                                                            block_ptr block = std::make_shared<ReadPoolBlock>();
+                                                            block->first = block_first;
+                                                            block->st_block = std::move(st_block);
+                                                            block_first += block->st_block.size();
+                                                            compute_stage.submit(std::bind(derive_job, block));
+                                                        });
+        
+        for (size_t i = 0; i < walk_count && !req.cancelled(); i++) {
+            dispatcher.push(st);
+            
+            if (i+1 < walk_count) {
+                st = public_tdp_.eval(st);
+            }
+        }
+        dispatcher.flush();
+    }
+    
+    {
+        std::unique_lock<std::mutex> lock(in_flight_mtx);
+        in_flight_cv.wait(lock, [&in_flight](){ return in_flight == 0; });
+    }
+    group.wait();
+    
+    if (prefix.results() && !req.cancelled()) {
+        std::vector<index_type> cached(prefix.results()->begin(), prefix.results()->end());
+        post_block(cached);
+    }
+    
+    prefix.complete();
+}
+
+search_results_type SophosServer::search_read_pool(const SearchRequest& req, uint8_t compute_threads, uint8_t read_threads)
+{
+    search_results_type results;
+    std::mutex res_mutex;
+    
+    read_pool_search(req, [&results, &res_mutex](std::vector<index_type>& res_block)
+                     {
+                         std::lock_guard<std::mutex> lock(res_mutex);
+                         results.append(res_block.begin(), res_block.end());
+                     }, compute_threads, read_threads);
+    
+    return results;
+}
+
+void SophosServer::search_read_pool_callback(const SearchRequest& req, std::function<void(index_type)> post_callback, uint8_t compute_threads, uint8_t read_threads)
+{
+    read_pool_search(req, [&post_callback](std::vector<index_type>& res_block)
+                     {
+                         for (index_type v : res_block) {
+                             post_callback(v);
+                         }
+                     }, compute_threads, read_threads);
+}
+
+uint8_t SophosServer::rsa_thread_count(const SearchExecutor& executor, size_t other_stages) const
+{
+    size_t n = executor.thread_count();
+    
+    return (uint8_t)std::min<size_t>((n > other_stages) ? n - other_stages : 1, public_tdp_.maximum_order());
+}
+
+bool SophosServer::lookup_tokens(const std::vector<update_token_type>& tokens, std::vector<index_type>& values, std::vector<bool>& found, std::vector<index_type>& record) const
+{
+    edb_.multi_get(tokens, values, found);
+
+    // the entries covered by a consolidation are removed from edb_, and the
+    // posting list is mapped to the token of the newest one: it can only be
+    // the first missing token (see SearchPrefix)
+    for (size_t i = 0; i < tokens.size(); i++) {
+        if (found[i]) {
+            continue;
+        }
+
+        // read the blocks of the list up to the last one (which is not full,
+        // or the first missing one)
+        const std::string key(tokens[i].begin(), tokens[i].end());
+        const size_t offset = record.size();
+        
+        for (size_t b = 0; read_record_blocks(consolidated_edb_, key, b, b+1, record) && record.size() - offset == (b+1)*kConsolidatedBlockSize; b++) {
+        }
+        
+        if (record.size() > offset) {
+            values.resize(i);
+            found.resize(i);
+            return true;
+        }
+
+        logger::log(logger::ERROR) << "We were supposed to find a value mapped to key " << hex_string(tokens[i]) << std::endl;
+    }
+
+    return false;
 }
 
 void SophosServer::update(const UpdateRequest& req)
@@ -604,8 +1949,215 @@ void SophosServer::update(const UpdateRequest& req)
     edb_.put(req.token, req.index);
 }
 
+SearchResultCache& SophosServer::search_cache()
+{
+    return *search_cache_;
+}
+
+uint32_t SophosServer::search_walk_count(const SearchRequest& req) const
+{
+    uint32_t record_count = 0;
+    search_token_type record_token;
+
+    bool has_record = read_marker(consolidated_edb_, crypto::Prf<kUpdateTokenSize>(req.derivation_key), record_count, record_token);
+
+    if (req.bounded()) {
+        // see bounded_search (when it has to be checked, the record is assumed
+        // to be reached)
+        if (req.add_count > record_count) {
+            return std::min(req.walk_count(), req.add_count - record_count);
+        }
+        return (has_record && req.add_count == record_count && req.token == record_token) ? 0 : req.walk_count();
+    }
+
+    // see SearchPrefix
+    has_record = has_record && (record_count < req.add_count || (record_count == req.add_count && record_token == req.token));
+
+    uint32_t record_walk_count = has_record ? req.add_count - record_count : req.add_count;
+
+    if (reconsolidates(record_walk_count, record_count)) {
+        return record_walk_count;
+    }
+    return std::min(search_cache_->walk_count(req), record_walk_count);
+}
+
+bool SophosServer::reconsolidates(uint32_t record_walk_count, uint32_t record_count) const
+{
+    // consolidate again only once enough new entries have been added since
+    // the last consolidation, so that rewriting the posting list is amortized
+    return consolidate_searches_ && record_walk_count >= kConsolidationMinCount && record_walk_count >= record_count/4;
+}
+
+SearchExecutor& SophosServer::search_executor()
+{
+    return *pinned_executor();
+}
+
+EdbReadPool& SophosServer::edb_read_pool()
+{
+    std::call_once(edb_read_pool_flag_, [this](){ edb_read_pool_.reset(new EdbReadPool(edb_, pinned_executor()->thread_count())); });
+    return *edb_read_pool_;
+}
+
+bool SophosServer::numa_placement() const
+{
+    return pinned_executor()->numa_aware();
+}
+
+void SophosServer::set_numa_placement(bool flag)
+{
+    std::lock_guard<std::mutex> lock(executor_mtx_);
+    
+    std::shared_ptr<SearchExecutor> current = pinned_executor();
+    
+    if (flag == current->numa_aware()) {
+        return;
+    }
+    
+    size_t thread_count = current->thread_count();
+    size_t high = current->stage_high_watermark();
+    size_t low = current->stage_low_watermark();
+    
+    std::shared_ptr<SearchExecutor> executor;
+    if (flag) {
+        executor = std::make_shared<SearchExecutor>(thread_count, NumaTopology::detect());
+    }else{
+        executor = std::make_shared<SearchExecutor>(thread_count);
+    }
+    executor->set_stage_watermarks(high, low);
+    
+    // the searches in progress keep the executor they pinned: the old one is
+    // destroyed once the last of them is over
+    std::atomic_store(&executor_, executor);
+}
+
+std::shared_ptr<SearchExecutor> SophosServer::pinned_executor() const
+{
+    return std::atomic_load(&executor_);
+}
+
+bool SophosServer::search_consolidation() const
+{
+    return consolidate_searches_;
+}
+
+void SophosServer::set_search_consolidation(bool flag)
+{
+    consolidate_searches_ = flag;
+}
+
+unsigned SophosServer::maximum_tdp_stride() const
+{
+    return public_tdp_.maximum_order();
+}
+
+double SophosServer::benchmark_search_stage(SearchStage stage, size_t count, unsigned thread_count, unsigned stride) const
+{
+    thread_count = std::max(thread_count, 1U);
+    const uint8_t order = static_cast<uint8_t>(std::min(std::max(stride, 1U), maximum_tdp_stride()));
+    size_t thread_iterations = std::max<size_t>(count/thread_count, 1);
+    
+    // dummy inputs, generated from a fresh random key
+    crypto::Prf<kSearchTokenSize> input_prf;
+    crypto::Prf<kUpdateTokenSize> derivation_prf;
+    
+    // generate the looked up tokens beforehand, so that only the lookups are timed
+    std::vector<update_token_type> lookup_tokens;
+    if (stage == EDB_LOOKUP) {
+        lookup_tokens.reserve(thread_iterations*thread_count);
+        for (size_t i = 0; i < thread_iterations*thread_count; i++) {
+            lookup_tokens.push_back(derivation_prf.prf(std::to_string(i)));
+        }
+    }
+    
+    auto job = [this, stage, thread_iterations, order, &input_prf, &derivation_prf, &lookup_tokens](const unsigned t)
+    {
+        search_token_type st = input_prf.prf(std::to_string(t));
+        st[0] = 0; // make sure the token is smaller than the TDP's modulus
+        
+        switch (stage) {
+            case TDP_EVAL:
+                if (order > 1) {
+                    for (size_t i = 0; i < thread_iterations; i++) {
+                        st = public_tdp_.eval(st, order);
+                    }
+                }else{
+                    for (size_t i = 0; i < thread_iterations; i++) {
+                        st = public_tdp_.eval(st);
+                    }
+                }
+                break;
+                
+            case PRF_DERIVE:
+            {
+                DerivationKernel kernel(derivation_prf);
+                update_token_type ut;
+                index_type mask;
+                
+                for (size_t i = 0; i < thread_iterations; i++) {
+                    kernel.derive(st, ut, mask);
+                    st[i % kSearchTokenSize] ^= ut[0] ^ (uint8_t)mask;
+                }
+            }
+                break;
+                
+            case EDB_LOOKUP:
+            {
+                std::vector<index_type> values;
+                std::vector<bool> found;
+                
+                for (size_t i = 0; i < thread_iterations; i += kLookupBlockSize) {
+                    auto first = lookup_tokens.begin() + t*thread_iterations + i;
+                    std::vector<update_token_type> tokens(first, first + std::min(kLookupBlockSize, thread_iterations - i));
+                    
+                    edb_.multi_get(tokens, values, found);
+                }
+                break;
+            }
+        }
+    };
+    
+    auto begin = std::chrono::high_resolution_clock::now();
+
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < thread_count; t++) {
+        threads.push_back(std::thread(job, t));
+    }
+    for (unsigned t = 0; t < thread_count; t++) {
+        threads[t].join();
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    
+    return std::chrono::duration<double, std::micro>(end - begin).count();
+}
+
+double SophosServer::benchmark_task_dispatch(size_t team_count) const
+{
+    std::shared_ptr<SearchExecutor> executor = pinned_executor();
+    team_count = std::max<size_t>(team_count, 1);
+    
+    size_t worker_count = 0;
+    
+    auto begin = std::chrono::high_resolution_clock::now();
+    
+    for (size_t i = 0; i < team_count; i++) {
+        worker_count += executor->run_team(executor->thread_count(), [](size_t, size_t){});
+    }
+    
+    auto end = std::chrono::high_resolution_clock::now();
+    
+    return std::chrono::duration<double, std::micro>(end - begin).count()/worker_count;
+}
+
 std::ostream& SophosServer::print_stats(std::ostream& out) const
 {
+    search_cache_->print_stats(out);
+    pinned_executor()->print_stats(out);
+    if (edb_read_pool_) {
+        edb_read_pool_->print_stats(out);
+    }
+    
 //    out << "Number of tokens: " << edb_.size();
 //    out << "; Load: " << edb_.load();
 //    out << "; Overflow bucket size: " << edb_.overflow_size() << std::endl;
@@ -22,11 +22,20 @@
 #pragma once
 
 #include "rocksdb_wrapper.hpp"
+#include "result_buffer.hpp"
 
 #include <string>
+#include <algorithm>
 #include <array>
 #include <fstream>
 #include <functional>
+#include <list>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
 
 #include <ssdmap/bucket_map.hpp>
 #include <sse/crypto/tdp.hpp>
@@ -40,24 +49,140 @@ constexpr size_t kSearchTokenSize = crypto::Tdp::kMessageSize;
 constexpr size_t kDerivationKeySize = 16;
 constexpr size_t kUpdateTokenSize = 16;
 
+// number of derived tokens resolved by a single EDB lookup during searches
+constexpr size_t kLookupBlockSize = 256;
+
+// number of derived tokens resolved by a single read of the EDB read pool,
+// and maximum number of such blocks walked but not posted yet by a search
+// (see SophosServer::search_read_pool)
+constexpr size_t kReadPoolBlockSize = 32;
+constexpr size_t kReadPoolWindow = 64;
+
+// Chain checkpoints (see SearchRequest::checkpoints): minimum number of
+// entries between two checkpoints, and maximum number of checkpoints of a
+// request
+constexpr uint32_t kMinCheckpointStride = 1024;
+constexpr size_t kMaxCheckpointCount = 256;
+
+// minimum number of new entries in a chain before it gets consolidated
+constexpr uint32_t kConsolidationMinCount = 64;
+
+// number of results per block of a consolidated posting list: a bounded
+// search only reads the blocks of the entries it returns
+constexpr size_t kConsolidatedBlockSize = 1024;
+
 typedef std::array<uint8_t, kSearchTokenSize> search_token_type;
 //typedef std::string search_token_type;
 typedef std::array<uint8_t, kUpdateTokenSize> update_token_type;
 typedef uint64_t index_type;
+typedef ResultBuffer<index_type> search_results_type;
     
 struct TokenHasher
 {
 public:
     size_t operator()(const update_token_type& ut) const;
 };
+
+// Derives the EDB entry of a chain element from its search token st: the
+// update token is prf(st || '0'), and the index is masked with (the first 8
+// bytes of) prf(st || '1').
+// The PRF inputs are built in place, without allocations, and the batches are
+// written to arrays preallocated by the caller.
+class DerivationKernel
+{
+public:
+    explicit DerivationKernel(const crypto::Prf<kUpdateTokenSize>& derivation_prf);
+    
+    update_token_type token(const search_token_type& st) const;
+    // masked index = index ^ mask
+    index_type mask(const search_token_type& st) const;
+    void derive(const search_token_type& st, update_token_type& token, index_type& mask) const;
+    
+    // tokens[i] (and masks[i]) for each of the count search tokens
+    void derive_tokens(const search_token_type* st, size_t count, update_token_type* tokens) const;
+    void derive(const search_token_type* st, size_t count, update_token_type* tokens, index_type* masks) const;
+    
+private:
+    const crypto::Prf<kUpdateTokenSize>& prf_;
+};
+    
+// Cancellation of a search, checked by the search engines between two RSA
+// evaluations and before processing a block of tokens or results.
+// A search is cancelled explicitly, when its deadline passes, or when the
+// probe returns true (e.g. when the client is gone).
+class SearchCancellation {
+public:
+    typedef std::chrono::steady_clock clock_type;
+    
+    SearchCancellation();
+    explicit SearchCancellation(std::function<bool()> probe, clock_type::time_point deadline = clock_type::time_point::max());
     
+    void cancel();
+    bool cancelled() const;
+    
+    // true if the deadline passed (and not only the client cancelled)
+    bool deadline_exceeded() const;
+    
+private:
+    mutable std::atomic_bool cancelled_;
+    std::function<bool()> probe_;
+    clock_type::time_point deadline_;
+};
+
 struct SearchRequest
 {
     search_token_type   token;
     std::string         derivation_key;
     uint32_t            add_count;
+    
+    // Optional checkpoints of the chain, computed by the client with the
+    // trapdoor: checkpoints[i] is the search token of the entry at
+    // (i+1)*checkpoint_stride in the walk order (token is the one at 0).
+    // The segments between the checkpoints are walked independently.
+    std::vector<search_token_type> checkpoints;
+    uint32_t            checkpoint_stride = 0;
+    
+    // Bounded searches: only the limit newest entries of the chain (starting
+    // at token, the entry of counter add_count-1) are walked, and the results
+    // are returned in the chain order, newest first. 0 for the whole chain.
+    uint32_t            limit = 0;
+    
+    // server side only (not sent by the client), can be null
+    std::shared_ptr<SearchCancellation> cancellation;
+    
+    bool cancelled() const
+    {
+        return cancellation && cancellation->cancelled();
+    }
+    
+    bool bounded() const
+    {
+        return limit != 0;
+    }
+    
+    // number of entries of the chain walked by the search
+    uint32_t walk_count() const
+    {
+        return bounded() ? std::min(limit, add_count) : add_count;
+    }
+    
+    // number of segments of a walk of walk_count entries from the
+    // checkpoints (1 if there are none)
+    size_t checkpoint_segment_count(uint32_t walk_count) const;
 };
 
+// Handle of the searches of a keyword, derived from its derivation key. The
+// token searches, which do not reveal the derivation key, send it so that the
+// server knows which chain they are reading.
+std::string keyword_handle(const std::string& derivation_key);
+
+
+// stages of a search, as measured by SophosServer::benchmark_search_stage
+typedef enum{
+    TDP_EVAL = 0,
+    PRF_DERIVE,
+    EDB_LOOKUP
+} SearchStage;
 
 struct UpdateRequest
 {
@@ -97,6 +222,10 @@ private:
     sse::crypto::TdpInverse inverse_tdp_;
 };
 
+class SearchResultCache;
+class SearchExecutor;
+class EdbReadPool;
+
 class SophosServer {
 public:
     
@@ -104,28 +233,190 @@ public:
     
     SophosServer(const std::string& db_path, const std::string& tdp_pk);
     SophosServer(const std::string& db_path, const size_t tm_setup_size, const std::string& tdp_pk);
+    ~SophosServer();
     
     const std::string public_key() const;
 
-    std::list<index_type> search(const SearchRequest& req);
+    search_results_type search(const SearchRequest& req);
     void search_callback(const SearchRequest& req, std::function<void(index_type)> post_callback);
     
-    std::list<index_type> search_parallel_full(const SearchRequest& req);
-    std::list<index_type> search_parallel(const SearchRequest& req, uint8_t access_threads);
-    std::list<index_type> search_parallel_light(const SearchRequest& req, uint8_t thread_count);
+    search_results_type search_parallel_full(const SearchRequest& req);
+    search_results_type search_parallel(const SearchRequest& req, uint8_t access_threads);
+    search_results_type search_parallel_light(const SearchRequest& req, uint8_t thread_count);
 
     void search_parallel_callback(const SearchRequest& req, std::function<void(index_type)> post_callback, uint8_t rsa_thread_count, uint8_t access_thread_count, uint8_t post_thread_count);
     void search_parallel_light_callback(const SearchRequest& req, std::function<void(index_type)> post_callback, uint8_t thread_count);
     void search_parallel_light_callback(const SearchRequest& req, std::function<void(index_type, uint8_t)> post_callback, uint8_t thread_count);
 
+    // Ring pipeline: the calling thread walks the chain (the only TDP stage)
+    // and hands blocks of tokens to lookup_threads derive+lookup stages,
+    // which hand their results to a post stage, through lock-free rings.
+    // post_callback can be called concurrently.
+    search_results_type search_pipeline(const SearchRequest& req, uint8_t lookup_threads);
+    void search_pipeline_callback(const SearchRequest& req, std::function<void(index_type)> post_callback, uint8_t lookup_threads);
+    
+    // Overlaps the EDB reads with the cryptographic work: the calling thread
+    // walks the chain, the blocks are derived and decrypted by at most
+    // compute_threads workers, and their lookups are run by the EDB read
+    // pool meanwhile, at most read_threads at a time. The reads block the
+    // pool's threads: they are workers of the search. post_callback can be
+    // called concurrently.
+    search_results_type search_read_pool(const SearchRequest& req, uint8_t compute_threads, uint8_t read_threads);
+    void search_read_pool_callback(const SearchRequest& req, std::function<void(index_type)> post_callback, uint8_t compute_threads, uint8_t read_threads);
+    
+    // Walks the segments of a chain split by the request's checkpoints with
+    // at most walker_threads walkers, each one evaluating the TDP from the
+    // beginning of its segment: the RSA work is parallel. Without
+    // checkpoints, the chain is walked sequentially. post_callback can be
+    // called concurrently.
+    search_results_type search_checkpoints(const SearchRequest& req, uint8_t walker_threads);
+    void search_checkpoints_callback(const SearchRequest& req, std::function<void(index_type)> post_callback, uint8_t walker_threads);
+    
+    // Bounded searches (see SearchRequest::limit): the chain is walked
+    // sequentially, and the results are posted in the chain order. The
+    // consolidated entries are not walked: only the blocks of the record
+    // holding their results are read. The other engines run bounded
+    // requests with these.
+    search_results_type search_bounded(const SearchRequest& req);
+    void search_bounded_callback(const SearchRequest& req, std::function<void(index_type)> post_callback);
+
+    // Batched lookup of update tokens derived by the client, for the
+    // searches whose chain is walked by the client (tokens are consecutive
+    // entries, newest first). values and found are filled as by a multi_get.
+    // If a token is not in the EDB but maps to a consolidated posting list,
+    // the list is appended to record: it covers this token and all the older
+    // entries, so values and found are truncated before it, and true is
+    // returned. The token searches must be registered (see ActiveSearch)
+    // while they run.
+    bool lookup_tokens(const std::vector<update_token_type>& tokens, std::vector<index_type>& values, std::vector<bool>& found, std::vector<index_type>& record) const;
+
     void update(const UpdateRequest& req);
     
+    SearchResultCache& search_cache();
+    
+    // Number of entries of the chain that a search of req walks: the others
+    // are covered by the search cache or by a consolidated record. Used to
+    // plan the search (which looks the cache and the record up again).
+    uint32_t search_walk_count(const SearchRequest& req) const;
+    
+    // shared by the search engines; its stages' watermarks bound the memory
+    // used by the pipelined engines. It is replaced by set_numa_placement.
+    SearchExecutor& search_executor();
+    
+    // threads running the reads of search_read_pool, started by the first
+    // one (one per worker of the executor)
+    EdbReadPool& edb_read_pool();
+    
+    // Runs the searches on a NUMA-aware executor, whose workers are pinned
+    // to the nodes of the machine, and places each search on a single node
+    // when it fits (see SearchExecutor::Placement). Disabled by default.
+    // It replaces the executor: the searches in progress finish on the one
+    // they started on.
+    bool numa_placement() const;
+    void set_numa_placement(bool flag);
+    
+    // Searches rewrite the chains they walked as a single posting list
+    // (stored in a separate database, at db_path + kConsolidatedSuffix),
+    // and remove the per-update entries. Disabled by default: it is
+    // destructive, and the readers of the removed entries must know about
+    // it. A chain is not consolidated while other searches of the keyword
+    // are running.
+    bool search_consolidation() const;
+    void set_search_consolidation(bool flag);
+    
+    static const std::string kConsolidatedSuffix;
+    
+    // Runs count iterations of a single search stage on dummy inputs, split
+    // among thread_count threads, and returns the elapsed time (in
+    // microseconds). Used to calibrate the search planner.
+    // The TDP iterations run eval(st, stride), as the stride walkers do.
+    double benchmark_search_stage(SearchStage stage, size_t count, unsigned thread_count, unsigned stride = 1) const;
+    
+    // Runs team_count empty teams of all the workers of the search executor,
+    // as the parallel engines start their workers (see
+    // SearchExecutor::run_team), and returns the average cost of starting a
+    // worker (in microseconds). Used to calibrate the search planner.
+    double benchmark_task_dispatch(size_t team_count) const;
+    
+    // Largest stride of the walkers' eval(st, stride).
+    unsigned maximum_tdp_stride() const;
+    
     std::ostream& print_stats(std::ostream& out) const;
+    
+    // Registers a search of a keyword, given by its handle (see
+    // keyword_handle), while it is alive: a chain is not consolidated while
+    // other searches are reading it. A search without a handle (an empty
+    // one) prevents the consolidation of every chain.
+    class ActiveSearch {
+    public:
+        ActiveSearch(SophosServer& server, const std::string& handle);
+        ~ActiveSearch();
+        
+        const std::string& handle() const;
+        
+    private:
+        SophosServer& server_;
+        const std::string handle_;
+    };
+    
 private:
+    class SearchPrefix;
+    friend class SearchPrefix;
+    
+    // derive_block, a lookup in edb_, then decrypt_block
+    void lookup_block(const crypto::Prf<kUpdateTokenSize>& derivation_prf, const std::vector<search_token_type>& st_block, std::vector<index_type>& results, std::vector<update_token_type>& tokens) const;
+    // update tokens and masks of a block of search tokens
+    void derive_block(const crypto::Prf<kUpdateTokenSize>& derivation_prf, const std::vector<search_token_type>& st_block, std::vector<update_token_type>& tokens, std::vector<index_type>& masks) const;
+    // unmasks the values found for a block, and appends them to results
+    void decrypt_block(const std::vector<search_token_type>& st_block, const std::vector<update_token_type>& tokens, const std::vector<index_type>& masks, const std::vector<index_type>& values, const std::vector<bool>& found, std::vector<index_type>& results) const;
+    
+    // runs a search from the checkpoints, and calls post_block on each block
+    // of results
+    void checkpoint_search(const SearchRequest& req, const std::function<void(std::vector<index_type>&)>& post_block, uint8_t walker_threads);
+    
+    // runs a bounded search, and calls post_block on each block of results,
+    // in order
+    void bounded_search(const SearchRequest& req, const std::function<void(std::vector<index_type>&)>& post_block);
+    
+    // runs a search whose reads are run by the EDB read pool, and calls
+    // post_block on each block of results
+    void read_pool_search(const SearchRequest& req, const std::function<void(std::vector<index_type>&)>& post_block, uint8_t compute_threads, uint8_t read_threads);
+    
+    // runs the ring pipeline, and calls post_block on each block of results
+    void pipeline_search(const SearchRequest& req, const std::function<void(std::vector<index_type>&)>& post_block, uint8_t lookup_threads);
+    
+    // true if a search walking record_walk_count entries above a record of
+    // record_count entries consolidates the chain again
+    bool reconsolidates(uint32_t record_walk_count, uint32_t record_count) const;
+    
+    // number of RSA walkers when other_stages workers of the executor are
+    // left to the other stages
+    uint8_t rsa_thread_count(const SearchExecutor& executor, size_t other_stages) const;
+    
+    // the current executor: a search holds it until it returns
+    std::shared_ptr<SearchExecutor> pinned_executor() const;
+    
 //    ssdmap::bucket_map<update_token_type, index_type, TokenHasher> edb_;
     RockDBWrapper edb_;
+    RockDBWrapper consolidated_edb_;
     
     sse::crypto::TdpMultPool public_tdp_;
+    
+    std::unique_ptr<SearchResultCache> search_cache_;
+    
+    // shared by all the searches. Only accessed atomically (see
+    // pinned_executor); replacements are serialized by executor_mtx_.
+    std::shared_ptr<SearchExecutor> executor_;
+    std::mutex executor_mtx_;
+    
+    std::unique_ptr<EdbReadPool> edb_read_pool_;
+    std::once_flag edb_read_pool_flag_;
+    
+    std::atomic_bool consolidate_searches_;
+    
+    // number of searches in progress, per keyword handle
+    std::unordered_map<std::string, uint32_t> active_searches_;
+    std::mutex active_searches_mtx_;
 };
 
 } // namespace sophos
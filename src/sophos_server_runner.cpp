@@ -20,6 +20,7 @@
 
 
 #include "sophos_server_runner.hpp"
+#include "search_reply_writer.hpp"
 
 #include "utils.hpp"
 #include "logger.hpp"
@@ -27,6 +28,9 @@
 #include <fstream>
 #include <atomic>
 #include <thread>
+#include <chrono>
+#include <deque>
+#include <condition_variable>
 
 #include <grpc/grpc.h>
 #include <grpc++/server.h>
@@ -42,7 +46,7 @@ namespace sse {
         const std::string SophosImpl::pairs_map_file = "pairs.dat";
 
 SophosImpl::SophosImpl(const std::string& path) :
-storage_path_(path), async_search_(true)
+storage_path_(path), async_search_(true), numa_placement_(false), consolidate_searches_(false)
 {
     if (is_directory(storage_path_)) {
         // try to initialize everything from this directory
@@ -65,6 +69,8 @@ storage_path_(path), async_search_(true)
         pk_buf << pk_in.rdbuf();
 
         server_.reset(new SophosServer(pairs_map_path, pk_buf.str()));
+        
+        init_search_planner();
     }else if (exists(storage_path_)){
         // there should be nothing else than a directory at path, but we found something  ...
         throw std::runtime_error(storage_path_ + ": not a directory");
@@ -110,6 +116,8 @@ grpc::Status SophosImpl::setup(grpc::ServerContext* context,
     try {
         logger::log(logger::INFO) << "Seting up with size " << message->setup_size() << std::endl;
         server_.reset(new SophosServer(pairs_map_path, message->setup_size(), message->public_key()));
+        server_->set_numa_placement(numa_placement_);
+        server_->set_search_consolidation(consolidate_searches_);
     } catch (std::exception &e) {
         logger::log(logger::ERROR) << "Error when setting up the server's core" << std::endl;
         
@@ -131,6 +139,8 @@ grpc::Status SophosImpl::setup(grpc::ServerContext* context,
     pk_out << message->public_key();
     pk_out.close();
 
+    init_search_planner();
+
     logger::log(logger::TRACE) << "Successful setup" << std::endl;
 
     return grpc::Status::OK;
@@ -167,20 +177,95 @@ std::to_string((t)) )
 
 
 
-grpc::Status SophosImpl::search(grpc::ServerContext* context,
-                                const sophos::SearchRequestMessage* mes,
-                                grpc::ServerWriter<sophos::SearchReply>* writer)
+// Cancellation of the search of a call: when the client is gone or after the
+// deadline of the call. The client is only polled if poll_context is true:
+// the asynchronous calls cancel it themselves, when their done notification
+// (see ServerContext::AsyncNotifyWhenDone) reports that they were cancelled.
+static std::shared_ptr<SearchCancellation> rpc_cancellation(grpc::ServerContext* context, bool poll_context = true)
 {
-    if(async_search_){
-        return async_search(context, mes, writer);
-    }else{
-        return sync_search(context, mes, writer);
+    typedef SearchCancellation::clock_type clock_type;
+    
+    clock_type::time_point deadline = clock_type::time_point::max();
+    auto remaining = context->deadline() - std::chrono::system_clock::now();
+    
+    // calls without deadline have an infinite one
+    if (remaining < std::chrono::hours(24*365)) {
+        deadline = clock_type::now() + std::chrono::duration_cast<clock_type::duration>(remaining);
     }
+    
+    std::function<bool()> probe;
+    if (poll_context) {
+        probe = [context](){ return context->IsCancelled(); };
+    }
+    return std::make_shared<SearchCancellation>(probe, deadline);
 }
 
-grpc::Status SophosImpl::sync_search(grpc::ServerContext* context,
-                                     const sophos::SearchRequestMessage* mes,
-                                     grpc::ServerWriter<sophos::SearchReply>* writer)
+static grpc::Status cancelled_status(const SearchCancellation& cancellation)
+{
+    if (cancellation.deadline_exceeded()) {
+        return grpc::Status(grpc::DEADLINE_EXCEEDED, "Search deadline exceeded");
+    }
+    return grpc::Status(grpc::CANCELLED, "Search cancelled");
+}
+
+// status of a search that was not admitted by the scheduler
+static grpc::Status admission_failure_status(const SearchCancellation& cancellation)
+{
+    if (cancellation.cancelled()) {
+        return cancelled_status(cancellation);
+    }
+    return grpc::Status(grpc::RESOURCE_EXHAUSTED, "Too many searches in progress");
+}
+
+template <class Writer>
+bool SophosImpl::follow_search(const sophos::SearchRequestMessage* mes,
+                               const SearchRequest& req,
+                               Writer* writer,
+                               SearchFlights::Seat& seat,
+                               grpc::Status& status)
+{
+    logger::log(logger::TRACE) << " coalesced ...";
+    
+    SearchReplyWriter<Writer> reply_writer(writer, mes->batched_results(), req.bounded() ? 0 : encoding_set(mes->result_encodings()), &flush_timer_);
+    
+    auto post_callback = [&reply_writer, &req](index_type i)
+    {
+        reply_writer.write((uint64_t) i);
+        
+        if (!reply_writer.ok()) {
+            // the stream is broken: leave the flight
+            req.cancellation->cancel();
+        }
+    };
+    
+    bool complete = seat.follow(post_callback);
+    reply_writer.close();
+    
+    if (req.cancelled()) {
+        logger::log(logger::TRACE) << " cancelled" << std::endl;
+        status = cancelled_status(*req.cancellation);
+        return true;
+    }
+    if (!complete) {
+        if (reply_writer.result_count() == 0) {
+            return false;
+        }
+        logger::log(logger::TRACE) << " interrupted" << std::endl;
+        status = grpc::Status(grpc::ABORTED, "The coalesced search was interrupted");
+        return true;
+    }
+    
+    logger::log(logger::TRACE) << " done" << std::endl;
+    
+    status = grpc::Status::OK;
+    return true;
+}
+
+template <class Writer>
+grpc::Status SophosImpl::collect_search(grpc::ServerContext* context,
+                                        const sophos::SearchRequestMessage* mes,
+                                        Writer* writer,
+                                        std::shared_ptr<SearchCancellation> cancellation)
 {
     if (!server_) {
         // problem, the server is already set up
@@ -188,44 +273,129 @@ grpc::Status SophosImpl::sync_search(grpc::ServerContext* context,
     }
 
     logger::log(logger::TRACE) << "Searching ...";
-    std::list<uint64_t> res_list;
     
-    // the choice of the best function for parallel searches is far from being trivial.
-    // it both depends on the number of matches and on the size of the database
+    SearchRequest req = message_to_request(mes);
+    req.cancellation = cancellation;
     
+    // identical searches running at the same time share the walk of the
+    // first one
+    SearchFlights::Seat seat = flights_.join(req);
+    while (!seat.leader()) {
+        grpc::Status status;
+        if (follow_search(mes, req, writer, seat, status)) {
+            return status;
+        }
+        seat = flights_.join(req);
+    }
+    // the walk goes on while any search of the flight is not cancelled
+    req.cancellation = seat.walk_cancellation();
     
-//    BENCHMARK_Q((res_list = server_->search_parallel_light(message_to_request(mes),std::thread::hardware_concurrency())),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC)
-
-    if (mes->add_count() <= 10) {
-        BENCHMARK_Q((res_list = server_->search_parallel_light(message_to_request(mes),std::thread::hardware_concurrency())),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC)
-    }else if (mes->add_count() < 1000){
-//            BENCHMARK_Q((res_list = server_->search(message_to_request(mes))),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC)
-//        BENCHMARK_Q((res_list = server_->search_parallel_light(message_to_request(mes),std::thread::hardware_concurrency())),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC)
-        BENCHMARK_Q((res_list = server_->search_parallel(message_to_request(mes),2)),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC);
-
-    }else if (mes->add_count() >= 1e3 && mes->add_count() < 1e5){
-        BENCHMARK_Q((res_list = server_->search_parallel(message_to_request(mes),2)),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC);
-    }else if (mes->add_count() >= 1e5){
-        BENCHMARK_Q((res_list = server_->search_parallel_light(message_to_request(mes),std::thread::hardware_concurrency())),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC)
-    }else{
-//            BENCHMARK_Q((res_list = server_->search_parallel_light(message_to_request(mes),std::thread::hardware_concurrency())),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC)
-
-                BENCHMARK_Q((res_list = server_->search_parallel(message_to_request(mes),2)),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC)
-
-        //    BENCHMARK_Q((res_list = server_->search(message_to_request(mes))),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC)
-        //    BENCHMARK_Q((res_list = server_->search_parallel(message_to_request(mes))),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC)
-        //    BENCHMARK_Q((res_list = server_->search_parallel_light(message_to_request(mes),1)),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC)
-        //    BENCHMARK_SIMPLE("\n\n",{;})
+    // the entries covered by the search cache or by a consolidated record are
+    // not walked: the search is scheduled and planned on the others
+    const uint32_t walk_count = server_->search_walk_count(req);
+    
+    SearchScheduler::Ticket ticket = scheduler_.admit(req, walk_count);
+    if (!ticket.admitted()) {
+        logger::log(logger::TRACE) << " rejected" << std::endl;
+        return admission_failure_status(*cancellation);
+    }
+    
+    return collect_admitted(mes, writer, req, seat, ticket, walk_count, cancellation);
+}
 
+template <class Writer>
+grpc::Status SophosImpl::collect_admitted(const sophos::SearchRequestMessage* mes,
+                                          Writer* writer,
+                                          const SearchRequest& req,
+                                          SearchFlights::Seat& seat,
+                                          SearchScheduler::Ticket& ticket,
+                                          uint32_t walk_count,
+                                          const std::shared_ptr<SearchCancellation>& cancellation)
+{
+    search_results_type res_list;
+    
+    // the choice of the best function for parallel searches is far from being trivial.
+    // it both depends on the number of matches and on the size of the database:
+    // let the planner decide from the measured costs.
+    SearchPlan plan = req.bounded() ? planner_.plan_bounded(walk_count) : planner_.plan(walk_count, false, ticket.workers(), req.checkpoint_segment_count(walk_count) - 1);
+    ticket.shrink(plan.worker_count());
+    
+    if (logger::severity() <= logger::DBG) {
+        logger::log(logger::DBG) << "Search plan: " << plan << std::endl;
     }
     
-    for (auto& i : res_list) {
-        sophos::SearchReply reply;
-        reply.set_result((uint64_t) i);
-        
-        writer->Write(reply);
+    switch (plan.engine) {
+        case SearchPlan::SEQUENTIAL:
+            BENCHMARK_Q((res_list = server_->search(req)),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC)
+            break;
+            
+        case SearchPlan::PARALLEL_LIGHT:
+            BENCHMARK_Q((res_list = server_->search_parallel_light(req,plan.rsa_threads)),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC)
+            break;
+            
+        case SearchPlan::PIPELINE:
+        {
+            std::mutex res_mutex;
+            
+            auto collect_callback = [&res_list, &res_mutex](index_type i)
+            {
+                std::lock_guard<std::mutex> lock(res_mutex);
+                res_list.push_back(i);
+            };
+            
+            BENCHMARK_Q((server_->search_parallel_callback(req, collect_callback, plan.rsa_threads, plan.access_threads, plan.post_threads)),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC)
+            break;
+        }
+            
+        case SearchPlan::RING_PIPELINE:
+            BENCHMARK_Q((res_list = server_->search_pipeline(req, plan.access_threads)),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC)
+            break;
+            
+        case SearchPlan::READ_POOL:
+            BENCHMARK_Q((res_list = server_->search_read_pool(req, plan.access_threads, plan.read_threads)),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC)
+            break;
+            
+        case SearchPlan::CHECKPOINTS:
+            BENCHMARK_Q((res_list = server_->search_checkpoints(req, plan.rsa_threads)),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC)
+            break;
+            
+        case SearchPlan::BOUNDED:
+            BENCHMARK_Q((res_list = server_->search_bounded(req)),res_list.size(), PRINT_BENCH_SEARCH_PAR_NORPC)
+            break;
+    }
+    
+    if (req.cancelled()) {
+        logger::log(logger::TRACE) << " cancelled" << std::endl;
+        return cancelled_status(*cancellation);
     }
     
+    res_list.for_each_chunk([&seat](const index_type* results, size_t count)
+                            {
+                                seat.publish(results, count);
+                            });
+    seat.complete(true);
+    
+    if (cancellation->cancelled()) {
+        logger::log(logger::TRACE) << " cancelled" << std::endl;
+        return cancelled_status(*cancellation);
+    }
+    
+    // all the results are known: no need for a latency bound. The encodings
+    // do not keep the order of the results of bounded searches.
+    SearchReplyWriter<Writer> reply_writer(writer, mes->batched_results(), req.bounded() ? 0 : encoding_set(mes->result_encodings()), nullptr,
+                                           SearchReplyWriter<Writer>::kDefaultMaxCount, SearchReplyWriter<Writer>::kDefaultMaxBytes,
+                                           std::chrono::microseconds(0));
+    
+    res_list.for_each_chunk([&reply_writer](const index_type* results, size_t count)
+                            {
+                                for (size_t i = 0; i < count; i++) {
+                                    reply_writer.write((uint64_t) results[i]);
+                                }
+                            });
+    reply_writer.close();
+    
+    planner_.record_rpc_writes(res_list.size(), reply_writer.write_time());
+    
     logger::log(logger::TRACE) << " done" << std::endl;
     
     
@@ -233,9 +403,11 @@ grpc::Status SophosImpl::sync_search(grpc::ServerContext* context,
 }
 
 
-grpc::Status SophosImpl::async_search(grpc::ServerContext* context,
-                                      const sophos::SearchRequestMessage* mes,
-                                      grpc::ServerWriter<sophos::SearchReply>* writer)
+template <class Writer>
+grpc::Status SophosImpl::stream_search(grpc::ServerContext* context,
+                                       const sophos::SearchRequestMessage* mes,
+                                       Writer* writer,
+                                       std::shared_ptr<SearchCancellation> cancellation)
 {
     if (!server_) {
         // problem, the server is already set up
@@ -244,54 +416,253 @@ grpc::Status SophosImpl::async_search(grpc::ServerContext* context,
     
     logger::log(logger::TRACE) << "Searching ...";
 
-    std::atomic_uint res_size(0);
+    SearchRequest req = message_to_request(mes);
+    req.cancellation = cancellation;
     
-    std::mutex writer_lock;
+    // identical searches running at the same time share the walk of the
+    // first one
+    SearchFlights::Seat seat = flights_.join(req);
+    while (!seat.leader()) {
+        grpc::Status status;
+        if (follow_search(mes, req, writer, seat, status)) {
+            return status;
+        }
+        seat = flights_.join(req);
+    }
+    // the walk goes on while any search of the flight is not cancelled
+    req.cancellation = seat.walk_cancellation();
+    
+    // the entries covered by the search cache or by a consolidated record are
+    // not walked: the search is scheduled and planned on the others
+    const uint32_t walk_count = server_->search_walk_count(req);
+    
+    SearchScheduler::Ticket ticket = scheduler_.admit(req, walk_count);
+    if (!ticket.admitted()) {
+        logger::log(logger::TRACE) << " rejected" << std::endl;
+        return admission_failure_status(*cancellation);
+    }
     
-    auto post_callback = [&writer, &res_size, &writer_lock](index_type i)
+    return stream_admitted(mes, writer, req, seat, ticket, walk_count, cancellation);
+}
+
+template <class Writer>
+grpc::Status SophosImpl::stream_admitted(const sophos::SearchRequestMessage* mes,
+                                         Writer* writer,
+                                         const SearchRequest& req,
+                                         SearchFlights::Seat& seat,
+                                         SearchScheduler::Ticket& ticket,
+                                         uint32_t walk_count,
+                                         const std::shared_ptr<SearchCancellation>& cancellation)
+{
+    // the results are coalesced in batches (and compressed, unless they are
+    // ordered) if the client accepts them
+    SearchReplyWriter<Writer> reply_writer(writer, mes->batched_results(), req.bounded() ? 0 : encoding_set(mes->result_encodings()), &flush_timer_);
+    
+    auto post_callback = [&reply_writer, &cancellation, &seat](index_type i)
     {
-        sophos::SearchReply reply;
-        reply.set_result((uint64_t) i);
+        seat.publish(i);
+        reply_writer.write((uint64_t) i);
         
-        writer_lock.lock();
-        writer->Write(reply);
-        writer_lock.unlock();
-
-        res_size++;
+        if (!reply_writer.ok()) {
+            // the stream is broken: stop the search (unless other searches
+            // follow it)
+            cancellation->cancel();
+        }
     };
 
-    if (mes->add_count() >= 40) { // run the search algorithm in parallel only if there are more than 2 results
-        BENCHMARK_Q((server_->search_parallel_callback(message_to_request(mes), post_callback, std::thread::hardware_concurrency(), 8,1)),res_size, PRINT_BENCH_SEARCH_PAR_RPC)
-//        BENCHMARK_Q((server_->search_parallel_light_callback(message_to_request(mes), post_callback, std::thread::hardware_concurrency())),res_size, PRINT_BENCH_SEARCH_PAR_RPC)
-//        BENCHMARK_Q((server_->search_parallel_light_callback(message_to_request(mes), post_callback, 10)),res_size, PRINT_BENCH_SEARCH_PAR_RPC)
-    }else if (mes->add_count() >= 2) {
-        
-        auto block = [this, &writer, &res_size](const sophos::SearchRequestMessage* m)
-        {
-            std::list<uint64_t> res_list;
-            res_list = server_->search_parallel_light(message_to_request(m),std::thread::hardware_concurrency());
-            for (auto& i : res_list) {
-                sophos::SearchReply reply;
-                reply.set_result((uint64_t) i);
-                
-                writer->Write(reply);
-            }
-        };
-        BENCHMARK_Q(block(mes),mes->add_count(), PRINT_BENCH_SEARCH_PAR_RPC)
-
+    SearchPlan plan = req.bounded() ? planner_.plan_bounded(walk_count) : planner_.plan(walk_count, true, ticket.workers(), req.checkpoint_segment_count(walk_count) - 1);
+    ticket.shrink(plan.worker_count());
+    
+    if (logger::severity() <= logger::DBG) {
+        logger::log(logger::DBG) << "Search plan: " << plan << std::endl;
+    }
 
-//                BENCHMARK_Q((server_->search_parallel_light_callback(message_to_request(mes), post_callback, std::thread::hardware_concurrency())),res_size, PRINT_BENCH_SEARCH_PAR_RPC)
-    }else{
-        BENCHMARK_Q((server_->search_callback(message_to_request(mes), post_callback)),res_size, PRINT_BENCH_SEARCH_PAR_RPC)
+    switch (plan.engine) {
+        case SearchPlan::SEQUENTIAL:
+            BENCHMARK_Q((server_->search_callback(req, post_callback)),reply_writer.result_count(), PRINT_BENCH_SEARCH_PAR_RPC)
+            break;
+            
+        case SearchPlan::PARALLEL_LIGHT:
+            BENCHMARK_Q((server_->search_parallel_light_callback(req, post_callback, plan.rsa_threads)),reply_writer.result_count(), PRINT_BENCH_SEARCH_PAR_RPC)
+            break;
+            
+        case SearchPlan::PIPELINE:
+            BENCHMARK_Q((server_->search_parallel_callback(req, post_callback, plan.rsa_threads, plan.access_threads, plan.post_threads)),reply_writer.result_count(), PRINT_BENCH_SEARCH_PAR_RPC)
+            break;
+            
+        case SearchPlan::RING_PIPELINE:
+            BENCHMARK_Q((server_->search_pipeline_callback(req, post_callback, plan.access_threads)),reply_writer.result_count(), PRINT_BENCH_SEARCH_PAR_RPC)
+            break;
+            
+        case SearchPlan::READ_POOL:
+            BENCHMARK_Q((server_->search_read_pool_callback(req, post_callback, plan.access_threads, plan.read_threads)),reply_writer.result_count(), PRINT_BENCH_SEARCH_PAR_RPC)
+            break;
+            
+        case SearchPlan::CHECKPOINTS:
+            BENCHMARK_Q((server_->search_checkpoints_callback(req, post_callback, plan.rsa_threads)),reply_writer.result_count(), PRINT_BENCH_SEARCH_PAR_RPC)
+            break;
+            
+        case SearchPlan::BOUNDED:
+            BENCHMARK_Q((server_->search_bounded_callback(req, post_callback)),reply_writer.result_count(), PRINT_BENCH_SEARCH_PAR_RPC)
+            break;
+    }
+    
+    // the followers do not wait for the last writes
+    seat.complete(!req.cancelled());
+    reply_writer.close();
+    
+    if (cancellation->cancelled()) {
+        logger::log(logger::TRACE) << " cancelled" << std::endl;
+        return cancelled_status(*cancellation);
     }
     
+    planner_.record_rpc_writes(reply_writer.result_count(), reply_writer.write_time());
     
     logger::log(logger::TRACE) << " done" << std::endl;
     
     
     return grpc::Status::OK;
 }
-        
+
+grpc::Status SophosImpl::sync_search(grpc::ServerContext* context,
+                                     const sophos::SearchRequestMessage* mes,
+                                     grpc::ServerWriter<sophos::SearchReply>* writer)
+{
+    return collect_search(context, mes, writer, rpc_cancellation(context));
+}
+
+grpc::Status SophosImpl::async_search(grpc::ServerContext* context,
+                                      const sophos::SearchRequestMessage* mes,
+                                      grpc::ServerWriter<sophos::SearchReply>* writer)
+{
+    return stream_search(context, mes, writer, rpc_cancellation(context));
+}
+
+grpc::Status SophosImpl::search(grpc::ServerContext* context,
+                                const sophos::SearchRequestMessage* mes,
+                                grpc::ServerWriter<sophos::SearchReply>* writer)
+{
+    if(async_search_){
+        return async_search(context, mes, writer);
+    }else{
+        return sync_search(context, mes, writer);
+    }
+}
+
+bool SophosImpl::token_lookup(const sophos::TokenSearchMessage& mes,
+                              result_encoding_set encodings,
+                              sophos::SearchReply& reply,
+                              grpc::Status& status) const
+{
+    if (mes.masks_size() != 0 && mes.masks_size() != mes.update_tokens_size()) {
+        status = grpc::Status(grpc::INVALID_ARGUMENT, "The masks do not match the update tokens");
+        return false;
+    }
+
+    std::vector<update_token_type> tokens(mes.update_tokens_size());
+
+    for (int i = 0; i < mes.update_tokens_size(); i++) {
+        const std::string& ut = mes.update_tokens(i);
+
+        if (ut.size() != kUpdateTokenSize) {
+            status = grpc::Status(grpc::INVALID_ARGUMENT, "Invalid update token");
+            return false;
+        }
+        std::copy(ut.begin(), ut.end(), tokens[i].begin());
+    }
+
+    std::vector<index_type> values;
+    std::vector<bool> found;
+    std::vector<index_type> record;
+    std::vector<uint64_t> results;
+
+    bool covered = server_->lookup_tokens(tokens, values, found, record);
+
+    // in the chain order: the entries found in the EDB are newer than the
+    // consolidated ones
+    if (mes.masks_size() > 0) {
+        for (size_t i = 0; i < values.size(); i++) {
+            if (found[i]) {
+                results.push_back(values[i] ^ mes.masks(static_cast<int>(i)));
+            }
+        }
+        results.insert(results.end(), record.begin(), record.end());
+    }else{
+        // the client unmasks the indices itself
+        reply.mutable_masked_results()->Reserve(static_cast<int>(values.size()));
+        for (size_t i = 0; i < values.size(); i++) {
+            reply.add_masked_results(found[i] ? values[i] : 0);
+            if (!found[i]) {
+                reply.add_missing(static_cast<uint32_t>(i));
+            }
+        }
+        results = std::move(record);
+    }
+
+    if (!results.empty()) {
+        std::string encoded;
+        ResultEncoding encoding = encode_results(results, encodings, encoded);
+
+        if (encoding != RAW_RESULTS) {
+            reply.set_encoding(encoding);
+            reply.set_encoded_results(std::move(encoded));
+        }else{
+            reply.mutable_results()->Reserve(static_cast<int>(results.size()));
+            for (uint64_t r : results) {
+                reply.add_results(r);
+            }
+        }
+    }
+
+    return !covered;
+}
+
+grpc::Status SophosImpl::token_search(grpc::ServerContext* context,
+                                      grpc::ServerReaderWriter<sophos::SearchReply, sophos::TokenSearchMessage>* stream)
+{
+    if (!server_) {
+        return grpc::Status(grpc::FAILED_PRECONDITION, "The server is not set up");
+    }
+
+    logger::log(logger::TRACE) << "Token search ...";
+
+    sophos::TokenSearchMessage mes;
+    result_encoding_set encodings = 0;
+    bool first = true;
+    grpc::Status status;
+    
+    // registered with the first message
+    std::unique_ptr<SophosServer::ActiveSearch> active;
+
+    while (stream->Read(&mes)) {
+        if (first) {
+            encodings = encoding_set(mes.result_encodings());
+            active.reset(new SophosServer::ActiveSearch(*server_, mes.keyword_handle()));
+            first = false;
+        }
+
+        sophos::SearchReply reply;
+        bool more = token_lookup(mes, encodings, reply, status);
+
+        if (!status.ok()) {
+            logger::log(logger::TRACE) << " invalid message" << std::endl;
+            return status;
+        }
+        if (!stream->Write(reply)) {
+            // the client is gone
+            logger::log(logger::TRACE) << " cancelled" << std::endl;
+            return grpc::Status(grpc::CANCELLED, "Search cancelled");
+        }
+        if (!more) {
+            // the rest of the chain is consolidated
+            break;
+        }
+    }
+
+    logger::log(logger::TRACE) << " done" << std::endl;
+
+    return grpc::Status::OK;
+}
 
 grpc::Status SophosImpl::update(grpc::ServerContext* context,
                     const sophos::UpdateRequestMessage* mes,
@@ -338,12 +709,41 @@ grpc::Status SophosImpl::update(grpc::ServerContext* context,
 
 std::ostream& SophosImpl::print_stats(std::ostream& out) const
 {
+    scheduler_.print_stats(out);
+    flights_.print_stats(out);
     if (server_) {
-        return server_->print_stats(out);
+        server_->print_stats(out);
     }
     return out;
 }
 
+void SophosImpl::init_search_planner()
+{
+    std::string profile_path = storage_path_ + "/" + SearchPlanner::kProfileFile;
+    SearchCostProfile profile;
+    
+    if (profile.load(profile_path)) {
+        logger::log(logger::INFO) << "Loaded search profile from " << profile_path << std::endl;
+        planner_.set_profile(profile);
+    }else{
+        logger::log(logger::INFO) << "Calibrating search planner ..." << std::endl;
+        planner_.calibrate(*server_);
+    }
+}
+
+bool SophosImpl::autotune_search_planner()
+{
+    if (!server_) {
+        logger::log(logger::ERROR) << "Unable to tune the search planner: the server is not set up" << std::endl;
+        return false;
+    }
+    
+    logger::log(logger::INFO) << "Tuning search planner (" << planner_.core_count() << " cores) ..." << std::endl;
+    planner_.autotune(*server_);
+    
+    return planner_.profile().save(storage_path_ + "/" + SearchPlanner::kProfileFile);
+}
+
 bool SophosImpl::search_asynchronously() const
 {
     return async_search_;
@@ -353,6 +753,42 @@ void SophosImpl::set_search_asynchronously(bool flag)
 {
     async_search_ = flag;
 }
+
+bool SophosImpl::numa_placement() const
+{
+    return numa_placement_;
+}
+
+void SophosImpl::set_numa_placement(bool flag)
+{
+    numa_placement_ = flag;
+    if (server_) {
+        server_->set_numa_placement(flag);
+    }
+}
+
+bool SophosImpl::search_consolidation() const
+{
+    return consolidate_searches_;
+}
+
+void SophosImpl::set_search_consolidation(bool flag)
+{
+    consolidate_searches_ = flag;
+    if (server_) {
+        server_->set_search_consolidation(flag);
+    }
+}
+
+SearchScheduler& SophosImpl::search_scheduler()
+{
+    return scheduler_;
+}
+
+SearchFlights& SophosImpl::search_flights()
+{
+    return flights_;
+}
         
 SearchRequest message_to_request(const SearchRequestMessage* mes)
 {
@@ -361,6 +797,19 @@ SearchRequest message_to_request(const SearchRequestMessage* mes)
     req.add_count = mes->add_count();
     req.derivation_key = mes->derivation_key();
     std::copy(mes->search_token().begin(), mes->search_token().end(), req.token.begin());
+    
+    // ignore malformed checkpoints
+    if (mes->checkpoint_stride() > 0) {
+        for (const std::string& cp : mes->checkpoints()) {
+            if (cp.size() != kSearchTokenSize || req.checkpoints.size() == kMaxCheckpointCount) {
+                break;
+            }
+            req.checkpoints.push_back(search_token_type());
+            std::copy(cp.begin(), cp.end(), req.checkpoints.back().begin());
+        }
+        req.checkpoint_stride = mes->checkpoint_stride();
+    }
+    req.limit = mes->limit();
 
     return req;
 }
@@ -375,13 +824,749 @@ UpdateRequest message_to_request(const UpdateRequestMessage* mes)
     return req;
 }
        
-void run_sophos_server(const std::string &address, const std::string& server_db_path, grpc::Server **server_ptr, bool async_search) {
+// Completion queue tag: an event of a call
+struct SophosAsyncService::Tag
+{
+    Call* call;
+    int event;
+    
+    void proceed(bool ok);
+};
+
+class SophosAsyncService::Call {
+public:
+    virtual ~Call() {}
+    virtual void proceed(int event, bool ok) = 0;
+};
+
+void SophosAsyncService::Tag::proceed(bool ok)
+{
+    call->proceed(event, ok);
+}
+
+// A search call. The completion queue thread joins the flight of the search
+// and, if it leads it, queues it in the scheduler without waiting (see
+// start()): the search is posted to the search pool once it is admitted, so
+// that the waiting searches hold no thread. It writes its replies through
+// Write(), which queues them. They are sent one at a time by the completion
+// queue thread.
+// The search is cancelled as soon as the client is gone: the call is notified
+// when it is done, which happens before it is finished if it was cancelled.
+// The call is deleted once it is both finished and notified.
+class SophosAsyncService::SearchCall : public Call {
+public:
+    // maximum number of replies waiting to be sent before Write() blocks
+    static constexpr size_t kMaxPendingReplies = 64;
+    
+    SearchCall(SophosAsyncService& service, grpc::ServerCompletionQueue* cq) :
+    service_(service), cq_(cq), stream_(&context_),
+    request_tag_{this, kRequest}, write_tag_{this, kWrite}, finish_tag_{this, kFinish}, notify_tag_{this, kNotify},
+    writing_(false), broken_(false), done_(false), finished_(false), notified_(false), walk_count_(0)
+    {
+        // must be registered before the call is requested
+        context_.AsyncNotifyWhenDone(&notify_tag_);
+        service_.service_.Requestsearch(&context_, &request_, &stream_, cq_, cq_, &request_tag_);
+    }
+    
+    // called by the search (see SophosImpl::stream_search)
+    bool Write(const sophos::SearchReply& reply)
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        
+        space_cv_.wait(lock, [this]{ return broken_ || outgoing_.size() < kMaxPendingReplies; });
+        if (broken_) {
+            return false;
+        }
+        outgoing_.push_back(reply);
+        if (!writing_) {
+            start_write();
+        }
+        return true;
+    }
+    
+    void proceed(int event, bool ok) override
+    {
+        switch (event) {
+            case kRequest:
+                if (!ok) {
+                    // the server is shutting down, and the call did not
+                    // start: it will not be notified
+                    delete this;
+                    return;
+                }
+                
+                cancellation_ = rpc_cancellation(&context_, false);
+                
+                if (service_.stopping_) {
+                    std::unique_lock<std::mutex> lock(mtx_);
+                    release(lock);
+                    return;
+                }
+                // wait for the next search
+                new SearchCall(service_, cq_);
+                
+                req_ = message_to_request(&request_);
+                req_.cancellation = cancellation_;
+                start();
+                break;
+                
+            case kWrite:
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                
+                outgoing_.pop_front();
+                writing_ = false;
+                if (!ok) {
+                    // the client is gone: stop the search
+                    broken_ = true;
+                    outgoing_.clear();
+                    cancellation_->cancel();
+                }
+                space_cv_.notify_all();
+                
+                if (service_.stopping_) {
+                    // no operation can be started anymore, and the search is
+                    // over (see stop())
+                    release(lock);
+                    return;
+                }
+                
+                if (!outgoing_.empty()) {
+                    start_write();
+                }else if (done_) {
+                    finish();
+                }
+                break;
+            }
+                
+            case kFinish:
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                release(lock);
+                break;
+            }
+                
+            case kNotify:
+            {
+                if (context_.IsCancelled() && cancellation_) {
+                    // the client is gone, or the deadline passed: the search
+                    // (or the one it follows) might be waiting for its
+                    // admission
+                    cancellation_->cancel();
+                    service_.impl_.scheduler_.drop_cancelled();
+                }
+                
+                std::unique_lock<std::mutex> lock(mtx_);
+                notified_ = true;
+                if (finished_) {
+                    lock.unlock();
+                    delete this;
+                }
+                break;
+            }
+        }
+    }
+    
+private:
+    enum { kRequest, kWrite, kFinish, kNotify };
+    
+    // The call is over (no operation is pending anymore, but the
+    // notification): deletes it if it was notified. lock holds mtx_.
+    void release(std::unique_lock<std::mutex>& lock)
+    {
+        finished_ = true;
+        if (notified_) {
+            lock.unlock();
+            delete this;
+        }
+    }
+    
+    // Joins the flight of the search and, if it leads it, queues it in the
+    // scheduler: run() is posted once it is admitted (or rejected). A
+    // follower is posted right away. Never waits: runs on the completion
+    // queue thread, or on the search pool when a follower joins again.
+    void start()
+    {
+        SophosImpl& impl = service_.impl_;
+        
+        try {
+            if (impl.server_) {
+                seat_ = impl.flights_.join(req_);
+                
+                if (seat_.leader()) {
+                    // the walk goes on while any search of the flight is not
+                    // cancelled
+                    req_.cancellation = seat_.walk_cancellation();
+                    walk_count_ = impl.server_->search_walk_count(req_);
+                    
+                    impl.scheduler_.admit(walk_count_, req_.cancellation, [this](SearchScheduler::Ticket&& ticket)
+                                          {
+                                              ticket_ = std::move(ticket);
+                                              post_run();
+                                          });
+                    return;
+                }
+            }
+        } catch (std::exception& e) {
+            logger::log(logger::ERROR) << "Search failed: " << e.what() << std::endl;
+            seat_ = SearchFlights::Seat();
+            done(grpc::Status(grpc::INTERNAL, e.what()));
+            return;
+        }
+        post_run();
+    }
+    
+    void post_run()
+    {
+        try {
+            service_.search_pool_.post([this](){ run(); });
+        } catch (std::exception& e) {
+            ticket_.release();
+            seat_ = SearchFlights::Seat();
+            done(grpc::Status(grpc::UNAVAILABLE, "The server is shutting down"));
+        }
+    }
+    
+    void run()
+    {
+        SophosImpl& impl = service_.impl_;
+        
+        grpc::Status status;
+        try {
+            if (!impl.server_) {
+                status = grpc::Status(grpc::FAILED_PRECONDITION, "The server is not set up");
+            }else if (!seat_.leader()) {
+                if (!impl.follow_search(&request_, req_, this, seat_, status)) {
+                    // the flight ended before publishing anything
+                    start();
+                    return;
+                }
+            }else if (!ticket_.admitted()) {
+                logger::log(logger::TRACE) << "Search rejected" << std::endl;
+                status = admission_failure_status(*cancellation_);
+            }else if (impl.search_asynchronously()) {
+                status = impl.stream_admitted(&request_, this, req_, seat_, ticket_, walk_count_, cancellation_);
+            }else{
+                status = impl.collect_admitted(&request_, this, req_, seat_, ticket_, walk_count_, cancellation_);
+            }
+        } catch (std::exception& e) {
+            logger::log(logger::ERROR) << "Search failed: " << e.what() << std::endl;
+            status = grpc::Status(grpc::INTERNAL, e.what());
+        }
+        
+        ticket_.release();
+        seat_ = SearchFlights::Seat();
+        done(status);
+    }
+    
+    // the search is over: finishes the call once its replies are sent
+    void done(const grpc::Status& status)
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        status_ = status;
+        done_ = true;
+        if (writing_) {
+            // finished once the last reply is sent
+            return;
+        }
+        if (service_.stopping_) {
+            // no operation can be started anymore (see stop()): the search
+            // was not run
+            release(lock);
+        }else{
+            finish();
+        }
+    }
+    
+    // must be called with the lock held
+    void start_write()
+    {
+        writing_ = true;
+        stream_.Write(outgoing_.front(), &write_tag_);
+    }
+    
+    // must be called with the lock held, once all the replies are sent
+    void finish()
+    {
+        stream_.Finish(status_, &finish_tag_);
+    }
+    
+    SophosAsyncService& service_;
+    grpc::ServerCompletionQueue* cq_;
+    
+    grpc::ServerContext context_;
+    sophos::SearchRequestMessage request_;
+    grpc::ServerAsyncWriter<sophos::SearchReply> stream_;
+    
+    Tag request_tag_;
+    Tag write_tag_;
+    Tag finish_tag_;
+    Tag notify_tag_;
+    
+    std::mutex mtx_;
+    std::condition_variable space_cv_;
+    std::deque<sophos::SearchReply> outgoing_;
+    bool writing_;
+    bool broken_;
+    bool done_;
+    // no operation is pending, but the notification
+    bool finished_;
+    // the done notification was received
+    bool notified_;
+    grpc::Status status_;
+    std::shared_ptr<SearchCancellation> cancellation_;
+    
+    // set by the completion queue thread before the search is posted
+    SearchRequest req_;
+    SearchFlights::Seat seat_;
+    uint32_t walk_count_;
+    SearchScheduler::Ticket ticket_;
+};
+
+constexpr size_t SophosAsyncService::SearchCall::kMaxPendingReplies;
+
+// A token search call. The messages are read one at a time by the completion
+// queue thread and looked up on the search pool, which queues the reply and
+// reads the next message: a message is read and looked up while the previous
+// replies are sent.
+class SophosAsyncService::TokenSearchCall : public Call {
+public:
+    // number of replies waiting to be sent above which the next message is
+    // only read once one of them is sent
+    static constexpr size_t kMaxPendingReplies = 8;
+
+    TokenSearchCall(SophosAsyncService& service, grpc::ServerCompletionQueue* cq) :
+    service_(service), cq_(cq), stream_(&context_),
+    request_tag_{this, kRequest}, read_tag_{this, kRead}, write_tag_{this, kWrite}, finish_tag_{this, kFinish},
+    encodings_(0), first_(true), reading_(false), read_deferred_(false), looking_up_(false), writing_(false),
+    reads_done_(false), broken_(false), finishing_(false)
+    {
+        service_.service_.Requesttoken_search(&context_, &stream_, cq_, cq_, &request_tag_);
+    }
+
+    void proceed(int event, bool ok) override
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+
+        switch (event) {
+            case kRequest:
+                if (!ok || service_.stopping_) {
+                    // the server is shutting down
+                    lock.unlock();
+                    delete this;
+                    return;
+                }
+                // wait for the next search
+                new TokenSearchCall(service_, cq_);
+
+                if (!service_.impl_.server_) {
+                    status_ = grpc::Status(grpc::FAILED_PRECONDITION, "The server is not set up");
+                    reads_done_ = true;
+                    maybe_finish();
+                    break;
+                }
+                logger::log(logger::TRACE) << "Token search ..." << std::endl;
+                start_read();
+                break;
+
+            case kRead:
+                reading_ = false;
+
+                if (service_.stopping_) {
+                    // no operation can be started anymore (see stop())
+                    if (!writing_) {
+                        lock.unlock();
+                        delete this;
+                    }
+                    return;
+                }
+                if (!ok) {
+                    // the client is done (or gone)
+                    reads_done_ = true;
+                    maybe_finish();
+                    break;
+                }
+                if (first_) {
+                    encodings_ = encoding_set(mes_.result_encodings());
+                    active_.reset(new SophosServer::ActiveSearch(*service_.impl_.server_, mes_.keyword_handle()));
+                    first_ = false;
+                }
+
+                try {
+                    looking_up_ = true;
+                    service_.search_pool_.post([this](){ look_up(); });
+                } catch (std::exception& e) {
+                    looking_up_ = false;
+                    status_ = grpc::Status(grpc::UNAVAILABLE, "The server is shutting down");
+                    reads_done_ = true;
+                    maybe_finish();
+                }
+                break;
+
+            case kWrite:
+                outgoing_.pop_front();
+                writing_ = false;
+                if (!ok) {
+                    // the client is gone
+                    broken_ = true;
+                    outgoing_.clear();
+                }
+
+                if (service_.stopping_) {
+                    if (!reading_) {
+                        lock.unlock();
+                        delete this;
+                    }
+                    return;
+                }
+
+                if (!outgoing_.empty()) {
+                    start_write();
+                }
+                if (read_deferred_) {
+                    read_deferred_ = false;
+                    if (broken_) {
+                        reads_done_ = true;
+                    }else{
+                        start_read();
+                    }
+                }
+                maybe_finish();
+                break;
+
+            case kFinish:
+                lock.unlock();
+                delete this;
+                return;
+        }
+    }
+
+private:
+    enum { kRequest, kRead, kWrite, kFinish };
+
+    // runs on the search pool
+    void look_up()
+    {
+        sophos::SearchReply reply;
+        grpc::Status status;
+        bool more;
+
+        try {
+            more = service_.impl_.token_lookup(mes_, encodings_, reply, status);
+        } catch (std::exception& e) {
+            logger::log(logger::ERROR) << "Token search failed: " << e.what() << std::endl;
+            status = grpc::Status(grpc::INTERNAL, e.what());
+            more = false;
+        }
+
+        std::lock_guard<std::mutex> lock(mtx_);
+        looking_up_ = false;
+
+        if (!status.ok()) {
+            status_ = status;
+        }else if (!broken_) {
+            outgoing_.push_back(std::move(reply));
+            if (!writing_) {
+                start_write();
+            }
+        }
+
+        if (!status.ok() || broken_ || !more) {
+            reads_done_ = true;
+            maybe_finish();
+        }else if (outgoing_.size() >= kMaxPendingReplies) {
+            read_deferred_ = true;
+        }else{
+            start_read();
+        }
+    }
+
+    // must be called with the lock held
+    void start_read()
+    {
+        reading_ = true;
+        stream_.Read(&mes_, &read_tag_);
+    }
+
+    // must be called with the lock held
+    void start_write()
+    {
+        writing_ = true;
+        stream_.Write(outgoing_.front(), &write_tag_);
+    }
+
+    // must be called with the lock held: finishes the call once the client
+    // is done and all the replies are sent
+    void maybe_finish()
+    {
+        if (!reads_done_ || reading_ || looking_up_ || writing_ || finishing_) {
+            return;
+        }
+        finishing_ = true;
+        if (status_.ok()) {
+            logger::log(logger::TRACE) << "Token search ... done" << std::endl;
+        }
+        stream_.Finish(status_, &finish_tag_);
+    }
+
+    SophosAsyncService& service_;
+    grpc::ServerCompletionQueue* cq_;
+
+    grpc::ServerContext context_;
+    sophos::TokenSearchMessage mes_;
+    grpc::ServerAsyncReaderWriter<sophos::SearchReply, sophos::TokenSearchMessage> stream_;
+
+    Tag request_tag_;
+    Tag read_tag_;
+    Tag write_tag_;
+    Tag finish_tag_;
+
+    std::mutex mtx_;
+    std::deque<sophos::SearchReply> outgoing_;
+    result_encoding_set encodings_;
+    // the chain is not consolidated until the call is over
+    std::unique_ptr<SophosServer::ActiveSearch> active_;
+    bool first_;
+    bool reading_;
+    bool read_deferred_;
+    bool looking_up_;
+    bool writing_;
+    bool reads_done_;
+    bool broken_;
+    bool finishing_;
+    grpc::Status status_;
+};
+
+constexpr size_t SophosAsyncService::TokenSearchCall::kMaxPendingReplies;
+
+// Setup and update calls. They are processed on the search pool, which also
+// finishes them: the setup builds the server and calibrates the search
+// planner, and an update writes to the EDB, none of which should hold the
+// completion queue thread.
+template <class Request, class Responder>
+class SophosAsyncService::UnaryCall : public Call {
+public:
+    typedef void (sophos::Sophos::AsyncService::*request_method)(grpc::ServerContext*, Request*, Responder*, grpc::CompletionQueue*, grpc::ServerCompletionQueue*, void*);
+    typedef grpc::Status (SophosImpl::*handler_method)(grpc::ServerContext*, const Request*, google::protobuf::Empty*);
+    
+    UnaryCall(SophosAsyncService& service, grpc::ServerCompletionQueue* cq, request_method request, handler_method handler) :
+    service_(service), cq_(cq), request_method_(request), handler_(handler), responder_(&context_),
+    request_tag_{this, kRequest}, finish_tag_{this, kFinish}
+    {
+        (service_.service_.*request_method_)(&context_, &request_, &responder_, cq_, cq_, &request_tag_);
+    }
+    
+    void proceed(int event, bool ok) override
+    {
+        if (event == kFinish || !ok || service_.stopping_) {
+            delete this;
+            return;
+        }
+        
+        new UnaryCall(service_, cq_, request_method_, handler_);
+        
+        try {
+            service_.search_pool_.post([this](){ run(); });
+        } catch (std::exception& e) {
+            responder_.FinishWithError(grpc::Status(grpc::UNAVAILABLE, "The server is shutting down"), &finish_tag_);
+        }
+    }
+    
+private:
+    enum { kRequest, kFinish };
+    
+    void run()
+    {
+        google::protobuf::Empty e;
+        grpc::Status status;
+        try {
+            status = (service_.impl_.*handler_)(&context_, &request_, &e);
+        } catch (std::exception& ex) {
+            logger::log(logger::ERROR) << "Call failed: " << ex.what() << std::endl;
+            status = grpc::Status(grpc::INTERNAL, ex.what());
+        }
+        responder_.Finish(e, status, &finish_tag_);
+    }
+    
+    SophosAsyncService& service_;
+    grpc::ServerCompletionQueue* cq_;
+    request_method request_method_;
+    handler_method handler_;
+    
+    grpc::ServerContext context_;
+    Request request_;
+    Responder responder_;
+    
+    Tag request_tag_;
+    Tag finish_tag_;
+};
+
+// A bulk update call. The messages are read one at a time by the completion
+// queue thread and applied on the search pool, which reads the next message:
+// the updates are applied in order.
+class SophosAsyncService::BulkUpdateCall : public Call {
+public:
+    BulkUpdateCall(SophosAsyncService& service, grpc::ServerCompletionQueue* cq) :
+    service_(service), cq_(cq), reader_(&context_),
+    request_tag_{this, kRequest}, read_tag_{this, kRead}, finish_tag_{this, kFinish}
+    {
+        service_.service_.Requestbulk_update(&context_, &reader_, cq_, cq_, &request_tag_);
+    }
+    
+    void proceed(int event, bool ok) override
+    {
+        if (event == kFinish || service_.stopping_ || (event == kRequest && !ok)) {
+            delete this;
+            return;
+        }
+        
+        if (event == kRequest) {
+            new BulkUpdateCall(service_, cq_);
+            
+            if (!service_.impl_.server_) {
+                reader_.FinishWithError(grpc::Status(grpc::FAILED_PRECONDITION, "The server is not set up"), &finish_tag_);
+                return;
+            }
+            logger::log(logger::TRACE) << "Updating (bulk)..." << std::endl;
+        }else if (ok) {
+            try {
+                service_.search_pool_.post([this](){ update(); });
+            } catch (std::exception& e) {
+                reader_.FinishWithError(grpc::Status(grpc::UNAVAILABLE, "The server is shutting down"), &finish_tag_);
+            }
+            return;
+        }else{
+            // the client is done
+            logger::log(logger::TRACE) << "Updating (bulk)... done" << std::endl;
+            reader_.Finish(google::protobuf::Empty(), grpc::Status::OK, &finish_tag_);
+            return;
+        }
+        
+        reader_.Read(&mes_, &read_tag_);
+    }
+    
+private:
+    enum { kRequest, kRead, kFinish };
+    
+    void update()
+    {
+        try {
+            service_.impl_.server_->update(message_to_request(&mes_));
+        } catch (std::exception& e) {
+            logger::log(logger::ERROR) << "Update failed: " << e.what() << std::endl;
+            reader_.FinishWithError(grpc::Status(grpc::INTERNAL, e.what()), &finish_tag_);
+            return;
+        }
+        reader_.Read(&mes_, &read_tag_);
+    }
+    
+    SophosAsyncService& service_;
+    grpc::ServerCompletionQueue* cq_;
+    
+    grpc::ServerContext context_;
+    sophos::UpdateRequestMessage mes_;
+    grpc::ServerAsyncReader<google::protobuf::Empty, sophos::UpdateRequestMessage> reader_;
+    
+    Tag request_tag_;
+    Tag read_tag_;
+    Tag finish_tag_;
+};
+
+SophosAsyncService::SophosAsyncService(SophosImpl& impl, size_t cq_count, size_t search_threads) :
+impl_(impl), cq_count_(std::max<size_t>(cq_count, 1)), search_pool_(std::max<size_t>(search_threads, 1)), stopping_(false)
+{
+}
+
+SophosAsyncService::~SophosAsyncService()
+{
+    stop();
+}
+
+void SophosAsyncService::register_service(grpc::ServerBuilder& builder)
+{
+    builder.RegisterService(&service_);
+    
+    for (size_t i = 0; i < cq_count_; i++) {
+        cqs_.push_back(builder.AddCompletionQueue());
+        cq_mutexes_.emplace_back(new std::mutex());
+    }
+}
+
+void SophosAsyncService::start()
+{
+    typedef UnaryCall<sophos::SetupMessage, grpc::ServerAsyncResponseWriter<google::protobuf::Empty>> SetupCall;
+    typedef UnaryCall<sophos::UpdateRequestMessage, grpc::ServerAsyncResponseWriter<google::protobuf::Empty>> UpdateCall;
+    
+    for (auto& cq : cqs_) {
+        new SetupCall(*this, cq.get(), &sophos::Sophos::AsyncService::Requestsetup, &SophosImpl::setup);
+        new UpdateCall(*this, cq.get(), &sophos::Sophos::AsyncService::Requestupdate, &SophosImpl::update);
+        new SearchCall(*this, cq.get());
+        new TokenSearchCall(*this, cq.get());
+        new BulkUpdateCall(*this, cq.get());
+        
+    }
+    for (size_t i = 0; i < cqs_.size(); i++) {
+        pollers_.push_back(std::thread(&SophosAsyncService::poll, this, i));
+    }
+}
+
+void SophosAsyncService::poll(size_t index)
+{
+    void* tag;
+    bool ok;
+    
+    while (cqs_[index]->Next(&tag, &ok)) {
+        // stop() takes the lock to make sure that no operation is started
+        // once the queue is shut down
+        std::lock_guard<std::mutex> lock(*cq_mutexes_[index]);
+        static_cast<Tag*>(tag)->proceed(ok);
+    }
+}
+
+void SophosAsyncService::stop()
+{
+    if (pollers_.empty()) {
+        return;
+    }
+    
+    // the searches still need the pollers to send their replies
+    search_pool_.join();
+    
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (auto& m : cq_mutexes_) {
+        locks.emplace_back(*m);
+    }
+    stopping_ = true;
+    for (auto& cq : cqs_) {
+        cq->Shutdown();
+    }
+    locks.clear();
+    
+    for (std::thread& t : pollers_) {
+        t.join();
+    }
+    pollers_.clear();
+}
+
+void run_sophos_server(const std::string &address, const std::string& server_db_path, grpc::Server **server_ptr, bool async_search, size_t cq_count, bool numa_placement, bool consolidate_searches) {
     std::string server_address(address);
     SophosImpl service(server_db_path);
     
+    // before serving: it replaces the search executor
+    service.set_numa_placement(numa_placement);
+    service.set_search_consolidation(consolidate_searches);
+    std::unique_ptr<SophosAsyncService> async_service;
+    
     grpc::ServerBuilder builder;
     builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-    builder.RegisterService(&service);
+    
+    if (cq_count > 0) {
+        async_service.reset(new SophosAsyncService(service, cq_count, std::thread::hardware_concurrency()));
+        async_service->register_service(builder);
+    }else{
+        builder.RegisterService(&service);
+    }
+    
     std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
     logger::log(logger::INFO) << "Server listening on " << server_address << std::endl;
     
@@ -390,7 +1575,23 @@ void run_sophos_server(const std::string &address, const std::string& server_db_
     service.print_stats(sse::logger::log(sse::logger::INFO));
     service.set_search_asynchronously(async_search);
     
+    if (async_service) {
+        logger::log(logger::INFO) << "Polling " << cq_count << " completion queues" << std::endl;
+        async_service->start();
+    }
+    
     server->Wait();
+    
+    if (async_service) {
+        async_service->stop();
+    }
+}
+
+bool tune_sophos_server(const std::string& server_db_path)
+{
+    SophosImpl service(server_db_path);
+    
+    return service.autotune_search_planner();
 }
 
 } // namespace sophos
@@ -22,14 +22,24 @@
 #pragma once
 
 #include "sophos_core.hpp"
+#include "search_planner.hpp"
+#include "search_scheduler.hpp"
+#include "search_flights.hpp"
+#include "timer_queue.hpp"
+#include "result_encoding.hpp"
+#include "thread_pool.hpp"
 
 #include "sophos.grpc.pb.h"
 
 #include <string>
 #include <memory>
 #include <mutex>
+#include <thread>
+#include <vector>
+#include <atomic>
 
 #include <grpc++/server.h>
+#include <grpc++/server_builder.h>
 #include <grpc++/server_context.h>
 
 namespace sse {
@@ -55,6 +65,9 @@ namespace sophos {
                                   const sophos::SearchRequestMessage* request,
                                   grpc::ServerWriter<sophos::SearchReply>* writer);
         
+        grpc::Status token_search(grpc::ServerContext* context,
+                                  grpc::ServerReaderWriter<sophos::SearchReply, sophos::TokenSearchMessage>* stream) override;
+        
         grpc::Status update(grpc::ServerContext* context,
                             const sophos::UpdateRequestMessage* request,
                             google::protobuf::Empty* e) override;
@@ -68,8 +81,88 @@ namespace sophos {
         bool search_asynchronously() const;
         void set_search_asynchronously(bool flag);
         
+        // see SophosServer::set_numa_placement. Must be set before serving.
+        bool numa_placement() const;
+        void set_numa_placement(bool flag);
+        
+        // see SophosServer::set_search_consolidation. Disabled by default.
+        bool search_consolidation() const;
+        void set_search_consolidation(bool flag);
+        
+        // Runs the offline tuning of the search planner and saves the
+        // resulting profile in the server's directory.
+        bool autotune_search_planner();
+        
+        // admission control of the searches
+        SearchScheduler& search_scheduler();
+        
+        // coalescing of the identical searches
+        SearchFlights& search_flights();
         
     private:
+        friend class SophosAsyncService;
+        
+        // search bodies, for the synchronous and the asynchronous services
+        // (Writer has a bool Write(const SearchReply&) method). The search
+        // stops when cancellation is cancelled, and is rejected with
+        // RESOURCE_EXHAUSTED if the scheduler's queue is full.
+        template <class Writer>
+        grpc::Status collect_search(grpc::ServerContext* context,
+                                    const sophos::SearchRequestMessage* request,
+                                    Writer* writer,
+                                    std::shared_ptr<SearchCancellation> cancellation);
+        template <class Writer>
+        grpc::Status stream_search(grpc::ServerContext* context,
+                                   const sophos::SearchRequestMessage* request,
+                                   Writer* writer,
+                                   std::shared_ptr<SearchCancellation> cancellation);
+        
+        // Leader part of the searches above, once admitted: plans the search
+        // of req (whose cancellation is the walk's, see
+        // SearchFlights::Seat::walk_cancellation) on the ticket's workers,
+        // runs it and publishes its results to seat. cancellation is the
+        // call's. The asynchronous service admits its searches without
+        // waiting, and runs them with these.
+        template <class Writer>
+        grpc::Status collect_admitted(const sophos::SearchRequestMessage* request,
+                                      Writer* writer,
+                                      const SearchRequest& req,
+                                      SearchFlights::Seat& seat,
+                                      SearchScheduler::Ticket& ticket,
+                                      uint32_t walk_count,
+                                      const std::shared_ptr<SearchCancellation>& cancellation);
+        template <class Writer>
+        grpc::Status stream_admitted(const sophos::SearchRequestMessage* request,
+                                     Writer* writer,
+                                     const SearchRequest& req,
+                                     SearchFlights::Seat& seat,
+                                     SearchScheduler::Ticket& ticket,
+                                     uint32_t walk_count,
+                                     const std::shared_ptr<SearchCancellation>& cancellation);
+        
+        // Replays the results of the flight of a follower (see
+        // SearchFlights) to its client. Returns false if the flight ended,
+        // interrupted, before any result was published: the search has to be
+        // joined again. Otherwise, status is set.
+        template <class Writer>
+        bool follow_search(const sophos::SearchRequestMessage* request,
+                           const SearchRequest& req,
+                           Writer* writer,
+                           SearchFlights::Seat& seat,
+                           grpc::Status& status);
+        
+        // Looks up a message of a token search, and fills its reply (whose
+        // results are encoded with one of encodings if it is smaller).
+        // Returns false once the message reached a consolidated posting list
+        // (the rest of the chain is covered), or if the message is invalid
+        // (status is then set).
+        bool token_lookup(const sophos::TokenSearchMessage& mes,
+                          result_encoding_set encodings,
+                          sophos::SearchReply& reply,
+                          grpc::Status& status) const;
+        
+        void init_search_planner();
+        
         static const std::string pk_file;
         static const std::string pairs_map_file;
 
@@ -79,11 +172,64 @@ namespace sophos {
         std::mutex update_mtx_;
         
         bool async_search_;
+        bool numa_placement_;
+        bool consolidate_searches_;
+        
+        SearchPlanner planner_;
+        SearchScheduler scheduler_;
+        SearchFlights flights_;
+        // flushes the batches of results of the streamed searches that
+        // stopped growing (see SearchReplyWriter)
+        TimerQueue flush_timer_;
+    };
+    
+    // Serves the RPCs of a SophosImpl with the asynchronous gRPC API: the
+    // calls are polled from cq_count completion queues (one thread each),
+    // and the searches run on search_threads threads (which drive the
+    // engines running on the server's executor) once they are admitted by
+    // the scheduler, so that no thread is held by a call waiting for the
+    // network or for its admission. The results are written
+    // asynchronously.
+    class SophosAsyncService {
+    public:
+        SophosAsyncService(SophosImpl& impl, size_t cq_count, size_t search_threads);
+        ~SophosAsyncService();
+        
+        // registers the service and creates the completion queues
+        void register_service(grpc::ServerBuilder& builder);
+        // starts polling the completion queues, once the server is built
+        void start();
+        // waits for the running searches and stops polling. The server must
+        // have been shut down.
+        void stop();
+        
+    private:
+        struct Tag;
+        class Call;
+        class SearchCall;
+        class TokenSearchCall;
+        template <class Request, class Responder> class UnaryCall;
+        class BulkUpdateCall;
+        
+        void poll(size_t index);
+        
+        SophosImpl& impl_;
+        sophos::Sophos::AsyncService service_;
+        
+        size_t cq_count_;
+        std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs_;
+        std::vector<std::unique_ptr<std::mutex>> cq_mutexes_;
+        std::vector<std::thread> pollers_;
+        
+        ThreadPool search_pool_;
+        std::atomic_bool stopping_;
     };
     
     SearchRequest message_to_request(const SearchRequestMessage* mes);
     UpdateRequest message_to_request(const UpdateRequestMessage* mes);
 
-    void run_sophos_server(const std::string &address, const std::string& server_db_path, grpc::Server **server_ptr, bool async_search);
+    // With cq_count == 0, the RPCs are served by the synchronous API.
+    void run_sophos_server(const std::string &address, const std::string& server_db_path, grpc::Server **server_ptr, bool async_search, size_t cq_count = 0, bool numa_placement = false, bool consolidate_searches = false);
+    bool tune_sophos_server(const std::string& server_db_path);
 } // namespace sophos
 } // namespace sse
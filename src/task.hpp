@@ -0,0 +1,628 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <mutex>
+#include <vector>
+#include <utility>
+#include <type_traits>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <condition_variable>
+#include <exception>
+#include <chrono>
+
+// Allocator of fixed-size blocks, with a cache per thread.
+// Blocks freed by a thread go to its cache. Full caches give half of their
+// blocks to a shared depot, and empty caches take them back from it, so that
+// blocks allocated by a producer and freed by a consumer are recycled
+// without going through the system allocator.
+template <size_t BlockSize>
+class BlockPool {
+public:
+    static void* allocate();
+    static void deallocate(void* p);
+
+private:
+    static constexpr size_t kCacheCapacity = 128;
+    static constexpr size_t kBatchSize = kCacheCapacity/2;
+
+    union Block
+    {
+        Block* next;
+        typename std::aligned_storage<BlockSize, alignof(std::max_align_t)>::type data;
+    };
+
+    // a linked list of at most kBatchSize blocks
+    struct Batch
+    {
+        Block* head;
+        size_t count;
+    };
+
+    struct Depot
+    {
+        std::mutex mtx;
+        std::vector<Batch> batches;
+    };
+
+    struct Cache
+    {
+        Block* head = nullptr;
+        size_t count = 0;
+
+        ~Cache();
+    };
+
+    static Depot& depot();
+    static Cache& cache();
+};
+
+// Move-only type-erased callable.
+// Callables up to kInlineSize bytes are stored in the task itself, bigger
+// ones in a block from a BlockPool (or from the heap if they are really big).
+class InlineTask {
+public:
+    static constexpr size_t kInlineSize = 64;
+    static constexpr size_t kPooledSize = 256;
+
+    InlineTask() noexcept : ops_(nullptr) {}
+
+    template <class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, InlineTask>::value>::type>
+    InlineTask(F&& f);
+
+    InlineTask(InlineTask&& t) noexcept;
+    InlineTask& operator=(InlineTask&& t) noexcept;
+
+    InlineTask(const InlineTask&) = delete;
+    InlineTask& operator=(const InlineTask&) = delete;
+
+    ~InlineTask();
+
+    void operator()();
+    explicit operator bool() const { return ops_ != nullptr; }
+
+private:
+    typedef typename std::aligned_storage<kInlineSize, alignof(std::max_align_t)>::type storage_type;
+
+    struct Ops
+    {
+        void (*invoke)(storage_type&);
+        // moves the callable to dst, src still has to be destroyed
+        void (*move)(storage_type& dst, storage_type& src);
+        void (*destroy)(storage_type&);
+    };
+
+    template <class F> struct InlineOps;
+    template <class F> struct PooledOps;
+
+    template <class F>
+    struct fits_inline : std::integral_constant<bool, sizeof(F) <= kInlineSize && alignof(F) <= alignof(storage_type) && std::is_nothrow_move_constructible<F>::value> {};
+
+    template <class F> void init(F&& f, std::true_type);
+    template <class F> void init(F&& f, std::false_type);
+
+    storage_type storage_;
+    const Ops* ops_;
+};
+
+// FIFO of tasks in a ring buffer, that only allocates when it grows.
+class TaskRing {
+public:
+    explicit TaskRing(size_t capacity = 64) : buffer_(capacity), head_(0), size_(0) {}
+
+    bool empty() const { return size_ == 0; }
+    size_t size() const { return size_; }
+
+    void push(InlineTask&& t)
+    {
+        if (size_ == buffer_.size()) {
+            grow();
+        }
+        buffer_[(head_ + size_) % buffer_.size()] = std::move(t);
+        size_++;
+    }
+
+    InlineTask pop()
+    {
+        InlineTask t(std::move(buffer_[head_]));
+        head_ = (head_ + 1) % buffer_.size();
+        size_--;
+        return t;
+    }
+
+private:
+    void grow()
+    {
+        std::vector<InlineTask> new_buffer(std::max<size_t>(2*buffer_.size(), 1));
+        for (size_t i = 0; i < size_; i++) {
+            new_buffer[i] = std::move(buffer_[(head_ + i) % buffer_.size()]);
+        }
+        buffer_.swap(new_buffer);
+        head_ = 0;
+    }
+
+    std::vector<InlineTask> buffer_;
+    size_t head_;
+    size_t size_;
+};
+
+template <size_t BlockSize>
+typename BlockPool<BlockSize>::Depot& BlockPool<BlockSize>::depot()
+{
+    // never destroyed: thread caches can give their blocks back until the very end
+    static Depot* d = new Depot();
+    return *d;
+}
+
+template <size_t BlockSize>
+typename BlockPool<BlockSize>::Cache& BlockPool<BlockSize>::cache()
+{
+    static thread_local Cache c;
+    return c;
+}
+
+template <size_t BlockSize>
+BlockPool<BlockSize>::Cache::~Cache()
+{
+    // give the blocks back
+    Depot& d = depot();
+    std::lock_guard<std::mutex> lock(d.mtx);
+
+    while (head) {
+        Batch b = {nullptr, 0};
+        while (head && b.count < kBatchSize) {
+            Block* next = head->next;
+            head->next = b.head;
+            b.head = head;
+            b.count++;
+            head = next;
+        }
+        d.batches.push_back(b);
+    }
+    count = 0;
+}
+
+template <size_t BlockSize>
+void* BlockPool<BlockSize>::allocate()
+{
+    Cache& c = cache();
+
+    if (!c.head) {
+        Depot& d = depot();
+        std::lock_guard<std::mutex> lock(d.mtx);
+
+        if (d.batches.empty()) {
+            return ::operator new(sizeof(Block));
+        }
+        c.head = d.batches.back().head;
+        c.count = d.batches.back().count;
+        d.batches.pop_back();
+    }
+
+    Block* b = c.head;
+    c.head = b->next;
+    c.count--;
+
+    return b;
+}
+
+template <size_t BlockSize>
+void BlockPool<BlockSize>::deallocate(void* p)
+{
+    Cache& c = cache();
+
+    if (c.count == kCacheCapacity) {
+        // move half of the cache to the depot
+        Batch batch = {c.head, 0};
+        Block* last = c.head;
+        for (size_t i = 1; i < kBatchSize; i++) {
+            last = last->next;
+        }
+        c.head = last->next;
+        last->next = nullptr;
+        batch.count = kBatchSize;
+        c.count -= kBatchSize;
+
+        Depot& d = depot();
+        std::lock_guard<std::mutex> lock(d.mtx);
+        d.batches.push_back(batch);
+    }
+
+    Block* b = static_cast<Block*>(p);
+    b->next = c.head;
+    c.head = b;
+    c.count++;
+}
+
+template <class F>
+struct InlineTask::InlineOps
+{
+    static F& get(storage_type& s) { return *reinterpret_cast<F*>(&s); }
+
+    static void invoke(storage_type& s) { get(s)(); }
+    static void move(storage_type& dst, storage_type& src)
+    {
+        new (&dst) F(std::move(get(src)));
+    }
+    static void destroy(storage_type& s) { get(s).~F(); }
+
+    static const Ops ops;
+};
+
+template <class F>
+const InlineTask::Ops InlineTask::InlineOps<F>::ops = {&InlineOps<F>::invoke, &InlineOps<F>::move, &InlineOps<F>::destroy};
+
+template <class F>
+struct InlineTask::PooledOps
+{
+    static F*& get(storage_type& s) { return *reinterpret_cast<F**>(&s); }
+
+    static void invoke(storage_type& s) { (*get(s))(); }
+    static void move(storage_type& dst, storage_type& src)
+    {
+        new (&dst) F*(get(src));
+        get(src) = nullptr;
+    }
+    static void destroy(storage_type& s)
+    {
+        F* f = get(s);
+        if (f) {
+            f->~F();
+            deallocate(f);
+        }
+    }
+
+    static void* allocate()
+    {
+        return (sizeof(F) <= kPooledSize) ? BlockPool<kPooledSize>::allocate() : ::operator new(sizeof(F));
+    }
+    static void deallocate(void* p)
+    {
+        if (sizeof(F) <= kPooledSize) {
+            BlockPool<kPooledSize>::deallocate(p);
+        }else{
+            ::operator delete(p);
+        }
+    }
+
+    static const Ops ops;
+};
+
+template <class F>
+const InlineTask::Ops InlineTask::PooledOps<F>::ops = {&PooledOps<F>::invoke, &PooledOps<F>::move, &PooledOps<F>::destroy};
+
+template <class F, class>
+InlineTask::InlineTask(F&& f) : ops_(nullptr)
+{
+    typedef typename std::decay<F>::type callable_type;
+    init(std::forward<F>(f), fits_inline<callable_type>());
+}
+
+template <class F>
+void InlineTask::init(F&& f, std::true_type)
+{
+    typedef typename std::decay<F>::type callable_type;
+
+    new (&storage_) callable_type(std::forward<F>(f));
+    ops_ = &InlineOps<callable_type>::ops;
+}
+
+template <class F>
+void InlineTask::init(F&& f, std::false_type)
+{
+    typedef typename std::decay<F>::type callable_type;
+
+    void* p = PooledOps<callable_type>::allocate();
+    try {
+        new (&storage_) callable_type*(new (p) callable_type(std::forward<F>(f)));
+    } catch (...) {
+        PooledOps<callable_type>::deallocate(p);
+        throw;
+    }
+    ops_ = &PooledOps<callable_type>::ops;
+}
+
+inline InlineTask::InlineTask(InlineTask&& t) noexcept : ops_(t.ops_)
+{
+    if (ops_) {
+        ops_->move(storage_, t.storage_);
+        ops_->destroy(t.storage_);
+        t.ops_ = nullptr;
+    }
+}
+
+inline InlineTask& InlineTask::operator=(InlineTask&& t) noexcept
+{
+    if (this != &t) {
+        if (ops_) {
+            ops_->destroy(storage_);
+        }
+        ops_ = t.ops_;
+        if (ops_) {
+            ops_->move(storage_, t.storage_);
+            ops_->destroy(t.storage_);
+            t.ops_ = nullptr;
+        }
+    }
+    return *this;
+}
+
+inline InlineTask::~InlineTask()
+{
+    if (ops_) {
+        ops_->destroy(storage_);
+    }
+}
+
+inline void InlineTask::operator()()
+{
+    ops_->invoke(storage_);
+}
+
+// Groups the items of a producer in chunks, and hands each full chunk to a
+// consumer (typically a function submitting a task that processes it).
+template <class T>
+class ChunkedDispatcher {
+public:
+    typedef std::vector<T> chunk_type;
+
+    ChunkedDispatcher(size_t chunk_size, std::function<void(chunk_type&&)> consumer)
+    : chunk_size_(std::max<size_t>(chunk_size, 1)), consumer_(std::move(consumer))
+    {
+        chunk_.reserve(chunk_size_);
+    }
+
+    // the remaining items are dispatched
+    ~ChunkedDispatcher()
+    {
+        flush();
+    }
+
+    void push(const T& item)
+    {
+        chunk_.push_back(item);
+        if (chunk_.size() == chunk_size_) {
+            flush();
+        }
+    }
+
+    void push(T&& item)
+    {
+        chunk_.push_back(std::move(item));
+        if (chunk_.size() == chunk_size_) {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        if (chunk_.empty()) {
+            return;
+        }
+        consumer_(std::move(chunk_));
+        chunk_ = chunk_type();
+        chunk_.reserve(chunk_size_);
+    }
+
+private:
+    const size_t chunk_size_;
+    std::function<void(chunk_type&&)> consumer_;
+    chunk_type chunk_;
+};
+
+namespace detail {
+
+// Shared state of a parallel_for. It is owned by the helper tasks too, as
+// they can start after the loop is over.
+template <class F>
+struct ParallelForState
+{
+    std::atomic<size_t> next;
+    size_t end;
+    size_t min_chunk;
+    size_t workers;
+    const F* f;
+
+    std::atomic<size_t> remaining;
+    std::mutex mtx;
+    std::condition_variable done_cv;
+    std::exception_ptr error;
+
+    // guided chunking: big chunks first, smaller ones at the end to balance the load
+    bool claim(size_t& first, size_t& last)
+    {
+        size_t cur = next.load();
+        for (;;) {
+            if (cur >= end) {
+                return false;
+            }
+            size_t chunk = std::max<size_t>(std::max<size_t>(min_chunk, (end - cur)/(2*workers)), 1);
+            size_t stop = std::min(end, cur + chunk);
+
+            if (next.compare_exchange_weak(cur, stop)) {
+                first = cur;
+                last = stop;
+                return true;
+            }
+        }
+    }
+
+    void work()
+    {
+        size_t first, last;
+        while (claim(first, last)) {
+            try {
+                for (size_t i = first; i < last; i++) {
+                    (*f)(i);
+                }
+            } catch (...) {
+                // rethrown by the caller, once the other chunks are done
+                std::lock_guard<std::mutex> lock(mtx);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+            if (remaining.fetch_sub(last - first) == last - first) {
+                std::lock_guard<std::mutex> lock(mtx);
+                done_cv.notify_all();
+            }
+        }
+    }
+};
+
+// Runs f(i) for i in [begin, end) on the pool and on the calling thread,
+// and returns when they are all done. The caller only waits for chunks that
+// are being processed, so this can be called from a task of the pool.
+template <class Pool, class F>
+void parallel_for(Pool& pool, size_t workers, size_t begin, size_t end, const F& f, size_t min_chunk)
+{
+    if (begin >= end) {
+        return;
+    }
+
+    auto state = std::make_shared<ParallelForState<F>>();
+    state->next = begin;
+    state->end = end;
+    state->min_chunk = std::max<size_t>(min_chunk, 1);
+    state->workers = std::max<size_t>(workers, 1);
+    state->f = &f;
+    state->remaining = end - begin;
+
+    size_t helpers = std::min(state->workers, (end - begin + state->min_chunk - 1)/state->min_chunk) - 1;
+
+    std::vector<InlineTask> tasks;
+    tasks.reserve(helpers);
+    for (size_t i = 0; i < helpers; i++) {
+        tasks.emplace_back([state](){ state->work(); });
+    }
+    pool.post_bulk(std::move(tasks));
+
+    state->work();
+
+    std::unique_lock<std::mutex> lock(state->mtx);
+    state->done_cv.wait(lock, [&state]{ return state->remaining == 0; });
+
+    if (state->error) {
+        std::rethrow_exception(state->error);
+    }
+}
+
+// Shared state of a run_team. Like ParallelForState, it is owned by the
+// helper tasks, which can start after the team is closed.
+template <class F>
+struct TeamState
+{
+    size_t max_count;
+    const F* f;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    size_t joined = 1; // the calling thread is a member
+    bool closed = false;
+    size_t running = 0; // helpers that joined and did not finish
+    std::exception_ptr error;
+
+    void run(size_t t, size_t n)
+    {
+        try {
+            (*f)(t, n);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+
+    void help()
+    {
+        size_t t, n;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            if (closed) {
+                // too late: the team works without this thread
+                return;
+            }
+            t = joined++;
+            running++;
+            if (joined == max_count) {
+                cv.notify_all();
+            }
+            cv.wait(lock, [this]{ return closed; });
+            n = joined;
+        }
+        run(t, n);
+
+        std::lock_guard<std::mutex> lock(mtx);
+        if (--running == 0) {
+            cv.notify_all();
+        }
+    }
+};
+
+// Runs f(t, n) for t in [0, n) on the calling thread and on the n-1 workers
+// of the pool that started within start_delay (n <= max_count), and returns n
+// once they are all done. Unlike with parallel_for, the calling thread does
+// not run the share of the workers that did not start: f can split the work
+// in n parts that are only efficient when they run at the same time.
+template <class Pool, class F>
+size_t run_team(Pool& pool, size_t max_count, const F& f, std::chrono::microseconds start_delay)
+{
+    max_count = std::max<size_t>(max_count, 1);
+
+    auto state = std::make_shared<TeamState<F>>();
+    state->max_count = max_count;
+    state->f = &f;
+
+    std::vector<InlineTask> tasks;
+    tasks.reserve(max_count - 1);
+    for (size_t i = 0; i + 1 < max_count; i++) {
+        tasks.emplace_back([state](){ state->help(); });
+    }
+    pool.post_bulk(std::move(tasks));
+
+    size_t n;
+    {
+        std::unique_lock<std::mutex> lock(state->mtx);
+        state->cv.wait_for(lock, start_delay, [&state]{ return state->joined == state->max_count; });
+        state->closed = true;
+        n = state->joined;
+    }
+    state->cv.notify_all();
+
+    state->run(0, n);
+
+    std::unique_lock<std::mutex> lock(state->mtx);
+    state->cv.wait(lock, [&state]{ return state->running == 0; });
+
+    if (state->error) {
+        std::rethrow_exception(state->error);
+    }
+    return n;
+}
+
+} // namespace detail
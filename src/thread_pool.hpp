@@ -31,34 +31,69 @@
 #include <future>
 #include <functional>
 #include <stdexcept>
+#include <algorithm>
+
+#include "task.hpp"
 #include <iostream>
 
+// If high_watermark is not 0, enqueue() blocks when the queue holds more than
+// high_watermark tasks, until it holds at most low_watermark tasks. Tasks
+// must not enqueue to a bounded pool: they could wait for themselves.
 class ThreadPool {
 public:
-    ThreadPool(size_t);
+    ThreadPool(size_t, size_t high_watermark = 0, size_t low_watermark = 0);
     template<class F, class... Args>
     auto enqueue(F&& f, Args&&... args)
     -> std::future<typename std::result_of<F(Args...)>::type>;
     
+    // fire-and-forget: no future, and no allocation for small callables
+    template<class F>
+    void post(F&& f);
+    
+    // enqueues several tasks at once (one lock, one wake-up)
+    template<class F>
+    auto enqueue_bulk(const std::vector<F>& fs)
+    -> std::vector< std::future<typename std::result_of<F()>::type> >;
+    void post_bulk(std::vector<InlineTask>&& tasks);
+    
+    // runs f(i) for i in [begin, end), in chunks of at least min_chunk
+    // indices, on the workers and on the calling thread
+    template<class F>
+    void parallel_for(size_t begin, size_t end, const F& f, size_t min_chunk = 1);
+    
     void join();
     ~ThreadPool();
+    
+    // largest number of tasks that waited in the queue
+    size_t max_queue_size() const;
+    // number of times enqueue() blocked
+    size_t blocked_count() const;
 private:
+    void push(InlineTask&& task);
+    
     // need to keep track of threads so we can join them
     std::vector< std::thread > workers;
     // the task queue
-    std::queue< std::function<void()> > tasks;
+    TaskRing tasks;
     
     size_t max_tasks_size_;
     
+    size_t high_watermark_;
+    size_t low_watermark_;
+    size_t blocked_producers_;
+    size_t blocked_count_;
+    
     // synchronization
-    std::mutex queue_mutex;
+    mutable std::mutex queue_mutex;
     std::condition_variable condition;
+    std::condition_variable space_condition;
     bool stop;
 };
 
 // the constructor just launches some amount of workers
-inline ThreadPool::ThreadPool(size_t threads)
-:   max_tasks_size_(0), stop(false)
+inline ThreadPool::ThreadPool(size_t threads, size_t high_watermark, size_t low_watermark)
+:   max_tasks_size_(0), high_watermark_(high_watermark), low_watermark_(std::min(low_watermark, high_watermark)),
+    blocked_producers_(0), blocked_count_(0), stop(false)
 {
     for(size_t i = 0;i<threads;++i)
         workers.emplace_back(
@@ -66,7 +101,7 @@ inline ThreadPool::ThreadPool(size_t threads)
                              {
                                  for(;;)
                                  {
-                                     std::function<void()> task;
+                                     InlineTask task;
                                      
                                      {
                                          std::unique_lock<std::mutex> lock(this->queue_mutex);
@@ -75,9 +110,10 @@ inline ThreadPool::ThreadPool(size_t threads)
                                          if(this->stop && this->tasks.empty())
                                              return;
                                          
-                                         max_tasks_size_ = std::max(max_tasks_size_, tasks.size());
-                                         task = std::move(this->tasks.front());
-                                         this->tasks.pop();
+                                         task = this->tasks.pop();
+                                         
+                                         if(this->blocked_producers_ > 0 && this->tasks.size() <= this->low_watermark_)
+                                             this->space_condition.notify_all();
                                      }
                                      
                                      task();
@@ -98,6 +134,79 @@ auto ThreadPool::enqueue(F&& f, Args&&... args)
                                                                       );
     
     std::future<return_type> res = task->get_future();
+    push([task](){ (*task)(); });
+    return res;
+}
+
+template<class F>
+void ThreadPool::post(F&& f)
+{
+    push(InlineTask(std::forward<F>(f)));
+}
+
+template<class F>
+auto ThreadPool::enqueue_bulk(const std::vector<F>& fs)
+-> std::vector< std::future<typename std::result_of<F()>::type> >
+{
+    using return_type = typename std::result_of<F()>::type;
+    
+    std::vector< std::future<return_type> > res;
+    std::vector<InlineTask> tasks;
+    res.reserve(fs.size());
+    tasks.reserve(fs.size());
+    
+    for(const F& f : fs)
+    {
+        auto task = std::make_shared< std::packaged_task<return_type()> >(f);
+        res.push_back(task->get_future());
+        tasks.emplace_back([task](){ (*task)(); });
+    }
+    post_bulk(std::move(tasks));
+    return res;
+}
+
+template<class F>
+void ThreadPool::parallel_for(size_t begin, size_t end, const F& f, size_t min_chunk)
+{
+    detail::parallel_for(*this, workers.size() + 1, begin, end, f, min_chunk);
+}
+
+inline void ThreadPool::post_bulk(std::vector<InlineTask>&& new_tasks)
+{
+    if(new_tasks.empty())
+        return;
+    
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        
+        if(stop)
+            throw std::runtime_error("enqueue on stopped ThreadPool");
+        
+        // the whole batch is accepted once there is space
+        if(high_watermark_ > 0 && tasks.size() >= high_watermark_)
+        {
+            blocked_producers_++;
+            blocked_count_++;
+            space_condition.wait(lock,
+                                 [this]{ return this->stop || this->tasks.size() <= this->low_watermark_; });
+            blocked_producers_--;
+            
+            if(stop)
+                throw std::runtime_error("enqueue on stopped ThreadPool");
+        }
+        
+        for(InlineTask& task : new_tasks)
+            tasks.push(std::move(task));
+        max_tasks_size_ = std::max(max_tasks_size_, tasks.size());
+    }
+    if(new_tasks.size() == 1)
+        condition.notify_one();
+    else
+        condition.notify_all();
+}
+
+inline void ThreadPool::push(InlineTask&& task)
+{
     {
         std::unique_lock<std::mutex> lock(queue_mutex);
         
@@ -105,10 +214,23 @@ auto ThreadPool::enqueue(F&& f, Args&&... args)
         if(stop)
             throw std::runtime_error("enqueue on stopped ThreadPool");
         
-        tasks.emplace([task](){ (*task)(); });
+        // backpressure
+        if(high_watermark_ > 0 && tasks.size() >= high_watermark_)
+        {
+            blocked_producers_++;
+            blocked_count_++;
+            space_condition.wait(lock,
+                                 [this]{ return this->stop || this->tasks.size() <= this->low_watermark_; });
+            blocked_producers_--;
+            
+            if(stop)
+                throw std::runtime_error("enqueue on stopped ThreadPool");
+        }
+        
+        tasks.push(std::move(task));
+        max_tasks_size_ = std::max(max_tasks_size_, tasks.size());
     }
     condition.notify_one();
-    return res;
 }
 
 inline void ThreadPool::join()
@@ -119,6 +241,7 @@ inline void ThreadPool::join()
         stop = true;
     }
     condition.notify_all();
+    space_condition.notify_all();
     for(std::thread &worker: workers)
     {
         if (worker.joinable()) {
@@ -129,6 +252,18 @@ inline void ThreadPool::join()
 //    std::cout << "Maximum queue size: " << max_tasks_size_ << std::endl;
 }
 
+inline size_t ThreadPool::max_queue_size() const
+{
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    return max_tasks_size_;
+}
+
+inline size_t ThreadPool::blocked_count() const
+{
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    return blocked_count_;
+}
+
 // the destructor joins all threads
 inline ThreadPool::~ThreadPool()
 {
@@ -138,6 +273,7 @@ inline ThreadPool::~ThreadPool()
         stop = true;
     }
     condition.notify_all();
+    space_condition.notify_all();
     for(std::thread &worker: workers)
     {
         if (worker.joinable()) {
@@ -0,0 +1,128 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "timer_queue.hpp"
+
+#include "logger.hpp"
+
+#include <exception>
+
+namespace sse {
+namespace sophos {
+
+constexpr TimerQueue::handle_type TimerQueue::kNoHandle;
+
+TimerQueue::TimerQueue() :
+next_handle_(kNoHandle + 1), running_(kNoHandle), stopping_(false)
+{
+    thread_ = std::thread(&TimerQueue::run, this);
+}
+
+TimerQueue::~TimerQueue()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+}
+
+TimerQueue::handle_type TimerQueue::schedule(clock_type::time_point when, std::function<void()> callback)
+{
+    bool first;
+    handle_type handle;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        
+        handle = next_handle_++;
+        auto it = timers_.emplace(key_type(when, handle), std::move(callback)).first;
+        deadlines_.emplace(handle, when);
+        first = (it == timers_.begin());
+    }
+    // the thread only waits for the first timer
+    if (first) {
+        cv_.notify_all();
+    }
+    return handle;
+}
+
+bool TimerQueue::cancel(handle_type handle)
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    
+    auto it = deadlines_.find(handle);
+    if (it != deadlines_.end()) {
+        timers_.erase(key_type(it->second, handle));
+        deadlines_.erase(it);
+        return true;
+    }
+    
+    if (std::this_thread::get_id() != thread_.get_id()) {
+        done_cv_.wait(lock, [this, handle]{ return running_ != handle; });
+    }
+    return false;
+}
+
+size_t TimerQueue::pending_count() const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return timers_.size();
+}
+
+void TimerQueue::run()
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    
+    while (!stopping_) {
+        if (timers_.empty()) {
+            cv_.wait(lock);
+            continue;
+        }
+        
+        auto first = timers_.begin();
+        // copied: the timer can be cancelled while we wait
+        clock_type::time_point deadline = first->first.first;
+        if (clock_type::now() < deadline) {
+            cv_.wait_until(lock, deadline);
+            continue;
+        }
+        
+        std::function<void()> callback = std::move(first->second);
+        running_ = first->first.second;
+        deadlines_.erase(running_);
+        timers_.erase(first);
+        
+        lock.unlock();
+        try {
+            callback();
+        } catch (std::exception& e) {
+            logger::log(logger::ERROR) << "Exception in timer callback: " << e.what() << std::endl;
+        }
+        lock.lock();
+        
+        running_ = kNoHandle;
+        done_cv_.notify_all();
+    }
+}
+
+} // namespace sophos
+} // namespace sse
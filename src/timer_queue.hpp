@@ -0,0 +1,81 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+namespace sse {
+namespace sophos {
+
+// Runs callbacks at given times, on a single thread shared by all the users
+// of the queue (e.g. the reply writers of a server, see SearchReplyWriter).
+// The callbacks should be short: they delay the ones due after them.
+// The callbacks that are not due when the queue is destroyed are dropped.
+class TimerQueue {
+public:
+    typedef std::chrono::steady_clock clock_type;
+    typedef uint64_t handle_type;
+    
+    // never returned by schedule
+    static constexpr handle_type kNoHandle = 0;
+    
+    TimerQueue();
+    ~TimerQueue();
+    
+    TimerQueue(const TimerQueue&) = delete;
+    TimerQueue& operator=(const TimerQueue&) = delete;
+    
+    handle_type schedule(clock_type::time_point when, std::function<void()> callback);
+    
+    // Cancels a callback. Returns false if it was already called: if it is
+    // running, waits until it returns (unless called by the callback).
+    bool cancel(handle_type handle);
+    
+    size_t pending_count() const;
+    
+private:
+    typedef std::pair<clock_type::time_point, handle_type> key_type;
+    
+    void run();
+    
+    std::map<key_type, std::function<void()>> timers_;
+    std::unordered_map<handle_type, clock_type::time_point> deadlines_;
+    handle_type next_handle_;
+    handle_type running_;
+    bool stopping_;
+    
+    mutable std::mutex mtx_;
+    std::condition_variable cv_;
+    std::condition_variable done_cv_;
+    
+    std::thread thread_;
+};
+
+} // namespace sophos
+} // namespace sse
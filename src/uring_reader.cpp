@@ -0,0 +1,336 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#include "uring_reader.hpp"
+
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#include <linux/io_uring.h>
+#define SOPHOS_IO_URING 1
+#endif
+#endif
+
+namespace sse {
+namespace sophos {
+
+constexpr unsigned UringReader::kDefaultQueueDepth;
+
+// reads the part of a read that was not done yet (after a short read)
+static bool pread_all(int fd, UringReader::Read& r, size_t done)
+{
+    while (done < r.length) {
+        ssize_t n = ::pread(fd, static_cast<char*>(r.buffer) + done, r.length - done, r.offset + done);
+        
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+UringReader::UringReader(int fd, unsigned queue_depth) :
+fd_(fd), queue_depth_(std::max(queue_depth, 1U)), ring_fd_(-1),
+sq_ring_(NULL), sq_ring_size_(0), cq_ring_(NULL), cq_ring_size_(0), sqes_(NULL), sqes_size_(0),
+sq_head_(NULL), sq_tail_(NULL), sq_mask_(0), sq_array_(NULL),
+cq_head_(NULL), cq_tail_(NULL), cq_mask_(0), cqes_(NULL),
+submitted_count_(0), enter_count_(0)
+{
+    if (!setup()) {
+        logger::log(logger::INFO) << "io_uring is not available: the reads are synchronous" << std::endl;
+    }
+}
+
+UringReader::~UringReader()
+{
+    teardown();
+}
+
+bool UringReader::uring() const
+{
+    return ring_fd_ >= 0;
+}
+
+unsigned UringReader::queue_depth() const
+{
+    return queue_depth_;
+}
+
+size_t UringReader::submitted_count() const
+{
+    return submitted_count_;
+}
+
+size_t UringReader::enter_count() const
+{
+    return enter_count_;
+}
+
+size_t UringReader::read(std::vector<Read>& reads)
+{
+    if (uring()) {
+        return read_uring(reads);
+    }
+    return read_sync(reads);
+}
+
+size_t UringReader::read_sync(std::vector<Read>& reads)
+{
+    size_t ok_count = 0;
+    
+    for (Read& r : reads) {
+        r.ok = pread_all(fd_, r, 0);
+        if (r.ok) {
+            ok_count++;
+        }
+    }
+    return ok_count;
+}
+
+#ifdef SOPHOS_IO_URING
+
+bool UringReader::setup()
+{
+    struct io_uring_params params;
+    ::memset(&params, 0, sizeof(params));
+    
+    int fd = (int)::syscall(__NR_io_uring_setup, queue_depth_, &params);
+    if (fd < 0) {
+        return false;
+    }
+    ring_fd_ = fd;
+    
+    sq_ring_size_ = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    
+    const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    
+    void* sq_ring = ::mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        teardown();
+        return false;
+    }
+    sq_ring_ = sq_ring;
+    
+    if (single_mmap) {
+        cq_ring_ = sq_ring_;
+    }else{
+        void* cq_ring = ::mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            teardown();
+            return false;
+        }
+        cq_ring_ = cq_ring;
+    }
+    
+    sqes_size_ = params.sq_entries*sizeof(struct io_uring_sqe);
+    void* sqes = ::mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        teardown();
+        return false;
+    }
+    sqes_ = sqes;
+    
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    
+    char* cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = cq + params.cq_off.cqes;
+    
+    return true;
+}
+
+void UringReader::teardown()
+{
+    if (sqes_) {
+        ::munmap(sqes_, sqes_size_);
+        sqes_ = NULL;
+    }
+    if (cq_ring_ && cq_ring_ != sq_ring_) {
+        ::munmap(cq_ring_, cq_ring_size_);
+    }
+    cq_ring_ = NULL;
+    if (sq_ring_) {
+        ::munmap(sq_ring_, sq_ring_size_);
+        sq_ring_ = NULL;
+    }
+    if (ring_fd_ >= 0) {
+        ::close(ring_fd_);
+        ring_fd_ = -1;
+    }
+}
+
+unsigned UringReader::queue_reads(std::vector<Read>& reads, size_t begin, size_t n)
+{
+    struct io_uring_sqe* sqes = static_cast<struct io_uring_sqe*>(sqes_);
+    unsigned tail = *sq_tail_;
+    
+    for (size_t i = begin; i < begin + n; i++) {
+        unsigned index = tail & sq_mask_;
+        struct io_uring_sqe& sqe = sqes[index];
+        
+        ::memset(&sqe, 0, sizeof(sqe));
+        // a plain read needs Linux 5.6: use a single-vector readv (5.1),
+        // whose iovec is the beginning of the read
+        sqe.opcode = IORING_OP_READV;
+        sqe.fd = fd_;
+        sqe.off = reads[i].offset;
+        sqe.addr = reinterpret_cast<uint64_t>(&iovecs_[i]);
+        sqe.len = 1;
+        sqe.user_data = i;
+        
+        sq_array_[index] = index;
+        tail++;
+    }
+    
+    // publish the entries to the kernel
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+    
+    return (unsigned)n;
+}
+
+unsigned UringReader::reap(std::vector<Read>& reads)
+{
+    const struct io_uring_cqe* cqes = static_cast<const struct io_uring_cqe*>(cqes_);
+    unsigned head = *cq_head_;
+    const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    unsigned count = 0;
+    
+    for (; head != tail; head++, count++) {
+        const struct io_uring_cqe& cqe = cqes[head & cq_mask_];
+        Read& r = reads[cqe.user_data];
+        
+        if (cqe.res < 0) {
+            r.ok = false;
+        }else if ((size_t)cqe.res < r.length && cqe.res > 0) {
+            // short read: finish it synchronously
+            r.ok = pread_all(fd_, r, cqe.res);
+        }else{
+            r.ok = ((size_t)cqe.res == r.length);
+        }
+    }
+    
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    
+    return count;
+}
+
+size_t UringReader::read_uring(std::vector<Read>& reads)
+{
+    iovecs_.resize(reads.size());
+    for (size_t i = 0; i < reads.size(); i++) {
+        iovecs_[i].iov_base = reads[i].buffer;
+        iovecs_[i].iov_len = reads[i].length;
+    }
+    
+    size_t next = 0;        // first read not queued yet
+    size_t done = 0;
+    unsigned in_flight = 0; // queued, not completed yet
+    unsigned to_submit = 0; // queued, not consumed by the kernel yet
+    
+    while (done < reads.size()) {
+        // keep the queue full
+        unsigned queued = queue_reads(reads, next, std::min<size_t>(queue_depth_ - in_flight, reads.size() - next));
+        next += queued;
+        in_flight += queued;
+        to_submit += queued;
+        
+        int ret = (int)::syscall(__NR_io_uring_enter, ring_fd_, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        enter_count_++;
+        
+        if (ret < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                throw std::runtime_error("io_uring_enter failed: " + std::string(::strerror(errno)));
+            }
+        }else{
+            to_submit -= ret;
+            submitted_count_ += ret;
+        }
+        
+        unsigned completed = reap(reads);
+        in_flight -= completed;
+        done += completed;
+    }
+    
+    size_t ok_count = 0;
+    for (const Read& r : reads) {
+        if (r.ok) {
+            ok_count++;
+        }
+    }
+    return ok_count;
+}
+
+#else
+
+bool UringReader::setup()
+{
+    return false;
+}
+
+void UringReader::teardown()
+{
+}
+
+unsigned UringReader::queue_reads(std::vector<Read>&, size_t, size_t)
+{
+    return 0;
+}
+
+unsigned UringReader::reap(std::vector<Read>&)
+{
+    return 0;
+}
+
+size_t UringReader::read_uring(std::vector<Read>& reads)
+{
+    return read_sync(reads);
+}
+
+#endif
+
+} // namespace sophos
+} // namespace sse
@@ -0,0 +1,113 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <sys/uio.h>
+
+namespace sse {
+namespace sophos {
+
+// Random reads of a file, with many reads in flight at once.
+// On Linux, the reads are submitted to an io_uring (set up with the raw
+// system calls: there is no dependency on liburing), and up to queue_depth of
+// them are outstanding. If io_uring is not available (older kernel, seccomp
+// filter, other systems), the reads fall back to pread, one at a time.
+// A reader is not thread-safe: use one per thread.
+class UringReader {
+public:
+    static constexpr unsigned kDefaultQueueDepth = 128;
+    
+    struct Read {
+        uint64_t offset;
+        size_t length;
+        void* buffer;
+        bool ok;    // set once the read is done: false on errors and EOF
+    };
+    
+    // fd must stay open for the lifetime of the reader
+    explicit UringReader(int fd, unsigned queue_depth = kDefaultQueueDepth);
+    ~UringReader();
+    
+    UringReader(const UringReader&) = delete;
+    UringReader& operator=(const UringReader&) = delete;
+    
+    // true if the reads go through io_uring
+    bool uring() const;
+    unsigned queue_depth() const;
+    
+    // Runs every read, and returns the number of successful ones.
+    size_t read(std::vector<Read>& reads);
+    
+    // reads submitted through io_uring, and calls to io_uring_enter
+    size_t submitted_count() const;
+    size_t enter_count() const;
+    
+private:
+    bool setup();
+    void teardown();
+    
+    // copies up to n reads to the submission queue, and returns their count
+    unsigned queue_reads(std::vector<Read>& reads, size_t begin, size_t n);
+    // handles the available completions, and returns their count
+    unsigned reap(std::vector<Read>& reads);
+    
+    size_t read_uring(std::vector<Read>& reads);
+    size_t read_sync(std::vector<Read>& reads);
+    
+    const int fd_;
+    const unsigned queue_depth_;
+    
+    int ring_fd_;
+    
+    // shared with the kernel
+    void* sq_ring_;
+    size_t sq_ring_size_;
+    void* cq_ring_;
+    size_t cq_ring_size_;
+    void* sqes_;
+    size_t sqes_size_;
+    
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned sq_mask_;
+    unsigned* sq_array_;
+    
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    void* cqes_;
+    
+    // buffers of the reads in flight
+    std::vector<struct iovec> iovecs_;
+    
+    size_t submitted_count_;
+    size_t enter_count_;
+};
+
+} // namespace sophos
+} // namespace sse
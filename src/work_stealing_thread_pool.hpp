@@ -0,0 +1,534 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <stdexcept>
+#include <algorithm>
+#include <cassert>
+
+#include "task.hpp"
+
+// Lock-free work-stealing deque (Chase & Lev, with the memory orderings of
+// Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models").
+// Only the owner can push and pop (at the bottom, in LIFO order), any thread
+// can steal (at the top, in FIFO order).
+template <class T>
+class WorkStealingDeque {
+public:
+    explicit WorkStealingDeque(size_t log_capacity = 10);
+    ~WorkStealingDeque();
+
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+    // owner only
+    void push(T x);
+    bool pop(T& x);
+
+    // any thread
+    bool steal(T& x);
+
+private:
+    struct Array
+    {
+        explicit Array(size_t log_size) : log_size(log_size), buffer(new std::atomic<T>[size_t(1) << log_size]) {}
+
+        size_t size() const { return size_t(1) << log_size; }
+        T get(int64_t i) const { return buffer[i & (size()-1)].load(std::memory_order_relaxed); }
+        void put(int64_t i, T x) { buffer[i & (size()-1)].store(x, std::memory_order_relaxed); }
+
+        const size_t log_size;
+        std::unique_ptr<std::atomic<T>[]> buffer;
+    };
+
+    Array* grow(Array* a, int64_t bottom, int64_t top);
+
+    std::atomic<int64_t> top_;
+    std::atomic<int64_t> bottom_;
+    std::atomic<Array*> array_;
+
+    // arrays replaced by a bigger one might still be read by thieves: keep them
+    std::vector<std::unique_ptr<Array>> arrays_;
+};
+
+// time given to the workers to join a team (see run_team), in microseconds
+constexpr std::chrono::microseconds::rep kDefaultTeamStartDelay = 200;
+
+// Thread pool with one work-stealing deque per worker.
+// Tasks enqueued from a worker go to its own deque and are executed in LIFO
+// order (the data they use is likely still in cache). Tasks enqueued from
+// other threads go to a shared queue. Idle workers steal from the others.
+// It has the same interface as ThreadPool.
+class WorkStealingThreadPool {
+public:
+    WorkStealingThreadPool(size_t);
+    // on_start(i) is called by the i-th worker before it runs any task (e.g.
+    // to set its CPU affinity)
+    WorkStealingThreadPool(size_t, std::function<void(size_t)> on_start);
+    template<class F, class... Args>
+    auto enqueue(F&& f, Args&&... args)
+    -> std::future<typename std::result_of<F(Args...)>::type>;
+
+    // fire-and-forget: no future, and no heap allocation for small callables
+    // (they are stored in pooled task nodes)
+    template<class F>
+    void post(F&& f);
+
+    // enqueues several tasks at once (one lock, one wake-up)
+    template<class F>
+    auto enqueue_bulk(const std::vector<F>& fs)
+    -> std::vector< std::future<typename std::result_of<F()>::type> >;
+    void post_bulk(std::vector<InlineTask>&& tasks);
+
+    // runs f(i) for i in [begin, end), in chunks of at least min_chunk
+    // indices, on the workers and on the calling thread. It can be called
+    // from a task of the pool.
+    template<class F>
+    void parallel_for(size_t begin, size_t end, const F& f, size_t min_chunk = 1);
+
+    // runs f(t, n) for t in [0, n) on the calling thread and on the workers
+    // that start within start_delay, n being at most max_count, and returns
+    // n. It can be called from a task of the pool.
+    template<class F>
+    size_t run_team(size_t max_count, const F& f, std::chrono::microseconds start_delay = std::chrono::microseconds(kDefaultTeamStartDelay));
+
+    void join();
+    ~WorkStealingThreadPool();
+
+    size_t size() const;
+    
+    // largest number of tasks waiting in the queues
+    size_t max_queue_size() const;
+
+private:
+    struct task_type
+    {
+        InlineTask run;
+        
+        // a node is nothing more than its task: it fits in the task's blocks
+        static void* operator new(size_t size)
+        {
+            assert(size <= sizeof(InlineTask));
+            (void)size;
+            return BlockPool<sizeof(InlineTask)>::allocate();
+        }
+        static void operator delete(void* p) { BlockPool<sizeof(InlineTask)>::deallocate(p); }
+    };
+
+    struct WorkerContext
+    {
+        const WorkStealingThreadPool* pool;
+        size_t index;
+    };
+    static WorkerContext& current_worker();
+
+    void push(task_type* task);
+    void count_queued(size_t n);
+    bool try_pop(size_t index, task_type*& task);
+    void worker_loop(size_t index);
+
+    std::function<void(size_t)> on_start;
+
+    std::vector< std::thread > workers;
+    std::vector< std::unique_ptr<WorkStealingDeque<task_type*>> > queues;
+
+    // tasks enqueued from outside the pool
+    std::deque<task_type*> injected;
+    std::mutex injected_mutex;
+
+    // number of tasks waiting in the queues
+    std::atomic<size_t> queued;
+    std::atomic<size_t> max_queued;
+    std::atomic<size_t> sleeping;
+
+    // synchronization of the idle workers
+    std::mutex sleep_mutex;
+    std::condition_variable condition;
+    std::atomic<bool> stop;
+};
+
+template <class T>
+WorkStealingDeque<T>::WorkStealingDeque(size_t log_capacity)
+: top_(0), bottom_(0)
+{
+    arrays_.emplace_back(new Array(log_capacity));
+    array_.store(arrays_.back().get(), std::memory_order_relaxed);
+}
+
+template <class T>
+WorkStealingDeque<T>::~WorkStealingDeque()
+{
+}
+
+template <class T>
+typename WorkStealingDeque<T>::Array* WorkStealingDeque<T>::grow(Array* a, int64_t bottom, int64_t top)
+{
+    Array* new_array = new Array(a->log_size + 1);
+    for (int64_t i = top; i < bottom; i++) {
+        new_array->put(i, a->get(i));
+    }
+    arrays_.emplace_back(new_array);
+    array_.store(new_array, std::memory_order_release);
+
+    return new_array;
+}
+
+template <class T>
+void WorkStealingDeque<T>::push(T x)
+{
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_acquire);
+    Array* a = array_.load(std::memory_order_relaxed);
+
+    if (b - t > (int64_t)a->size() - 1) {
+        a = grow(a, b, t);
+    }
+    a->put(b, x);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+}
+
+template <class T>
+bool WorkStealingDeque<T>::pop(T& x)
+{
+    int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    Array* a = array_.load(std::memory_order_relaxed);
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top_.load(std::memory_order_relaxed);
+
+    if (t > b) {
+        // empty
+        bottom_.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+
+    x = a->get(b);
+
+    if (t == b) {
+        // last element: race against the thieves
+        bool won = top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        bottom_.store(b + 1, std::memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+template <class T>
+bool WorkStealingDeque<T>::steal(T& x)
+{
+    int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom_.load(std::memory_order_acquire);
+
+    if (t >= b) {
+        return false;
+    }
+
+    Array* a = array_.load(std::memory_order_acquire);
+    x = a->get(t);
+
+    return top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+}
+
+inline WorkStealingThreadPool::WorkerContext& WorkStealingThreadPool::current_worker()
+{
+    static thread_local WorkerContext context = {nullptr, 0};
+    return context;
+}
+
+// the constructor just launches some amount of workers
+inline WorkStealingThreadPool::WorkStealingThreadPool(size_t threads)
+:   WorkStealingThreadPool(threads, nullptr)
+{
+}
+
+inline WorkStealingThreadPool::WorkStealingThreadPool(size_t threads, std::function<void(size_t)> start_hook)
+:   on_start(std::move(start_hook)), queued(0), max_queued(0), sleeping(0), stop(false)
+{
+    threads = std::max<size_t>(threads, 1);
+
+    for(size_t i = 0;i<threads;++i)
+        queues.emplace_back(new WorkStealingDeque<task_type*>());
+
+    for(size_t i = 0;i<threads;++i)
+        workers.emplace_back(&WorkStealingThreadPool::worker_loop, this, i);
+}
+
+inline size_t WorkStealingThreadPool::size() const
+{
+    return queues.size();
+}
+
+inline size_t WorkStealingThreadPool::max_queue_size() const
+{
+    return max_queued;
+}
+
+inline void WorkStealingThreadPool::push(task_type* task)
+{
+    WorkerContext& context = current_worker();
+
+    // count the task first, so that the counter never goes below the number
+    // of tasks that can be popped
+    count_queued(1);
+
+    if (context.pool == this) {
+        queues[context.index]->push(task);
+    }else{
+        std::unique_lock<std::mutex> lock(injected_mutex);
+        injected.push_back(task);
+    }
+
+    if (sleeping > 0) {
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        condition.notify_one();
+    }
+}
+
+inline void WorkStealingThreadPool::count_queued(size_t n)
+{
+    size_t q = (queued += n);
+    size_t m = max_queued;
+    while (q > m && !max_queued.compare_exchange_weak(m, q)) {
+    }
+}
+
+inline void WorkStealingThreadPool::post_bulk(std::vector<InlineTask>&& tasks)
+{
+    if (tasks.empty()) {
+        return;
+    }
+    if(stop)
+        throw std::runtime_error("enqueue on stopped WorkStealingThreadPool");
+
+    WorkerContext& context = current_worker();
+
+    count_queued(tasks.size());
+
+    if (context.pool == this) {
+        for (InlineTask& t : tasks) {
+            queues[context.index]->push(new task_type{std::move(t)});
+        }
+    }else{
+        std::unique_lock<std::mutex> lock(injected_mutex);
+        for (InlineTask& t : tasks) {
+            injected.push_back(new task_type{std::move(t)});
+        }
+    }
+
+    if (sleeping > 0) {
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        if (tasks.size() == 1) {
+            condition.notify_one();
+        }else{
+            condition.notify_all();
+        }
+    }
+}
+
+inline bool WorkStealingThreadPool::try_pop(size_t index, task_type*& task)
+{
+    if (queues[index]->pop(task)) {
+        return true;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(injected_mutex);
+        if (!injected.empty()) {
+            task = injected.front();
+            injected.pop_front();
+            return true;
+        }
+    }
+
+    // start stealing from the next worker, so that the victims are spread
+    for (size_t i = 1; i < queues.size(); i++) {
+        if (queues[(index + i) % queues.size()]->steal(task)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+inline void WorkStealingThreadPool::worker_loop(size_t index)
+{
+    current_worker().pool = this;
+    current_worker().index = index;
+
+    if (on_start) {
+        on_start(index);
+    }
+
+    // number of unsuccessful attempts before going to sleep
+    constexpr unsigned kSpinCount = 64;
+    unsigned spins = 0;
+
+    for(;;)
+    {
+        task_type* task = nullptr;
+
+        if (queued > 0 && try_pop(index, task)) {
+            queued--;
+            spins = 0;
+
+            task->run();
+            delete task;
+
+            continue;
+        }
+
+        if (spins++ < kSpinCount) {
+            std::this_thread::yield();
+            continue;
+        }
+        spins = 0;
+
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        sleeping++;
+        condition.wait(lock,
+                       [this]{ return this->stop || this->queued > 0; });
+        sleeping--;
+
+        if(this->stop && this->queued == 0)
+            return;
+    }
+}
+
+// add new work item to the pool
+template<class F, class... Args>
+auto WorkStealingThreadPool::enqueue(F&& f, Args&&... args)
+-> std::future<typename std::result_of<F(Args...)>::type>
+{
+    using return_type = typename std::result_of<F(Args...)>::type;
+
+    auto task = std::make_shared< std::packaged_task<return_type()> >(
+                                                                      std::bind(std::forward<F>(f), std::forward<Args>(args)...)
+                                                                      );
+
+    std::future<return_type> res = task->get_future();
+
+    post([task](){ (*task)(); });
+
+    return res;
+}
+
+template<class F>
+void WorkStealingThreadPool::post(F&& f)
+{
+    // don't allow enqueueing after stopping the pool
+    if(stop)
+        throw std::runtime_error("enqueue on stopped WorkStealingThreadPool");
+
+    push(new task_type{InlineTask(std::forward<F>(f))});
+}
+
+template<class F>
+auto WorkStealingThreadPool::enqueue_bulk(const std::vector<F>& fs)
+-> std::vector< std::future<typename std::result_of<F()>::type> >
+{
+    using return_type = typename std::result_of<F()>::type;
+
+    std::vector< std::future<return_type> > res;
+    std::vector<InlineTask> tasks;
+    res.reserve(fs.size());
+    tasks.reserve(fs.size());
+
+    for (const F& f : fs) {
+        auto task = std::make_shared< std::packaged_task<return_type()> >(f);
+        res.push_back(task->get_future());
+        tasks.emplace_back([task](){ (*task)(); });
+    }
+    post_bulk(std::move(tasks));
+
+    return res;
+}
+
+template<class F>
+void WorkStealingThreadPool::parallel_for(size_t begin, size_t end, const F& f, size_t min_chunk)
+{
+    // when called from a worker, the caller is one of the workers
+    size_t workers_count = queues.size() + (current_worker().pool == this ? 0 : 1);
+    detail::parallel_for(*this, workers_count, begin, end, f, min_chunk);
+}
+
+template<class F>
+size_t WorkStealingThreadPool::run_team(size_t max_count, const F& f, std::chrono::microseconds start_delay)
+{
+    // when called from a worker, the caller is one of the workers
+    size_t workers_count = queues.size() + (current_worker().pool == this ? 0 : 1);
+    return detail::run_team(*this, std::min(max_count, workers_count), f, start_delay);
+}
+
+inline void WorkStealingThreadPool::join()
+{
+    {
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        stop = true;
+    }
+    condition.notify_all();
+    for(std::thread &worker: workers)
+    {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    // run the tasks enqueued concurrently with the stop
+    task_type* task = nullptr;
+    while (queued > 0) {
+        bool found = false;
+        for (size_t i = 0; i < queues.size() && !found; i++) {
+            found = queues[i]->steal(task);
+        }
+        if (!found) {
+            std::unique_lock<std::mutex> lock(injected_mutex);
+            if (injected.empty()) {
+                // the task is being pushed
+                continue;
+            }
+            task = injected.front();
+            injected.pop_front();
+        }
+
+        queued--;
+        task->run();
+        delete task;
+    }
+}
+
+// the destructor joins all threads
+inline WorkStealingThreadPool::~WorkStealingThreadPool()
+{
+    join();
+}
@@ -0,0 +1,93 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "edb_file.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <cstdio>
+#include <cstring>
+
+using namespace sse::sophos;
+
+static const std::string kEdbFilePath = "test_edb_file.dat";
+
+static update_token_type token(uint64_t home, uint64_t id)
+{
+    // the first 8 bytes choose the home bucket
+    update_token_type t;
+    std::memcpy(t.data(), &home, sizeof(home));
+    std::memcpy(t.data() + sizeof(home), &id, sizeof(id));
+    return t;
+}
+
+BOOST_AUTO_TEST_SUITE(edb_file)
+
+BOOST_AUTO_TEST_CASE(lookups)
+{
+    std::vector<EdbFile::entry_type> entries;
+    for (uint64_t i = 0; i < 1000; i++) {
+        entries.push_back(std::make_pair(token(i*7919, i), index_type(i*i)));
+    }
+    // more entries than a bucket holds, all in bucket 0: they overflow
+    for (uint64_t i = 0; i < 2*EdbFile::kBucketEntryCount; i++) {
+        entries.push_back(std::make_pair(token(0, 1000 + i), index_type(1000 + i)));
+    }
+
+    BOOST_REQUIRE(EdbFile::build(kEdbFilePath, entries));
+
+    {
+        EdbFile edb(kEdbFilePath, false);
+        BOOST_REQUIRE(edb.is_open());
+        BOOST_CHECK_EQUAL(edb.entry_count(), entries.size());
+
+        std::vector<update_token_type> keys;
+        for (const EdbFile::entry_type& e : entries) {
+            keys.push_back(e.first);
+        }
+        keys.push_back(token(0, 1u << 20));
+        keys.push_back(token(42, 1u << 20));
+
+        std::vector<index_type> values;
+        std::vector<bool> found;
+        BOOST_CHECK_EQUAL(edb.multi_get(keys, values, found), entries.size());
+        BOOST_REQUIRE_EQUAL(values.size(), keys.size());
+        BOOST_REQUIRE_EQUAL(found.size(), keys.size());
+
+        size_t wrong = 0;
+        for (size_t i = 0; i < entries.size(); i++) {
+            wrong += (!found[i] || values[i] != entries[i].second);
+        }
+        BOOST_CHECK_EQUAL(wrong, 0u);
+        BOOST_CHECK(!found[entries.size()]);
+        BOOST_CHECK(!found[entries.size() + 1]);
+    }
+
+    std::remove(kEdbFilePath.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(missing_file)
+{
+    EdbFile edb("missing_edb_file.dat", false);
+    BOOST_CHECK(!edb.is_open());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,166 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "result_encoding.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+using namespace sse::sophos;
+
+static std::vector<uint64_t> decode(ResultEncoding encoding, const std::string& data, bool& valid)
+{
+    std::vector<uint64_t> values;
+    valid = decode_results(encoding, data, [&values](uint64_t v){ values.push_back(v); });
+    std::sort(values.begin(), values.end());
+    return values;
+}
+
+static result_encoding_set all_encodings()
+{
+    return encoding_flag(DELTA_VARINT) | encoding_flag(BITMAP);
+}
+
+BOOST_AUTO_TEST_SUITE(result_encoding)
+
+BOOST_AUTO_TEST_CASE(varint_round_trip)
+{
+    const uint64_t values[] = {0, 1, 0x7F, 0x80, 0x3FFF, 0x4000, uint64_t(1) << 32, std::numeric_limits<uint64_t>::max()};
+
+    std::string data;
+    for (uint64_t v : values) {
+        append_varint(v, data);
+    }
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data());
+    const uint8_t* end = p + data.size();
+
+    for (uint64_t v : values) {
+        uint64_t read;
+        BOOST_REQUIRE(read_varint(p, end, read));
+        BOOST_CHECK_EQUAL(read, v);
+    }
+    BOOST_CHECK(p == end);
+}
+
+BOOST_AUTO_TEST_CASE(truncated_varint)
+{
+    std::string data;
+    append_varint(uint64_t(1) << 40, data);
+    data.pop_back();
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data());
+    uint64_t v;
+    BOOST_CHECK(!read_varint(p, p + data.size(), v));
+}
+
+BOOST_AUTO_TEST_CASE(delta_varint_round_trip)
+{
+    // sparse values, with duplicates: no bitmap
+    std::vector<uint64_t> values = {1000000, 5, 1u << 30, 5, 77, std::numeric_limits<uint64_t>::max()/2};
+    std::vector<uint64_t> expected = values;
+    std::sort(expected.begin(), expected.end());
+
+    std::string data;
+    BOOST_REQUIRE_EQUAL(encode_results(values, all_encodings(), data), DELTA_VARINT);
+
+    bool valid;
+    std::vector<uint64_t> decoded = decode(DELTA_VARINT, data, valid);
+    BOOST_CHECK(valid);
+    BOOST_CHECK_EQUAL_COLLECTIONS(decoded.begin(), decoded.end(), expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE(bitmap_round_trip)
+{
+    // dense values
+    std::vector<uint64_t> values;
+    for (uint64_t v = 1000; v < 3000; v++) {
+        if (v % 3 != 0) {
+            values.push_back(v);
+        }
+    }
+    std::reverse(values.begin(), values.end());
+    std::vector<uint64_t> expected = values;
+    std::sort(expected.begin(), expected.end());
+
+    std::string data;
+    BOOST_REQUIRE_EQUAL(encode_results(values, all_encodings(), data), BITMAP);
+    BOOST_CHECK_LT(data.size(), expected.size());
+
+    bool valid;
+    std::vector<uint64_t> decoded = decode(BITMAP, data, valid);
+    BOOST_CHECK(valid);
+    BOOST_CHECK_EQUAL_COLLECTIONS(decoded.begin(), decoded.end(), expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE(raw_fallback)
+{
+    std::vector<uint64_t> values = {3, 1, 2};
+    std::string data = "untouched";
+
+    BOOST_CHECK_EQUAL(encode_results(values, 0, data), RAW_RESULTS);
+    BOOST_CHECK_EQUAL(data, "untouched");
+
+    // duplicates cannot be put in a bitmap
+    std::vector<uint64_t> duplicates = {4, 4, 5};
+    BOOST_CHECK_EQUAL(encode_results(duplicates, encoding_flag(BITMAP), data), RAW_RESULTS);
+
+    std::vector<uint64_t> empty;
+    BOOST_CHECK_EQUAL(encode_results(empty, all_encodings(), data), RAW_RESULTS);
+}
+
+BOOST_AUTO_TEST_CASE(invalid_data)
+{
+    std::vector<uint64_t> values = {1, 2, 3, 100, 200};
+    std::string data;
+    BOOST_REQUIRE_EQUAL(encode_results(values, encoding_flag(DELTA_VARINT), data), DELTA_VARINT);
+
+    bool valid;
+    decode(DELTA_VARINT, data.substr(0, data.size() - 1), valid);
+    BOOST_CHECK(!valid);
+    decode(DELTA_VARINT, data + data, valid);
+    BOOST_CHECK(!valid);
+
+    // the count does not match the bitmap
+    std::string bitmap;
+    append_varint(3, bitmap);
+    append_varint(10, bitmap);
+    bitmap.push_back(0x3);
+    decode(BITMAP, bitmap, valid);
+    BOOST_CHECK(!valid);
+
+    decode(RAW_RESULTS, data, valid);
+    BOOST_CHECK(!valid);
+}
+
+BOOST_AUTO_TEST_CASE(accepted_encodings)
+{
+    google::protobuf::RepeatedField<int> encodings;
+    encodings.Add(BITMAP);
+    encodings.Add(42);
+
+    BOOST_CHECK_EQUAL(encoding_set(encodings), encoding_flag(BITMAP));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,149 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "ring_buffer.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <thread>
+#include <vector>
+
+using namespace sse::sophos;
+
+constexpr size_t kItemCount = 20000;
+
+BOOST_AUTO_TEST_SUITE(ring_buffer)
+
+BOOST_AUTO_TEST_CASE(spsc_ring_bounds)
+{
+    SpscRing<int> ring(5);
+    BOOST_REQUIRE_EQUAL(ring.capacity(), 8u);
+
+    int item;
+    BOOST_CHECK(!ring.try_pop(item));
+
+    for (int i = 0; i < 8; i++) {
+        BOOST_CHECK(ring.try_push(int(i)));
+    }
+    BOOST_CHECK(!ring.try_push(8));
+
+    for (int i = 0; i < 8; i++) {
+        BOOST_REQUIRE(ring.try_pop(item));
+        BOOST_CHECK_EQUAL(item, i);
+    }
+    BOOST_CHECK(!ring.try_pop(item));
+}
+
+BOOST_AUTO_TEST_CASE(spsc_ring_concurrent)
+{
+    SpscRing<size_t> ring(64);
+
+    std::thread producer([&ring]()
+    {
+        for (size_t i = 0; i < kItemCount; i++) {
+            while (!ring.try_push(size_t(i))) {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    // the items come out in order
+    size_t expected = 0;
+    bool ordered = true;
+    while (expected < kItemCount) {
+        size_t item;
+        if (ring.try_pop(item)) {
+            ordered = ordered && (item == expected);
+            expected++;
+        }else{
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+
+    BOOST_CHECK(ordered);
+}
+
+BOOST_AUTO_TEST_CASE(mpsc_ring_bounds)
+{
+    MpscRing<int> ring(3);
+    BOOST_REQUIRE_EQUAL(ring.capacity(), 4u);
+
+    for (int i = 0; i < 4; i++) {
+        BOOST_CHECK(ring.try_push(int(i)));
+    }
+    BOOST_CHECK(!ring.try_push(4));
+
+    int item;
+    for (int i = 0; i < 4; i++) {
+        BOOST_REQUIRE(ring.try_pop(item));
+        BOOST_CHECK_EQUAL(item, i);
+    }
+    BOOST_CHECK(!ring.try_pop(item));
+
+    // the cells are reused
+    BOOST_CHECK(ring.try_push(5));
+    BOOST_CHECK(ring.try_pop(item));
+    BOOST_CHECK_EQUAL(item, 5);
+}
+
+BOOST_AUTO_TEST_CASE(mpsc_ring_concurrent)
+{
+    constexpr size_t kProducerCount = 4;
+    MpscRing<size_t> ring(64);
+
+    std::vector<std::thread> producers;
+    for (size_t p = 0; p < kProducerCount; p++) {
+        producers.push_back(std::thread([&ring, p]()
+        {
+            for (size_t i = 0; i < kItemCount; i++) {
+                while (!ring.try_push(i*kProducerCount + p)) {
+                    std::this_thread::yield();
+                }
+            }
+        }));
+    }
+
+    // every item comes out once, in the order of its producer
+    std::vector<size_t> next(kProducerCount, 0);
+    bool ordered = true;
+    for (size_t count = 0; count < kItemCount*kProducerCount; ) {
+        size_t item;
+        if (ring.try_pop(item)) {
+            size_t p = item % kProducerCount;
+            ordered = ordered && (item/kProducerCount == next[p]);
+            next[p]++;
+            count++;
+        }else{
+            std::this_thread::yield();
+        }
+    }
+    for (auto& t : producers) {
+        t.join();
+    }
+
+    BOOST_CHECK(ordered);
+    for (size_t p = 0; p < kProducerCount; p++) {
+        BOOST_CHECK_EQUAL(next[p], kItemCount);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
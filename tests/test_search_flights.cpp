@@ -0,0 +1,232 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "search_flights.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace sse::sophos;
+
+static SearchRequest request(uint8_t keyword, uint32_t add_count)
+{
+    SearchRequest req;
+    req.token.fill(keyword);
+    req.derivation_key = std::string(16, static_cast<char>(keyword));
+    req.add_count = add_count;
+    req.cancellation = std::make_shared<SearchCancellation>();
+    return req;
+}
+
+BOOST_AUTO_TEST_SUITE(search_flights)
+
+BOOST_AUTO_TEST_CASE(join)
+{
+    SearchFlights flights;
+    SearchRequest req = request(1, 10);
+
+    SearchFlights::Seat leader = flights.join(req);
+    BOOST_CHECK(leader.leader());
+
+    SearchRequest same = req;
+    same.cancellation = std::make_shared<SearchCancellation>();
+    SearchFlights::Seat follower = flights.join(same);
+    BOOST_CHECK(!follower.leader());
+    BOOST_CHECK_EQUAL(flights.flight_count(), 1u);
+
+    // the searches of other entries start their own flights
+    SearchRequest longer = request(1, 11);
+    SearchRequest bounded = request(1, 10);
+    bounded.limit = 5;
+    SearchRequest checkpoints = request(1, 10);
+    checkpoints.checkpoint_stride = 5;
+    checkpoints.checkpoints.push_back(search_token_type());
+    SearchRequest other = request(2, 10);
+
+    std::vector<SearchFlights::Seat> seats;
+    for (const SearchRequest& r : {longer, bounded, checkpoints, other}) {
+        seats.push_back(flights.join(r));
+        BOOST_CHECK(seats.back().leader());
+    }
+    BOOST_CHECK_EQUAL(flights.flight_count(), 5u);
+
+    // a completed flight is not joined
+    leader.complete(true);
+    BOOST_CHECK(flights.join(req).leader());
+}
+
+BOOST_AUTO_TEST_CASE(follow)
+{
+    SearchFlights flights;
+    SearchRequest req = request(1, 10);
+
+    SearchFlights::Seat leader = flights.join(req);
+
+    std::vector<std::vector<index_type>> followed(3);
+    std::vector<int> complete(followed.size(), 0);
+    std::vector<std::thread> followers;
+
+    for (size_t f = 0; f < followed.size(); f++) {
+        SearchRequest r = req;
+        r.cancellation = std::make_shared<SearchCancellation>();
+        SearchFlights::Seat seat = flights.join(r);
+        BOOST_REQUIRE(!seat.leader());
+
+        // seats are move-only: move them in the threads
+        followers.push_back(std::thread([&followed, &complete, f](SearchFlights::Seat&& s)
+        {
+            complete[f] = s.follow([&followed, f](index_type v){ followed[f].push_back(v); });
+        }, std::move(seat)));
+    }
+
+    leader.publish(1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    const index_type values[] = {2, 3, 4};
+    leader.publish(values, 3);
+    leader.publish(5);
+    leader.complete(true);
+
+    for (auto& t : followers) {
+        t.join();
+    }
+
+    // the results are replayed in the order of publication
+    const std::vector<index_type> expected = {1, 2, 3, 4, 5};
+    for (size_t f = 0; f < followed.size(); f++) {
+        BOOST_CHECK(complete[f]);
+        BOOST_CHECK_EQUAL_COLLECTIONS(followed[f].begin(), followed[f].end(), expected.begin(), expected.end());
+    }
+    BOOST_CHECK_EQUAL(flights.flight_count(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(replay)
+{
+    SearchFlights flights;
+    SearchRequest req = request(1, 10);
+
+    // the results published before a follower joined are replayed to it
+    SearchFlights::Seat leader = flights.join(req);
+    leader.publish(1);
+    const index_type values[] = {2, 3};
+    leader.publish(values, 2);
+
+    SearchRequest same = req;
+    same.cancellation = std::make_shared<SearchCancellation>();
+    SearchFlights::Seat follower = flights.join(same);
+    BOOST_REQUIRE(!follower.leader());
+
+    leader.publish(4);
+    leader.complete(true);
+
+    std::vector<index_type> followed;
+    BOOST_CHECK(follower.follow([&followed](index_type v){ followed.push_back(v); }));
+
+    const std::vector<index_type> expected = {1, 2, 3, 4};
+    BOOST_CHECK_EQUAL_COLLECTIONS(followed.begin(), followed.end(), expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE(sealed)
+{
+    SearchFlights flights(2);
+    SearchRequest req = request(1, 10);
+
+    // past the replay limit, the results published without followers are
+    // not kept: the flight cannot be joined anymore
+    SearchFlights::Seat leader = flights.join(req);
+    leader.publish(1);
+    leader.publish(2);
+    leader.publish(3);
+
+    SearchRequest same = req;
+    same.cancellation = std::make_shared<SearchCancellation>();
+    SearchFlights::Seat second = flights.join(same);
+    BOOST_CHECK(second.leader());
+
+    // with followers, the results are kept past the limit
+    SearchRequest third = req;
+    third.cancellation = std::make_shared<SearchCancellation>();
+    SearchFlights::Seat follower = flights.join(third);
+    BOOST_REQUIRE(!follower.leader());
+
+    leader.complete(true);
+    const index_type values[] = {4, 5, 6};
+    second.publish(values, 3);
+    second.publish(7);
+    second.complete(true);
+
+    std::vector<index_type> followed;
+    BOOST_CHECK(follower.follow([&followed](index_type v){ followed.push_back(v); }));
+
+    const std::vector<index_type> expected = {4, 5, 6, 7};
+    BOOST_CHECK_EQUAL_COLLECTIONS(followed.begin(), followed.end(), expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE(interrupted_leader)
+{
+    SearchFlights flights;
+    SearchRequest req = request(1, 10);
+
+    SearchFlights::Seat leader = flights.join(req);
+    SearchRequest r = req;
+    r.cancellation = std::make_shared<SearchCancellation>();
+    SearchFlights::Seat follower = flights.join(r);
+
+    leader.publish(1);
+    // the leader leaves without completing the flight
+    leader = SearchFlights::Seat();
+
+    std::vector<index_type> followed;
+    BOOST_CHECK(!follower.follow([&followed](index_type v){ followed.push_back(v); }));
+    BOOST_CHECK_EQUAL(followed.size(), 1u);
+    BOOST_CHECK_EQUAL(flights.flight_count(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(abandon)
+{
+    SearchFlights flights;
+    SearchRequest req = request(1, 10);
+    std::shared_ptr<SearchCancellation> leader_cancellation = req.cancellation;
+
+    SearchFlights::Seat leader = flights.join(req);
+    SearchRequest r = req;
+    r.cancellation = std::make_shared<SearchCancellation>();
+    SearchFlights::Seat follower = flights.join(r);
+
+    // the walk goes on while a search of the flight is running
+    leader_cancellation->cancel();
+    BOOST_CHECK(!leader.walk_cancellation()->cancelled());
+
+    r.cancellation->cancel();
+    BOOST_CHECK(!follower.follow([](index_type){}));
+    BOOST_CHECK(leader.walk_cancellation()->cancelled());
+
+    // an abandoned flight is replaced by a new one
+    SearchRequest fresh = req;
+    fresh.cancellation = std::make_shared<SearchCancellation>();
+    SearchFlights::Seat new_leader = flights.join(fresh);
+    BOOST_CHECK(new_leader.leader());
+    BOOST_CHECK(!new_leader.walk_cancellation()->cancelled());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,126 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "search_reply_writer.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace sse::sophos;
+
+typedef std::chrono::steady_clock clock_type;
+
+// records the replies, and when they were written
+struct RecordingWriter
+{
+    std::vector<SearchReply> replies;
+    std::vector<clock_type::time_point> times;
+    std::mutex mtx;
+
+    bool Write(const SearchReply& reply)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        replies.push_back(reply);
+        times.push_back(clock_type::now());
+        return true;
+    }
+
+    size_t count()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return replies.size();
+    }
+};
+
+typedef SearchReplyWriter<RecordingWriter> Writer;
+
+BOOST_AUTO_TEST_SUITE(search_reply_writer)
+
+BOOST_AUTO_TEST_CASE(batches)
+{
+    RecordingWriter out;
+    {
+        Writer writer(&out, true, 0, nullptr, 4, Writer::kDefaultMaxBytes, std::chrono::seconds(10));
+        for (uint64_t i = 0; i < 10; i++) {
+            writer.write(i);
+        }
+        BOOST_CHECK_EQUAL(out.count(), 2u);
+        writer.close();
+        BOOST_CHECK_EQUAL(writer.result_count(), 10u);
+    }
+
+    BOOST_REQUIRE_EQUAL(out.replies.size(), 3u);
+    uint64_t next = 0;
+    for (const SearchReply& reply : out.replies) {
+        for (uint64_t v : reply.results()) {
+            BOOST_CHECK_EQUAL(v, next++);
+        }
+    }
+    BOOST_CHECK_EQUAL(next, 10u);
+}
+
+BOOST_AUTO_TEST_CASE(lone_result)
+{
+    const std::chrono::milliseconds kMaxDelay(20);
+    // the timer's thread is not scheduled right away
+    const std::chrono::milliseconds kSlack(500);
+
+    TimerQueue timer;
+    RecordingWriter out;
+    Writer writer(&out, true, 0, &timer, Writer::kDefaultMaxCount, Writer::kDefaultMaxBytes, kMaxDelay);
+
+    auto begin = clock_type::now();
+    writer.write(42);
+
+    // no other result comes: the batch is written once it waited max_delay
+    while (out.count() == 0 && clock_type::now() < begin + kMaxDelay + kSlack) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    BOOST_REQUIRE_EQUAL(out.count(), 1u);
+    BOOST_CHECK(out.times[0] >= begin + kMaxDelay);
+    BOOST_CHECK(out.times[0] < begin + kMaxDelay + kSlack);
+    BOOST_REQUIRE_EQUAL(out.replies[0].results_size(), 1);
+    BOOST_CHECK_EQUAL(out.replies[0].results(0), 42u);
+
+    writer.close();
+    BOOST_CHECK_EQUAL(out.count(), 1u);
+    BOOST_CHECK_EQUAL(timer.pending_count(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(close_cancels_timer)
+{
+    TimerQueue timer;
+    RecordingWriter out;
+    {
+        Writer writer(&out, true, 0, &timer, Writer::kDefaultMaxCount, Writer::kDefaultMaxBytes, std::chrono::seconds(10));
+        writer.write(1);
+        BOOST_CHECK_EQUAL(timer.pending_count(), 1u);
+    }
+    // written by close(), and the timer is gone with the writer
+    BOOST_CHECK_EQUAL(out.count(), 1u);
+    BOOST_CHECK_EQUAL(timer.pending_count(), 0u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,154 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "search_result_cache.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace sse::sophos;
+
+static SearchRequest request(uint8_t keyword, uint32_t add_count)
+{
+    SearchRequest req;
+    req.token.fill(static_cast<uint8_t>(keyword + add_count));
+    req.derivation_key = std::string(16, static_cast<char>(keyword));
+    req.add_count = add_count;
+    return req;
+}
+
+static SearchResultCache::result_list_ptr results(size_t count)
+{
+    auto list = std::make_shared<SearchResultCache::result_list_type>();
+    for (size_t i = 0; i < count; i++) {
+        list->push_back(i);
+    }
+    return list;
+}
+
+// memory used by the cache for the results of req
+static size_t entry_size(const SearchRequest& req, const SearchResultCache::result_list_ptr& list)
+{
+    SearchResultCache cache;
+    cache.put(req, list);
+    return cache.memory_usage();
+}
+
+BOOST_AUTO_TEST_SUITE(search_result_cache)
+
+BOOST_AUTO_TEST_CASE(get)
+{
+    SearchResultCache cache;
+    SearchRequest req = request(1, 10);
+    auto list = results(10);
+
+    SearchResultCache::result_list_ptr cached;
+    search_token_type token;
+
+    BOOST_CHECK_EQUAL(cache.get(req, cached, token), 10u);
+    BOOST_CHECK(!cached);
+
+    cache.put(req, list);
+    BOOST_CHECK_EQUAL(cache.size(), 1u);
+
+    // the same search is fully cached
+    BOOST_CHECK_EQUAL(cache.get(req, cached, token), 0u);
+    BOOST_CHECK(cached == list);
+    BOOST_CHECK(token == req.token);
+
+    // a longer chain only walks its new entries, down to the cached token
+    token = search_token_type();
+    BOOST_CHECK_EQUAL(cache.get(request(1, 15), cached, token), 5u);
+    BOOST_CHECK(cached == list);
+    BOOST_CHECK(token == req.token);
+
+    // the chain cannot shrink, nor change without growing
+    BOOST_CHECK_EQUAL(cache.get(request(1, 5), cached, token), 5u);
+    BOOST_CHECK(!cached);
+    SearchRequest forged = req;
+    forged.token.fill(0xFF);
+    BOOST_CHECK_EQUAL(cache.get(forged, cached, token), 10u);
+    BOOST_CHECK(!cached);
+
+    // a shorter chain does not replace a longer one
+    cache.put(request(1, 5), results(5));
+    BOOST_CHECK_EQUAL(cache.get(req, cached, token), 0u);
+    BOOST_CHECK(cached == list);
+}
+
+BOOST_AUTO_TEST_CASE(lru_eviction)
+{
+    SearchRequest a = request(1, 100), b = request(2, 100), c = request(3, 100);
+    auto list = results(100);
+    const size_t size = entry_size(a, list);
+
+    // room for two entries
+    SearchResultCache cache(2*size + size/2);
+    SearchResultCache::result_list_ptr cached;
+    search_token_type token;
+
+    cache.put(a, list);
+    cache.put(b, list);
+    BOOST_CHECK_EQUAL(cache.size(), 2u);
+
+    // a is used again: b is the least recently used entry
+    BOOST_CHECK_EQUAL(cache.get(a, cached, token), 0u);
+    cache.put(c, list);
+
+    BOOST_CHECK_EQUAL(cache.size(), 2u);
+    BOOST_CHECK_LE(cache.memory_usage(), cache.memory_budget());
+    BOOST_CHECK_EQUAL(cache.get(b, cached, token), 100u);
+    BOOST_CHECK_EQUAL(cache.get(a, cached, token), 0u);
+    BOOST_CHECK_EQUAL(cache.get(c, cached, token), 0u);
+
+    // shrinking the budget evicts the least recently used entries first
+    cache.set_memory_budget(size + size/2);
+    BOOST_CHECK_EQUAL(cache.size(), 1u);
+    BOOST_CHECK_EQUAL(cache.get(a, cached, token), 100u);
+    BOOST_CHECK_EQUAL(cache.get(c, cached, token), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(budget)
+{
+    SearchRequest a = request(1, 100), big = request(2, 1000);
+    auto list = results(100);
+
+    SearchResultCache cache(2*entry_size(a, list));
+    SearchResultCache::result_list_ptr cached;
+    search_token_type token;
+
+    cache.put(a, list);
+
+    // a list bigger than the whole budget does not flush the cache
+    cache.put(big, results(1000));
+    BOOST_CHECK_EQUAL(cache.size(), 1u);
+    BOOST_CHECK_EQUAL(cache.get(big, cached, token), 1000u);
+    BOOST_CHECK_EQUAL(cache.get(a, cached, token), 0u);
+
+    // no budget, no cache
+    cache.set_memory_budget(0);
+    BOOST_CHECK(!cache.enabled());
+    BOOST_CHECK_EQUAL(cache.size(), 0u);
+    cache.put(a, list);
+    BOOST_CHECK_EQUAL(cache.get(a, cached, token), 100u);
+    BOOST_CHECK_EQUAL(cache.memory_usage(), 0u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
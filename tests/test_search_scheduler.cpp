@@ -0,0 +1,203 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "search_scheduler.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace sse::sophos;
+
+constexpr uint32_t kInteractiveCount = 10;
+constexpr uint32_t kBulkCount = 1 << 20;
+
+// Admissions of the searches queued by a test, in order. The callbacks run
+// on the thread that frees the workers, which is the test's: the tickets are
+// not moved when a release admits another search.
+struct Admissions
+{
+    std::vector<int> order;
+    std::deque<SearchScheduler::Ticket> tickets;
+
+    SearchScheduler::Admission callback(int search)
+    {
+        return [this, search](SearchScheduler::Ticket&& ticket)
+        {
+            order.push_back(search);
+            tickets.push_back(std::move(ticket));
+        };
+    }
+};
+
+// admits a search right away
+static SearchScheduler::Ticket admit_now(SearchScheduler& scheduler, uint32_t walk_count)
+{
+    Admissions admissions;
+    scheduler.admit(walk_count, nullptr, admissions.callback(0));
+
+    BOOST_REQUIRE_EQUAL(admissions.tickets.size(), 1u);
+    BOOST_REQUIRE(admissions.tickets[0].admitted());
+    return std::move(admissions.tickets[0]);
+}
+
+BOOST_AUTO_TEST_SUITE(search_scheduler)
+
+BOOST_AUTO_TEST_CASE(interactive_first)
+{
+    // 1 of the 4 workers is reserved for the interactive searches
+    SearchScheduler scheduler(4);
+
+    SearchScheduler::Ticket bulk = admit_now(scheduler, kBulkCount);
+    BOOST_CHECK_EQUAL(bulk.lane(), SearchScheduler::BULK);
+    BOOST_CHECK_EQUAL(bulk.workers(), 3u);
+    SearchScheduler::Ticket interactive = admit_now(scheduler, kInteractiveCount);
+    BOOST_CHECK_EQUAL(interactive.lane(), SearchScheduler::INTERACTIVE);
+    BOOST_CHECK_EQUAL(interactive.workers(), 1u);
+
+    // all the workers are used: the searches wait, and the interactive one
+    // arrives last
+    const int kBulkSearches = 3;
+    Admissions admissions;
+    for (int i = 0; i < kBulkSearches; i++) {
+        scheduler.admit(kBulkCount, nullptr, admissions.callback(i));
+    }
+    scheduler.admit(kInteractiveCount, nullptr, admissions.callback(kBulkSearches));
+
+    BOOST_CHECK(admissions.order.empty());
+    BOOST_CHECK_EQUAL(scheduler.queued_count(SearchScheduler::BULK), (size_t)kBulkSearches);
+    BOOST_CHECK_EQUAL(scheduler.queued_count(SearchScheduler::INTERACTIVE), 1u);
+
+    bulk.release();
+
+    // the interactive search went first
+    BOOST_REQUIRE(!admissions.order.empty());
+    BOOST_CHECK_EQUAL(admissions.order[0], kBulkSearches);
+    BOOST_CHECK(admissions.tickets[0].admitted());
+    BOOST_CHECK_EQUAL(admissions.tickets[0].lane(), SearchScheduler::INTERACTIVE);
+    BOOST_CHECK_EQUAL(scheduler.queued_count(SearchScheduler::INTERACTIVE), 0u);
+
+    // then the bulk ones, in order, as the workers are freed
+    interactive.release();
+    for (size_t i = 0; i < admissions.tickets.size(); i++) {
+        admissions.tickets[i].release();
+    }
+    BOOST_REQUIRE_EQUAL(admissions.order.size(), (size_t)kBulkSearches + 1);
+    for (int i = 0; i < kBulkSearches; i++) {
+        BOOST_CHECK_EQUAL(admissions.order[i+1], i);
+    }
+    BOOST_CHECK_EQUAL(scheduler.queued_count(SearchScheduler::BULK), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(rejected)
+{
+    SearchScheduler scheduler(2);
+    scheduler.set_max_queued(1);
+
+    SearchScheduler::Ticket ticket = admit_now(scheduler, kInteractiveCount);
+    BOOST_CHECK_EQUAL(ticket.workers(), 2u);
+
+    Admissions admissions;
+    scheduler.admit(kInteractiveCount, nullptr, admissions.callback(0));
+    BOOST_CHECK(admissions.order.empty());
+
+    // the queue is full: the search is rejected right away
+    scheduler.admit(kInteractiveCount, nullptr, admissions.callback(1));
+    BOOST_REQUIRE_EQUAL(admissions.order.size(), 1u);
+    BOOST_CHECK_EQUAL(admissions.order[0], 1);
+    BOOST_CHECK(!admissions.tickets[0].admitted());
+    BOOST_CHECK_EQUAL(scheduler.rejected_count(), 1u);
+
+    ticket.release();
+    BOOST_REQUIRE_EQUAL(admissions.order.size(), 2u);
+    BOOST_CHECK(admissions.tickets[1].admitted());
+}
+
+BOOST_AUTO_TEST_CASE(cancelled)
+{
+    SearchScheduler scheduler(2);
+
+    SearchScheduler::Ticket ticket = admit_now(scheduler, kInteractiveCount);
+
+    auto cancellation = std::make_shared<SearchCancellation>();
+    Admissions admissions;
+    scheduler.admit(kInteractiveCount, cancellation, admissions.callback(0));
+    scheduler.admit(kInteractiveCount, nullptr, admissions.callback(1));
+
+    // the waiting searches are not polled
+    cancellation->cancel();
+    BOOST_CHECK(admissions.order.empty());
+
+    scheduler.drop_cancelled();
+    BOOST_REQUIRE_EQUAL(admissions.order.size(), 1u);
+    BOOST_CHECK_EQUAL(admissions.order[0], 0);
+    BOOST_CHECK(!admissions.tickets[0].admitted());
+    BOOST_CHECK_EQUAL(scheduler.queued_count(SearchScheduler::INTERACTIVE), 1u);
+
+    ticket.release();
+    BOOST_REQUIRE_EQUAL(admissions.order.size(), 2u);
+    BOOST_CHECK(admissions.tickets[1].admitted());
+}
+
+BOOST_AUTO_TEST_CASE(wait)
+{
+    SearchScheduler scheduler(2);
+
+    SearchScheduler::Ticket ticket = admit_now(scheduler, kInteractiveCount);
+
+    SearchRequest req;
+    req.add_count = kInteractiveCount;
+    req.cancellation = std::make_shared<SearchCancellation>();
+
+    bool admitted = false;
+    std::thread waiter([&scheduler, &req, &admitted]()
+                       {
+                           SearchScheduler::Ticket t = scheduler.admit(req, kInteractiveCount);
+                           admitted = t.admitted();
+                       });
+
+    while (scheduler.queued_count(SearchScheduler::INTERACTIVE) == 0) {
+        std::this_thread::yield();
+    }
+    ticket.release();
+    waiter.join();
+    BOOST_CHECK(admitted);
+
+    // a cancelled search stops waiting
+    ticket = admit_now(scheduler, kInteractiveCount);
+    waiter = std::thread([&scheduler, &req, &admitted]()
+                         {
+                             SearchScheduler::Ticket t = scheduler.admit(req, kInteractiveCount);
+                             admitted = t.admitted();
+                         });
+    while (scheduler.queued_count(SearchScheduler::INTERACTIVE) == 0) {
+        std::this_thread::yield();
+    }
+    req.cancellation->cancel();
+    waiter.join();
+    BOOST_CHECK(!admitted);
+    BOOST_CHECK_EQUAL(scheduler.queued_count(SearchScheduler::INTERACTIVE), 0u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,95 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "task.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <memory>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(task)
+
+BOOST_AUTO_TEST_CASE(task_ring_fifo)
+{
+    TaskRing ring(2);
+    std::vector<int> ran;
+
+    // grows while wrapped around
+    ring.push(InlineTask([&ran](){ ran.push_back(0); }));
+    ring.pop()();
+    for (int i = 1; i <= 10; i++) {
+        ring.push(InlineTask([&ran, i](){ ran.push_back(i); }));
+    }
+    BOOST_CHECK_EQUAL(ring.size(), 10u);
+
+    while (!ring.empty()) {
+        ring.pop()();
+    }
+
+    BOOST_REQUIRE_EQUAL(ran.size(), 11u);
+    for (int i = 0; i <= 10; i++) {
+        BOOST_CHECK_EQUAL(ran[i], i);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(inline_task_sizes)
+{
+    // small callables are stored inline, bigger ones in pooled blocks or on
+    // the heap: they all run once and are destroyed with their task
+    auto counter = std::make_shared<int>(0);
+    struct Big
+    {
+        std::shared_ptr<int> counter;
+        char padding[InlineTask::kPooledSize];
+
+        void operator()() { (*counter)++; }
+    };
+
+    std::vector<InlineTask> tasks;
+    tasks.push_back(InlineTask([counter](){ (*counter)++; }));
+
+    char medium[InlineTask::kInlineSize] = {1};
+    tasks.push_back(InlineTask([counter, medium](){ (*counter) += medium[0]; }));
+
+    Big big = Big();
+    big.counter = counter;
+    tasks.push_back(InlineTask(std::move(big)));
+    big.counter.reset();
+
+    // the tasks are moved around when the vector grows
+    tasks.reserve(2*tasks.size());
+    InlineTask moved(std::move(tasks[0]));
+    BOOST_CHECK(!tasks[0]);
+    BOOST_REQUIRE(moved);
+    moved();
+
+    for (size_t i = 1; i < tasks.size(); i++) {
+        tasks[i]();
+    }
+    BOOST_CHECK_EQUAL(*counter, 3);
+
+    tasks.clear();
+    moved = InlineTask();
+    BOOST_CHECK_EQUAL(counter.use_count(), 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
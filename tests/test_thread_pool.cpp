@@ -0,0 +1,114 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "thread_pool.hpp"
+#include "work_stealing_thread_pool.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+// The bulk and parallel_for APIs are the same for both pools.
+template <class Pool>
+static void check_bulk(Pool& pool)
+{
+    std::vector<std::function<size_t()>> fs;
+    for (size_t i = 0; i < 100; i++) {
+        fs.push_back([i](){ return i*i; });
+    }
+
+    auto futures = pool.enqueue_bulk(fs);
+    BOOST_REQUIRE_EQUAL(futures.size(), fs.size());
+    for (size_t i = 0; i < futures.size(); i++) {
+        BOOST_CHECK_EQUAL(futures[i].get(), i*i);
+    }
+
+    std::atomic<size_t> count(0);
+    std::vector<InlineTask> tasks;
+    for (size_t i = 0; i < 100; i++) {
+        tasks.push_back(InlineTask([&count](){ count++; }));
+    }
+    pool.post_bulk(std::move(tasks));
+    pool.enqueue([](){}).get();
+    pool.join();
+    BOOST_CHECK_EQUAL(count.load(), 100u);
+}
+
+template <class Pool>
+static void check_parallel_for(Pool& pool)
+{
+    // every index is visited once, whatever the chunk size
+    for (size_t min_chunk : {size_t(1), size_t(7), size_t(1000)}) {
+        std::vector<std::atomic<int>> visits(500);
+        for (auto& v : visits) {
+            v.store(0);
+        }
+
+        pool.parallel_for(10, visits.size(), [&visits](size_t i){ visits[i]++; }, min_chunk);
+
+        size_t wrong = 0;
+        for (size_t i = 0; i < visits.size(); i++) {
+            wrong += (visits[i].load() != (i < 10 ? 0 : 1));
+        }
+        BOOST_CHECK_EQUAL(wrong, 0u);
+    }
+
+    // empty range
+    pool.parallel_for(5, 5, [](size_t){ BOOST_ERROR("empty range"); });
+}
+
+BOOST_AUTO_TEST_SUITE(thread_pool)
+
+BOOST_AUTO_TEST_CASE(bulk)
+{
+    ThreadPool pool(4);
+    check_bulk(pool);
+
+    WorkStealingThreadPool ws_pool(4);
+    check_bulk(ws_pool);
+}
+
+BOOST_AUTO_TEST_CASE(parallel_for)
+{
+    ThreadPool pool(4);
+    check_parallel_for(pool);
+
+    WorkStealingThreadPool ws_pool(4);
+    check_parallel_for(ws_pool);
+}
+
+BOOST_AUTO_TEST_CASE(nested_parallel_for)
+{
+    // a task of the work-stealing pool can run a parallel_for
+    WorkStealingThreadPool pool(4);
+    std::atomic<size_t> sum(0);
+
+    pool.enqueue([&pool, &sum]()
+    {
+        pool.parallel_for(0, 1000, [&sum](size_t i){ sum += i; }, 16);
+    }).get();
+
+    BOOST_CHECK_EQUAL(sum.load(), 999u*1000u/2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
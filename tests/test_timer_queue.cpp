@@ -0,0 +1,90 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "timer_queue.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace sse::sophos;
+
+BOOST_AUTO_TEST_SUITE(timer_queue)
+
+BOOST_AUTO_TEST_CASE(order)
+{
+    TimerQueue timer;
+    std::vector<int> calls;
+    std::mutex mtx;
+
+    auto now = TimerQueue::clock_type::now();
+    // scheduled out of order
+    for (int i : {3, 1, 2, 0}) {
+        timer.schedule(now + std::chrono::milliseconds(5*i), [i, &calls, &mtx]()
+                       {
+                           std::lock_guard<std::mutex> lock(mtx);
+                           calls.push_back(i);
+                       });
+    }
+
+    while (timer.pending_count() > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    // the last callback might still be running
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    std::lock_guard<std::mutex> lock(mtx);
+    BOOST_REQUIRE_EQUAL(calls.size(), 4u);
+    for (int i = 0; i < 4; i++) {
+        BOOST_CHECK_EQUAL(calls[i], i);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(cancel)
+{
+    TimerQueue timer;
+    std::atomic_int calls(0);
+
+    auto handle = timer.schedule(TimerQueue::clock_type::now() + std::chrono::seconds(10), [&calls](){ calls++; });
+    BOOST_CHECK(timer.cancel(handle));
+    BOOST_CHECK(!timer.cancel(handle));
+    BOOST_CHECK_EQUAL(timer.pending_count(), 0u);
+
+    // cancelling a running callback waits for it
+    std::atomic_bool started(false);
+    handle = timer.schedule(TimerQueue::clock_type::now(), [&started, &calls]()
+                            {
+                                started = true;
+                                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                                calls++;
+                            });
+    while (!started) {
+        std::this_thread::yield();
+    }
+    BOOST_CHECK(!timer.cancel(handle));
+    BOOST_CHECK_EQUAL(calls.load(), 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
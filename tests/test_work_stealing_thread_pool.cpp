@@ -0,0 +1,185 @@
+//
+// Sophos - Forward Private Searchable Encryption
+// Copyright (C) 2016 Raphael Bost
+//
+// This file is part of Sophos.
+//
+// Sophos is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sophos is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with Sophos.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "work_stealing_thread_pool.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <vector>
+
+constexpr size_t kItemCount = 20000;
+
+BOOST_AUTO_TEST_SUITE(work_stealing_thread_pool)
+
+BOOST_AUTO_TEST_CASE(work_stealing_deque_order)
+{
+    // starts with 4 slots: the pushes grow it
+    WorkStealingDeque<int64_t> deque(2);
+
+    for (int64_t i = 0; i < 10; i++) {
+        deque.push(i);
+    }
+
+    int64_t x;
+    // the owner pops the newest items, the thieves steal the oldest ones
+    BOOST_REQUIRE(deque.pop(x));
+    BOOST_CHECK_EQUAL(x, 9);
+    BOOST_REQUIRE(deque.steal(x));
+    BOOST_CHECK_EQUAL(x, 0);
+    BOOST_REQUIRE(deque.steal(x));
+    BOOST_CHECK_EQUAL(x, 1);
+
+    for (int64_t i = 8; i >= 2; i--) {
+        BOOST_REQUIRE(deque.pop(x));
+        BOOST_CHECK_EQUAL(x, i);
+    }
+    BOOST_CHECK(!deque.pop(x));
+    BOOST_CHECK(!deque.steal(x));
+}
+
+BOOST_AUTO_TEST_CASE(work_stealing_deque_concurrent)
+{
+    constexpr size_t kThiefCount = 3;
+    WorkStealingDeque<int64_t> deque(4);
+
+    std::vector<std::atomic<int>> taken(kItemCount);
+    for (auto& t : taken) {
+        t.store(0);
+    }
+    std::atomic_bool done(false);
+
+    std::vector<std::thread> thieves;
+    for (size_t t = 0; t < kThiefCount; t++) {
+        thieves.push_back(std::thread([&]()
+        {
+            int64_t x;
+            while (!done.load()) {
+                if (deque.steal(x)) {
+                    taken[x]++;
+                }
+            }
+        }));
+    }
+
+    // the owner pushes everything, and pops some of the items back
+    int64_t x;
+    for (size_t i = 0; i < kItemCount; i++) {
+        deque.push(i);
+        if (i % 3 == 0 && deque.pop(x)) {
+            taken[x]++;
+        }
+    }
+    while (deque.pop(x)) {
+        taken[x]++;
+    }
+    done.store(true);
+    for (auto& t : thieves) {
+        t.join();
+    }
+
+    // every item was taken exactly once
+    size_t wrong = 0;
+    for (auto& t : taken) {
+        wrong += (t.load() != 1);
+    }
+    BOOST_CHECK_EQUAL(wrong, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(nested_tasks)
+{
+    WorkStealingThreadPool pool(4);
+    std::atomic<size_t> count(0);
+
+    // the tasks posted by the workers go to their own deques, and are stolen
+    // by the idle workers
+    std::vector<std::future<void>> futures;
+    for (size_t i = 0; i < 8; i++) {
+        futures.push_back(pool.enqueue([&pool, &count]()
+        {
+            for (size_t j = 0; j < 100; j++) {
+                pool.post([&count](){ count++; });
+            }
+        }));
+    }
+    for (auto& f : futures) {
+        f.get();
+    }
+    BOOST_CHECK_EQUAL(pool.enqueue([](){ return 42; }).get(), 42);
+
+    pool.join();
+    BOOST_CHECK_EQUAL(count.load(), 800u);
+}
+
+BOOST_AUTO_TEST_CASE(team)
+{
+    WorkStealingThreadPool pool(4);
+
+    // the idle workers join the team: every member runs its own part
+    std::vector<std::atomic<int>> parts(4);
+    for (auto& p : parts) {
+        p.store(0);
+    }
+    std::atomic<size_t> wrong_size(0);
+
+    size_t n = pool.run_team(4, [&parts, &wrong_size](size_t t, size_t size)
+    {
+        parts[t]++;
+        wrong_size += (size != 4);
+    }, std::chrono::microseconds(1000000));
+
+    BOOST_CHECK_EQUAL(n, 4u);
+    BOOST_CHECK_EQUAL(wrong_size.load(), 0u);
+    for (auto& p : parts) {
+        BOOST_CHECK_EQUAL(p.load(), 1);
+    }
+
+    // with all the workers busy, the calling thread works alone
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    std::atomic<size_t> started(0);
+    for (size_t i = 0; i < 4; i++) {
+        pool.post([released, &started](){ started++; released.wait(); });
+    }
+    while (started.load() < 4) {
+        std::this_thread::yield();
+    }
+
+    std::atomic<size_t> runs(0);
+    n = pool.run_team(4, [&runs](size_t t, size_t size)
+    {
+        BOOST_CHECK_EQUAL(t, 0u);
+        BOOST_CHECK_EQUAL(size, 1u);
+        runs++;
+    });
+    BOOST_CHECK_EQUAL(n, 1u);
+    BOOST_CHECK_EQUAL(runs.load(), 1u);
+
+    // the helpers that start late do nothing
+    release.set_value();
+    pool.join();
+    BOOST_CHECK_EQUAL(runs.load(), 1u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()